@@ -0,0 +1,622 @@
+//
+//  TJDropboxBenchmark.m
+//  TJDropbox
+//
+//  Runs TJDropbox's public API against a local stand-in server and reports throughput and latency for each call.
+//  See Docs/benchmarking.md for how to build and run it.
+//
+
+#import "TJDropbox.h"
+#import <mach/mach.h>
+#import <malloc/malloc.h>
+#import <time.h>
+
+// Only exported when TJDropbox.m is built with TJDROPBOX_BENCHMARK set, see Docs/benchmarking.md.
+extern NSData * _Nullable TJDropboxFileContentHashSequential(NSString *const filePath);
+extern NSString * _Nullable TJDropboxParameterStringForParameters(NSDictionary<NSString *, id> *const parameters);
+extern NSArray<TJDropboxMetadata *> *TJDropboxMetadataForListFolderEntries(NSArray<NSDictionary *> *const entries, NSMutableDictionary *const pathPrefixes);
+
+typedef void (^TJDropboxBenchmarkCompletion)(unsigned long long byteCount, NSError *_Nullable error);
+typedef void (^TJDropboxBenchmarkOperation)(NSUInteger iteration, TJDropboxBenchmarkCompletion completion);
+
+static NSString *const kRemoteRoot = @"/tjdropbox-benchmark";
+static const NSUInteger kListingFileCount = 200;
+static const NSUInteger kThumbnailBatchSize = 10;
+static const NSUInteger kReadRangeLength = 64 * 1024;
+
+static uint64_t _timestamp(void)
+{
+    return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+}
+
+static NSString *_argumentValue(NSArray<NSString *> *const arguments, NSString *const name, NSString *const defaultValue)
+{
+    const NSUInteger index = [arguments indexOfObject:name];
+    return index != NSNotFound && index + 1 < arguments.count ? arguments[index + 1] : defaultValue;
+}
+
+static NSString *_writeRandomFile(NSString *const directory, NSString *const name, const unsigned long long size)
+{
+    NSString *const path = [directory stringByAppendingPathComponent:name];
+    [[NSFileManager defaultManager] createFileAtPath:path contents:nil attributes:nil];
+    NSFileHandle *const fileHandle = [NSFileHandle fileHandleForWritingAtPath:path];
+    NSMutableData *const block = [NSMutableData dataWithLength:1024 * 1024];
+    for (unsigned long long written = 0; written < size; written += block.length) {
+        arc4random_buf(block.mutableBytes, block.length);
+        [fileHandle writeData:size - written < block.length ? [block subdataWithRange:NSMakeRange(0, (NSUInteger)(size - written))] : block];
+    }
+    [fileHandle closeFile];
+    return path;
+}
+
+static double _percentile(NSArray<NSNumber *> *const sortedDurations, const double percentile)
+{
+    if (sortedDurations.count == 0) {
+        return 0.0;
+    }
+    const NSUInteger index = MIN((NSUInteger)ceil(percentile * sortedDurations.count), sortedDurations.count) - 1;
+    return sortedDurations[index].doubleValue;
+}
+
+// Runs the operation the given number of times with at most concurrency in flight, then prints its totals and the per-endpoint metrics it produced.
+static void _runBenchmark(NSString *const name, const NSUInteger iterations, const NSUInteger concurrency, TJDropboxBenchmarkOperation const operation)
+{
+    [TJDropbox resetMetrics];
+
+    dispatch_queue_t const resultsQueue = dispatch_queue_create("com.tijo.TJDropbox.benchmark.results", DISPATCH_QUEUE_SERIAL);
+    dispatch_semaphore_t const slots = dispatch_semaphore_create(concurrency);
+    dispatch_group_t const group = dispatch_group_create();
+    NSMutableArray<NSNumber *> *const durations = [NSMutableArray arrayWithCapacity:iterations];
+    __block unsigned long long totalByteCount = 0;
+    __block NSUInteger failureCount = 0;
+    __block NSError *firstError = nil;
+
+    const uint64_t startTimestamp = _timestamp();
+    for (NSUInteger iteration = 0; iteration < iterations; iteration++) {
+        dispatch_semaphore_wait(slots, DISPATCH_TIME_FOREVER);
+        dispatch_group_enter(group);
+        const uint64_t operationStartTimestamp = _timestamp();
+        operation(iteration, ^(unsigned long long byteCount, NSError *error) {
+            const double duration = (_timestamp() - operationStartTimestamp) / (double)NSEC_PER_SEC;
+            dispatch_async(resultsQueue, ^{
+                if (error) {
+                    failureCount++;
+                    firstError = firstError ?: error;
+                } else {
+                    [durations addObject:@(duration)];
+                    totalByteCount += byteCount;
+                }
+                dispatch_semaphore_signal(slots);
+                dispatch_group_leave(group);
+            });
+        });
+    }
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    const double elapsed = (_timestamp() - startTimestamp) / (double)NSEC_PER_SEC;
+
+    dispatch_sync(resultsQueue, ^{
+        NSArray<NSNumber *> *const sortedDurations = [durations sortedArrayUsingSelector:@selector(compare:)];
+        printf("%-22s %6lu ok %4lu failed %10.1f req/s %9.2f MB/s   p50 %8.1f ms   p99 %8.1f ms\n",
+               name.UTF8String,
+               (unsigned long)durations.count,
+               (unsigned long)failureCount,
+               durations.count / elapsed,
+               totalByteCount / elapsed / (1024.0 * 1024.0),
+               _percentile(sortedDurations, 0.5) * 1000.0,
+               _percentile(sortedDurations, 0.99) * 1000.0);
+        if (firstError) {
+            printf("%22s first error: %s\n", "", firstError.description.UTF8String);
+        }
+    });
+
+    NSDictionary<NSString *, NSDictionary<NSString *, id> *> *const snapshot = [TJDropbox metricsSnapshot];
+    for (NSString *const endpoint in [snapshot.allKeys sortedArrayUsingSelector:@selector(compare:)]) {
+        NSDictionary<NSString *, id> *const totals = snapshot[endpoint];
+        printf("%24s%-40s %6lu requests   p50 %8.1f ms   p99 %8.1f ms\n",
+               "",
+               endpoint.UTF8String,
+               [totals[TJDropboxMetricsKeyCount] unsignedLongValue],
+               [totals[TJDropboxMetricsKeyMedianLatency] doubleValue] * 1000.0,
+               [totals[TJDropboxMetricsKeyP99Latency] doubleValue] * 1000.0);
+    }
+}
+
+// Times a synchronous operation in-process, for comparing code paths without the server. prepare runs before every iteration and isn't timed.
+static void _runLocalBenchmark(NSString *const name, const NSUInteger iterations, const unsigned long long byteCount, dispatch_block_t const prepare, dispatch_block_t const operation)
+{
+    NSMutableArray<NSNumber *> *const durations = [NSMutableArray arrayWithCapacity:iterations];
+    double elapsed = 0.0;
+    for (NSUInteger iteration = 0; iteration < iterations; iteration++) {
+        @autoreleasepool {
+            if (prepare) {
+                prepare();
+            }
+            const uint64_t startTimestamp = _timestamp();
+            operation();
+            const double duration = (_timestamp() - startTimestamp) / (double)NSEC_PER_SEC;
+            elapsed += duration;
+            [durations addObject:@(duration)];
+        }
+    }
+
+    NSArray<NSNumber *> *const sortedDurations = [durations sortedArrayUsingSelector:@selector(compare:)];
+    printf("%-22s %6lu runs %12.1f ops/s %9.3f GB/s   p50 %10.4f ms   p99 %10.4f ms\n",
+           name.UTF8String,
+           (unsigned long)iterations,
+           iterations / elapsed,
+           byteCount * iterations / elapsed / (1024.0 * 1024.0 * 1024.0),
+           _percentile(sortedDurations, 0.5) * 1000.0,
+           _percentile(sortedDurations, 0.99) * 1000.0);
+}
+
+// Hashes a file of each size with TJDropboxFileContentHash() and with the sequential path it replaced.
+// The hash cache is cleared before every iteration, otherwise all but the first would only measure a cache lookup.
+static void _runContentHashBenchmarks(NSString *const temporaryDirectory, const NSUInteger iterations, NSArray<NSNumber *> *const fileSizes)
+{
+    for (NSNumber *const fileSize in fileSizes) {
+        NSString *const path = _writeRandomFile(temporaryDirectory, @"content-hash.bin", fileSize.unsignedLongLongValue);
+        NSString *const sizeDescription = [NSByteCountFormatter stringFromByteCount:fileSize.longLongValue countStyle:NSByteCountFormatterCountStyleBinary];
+        _runLocalBenchmark([@"hash " stringByAppendingString:sizeDescription], iterations, fileSize.unsignedLongLongValue, ^{
+            TJDropboxRemoveAllCachedFileContentHashes();
+        }, ^{
+            TJDropboxFileContentHash(path);
+        });
+        _runLocalBenchmark([@"hash-sequential " stringByAppendingString:sizeDescription], iterations, fileSize.unsignedLongLongValue, nil, ^{
+            TJDropboxFileContentHashSequential(path);
+        });
+        unlink(path.fileSystemRepresentation);
+    }
+}
+
+// The argument encoding TJDropbox used before its JSON writer, kept here for the encode-arguments comparison.
+// Paths were escaped one appendFormat: per character, serialized with NSJSONSerialization, then every \\ was collapsed back to \ (which also mangled real backslashes).
+static NSString *_legacyAsciiEncodeString(NSString *const string)
+{
+    const NSUInteger stringLength = string.length;
+    NSMutableString *const result = string != nil ? [NSMutableString stringWithCapacity:stringLength] : nil;
+    for (NSUInteger i = 0; i < stringLength; i++) {
+        const unichar character = [string characterAtIndex:i];
+        if (character > 127) {
+            [result appendFormat:@"\\u%04x", character];
+        } else {
+            [result appendFormat:@"%c", character];
+        }
+    }
+    return result;
+}
+
+static NSString *_legacyParameterString(NSDictionary<NSString *, id> *const parameters)
+{
+    NSJSONWritingOptions options = 0;
+    if (@available(macOS 10.15, *)) {
+        options = NSJSONWritingWithoutEscapingSlashes;
+    }
+    NSData *const parameterData = [NSJSONSerialization dataWithJSONObject:parameters options:options error:nil];
+    NSString *const parameterString = [[NSString alloc] initWithData:parameterData encoding:NSUTF8StringEncoding];
+    return [parameterString stringByReplacingOccurrencesOfString:@"\\\\" withString:@"\\"];
+}
+
+// Encodes upload arguments for ASCII, non-ASCII and backslash-containing paths with the JSON writer and with the legacy encoding.
+// The legacy timing includes escaping the path since callers used to do that for every request.
+static void _runEncodeArgumentsBenchmarks(const NSUInteger iterations)
+{
+    NSDictionary<NSString *, NSString *> *const pathsForNames = @{
+        @"ascii": @"/Photos/2024/Trip to the coast/IMG_0001.jpg",
+        @"non-ascii": @"/Fotos/2024/Reise nach Zürich/写真_0001.jpg",
+        @"backslash": @"/Backups/C:\\Users\\Shared\\report.docx",
+    };
+    for (NSString *const name in @[@"ascii", @"non-ascii", @"backslash"]) {
+        NSString *const path = pathsForNames[name];
+        NSDictionary<NSString *, id> *(^const parameters)(NSString *) = ^NSDictionary<NSString *, id> *(NSString *encodedPath) {
+            return @{@"path": encodedPath, @"mode": @"overwrite", @"mute": @YES, @"autorename": @NO};
+        };
+        NSString *const writerOutput = TJDropboxParameterStringForParameters(parameters(path));
+        NSString *const legacyOutput = _legacyParameterString(parameters(_legacyAsciiEncodeString(path)));
+        _runLocalBenchmark([@"json-writer " stringByAppendingString:name], iterations, writerOutput.length, nil, ^{
+            TJDropboxParameterStringForParameters(parameters(path));
+        });
+        _runLocalBenchmark([@"legacy " stringByAppendingString:name], iterations, legacyOutput.length, nil, ^{
+            _legacyParameterString(parameters(_legacyAsciiEncodeString(path)));
+        });
+        // Compared once parsed since the two may order keys differently.
+        const id writerObject = [NSJSONSerialization JSONObjectWithData:[writerOutput dataUsingEncoding:NSUTF8StringEncoding] options:0 error:nil];
+        const id legacyObject = [NSJSONSerialization JSONObjectWithData:[legacyOutput dataUsingEncoding:NSUTF8StringEncoding] options:0 error:nil];
+        if (!legacyObject || ![writerObject isEqual:legacyObject]) {
+            printf("%24sjson-writer: %s\n%24slegacy:      %s\n", "", writerOutput.UTF8String, "", legacyOutput.UTF8String);
+        }
+    }
+}
+
+static unsigned long long _residentFootprint(void)
+{
+    task_vm_info_data_t info;
+    mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+    return task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&info, &count) == KERN_SUCCESS ? info.phys_footprint : 0;
+}
+
+// Fetches the raw list_folder responses for every page of a listing, so decoding them can be timed without the network.
+static NSArray<NSData *> *_fetchListFolderPages(NSURL *const serverURL, NSString *const token, NSString *const path)
+{
+    NSMutableArray<NSData *> *const pages = [NSMutableArray new];
+    NSString *endpoint = @"2/files/list_folder";
+    NSDictionary *argument = @{@"path": path};
+    while (argument) {
+        NSMutableURLRequest *const request = [NSMutableURLRequest requestWithURL:[serverURL URLByAppendingPathComponent:endpoint]];
+        request.HTTPMethod = @"POST";
+        request.HTTPBody = [NSJSONSerialization dataWithJSONObject:argument options:0 error:nil];
+        [request setValue:@"application/json" forHTTPHeaderField:@"Content-Type"];
+        [request setValue:[@"Bearer " stringByAppendingString:token] forHTTPHeaderField:@"Authorization"];
+        dispatch_semaphore_t const semaphore = dispatch_semaphore_create(0);
+        __block NSData *page = nil;
+        [[[NSURLSession sharedSession] dataTaskWithRequest:request completionHandler:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
+            page = [(NSHTTPURLResponse *)response statusCode] == 200 ? data : nil;
+            dispatch_semaphore_signal(semaphore);
+        }] resume];
+        dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+        NSDictionary *const result = page ? [NSJSONSerialization JSONObjectWithData:page options:0 error:nil] : nil;
+        if (![result isKindOfClass:[NSDictionary class]]) {
+            return nil;
+        }
+        [pages addObject:page];
+        endpoint = @"2/files/list_folder/continue";
+        argument = [result[@"has_more"] boolValue] ? @{@"cursor": result[@"cursor"]} : nil;
+    }
+    return pages;
+}
+
+// Decodes every page of a listing into dictionaries, as +listFolderWithPath: hands them out, and into TJDropboxMetadata, as +listFolderMetadataWithPath: does.
+// Prints how long each takes and how much resident memory holding the whole listing that way costs.
+static void _runListFolderDecodingBenchmarks(NSArray<NSData *> *const pages, const NSUInteger iterations)
+{
+    unsigned long long byteCount = 0;
+    for (NSData *const page in pages) {
+        byteCount += page.length;
+    }
+    NSArray *(^const decodeDictionaries)(void) = ^NSArray *{
+        NSMutableArray<NSDictionary *> *const entries = [NSMutableArray new];
+        for (NSData *const page in pages) {
+            @autoreleasepool {
+                [entries addObjectsFromArray:[NSJSONSerialization JSONObjectWithData:page options:0 error:nil][@"entries"]];
+            }
+        }
+        return entries;
+    };
+    NSArray *(^const decodeMetadata)(void) = ^NSArray *{
+        NSMutableArray<TJDropboxMetadata *> *const entries = [NSMutableArray new];
+        NSMutableDictionary *const pathPrefixes = [NSMutableDictionary new];
+        for (NSData *const page in pages) {
+            @autoreleasepool {
+                [entries addObjectsFromArray:TJDropboxMetadataForListFolderEntries([NSJSONSerialization JSONObjectWithData:page options:0 error:nil][@"entries"], pathPrefixes)];
+            }
+        }
+        return entries;
+    };
+
+    for (NSArray *const decoder in @[@[@"decode dictionaries", decodeDictionaries], @[@"decode metadata", decodeMetadata]]) {
+        NSArray *(^const decode)(void) = decoder[1];
+        // Measured before the timed runs, whose freed memory would otherwise be reused and hide the cost.
+        malloc_zone_pressure_relief(NULL, 0);
+        const unsigned long long footprintBefore = _residentFootprint();
+        NSArray *const entries = decode();
+        const unsigned long long footprintAfter = _residentFootprint();
+        const double footprint = footprintAfter > footprintBefore ? (double)(footprintAfter - footprintBefore) : 0.0;
+        _runLocalBenchmark(decoder[0], iterations, byteCount, nil, ^{
+            decode();
+        });
+        printf("%24s%lu entries held in %.2f MB, %.0f bytes each\n", "", (unsigned long)entries.count, footprint / (1024.0 * 1024.0), entries.count > 0 ? footprint / entries.count : 0.0);
+    }
+}
+
+// Uploads the files the download, listing, search and thumbnail benchmarks read.
+static BOOL _uploadFixtures(NSString *const smallFilePath, NSString *const largeFilePath, NSString *const temporaryDirectory, TJDropboxCredential *const credential)
+{
+    dispatch_group_t const group = dispatch_group_create();
+    __block BOOL succeeded = YES;
+
+    dispatch_group_enter(group);
+    [TJDropbox uploadFileAtPath:smallFilePath toPath:[kRemoteRoot stringByAppendingPathComponent:@"small.bin"] contentHash:nil overwriteExisting:YES muteDesktopNotifications:YES credential:credential progressBlock:nil completion:^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        succeeded = succeeded && !error;
+        dispatch_group_leave(group);
+    }];
+
+    dispatch_group_enter(group);
+    [TJDropbox uploadLargeFileAtPath:largeFilePath toPath:[kRemoteRoot stringByAppendingPathComponent:@"large.bin"] overwriteExisting:YES muteDesktopNotifications:YES credential:credential progressBlock:nil completion:^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        succeeded = succeeded && !error;
+        dispatch_group_leave(group);
+    }];
+
+    NSString *const itemPath = _writeRandomFile(temporaryDirectory, @"item.bin", 1024);
+    NSMutableArray<NSString *> *const localPaths = [NSMutableArray arrayWithCapacity:kListingFileCount];
+    NSMutableArray<NSString *> *const remotePaths = [NSMutableArray arrayWithCapacity:kListingFileCount];
+    for (NSUInteger i = 0; i < kListingFileCount; i++) {
+        [localPaths addObject:itemPath];
+        [remotePaths addObject:[NSString stringWithFormat:@"%@/listing/item-%04lu.jpg", kRemoteRoot, (unsigned long)i]];
+    }
+    dispatch_group_enter(group);
+    [TJDropbox uploadFilesAtPaths:localPaths toPaths:remotePaths overwriteExisting:YES muteDesktopNotifications:YES credential:credential progressBlock:nil completion:^(NSArray *results) {
+        for (const id result in results) {
+            succeeded = succeeded && ![result isKindOfClass:[NSError class]];
+        }
+        dispatch_group_leave(group);
+    }];
+
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    return succeeded;
+}
+
+// Uploads a large file with the default API, picking up from the upload's journal after failures such as dropped connections, or starting over if there's nothing to resume.
+static void _uploadLargeFileRecoveringFromFailures(NSString *const localPath, NSString *const remotePath, TJDropboxCredential *const credential, const NSUInteger remainingAttempts, const BOOL resume, void (^const completion)(NSError *_Nullable error))
+{
+    void (^const uploadCompletion)(NSDictionary *, NSError *) = ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        if (error && remainingAttempts > 1) {
+            const BOOL canResume = [TJDropbox hasResumableLargeFileUploadAtPath:localPath toPath:remotePath];
+            printf("%24s%s after: %s\n", "", canResume ? "resuming" : "starting over", error.localizedDescription.UTF8String);
+            _uploadLargeFileRecoveringFromFailures(localPath, remotePath, credential, remainingAttempts - 1, canResume, completion);
+        } else {
+            completion(error);
+        }
+    };
+    if (resume) {
+        [TJDropbox resumeLargeFileUploadAtPath:localPath toPath:remotePath credential:credential progressBlock:nil completion:uploadCompletion];
+    } else {
+        [TJDropbox uploadLargeFileAtPath:localPath toPath:remotePath overwriteExisting:YES muteDesktopNotifications:YES credential:credential progressBlock:nil completion:uploadCompletion];
+    }
+}
+
+// Runs upload-large with adaptive chunk sizes, one upload at a time, printing the chunk size and compression level each time the tuner changes them.
+// Meant to be run against a server with a loss profile (see Docs/benchmarking.md) to see how the tuner reacts to it.
+static void _runLargeUploadTuningBenchmark(NSString *const largeFilePath, const unsigned long long largeFileSize, const NSUInteger iterations, TJDropboxCredential *const credential)
+{
+    static const NSUInteger kMaximumAttempts = 10;
+
+    TJDropbox.adjustsLargeUploadChunkSize = YES;
+    TJDropbox.metricsSink = ^(NSDictionary<NSString *, id> * _Nonnull event) {
+        if ([event[TJDropboxMetricsKeyEndpoint] isEqual:TJDropboxMetricsEndpointUploadTuning]) {
+            printf("%24schunk size %6.1f MB   compression level %d   throughput %8.2f MB/s\n",
+                   "",
+                   [event[TJDropboxMetricsKeyChunkSize] doubleValue] / (1024.0 * 1024.0),
+                   [event[TJDropboxMetricsKeyCompressionLevel] intValue],
+                   [event[TJDropboxMetricsKeyThroughput] doubleValue] / (1024.0 * 1024.0));
+        }
+    };
+    _runBenchmark(@"upload-large-tuning", iterations, 1, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+        printf("%24supload %lu\n", "", (unsigned long)iteration);
+        NSString *const remotePath = [NSString stringWithFormat:@"%@/uploads/large-tuning-%lu.bin", kRemoteRoot, (unsigned long)iteration];
+        _uploadLargeFileRecoveringFromFailures(largeFilePath, remotePath, credential, kMaximumAttempts, NO, ^(NSError * _Nullable error) {
+            completion(largeFileSize, error);
+        });
+    });
+    TJDropbox.metricsSink = nil;
+    TJDropbox.adjustsLargeUploadChunkSize = NO;
+}
+
+// Uploads a folder of fileCount small files for the large listing benchmarks.
+static BOOL _uploadLargeListingFixture(NSString *const temporaryDirectory, const NSUInteger fileCount, TJDropboxCredential *const credential)
+{
+    NSString *const itemPath = _writeRandomFile(temporaryDirectory, @"large-listing-item.bin", 16);
+    NSMutableArray<NSString *> *const localPaths = [NSMutableArray arrayWithCapacity:fileCount];
+    NSMutableArray<NSString *> *const remotePaths = [NSMutableArray arrayWithCapacity:fileCount];
+    for (NSUInteger i = 0; i < fileCount; i++) {
+        [localPaths addObject:itemPath];
+        [remotePaths addObject:[NSString stringWithFormat:@"%@/large-listing/IMG_%06lu.jpg", kRemoteRoot, (unsigned long)i]];
+    }
+    dispatch_semaphore_t const semaphore = dispatch_semaphore_create(0);
+    __block BOOL succeeded = YES;
+    [TJDropbox uploadFilesAtPaths:localPaths toPaths:remotePaths overwriteExisting:YES muteDesktopNotifications:YES credential:credential progressBlock:nil completion:^(NSArray *results) {
+        for (const id result in results) {
+            succeeded = succeeded && ![result isKindOfClass:[NSError class]];
+        }
+        dispatch_semaphore_signal(semaphore);
+    }];
+    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    return succeeded;
+}
+
+int main(int argc, const char *argv[])
+{
+    @autoreleasepool {
+        NSArray<NSString *> *const arguments = [[NSProcessInfo processInfo] arguments];
+        if ([arguments containsObject:@"--help"]) {
+            printf("usage: tjdropbox-benchmark [--server URL] [--token TOKEN] [--iterations N] [--large-iterations N] [--concurrency N] [--small-file-size BYTES] [--large-file-size BYTES] [--large-listing-size N] [--hash-sizes BYTES,...] [benchmark...]\n");
+            return 0;
+        }
+        NSURL *const serverURL = [NSURL URLWithString:_argumentValue(arguments, @"--server", @"http://127.0.0.1:8080")];
+        NSString *const token = _argumentValue(arguments, @"--token", @"benchmark");
+        const NSUInteger iterations = (NSUInteger)_argumentValue(arguments, @"--iterations", @"100").integerValue;
+        const NSUInteger largeIterations = (NSUInteger)_argumentValue(arguments, @"--large-iterations", @"5").integerValue;
+        const NSUInteger concurrency = MAX((NSUInteger)_argumentValue(arguments, @"--concurrency", @"4").integerValue, 1);
+        const unsigned long long smallFileSize = (unsigned long long)_argumentValue(arguments, @"--small-file-size", @"262144").longLongValue;
+        const unsigned long long largeFileSize = (unsigned long long)_argumentValue(arguments, @"--large-file-size", @"33554432").longLongValue;
+        const NSUInteger largeListingSize = (NSUInteger)_argumentValue(arguments, @"--large-listing-size", @"10000").integerValue;
+        NSMutableArray<NSNumber *> *const hashFileSizes = [NSMutableArray new];
+        for (NSString *const size in [_argumentValue(arguments, @"--hash-sizes", @"1048576,104857600,4294967296") componentsSeparatedByString:@","]) {
+            [hashFileSizes addObject:@(size.longLongValue)];
+        }
+
+        // Anything that isn't an option or an option's value names a benchmark to run.
+        NSMutableSet<NSString *> *const selectedBenchmarks = [NSMutableSet new];
+        for (NSUInteger i = 1; i < arguments.count; i++) {
+            if ([arguments[i] hasPrefix:@"--"]) {
+                i++;
+            } else {
+                [selectedBenchmarks addObject:arguments[i]];
+            }
+        }
+
+        TJDropbox.apiBaseURL = serverURL;
+        TJDropbox.contentBaseURL = serverURL;
+        TJDropbox.notifyBaseURL = serverURL;
+        TJDropbox.metricsEnabled = YES;
+        // Every call should reach the server.
+        TJDropbox.cachedResponseLifetime = 0.0;
+
+        TJDropboxCredential *const credential = [[TJDropboxCredential alloc] initWithAccessToken:token];
+        NSString *const temporaryDirectory = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]];
+        [[NSFileManager defaultManager] createDirectoryAtPath:temporaryDirectory withIntermediateDirectories:YES attributes:nil error:nil];
+
+        // Local benchmarks don't talk to the server, and only run when they're named.
+        NSSet<NSString *> *const localBenchmarks = [NSSet setWithObjects:@"content-hash", @"encode-arguments", nil];
+        if ([selectedBenchmarks containsObject:@"content-hash"]) {
+            _runContentHashBenchmarks(temporaryDirectory, largeIterations, hashFileSizes);
+        }
+        if ([selectedBenchmarks containsObject:@"encode-arguments"]) {
+            // Each encode takes around a microsecond, so run many more of them than requests.
+            _runEncodeArgumentsBenchmarks(iterations * 1000);
+        }
+        if (selectedBenchmarks.count > 0 && [selectedBenchmarks isSubsetOfSet:localBenchmarks]) {
+            [[NSFileManager defaultManager] removeItemAtPath:temporaryDirectory error:nil];
+            return 0;
+        }
+
+        NSString *const smallFilePath = _writeRandomFile(temporaryDirectory, @"small.bin", smallFileSize);
+        NSString *const largeFilePath = _writeRandomFile(temporaryDirectory, @"large.bin", largeFileSize);
+
+        // Uploads don't read anything back, so they can run against a lossy server without first uploading fixtures through it.
+        NSSet<NSString *> *const benchmarksWithoutFixtures = [localBenchmarks setByAddingObjectsFromArray:@[@"upload", @"upload-large", @"upload-large-concurrent", @"upload-large-tuning"]];
+        const BOOL needsFixtures = selectedBenchmarks.count == 0 || ![selectedBenchmarks isSubsetOfSet:benchmarksWithoutFixtures];
+        if (needsFixtures && !_uploadFixtures(smallFilePath, largeFilePath, temporaryDirectory, credential)) {
+            fprintf(stderr, "Couldn't upload fixtures to %s, is the mock server running?\n", serverURL.absoluteString.UTF8String);
+            return 1;
+        }
+        NSString *const remoteSmallPath = [kRemoteRoot stringByAppendingPathComponent:@"small.bin"];
+        NSString *const remoteLargePath = [kRemoteRoot stringByAppendingPathComponent:@"large.bin"];
+        NSString *const remoteListingPath = [kRemoteRoot stringByAppendingPathComponent:@"listing"];
+        NSString *const remoteLargeListingPath = [kRemoteRoot stringByAppendingPathComponent:@"large-listing"];
+        const BOOL runsLargeListingBenchmarks = selectedBenchmarks.count == 0 || [selectedBenchmarks containsObject:@"list-folder-large"] || [selectedBenchmarks containsObject:@"list-folder-metadata"];
+        if (runsLargeListingBenchmarks && !_uploadLargeListingFixture(temporaryDirectory, largeListingSize, credential)) {
+            fprintf(stderr, "Couldn't upload the large listing to %s\n", serverURL.absoluteString.UTF8String);
+            return 1;
+        }
+
+        NSMutableArray<NSArray *> *const benchmarks = [NSMutableArray new];
+        void (^const addBenchmark)(NSString *, NSUInteger, TJDropboxBenchmarkOperation) = ^(NSString *name, NSUInteger count, TJDropboxBenchmarkOperation operation) {
+            if (selectedBenchmarks.count == 0 || [selectedBenchmarks containsObject:name]) {
+                [benchmarks addObject:@[name, @(count), operation]];
+            }
+        };
+
+        addBenchmark(@"upload", iterations, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+            NSString *const remotePath = [NSString stringWithFormat:@"%@/uploads/small-%lu.bin", kRemoteRoot, (unsigned long)iteration];
+            [TJDropbox uploadFileAtPath:smallFilePath toPath:remotePath contentHash:nil overwriteExisting:YES muteDesktopNotifications:YES credential:credential progressBlock:nil completion:^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+                completion(smallFileSize, error);
+            }];
+        });
+        addBenchmark(@"upload-large", largeIterations, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+            NSString *const remotePath = [NSString stringWithFormat:@"%@/uploads/large-%lu.bin", kRemoteRoot, (unsigned long)iteration];
+            [TJDropbox uploadLargeFileAtPath:largeFilePath toPath:remotePath overwriteExisting:YES muteDesktopNotifications:YES credential:credential progressBlock:nil completion:^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+                completion(largeFileSize, error);
+            }];
+        });
+        addBenchmark(@"upload-large-concurrent", largeIterations, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+            // The same file as upload-large through a concurrent session, 4 appends of 8 MB in flight at once.
+            NSString *const remotePath = [NSString stringWithFormat:@"%@/uploads/large-concurrent-%lu.bin", kRemoteRoot, (unsigned long)iteration];
+            [TJDropbox uploadLargeFileAtPath:largeFilePath toPath:remotePath overwriteExisting:YES muteDesktopNotifications:YES chunkSize:8 * 1024 * 1024 maximumConcurrentChunks:4 credential:credential progressBlock:nil completion:^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+                completion(largeFileSize, error);
+            }];
+        });
+        addBenchmark(@"download", iterations, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+            NSString *const localPath = [temporaryDirectory stringByAppendingPathComponent:[NSString stringWithFormat:@"download-%lu.bin", (unsigned long)iteration]];
+            [TJDropbox downloadFileAtPath:remoteSmallPath toPath:localPath credential:credential completion:^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+                unlink(localPath.fileSystemRepresentation);
+                completion(smallFileSize, error);
+            }];
+        });
+        addBenchmark(@"fetch", iterations, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+            // The same file as download, kept in memory rather than written to disk.
+            [TJDropbox fetchFileAtPath:remoteSmallPath credential:credential completion:^(NSData * _Nullable data, NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+                completion(data.length, error);
+            }];
+        });
+        addBenchmark(@"download-large", largeIterations, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+            NSString *const localPath = [temporaryDirectory stringByAppendingPathComponent:[NSString stringWithFormat:@"download-large-%lu.bin", (unsigned long)iteration]];
+            [TJDropbox downloadLargeFileAtPath:remoteLargePath toPath:localPath maximumConcurrentRanges:4 credential:credential progressBlock:nil completion:^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+                unlink(localPath.fileSystemRepresentation);
+                completion(largeFileSize, error);
+            }];
+        });
+        addBenchmark(@"read-range", iterations, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+            // Just the start of the large file, as when only a header or index is needed.
+            [TJDropbox readFileAtPath:remoteLargePath offset:0 length:kReadRangeLength credential:credential completion:^(NSData * _Nullable data, NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+                completion(data.length, error);
+            }];
+        });
+        addBenchmark(@"get-metadata", iterations, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+            [TJDropbox getMetadataAtPath:remoteSmallPath credential:credential completion:^(TJDropboxMetadata * _Nullable metadata, NSError * _Nullable error) {
+                completion(0, error);
+            }];
+        });
+        addBenchmark(@"list-folder", iterations, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+            [TJDropbox listFolderWithPath:remoteListingPath credential:credential completion:^(NSArray<NSDictionary *> * _Nullable entries, NSString * _Nullable cursor, NSError * _Nullable error) {
+                completion(0, error);
+            }];
+        });
+        addBenchmark(@"list-folder-large", iterations, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+            // Holds on to every page, as a caller showing the whole folder would.
+            NSMutableArray<NSDictionary *> *const entries = [NSMutableArray arrayWithCapacity:largeListingSize];
+            [TJDropbox listFolderWithPath:remoteLargeListingPath cursor:nil includeDeleted:NO credential:credential pageHandler:^BOOL(NSArray<NSDictionary *> * _Nonnull page, BOOL hasMore) {
+                [entries addObjectsFromArray:page];
+                return YES;
+            } completion:^(NSString * _Nullable cursor, NSError * _Nullable error) {
+                completion(0, error);
+            }];
+        });
+        addBenchmark(@"list-folder-metadata", iterations, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+            // The same listing as list-folder-large, decoded into TJDropboxMetadata page by page.
+            NSMutableArray<TJDropboxMetadata *> *const entries = [NSMutableArray arrayWithCapacity:largeListingSize];
+            [TJDropbox listFolderMetadataWithPath:remoteLargeListingPath cursor:nil includeDeleted:NO credential:credential pageHandler:^BOOL(NSArray<TJDropboxMetadata *> * _Nonnull page, BOOL hasMore) {
+                [entries addObjectsFromArray:page];
+                return YES;
+            } completion:^(NSString * _Nullable cursor, NSError * _Nullable error) {
+                completion(0, error);
+            }];
+        });
+        addBenchmark(@"search", iterations, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+            [TJDropbox searchForFilesAtPath:remoteListingPath matchingQuery:@"item" options:nil credential:credential completion:^(NSArray * _Nullable entries, NSError * _Nullable error) {
+                completion(0, error);
+            }];
+        });
+        addBenchmark(@"thumbnails", iterations, ^(NSUInteger iteration, TJDropboxBenchmarkCompletion completion) {
+            // A fresh loader per iteration so every thumbnail is fetched rather than read from its caches.
+            NSString *const cacheDirectoryPath = [temporaryDirectory stringByAppendingPathComponent:[NSString stringWithFormat:@"thumbnails-%lu", (unsigned long)iteration]];
+            TJDropboxThumbnailLoader *const loader = [[TJDropboxThumbnailLoader alloc] initWithCredential:credential cacheDirectoryPath:cacheDirectoryPath];
+            dispatch_group_t const group = dispatch_group_create();
+            __block unsigned long long byteCount = 0;
+            __block NSError *firstError = nil;
+            NSObject *const lock = [NSObject new];
+            for (NSUInteger i = 0; i < kThumbnailBatchSize; i++) {
+                dispatch_group_enter(group);
+                NSString *const path = [NSString stringWithFormat:@"%@/item-%04lu.jpg", remoteListingPath, (unsigned long)((iteration * kThumbnailBatchSize + i) % kListingFileCount)];
+                [loader loadThumbnailAtPath:path rev:nil size:TJDropboxThumbnailSize64Square completion:^(NSData * _Nullable thumbnailData, NSError * _Nullable error) {
+                    @synchronized (lock) {
+                        byteCount += thumbnailData.length;
+                        firstError = firstError ?: error;
+                    }
+                    dispatch_group_leave(group);
+                }];
+            }
+            dispatch_group_notify(group, dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+                (void)loader;
+                completion(byteCount, firstError);
+            });
+        });
+
+        for (NSArray *const benchmark in benchmarks) {
+            _runBenchmark(benchmark[0], [benchmark[1] unsignedIntegerValue], concurrency, benchmark[2]);
+        }
+
+        if (selectedBenchmarks.count == 0 || [selectedBenchmarks containsObject:@"upload-large-tuning"]) {
+            _runLargeUploadTuningBenchmark(largeFilePath, largeFileSize, largeIterations, credential);
+        }
+        if (selectedBenchmarks.count == 0 || [selectedBenchmarks containsObject:@"list-folder-metadata"]) {
+            NSArray<NSData *> *const pages = _fetchListFolderPages(serverURL, token, remoteLargeListingPath);
+            if (pages) {
+                _runListFolderDecodingBenchmarks(pages, iterations);
+            } else {
+                fprintf(stderr, "Couldn't fetch the large listing for the decoding benchmarks\n");
+            }
+        }
+
+        [[NSFileManager defaultManager] removeItemAtPath:temporaryDirectory error:nil];
+    }
+    return 0;
+}
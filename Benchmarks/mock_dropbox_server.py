@@ -0,0 +1,625 @@
+#!/usr/bin/env python3
+"""A local stand-in for the Dropbox API hosts, for load testing and profiling TJDropbox.
+
+Serves the api, content and notify endpoints TJDropbox uses from a single port, backed by an in-memory file tree.
+Point TJDropbox.apiBaseURL, contentBaseURL and notifyBaseURL at it (see Docs/benchmarking.md).
+
+Only the Python standard library is used:
+
+    python3 Benchmarks/mock_dropbox_server.py --port 8080 --latency 40 --bandwidth 2000000 --rate-limit 0.05
+"""
+
+import argparse
+import base64
+import gzip
+import hashlib
+import itertools
+import json
+import random
+import re
+import sys
+import threading
+import time
+import uuid
+import zlib
+from datetime import datetime, timezone
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs
+
+CONTENT_HASH_BLOCK_SIZE = 4 * 1024 * 1024
+IO_CHUNK_SIZE = 64 * 1024
+
+# A 1x1 JPEG returned for every thumbnail.
+THUMBNAIL = base64.b64decode(
+    "/9j/4AAQSkZJRgABAQEASABIAAD/2wBDAP//////////////////////////////////////////////////////////////////////////////////////"
+    "wgALCAABAAEBAREA/8QAFBABAAAAAAAAAAAAAAAAAAAAAP/aAAgBAQABPxA="
+)
+
+
+class DropboxError(Exception):
+    """Raised by endpoint handlers, becomes a Dropbox-style error response."""
+
+    def __init__(self, summary, error=None, status=409):
+        super().__init__(summary)
+        self.summary = summary
+        self.error = error if error is not None else _error_for_summary(summary)
+        self.status = status
+
+
+def _error_for_summary(summary):
+    # "path/not_found/" -> {".tag": "path", "path": {".tag": "not_found"}}
+    tags = [tag for tag in summary.split("/") if tag and not tag.startswith(".")]
+    error = {}
+    for tag in reversed(tags):
+        error = {".tag": tag, tag: error} if error else {".tag": tag}
+    return error
+
+
+def content_hash(data):
+    block_hashes = b"".join(
+        hashlib.sha256(data[offset:offset + CONTENT_HASH_BLOCK_SIZE]).digest()
+        for offset in range(0, len(data), CONTENT_HASH_BLOCK_SIZE)
+    )
+    return hashlib.sha256(block_hashes).hexdigest()
+
+
+def _timestamp():
+    return datetime.now(timezone.utc).strftime("%Y-%m-%dT%H:%M:%SZ")
+
+
+def _encode_cursor(state):
+    return base64.urlsafe_b64encode(json.dumps(state, separators=(",", ":")).encode()).decode()
+
+
+def _decode_cursor(cursor, reset_summary):
+    try:
+        return json.loads(base64.urlsafe_b64decode(cursor.encode()))
+    except (ValueError, TypeError):
+        raise DropboxError(reset_summary)
+
+
+class FileTree:
+    """In-memory files and folders keyed by lowercased path, with a journal of changes for list_folder cursors."""
+
+    def __init__(self):
+        self.lock = threading.Condition()
+        self.entries = {"": {".tag": "folder", "name": "", "path_lower": "", "path_display": "", "id": "id:root"}}
+        self.contents = {}  # path_lower -> bytes, files only
+        self.revisions = {}  # rev -> (metadata, bytes), kept for rev: lookups
+        self.journal = []  # (path_lower, metadata), metadata is a deleted entry for removals
+        self.next_revision = itertools.count(0x100000000)
+
+    @staticmethod
+    def normalize(path):
+        if path in ("", "/"):
+            return ""
+        if not path.startswith("/"):
+            raise DropboxError("path/malformed_path/", status=400)
+        return path.rstrip("/")
+
+    def _record(self, metadata):
+        self.journal.append((metadata["path_lower"], metadata))
+        self.lock.notify_all()
+
+    def _ensure_parents(self, path_display):
+        parts = path_display.split("/")[1:-1]
+        for index in range(1, len(parts) + 1):
+            folder_display = "/" + "/".join(parts[:index])
+            folder_lower = folder_display.lower()
+            existing = self.entries.get(folder_lower)
+            if existing is None:
+                metadata = {
+                    ".tag": "folder",
+                    "name": parts[index - 1],
+                    "path_lower": folder_lower,
+                    "path_display": folder_display,
+                    "id": "id:" + uuid.uuid4().hex,
+                }
+                self.entries[folder_lower] = metadata
+                self._record(metadata)
+            elif existing[".tag"] != "folder":
+                raise DropboxError("path/conflict/file/")
+
+    def resolve(self, path):
+        """Returns (metadata, bytes) for a path, rev: or id: reference."""
+        with self.lock:
+            if path.startswith("rev:"):
+                found = self.revisions.get(path[4:])
+                if found is None:
+                    raise DropboxError("path/not_found/")
+                return found
+            if path.startswith("id:"):
+                for path_lower, metadata in self.entries.items():
+                    if metadata.get("id") == path:
+                        return metadata, self.contents.get(path_lower)
+                raise DropboxError("path/not_found/")
+            path_lower = self.normalize(path).lower()
+            metadata = self.entries.get(path_lower)
+            if metadata is None:
+                raise DropboxError("path/not_found/")
+            return metadata, self.contents.get(path_lower)
+
+    def write(self, path, data, mode, expected_content_hash=None):
+        path_display = self.normalize(path)
+        if not path_display:
+            raise DropboxError("path/malformed_path/", status=400)
+        if expected_content_hash is not None and expected_content_hash != content_hash(data):
+            raise DropboxError("content_hash_mismatch/")
+        path_lower = path_display.lower()
+        with self.lock:
+            existing = self.entries.get(path_lower)
+            overwrite = isinstance(mode, dict) and mode.get(".tag") == "overwrite" or mode == "overwrite"
+            if existing is not None:
+                if existing[".tag"] == "folder":
+                    raise DropboxError("path/conflict/folder/")
+                if not overwrite:
+                    if self.contents.get(path_lower) == data:
+                        return existing
+                    raise DropboxError("path/conflict/file/")
+            self._ensure_parents(path_display)
+            now = _timestamp()
+            metadata = {
+                ".tag": "file",
+                "name": path_display.rsplit("/", 1)[-1],
+                "path_lower": path_lower,
+                "path_display": path_display,
+                "id": existing["id"] if existing else "id:" + uuid.uuid4().hex,
+                "rev": "%012x" % next(self.next_revision),
+                "size": len(data),
+                "client_modified": now,
+                "server_modified": now,
+                "content_hash": content_hash(data),
+                "is_downloadable": True,
+            }
+            self.entries[path_lower] = metadata
+            self.contents[path_lower] = data
+            self.revisions[metadata["rev"]] = (metadata, data)
+            self._record(metadata)
+            return metadata
+
+    def create_folder(self, path):
+        path_display = self.normalize(path)
+        path_lower = path_display.lower()
+        with self.lock:
+            if path_lower in self.entries:
+                raise DropboxError("path/conflict/folder/")
+            self._ensure_parents(path_display + "/placeholder")
+            return self.entries[path_lower]
+
+    def delete(self, path):
+        path_lower = self.normalize(path).lower()
+        with self.lock:
+            metadata = self.entries.get(path_lower)
+            if metadata is None or not path_lower:
+                raise DropboxError("path_lookup/not_found/")
+            for child in [key for key in self.entries if key == path_lower or key.startswith(path_lower + "/")]:
+                removed = self.entries.pop(child)
+                self.contents.pop(child, None)
+                self._record({".tag": "deleted", "name": removed["name"], "path_lower": child, "path_display": removed["path_display"]})
+            return metadata
+
+    def listing(self, path_lower, recursive):
+        """Current entries under a folder, in a stable order. Must be called with the lock held."""
+        folder = self.entries.get(path_lower)
+        if folder is None:
+            raise DropboxError("path/not_found/")
+        if folder[".tag"] != "folder":
+            raise DropboxError("path/not_folder/")
+        return [
+            metadata for key, metadata in sorted(self.entries.items())
+            if key and _is_within(key, path_lower, recursive)
+        ]
+
+    def changes(self, path_lower, recursive, position):
+        """Journal entries under a folder since a cursor's position. Must be called with the lock held."""
+        latest = {}
+        for key, metadata in self.journal[position:]:
+            if _is_within(key, path_lower, recursive):
+                latest.pop(key, None)
+                latest[key] = metadata
+        return list(latest.values())
+
+
+def _is_within(key, path_lower, recursive):
+    if not key.startswith(path_lower + "/"):
+        return False
+    return recursive or "/" not in key[len(path_lower) + 1:]
+
+
+class Server(ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, address, options):
+        super().__init__(address, Handler)
+        self.options = options
+        self.tree = FileTree()
+        self.sessions = {}  # session_id -> {"chunks": {offset: bytes}, "length": int, "closed": bool, "concurrent": bool}
+        self.sessions_lock = threading.Lock()
+        self.tokens = {}  # access token -> expiration time, only for tokens issued by /oauth2/token
+        self.tokens_lock = threading.Lock()
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    server_version = "TJDropboxMockServer/1.0"
+
+    # Routing
+
+    def do_POST(self):
+        options = self.server.options
+        self.content_range = None
+        # The request is still handled, only its response is lost, as when a link drops before the reply arrives.
+        self.drops_response = random.random() < options.drop_rate
+        started = time.monotonic()
+        try:
+            body = self._read_body()
+            if options.latency > 0:
+                time.sleep((options.latency + random.uniform(-options.jitter, options.jitter)) / 1000.0)
+            if random.random() < options.rate_limit:
+                raise DropboxError("too_many_requests/", {"reason": {".tag": "too_many_requests"}, "retry_after": options.retry_after}, status=429)
+            if random.random() < options.failure_rate:
+                raise DropboxError("service_unavailable/", status=503)
+
+            route = ROUTES.get(self.path.split("?", 1)[0])
+            if route is None:
+                raise DropboxError("unknown_endpoint/", status=404)
+            style, handler = route
+            if handler is not Handler.oauth_token and handler is not Handler.list_folder_longpoll:
+                self._authenticate()
+            if style == "download":
+                result, data = handler(self, json.loads(self.headers.get("Dropbox-API-Arg") or "null") or {})
+                headers = {"Dropbox-API-Result": _ascii_json(result)}
+                if self.content_range:
+                    headers["Content-Range"] = self.content_range
+                self._respond(206 if self.content_range else 200, data, "application/octet-stream", headers)
+            elif style == "upload":
+                result = handler(self, json.loads(self.headers.get("Dropbox-API-Arg") or "null") or {}, body)
+                self._respond_json(200, result)
+            elif style == "form":
+                result = handler(self, {key: values[0] for key, values in parse_qs(body.decode()).items()})
+                self._respond_json(200, result)
+            else:
+                result = handler(self, json.loads(body or b"null"))
+                self._respond_json(200, result)
+        except DropboxError as error:
+            headers = {"Retry-After": str(options.retry_after)} if error.status in (429, 503) else {}
+            self._respond_json(error.status, {"error_summary": error.summary, "error": error.error}, headers)
+        except (ValueError, KeyError, TypeError) as error:
+            # The body may not have been read completely, so the connection can't be reused.
+            self.close_connection = True
+            self._respond(400, ("Error in call: %s" % error).encode(), "text/plain")
+        if options.verbose:
+            sys.stderr.write("%s %.1fms\n" % (self.path, (time.monotonic() - started) * 1000))
+
+    def log_message(self, format, *args):
+        pass
+
+    # I/O
+
+    def _read_body(self):
+        if self.headers.get("Transfer-Encoding", "").lower() == "chunked":
+            body = bytearray()
+            while True:
+                size = int(self.rfile.readline().split(b";", 1)[0], 16)
+                if size == 0:
+                    while self.rfile.readline() not in (b"\r\n", b"\n", b""):
+                        pass
+                    break
+                body += self._read_throttled(size)
+                self.rfile.readline()
+        else:
+            body = self._read_throttled(int(self.headers.get("Content-Length") or 0))
+        if self.headers.get("Content-Encoding", "").lower() == "gzip":
+            body = gzip.decompress(bytes(body))
+        elif self.headers.get("Content-Encoding", "").lower() == "deflate":
+            body = zlib.decompress(bytes(body))
+        return bytes(body)
+
+    def _read_throttled(self, length):
+        data = bytearray()
+        while len(data) < length:
+            chunk = self.rfile.read(min(IO_CHUNK_SIZE, length - len(data)))
+            if not chunk:
+                raise ValueError("request body ended early")
+            data += chunk
+            self._throttle(len(chunk))
+        return data
+
+    def _throttle(self, byte_count):
+        bandwidth = self.server.options.bandwidth
+        if bandwidth > 0:
+            time.sleep(byte_count / float(bandwidth))
+
+    def _respond(self, status, data, content_type, headers=None):
+        if self.drops_response:
+            self.close_connection = True
+            return
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(data)))
+        for name, value in (headers or {}).items():
+            self.send_header(name, value)
+        self.end_headers()
+        for offset in range(0, len(data), IO_CHUNK_SIZE):
+            chunk = data[offset:offset + IO_CHUNK_SIZE]
+            self.wfile.write(chunk)
+            self._throttle(len(chunk))
+
+    def _respond_json(self, status, result, headers=None):
+        self._respond(status, json.dumps(result).encode(), "application/json", headers)
+
+    def _authenticate(self):
+        authorization = self.headers.get("Authorization", "")
+        if not authorization.startswith("Bearer ") or len(authorization) <= len("Bearer "):
+            raise DropboxError("invalid_access_token/", status=401)
+        token = authorization[len("Bearer "):]
+        with self.server.tokens_lock:
+            expiration = self.server.tokens.get(token)
+        # Tokens that weren't issued here are accepted so benchmarks can use any placeholder.
+        if expiration is not None and time.time() >= expiration:
+            raise DropboxError("expired_access_token/", status=401)
+
+    # Auth
+
+    def oauth_token(self, form):
+        grant_type = form.get("grant_type")
+        if grant_type not in ("authorization_code", "refresh_token"):
+            raise DropboxError("unsupported_grant_type/", {"error": "unsupported_grant_type"}, status=400)
+        lifetime = self.server.options.token_lifetime
+        token = "mock-" + uuid.uuid4().hex
+        with self.server.tokens_lock:
+            self.server.tokens[token] = time.time() + lifetime
+        result = {"access_token": token, "token_type": "bearer", "expires_in": lifetime}
+        if grant_type == "authorization_code":
+            result["refresh_token"] = "mock-refresh-" + uuid.uuid4().hex
+        return result
+
+    # Files
+
+    def get_metadata(self, argument):
+        return self.server.tree.resolve(argument["path"])[0]
+
+    def upload(self, argument, body):
+        return self.server.tree.write(argument["path"], body, argument.get("mode", "add"), argument.get("content_hash"))
+
+    def download(self, argument):
+        metadata, data = self.server.tree.resolve(argument["path"])
+        if metadata[".tag"] != "file":
+            raise DropboxError("path/not_file/")
+        byte_range = self.headers.get("Range")
+        if byte_range is None:
+            return metadata, data
+        match = re.fullmatch(r"bytes=(\d*)-(\d*)", byte_range.strip())
+        if match is None or match.group(1) == match.group(2) == "":
+            raise DropboxError("range_not_satisfiable/", status=416)
+        if match.group(1) == "":
+            start, end = max(len(data) - int(match.group(2)), 0), len(data) - 1
+        else:
+            start = int(match.group(1))
+            end = min(int(match.group(2)), len(data) - 1) if match.group(2) else len(data) - 1
+        if start > end or start >= len(data):
+            raise DropboxError("range_not_satisfiable/", status=416)
+        self.content_range = "bytes %d-%d/%d" % (start, end, len(data))
+        return metadata, data[start:end + 1]
+
+    def _new_session(self, argument):
+        session_id = "session-" + uuid.uuid4().hex
+        concurrent = (argument.get("session_type") or {}).get(".tag") == "concurrent"
+        self.server.sessions[session_id] = {"chunks": {}, "length": 0, "closed": False, "concurrent": concurrent}
+        return session_id
+
+    def upload_session_start(self, argument, body):
+        with self.server.sessions_lock:
+            session_id = self._new_session(argument)
+        self._append({"session_id": session_id, "offset": 0}, body, bool(argument.get("close")))
+        return {"session_id": session_id}
+
+    def upload_session_start_batch(self, argument):
+        with self.server.sessions_lock:
+            return {"session_ids": [self._new_session(argument) for _ in range(int(argument["num_sessions"]))]}
+
+    def _append(self, cursor, body, close):
+        offset = int(cursor["offset"])
+        with self.server.sessions_lock:
+            session = self.server.sessions.get(cursor["session_id"])
+            if session is None:
+                raise DropboxError("lookup_failed/not_found/")
+            # Chunks of a concurrent session can still arrive after the one that closed it.
+            if session["closed"] and body and not session["concurrent"]:
+                raise DropboxError("lookup_failed/closed/")
+            # Concurrent sessions take chunks in any order, sequential ones only at the end of what's been received.
+            if not session["concurrent"] and offset != session["length"]:
+                raise DropboxError("lookup_failed/incorrect_offset/", {".tag": "lookup_failed", "lookup_failed": {".tag": "incorrect_offset", "correct_offset": session["length"]}})
+            if body:
+                session["chunks"][offset] = body
+                session["length"] = max(session["length"], offset + len(body))
+            session["closed"] = session["closed"] or close
+            return session
+
+    def upload_session_append(self, argument, body):
+        self._append(argument["cursor"], body, bool(argument.get("close")))
+        return None
+
+    def _finish(self, cursor, commit, body):
+        session = self._append(cursor, body, True)
+        data = bytearray()
+        for offset, chunk in sorted(session["chunks"].items()):
+            if offset != len(data):
+                raise DropboxError("lookup_failed/incorrect_offset/", {".tag": "lookup_failed", "lookup_failed": {".tag": "incorrect_offset", "correct_offset": len(data)}})
+            data += chunk
+        if session["concurrent"] and int(cursor["offset"]) != len(data):
+            raise DropboxError("lookup_failed/incorrect_offset/", {".tag": "lookup_failed", "lookup_failed": {".tag": "incorrect_offset", "correct_offset": len(data)}})
+        with self.server.sessions_lock:
+            self.server.sessions.pop(cursor["session_id"], None)
+        return self.server.tree.write(commit["path"], bytes(data), commit.get("mode", "add"), commit.get("content_hash"))
+
+    def upload_session_finish(self, argument, body):
+        return self._finish(argument["cursor"], argument["commit"], body)
+
+    def upload_session_finish_batch(self, argument):
+        entries = []
+        for entry in argument["entries"]:
+            try:
+                entries.append(dict(self._finish(entry["cursor"], entry["commit"], b""), **{".tag": "success"}))
+            except DropboxError as error:
+                entries.append({".tag": "failure", "failure": error.error})
+        return {"entries": entries}
+
+    def create_folder(self, argument):
+        return self.server.tree.create_folder(argument["path"])
+
+    def delete(self, argument):
+        return {"metadata": self.server.tree.delete(argument["path"])}
+
+    # Listing
+
+    def list_folder(self, argument):
+        tree = self.server.tree
+        path_lower = tree.normalize(argument.get("path", "")).lower()
+        with tree.lock:
+            tree.listing(path_lower, bool(argument.get("recursive")))
+            state = {"p": path_lower, "r": bool(argument.get("recursive")), "l": int(argument.get("limit") or 2000), "o": 0, "j": len(tree.journal)}
+        return self._list_folder_page(state)
+
+    def list_folder_continue(self, argument):
+        return self._list_folder_page(_decode_cursor(argument["cursor"], "reset/"))
+
+    def _list_folder_page(self, state):
+        tree = self.server.tree
+        with tree.lock:
+            if "o" in state:
+                # Still enumerating the initial listing, changes made meanwhile are picked up from the journal afterwards.
+                entries = tree.listing(state["p"], state["r"])
+                page = entries[state["o"]:state["o"] + state["l"]]
+                if state["o"] + state["l"] < len(entries):
+                    next_state = dict(state, o=state["o"] + state["l"])
+                else:
+                    next_state = {"p": state["p"], "r": state["r"], "l": state["l"], "j": state["j"]}
+                has_more = "o" in next_state
+            else:
+                # Changes are paged by skipping those already delivered, the journal position only advances once they all have been.
+                changes = tree.changes(state["p"], state["r"], state["j"])
+                skip = state.get("s", 0)
+                page = changes[skip:skip + state["l"]]
+                has_more = skip + state["l"] < len(changes)
+                if has_more:
+                    next_state = dict(state, s=skip + state["l"])
+                else:
+                    next_state = {"p": state["p"], "r": state["r"], "l": state["l"], "j": len(tree.journal)}
+        return {"entries": page, "cursor": _encode_cursor(next_state), "has_more": has_more}
+
+    def list_folder_longpoll(self, argument):
+        state = _decode_cursor(argument["cursor"], "reset/")
+        timeout = min(max(int(argument.get("timeout", 30)), 30), 480)
+        tree = self.server.tree
+        with tree.lock:
+            if "o" in state:
+                return {"changes": True}
+            changed = tree.lock.wait_for(lambda: tree.changes(state["p"], state["r"], state["j"]), timeout)
+        return {"changes": bool(changed)}
+
+    def search(self, argument):
+        options = argument.get("options") or {}
+        state = {
+            "q": argument["query"].lower(),
+            "p": self.server.tree.normalize(options.get("path", "")).lower(),
+            "l": int(options.get("max_results") or 100),
+            "o": 0,
+        }
+        return self._search_page(state)
+
+    def search_continue(self, argument):
+        return self._search_page(_decode_cursor(argument["cursor"], "invalid_argument/"))
+
+    def _search_page(self, state):
+        tree = self.server.tree
+        with tree.lock:
+            matches = [
+                metadata for metadata in tree.listing(state["p"], True)
+                if state["q"] in metadata["name"].lower()
+            ]
+        page = matches[state["o"]:state["o"] + state["l"]]
+        has_more = state["o"] + state["l"] < len(matches)
+        result = {
+            "matches": [{"match_type": {".tag": "filename"}, "metadata": {".tag": "metadata", "metadata": metadata}} for metadata in page],
+            "has_more": has_more,
+        }
+        if has_more:
+            result["cursor"] = _encode_cursor(dict(state, o=state["o"] + state["l"]))
+        return result
+
+    # Thumbnails
+
+    def get_thumbnail(self, argument):
+        path = argument.get("path") or argument.get("resource", {}).get("path")
+        metadata, _ = self.server.tree.resolve(path)
+        if metadata[".tag"] != "file":
+            raise DropboxError("path/not_file/")
+        return metadata, THUMBNAIL
+
+    def get_thumbnail_batch(self, argument):
+        entries = []
+        for entry in argument["entries"]:
+            try:
+                metadata, _ = self.server.tree.resolve(entry["path"])
+                entries.append({".tag": "success", "metadata": metadata, "thumbnail": base64.b64encode(THUMBNAIL).decode()})
+            except DropboxError as error:
+                entries.append({".tag": "failure", "failure": error.error})
+        return {"entries": entries}
+
+
+def _ascii_json(value):
+    # Header values must be ASCII, json.dumps escapes everything else.
+    return json.dumps(value, ensure_ascii=True)
+
+
+# endpoint -> (style, handler)
+# "rpc" takes and returns JSON. "upload" takes its argument in Dropbox-API-Arg and returns JSON. "download" takes its argument in Dropbox-API-Arg and returns its result in Dropbox-API-Result alongside the data.
+ROUTES = {
+    "/oauth2/token": ("form", Handler.oauth_token),
+    "/2/files/get_metadata": ("rpc", Handler.get_metadata),
+    "/2/files/upload": ("upload", Handler.upload),
+    "/2/files/download": ("download", Handler.download),
+    "/2/files/upload_session/start": ("upload", Handler.upload_session_start),
+    "/2/files/upload_session/start_batch": ("rpc", Handler.upload_session_start_batch),
+    "/2/files/upload_session/append_v2": ("upload", Handler.upload_session_append),
+    "/2/files/upload_session/finish": ("upload", Handler.upload_session_finish),
+    "/2/files/upload_session/finish_batch_v2": ("rpc", Handler.upload_session_finish_batch),
+    "/2/files/create_folder": ("rpc", Handler.create_folder),
+    "/2/files/delete_v2": ("rpc", Handler.delete),
+    "/2/files/list_folder": ("rpc", Handler.list_folder),
+    "/2/files/list_folder/continue": ("rpc", Handler.list_folder_continue),
+    "/2/files/list_folder/longpoll": ("rpc", Handler.list_folder_longpoll),
+    "/2/files/search_v2": ("rpc", Handler.search),
+    "/2/files/search/continue_v2": ("rpc", Handler.search_continue),
+    "/2/files/get_thumbnail": ("download", Handler.get_thumbnail),
+    "/2/files/get_thumbnail_batch": ("rpc", Handler.get_thumbnail_batch),
+}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n", 1)[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--latency", type=float, default=0, help="milliseconds added before each response")
+    parser.add_argument("--jitter", type=float, default=0, help="random milliseconds added to or removed from --latency")
+    parser.add_argument("--bandwidth", type=float, default=0, help="bytes per second per connection in each direction, 0 for unlimited")
+    parser.add_argument("--rate-limit", type=float, default=0, help="fraction of requests answered with 429 too_many_requests")
+    parser.add_argument("--retry-after", type=int, default=1, help="seconds sent in Retry-After with 429s and 503s")
+    parser.add_argument("--failure-rate", type=float, default=0, help="fraction of requests answered with 503 service unavailable")
+    parser.add_argument("--drop-rate", type=float, default=0, help="fraction of requests whose connection is closed without a response after they're handled")
+    parser.add_argument("--token-lifetime", type=int, default=14400, help="seconds until tokens issued by /oauth2/token expire")
+    parser.add_argument("--verbose", action="store_true", help="log each request and its duration to stderr")
+    options = parser.parse_args()
+    options.jitter = min(options.jitter, options.latency)
+
+    server = Server((options.host, options.port), options)
+    print("Serving mock Dropbox on http://%s:%d" % (options.host, options.port), flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -21,6 +21,38 @@ extern NSString *const TJDropboxErrorUserInfoKeyResponse; // For errors with TJD
 extern NSString *const TJDropboxErrorUserInfoKeyDropboxError; // For error with TJDropboxErrorDomain, userInfo may contain a Dropbox API error response dictionary under this field.
 extern NSString *const TJDropboxErrorUserInfoKeyErrorString; // For error with TJDropboxErrorDomain, userInfo may contain a string under this field.
 
+// Keys for metrics events passed to +metricsSink, and for the per-endpoint totals in +metricsSnapshot. Durations are in seconds.
+extern NSString *const TJDropboxMetricsKeyEndpoint; // The request's path (e.g. /2/files/upload), or one of the local operation endpoints below. Events only.
+extern NSString *const TJDropboxMetricsKeyDuration; // Total time taken.
+extern NSString *const TJDropboxMetricsKeyRefreshWaitDuration; // Time spent waiting for an access token refresh before the request was built.
+extern NSString *const TJDropboxMetricsKeyRequestBuildDuration; // Time spent building the request and task.
+extern NSString *const TJDropboxMetricsKeyDomainLookupDuration; // Events only, absent when a connection was reused.
+extern NSString *const TJDropboxMetricsKeyConnectDuration; // Includes TLS, absent from events when a connection was reused.
+extern NSString *const TJDropboxMetricsKeySecureConnectionDuration; // Events only, absent when a connection was reused.
+extern NSString *const TJDropboxMetricsKeyTimeToFirstByte;
+extern NSString *const TJDropboxMetricsKeyTransferDuration; // Time from the first to the last byte of the response.
+extern NSString *const TJDropboxMetricsKeyInputByteCount; // Bytes sent, or bytes consumed by a local operation.
+extern NSString *const TJDropboxMetricsKeyOutputByteCount; // Bytes received, or bytes produced by a local operation.
+extern NSString *const TJDropboxMetricsKeyStatusCode; // Events only.
+extern NSString *const TJDropboxMetricsKeyFailed; // Events only.
+extern NSString *const TJDropboxMetricsKeyCount; // Snapshots only.
+extern NSString *const TJDropboxMetricsKeyFailureCount; // Snapshots only.
+extern NSString *const TJDropboxMetricsKeyLatencyHistogram; // Snapshots only. An array of counts where bucket i holds durations under 2^i milliseconds (and at least 2^(i-1)).
+extern NSString *const TJDropboxMetricsKeyMedianLatency; // Snapshots only, approximated from the histogram.
+extern NSString *const TJDropboxMetricsKeyP99Latency; // Snapshots only, approximated from the histogram.
+extern NSString *const TJDropboxMetricsKeyChunkSize; // Upload tuning events only, the chunk size chosen for the rest of the upload.
+extern NSString *const TJDropboxMetricsKeyCompressionLevel; // Upload tuning events only, the deflate level chosen for the rest of the upload (0 when compression is off).
+extern NSString *const TJDropboxMetricsKeyThroughput; // Upload tuning events only, measured bytes per second on the wire.
+
+extern NSString *const TJDropboxMetricsEndpointCompression; // Local gzip compression of upload data.
+extern NSString *const TJDropboxMetricsEndpointContentHash; // Local content hashing by TJDropboxFileContentHash().
+extern NSString *const TJDropboxMetricsEndpointUploadTuning; // Chunk size and compression changes made by large uploads as they measure the link.
+
+// Keys for +responseCacheStatistics, counted since launch or the last call to +removeAllCachedResponses.
+extern NSString *const TJDropboxResponseCacheKeyHitCount; // Calls answered from the cache.
+extern NSString *const TJDropboxResponseCacheKeyMissCount; // Calls that sent a request.
+extern NSString *const TJDropboxResponseCacheKeyCoalescedCount; // Calls that waited on an identical request already in flight.
+
 /// This notification is posted whenever a long-lived @c TJDropboxCredential (i.e. with refresh token) refreshes its access token.
 /// You should observe this notification and save the updated credential when it's posted.
 /// The @c object this is posted on is the @c TJDropboxCredential being updated.
@@ -67,9 +99,81 @@ __attribute__((objc_direct_members))
 
 @end
 
+typedef NS_ENUM(uint8_t, TJDropboxMetadataType) {
+    TJDropboxMetadataTypeFile,
+    TJDropboxMetadataTypeFolder,
+    TJDropboxMetadataTypeDeleted
+};
+
+/// A compact, typed alternative to the metadata dictionaries returned by most methods, suited to holding very large listings in memory.
+/// Entries decoded together share their parent directory paths, and string properties are created on access rather than stored as objects.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxMetadata : NSObject
+
+/// Accepts the file, folder or deleted entry dictionaries returned by the other methods, returns @c nil for anything else.
+- (nullable instancetype)initWithDictionary:(NSDictionary *const)dictionary;
+- (instancetype)init NS_UNAVAILABLE;
++ (instancetype)new NS_UNAVAILABLE;
+
+@property (nonatomic, readonly) TJDropboxMetadataType type;
+@property (nonatomic, readonly) NSString *name;
+@property (nonatomic, readonly, nullable) NSString *pathDisplay;
+@property (nonatomic, readonly, nullable) NSString *pathLower;
+@property (nonatomic, readonly, nullable) NSString *identifier;
+
+// Files only
+@property (nonatomic, readonly, nullable) NSString *rev;
+@property (nonatomic, readonly) unsigned long long size;
+@property (nonatomic, readonly, nullable) NSDate *serverModifiedDate;
+@property (nonatomic, readonly, nullable) NSDate *clientModifiedDate;
+@property (nonatomic, readonly, nullable) NSData *contentHash; // Comparable with TJDropboxFileContentHash()
+
+@end
+
+/// Requests are sent through separate URL sessions by workload, so each has its own connections, limits and timeouts.
+typedef NS_ENUM(NSUInteger, TJDropboxSessionPool) {
+    TJDropboxSessionPoolInteractive, // RPC requests, thumbnails and reads of small ranges from either host
+    TJDropboxSessionPoolBulk,        // Uploads and downloads, which may run for as long as data keeps moving
+    TJDropboxSessionPoolBackground   // Long-lived requests like change notification longpolls
+};
+
 @interface TJDropbox : NSObject
 
 @property (nonatomic, nullable, copy, class) void (^requestModifier)(NSMutableURLRequest *);
+/// The hosts RPC, content and change notification requests are sent to, which can be pointed at a local server for testing or profiling. Set to @c nil to restore the defaults (https://api.dropboxapi.com, https://content.dropboxapi.com and https://notify.dropboxapi.com).
+@property (nonatomic, null_resettable, copy, class) NSURL *apiBaseURL;
+@property (nonatomic, null_resettable, copy, class) NSURL *contentBaseURL;
+@property (nonatomic, null_resettable, copy, class) NSURL *notifyBaseURL;
+
+/// Opt-in instrumentation. When enabled, every request and local compression or hashing operation is timed and added to per-endpoint totals.
+@property (nonatomic, class) BOOL metricsEnabled;
+/// When metrics are enabled, this is called on an arbitrary queue with an event dictionary for each request or operation as it finishes.
+@property (nonatomic, nullable, copy, class) void (^metricsSink)(NSDictionary<NSString *, id> *event);
+/// Per-endpoint totals collected since metrics were enabled or last reset, keyed by endpoint.
++ (NSDictionary<NSString *, NSDictionary<NSString *, id> *> *)metricsSnapshot;
++ (void)resetMetrics;
+
+/// When set, requests are started at most this many at a time per host. Defaults to 0, which leaves concurrency to NSURLSession. Metadata calls, thumbnails and reads are started ahead of file transfers. Requests that are rate limited (429) or hit an unavailable server (503) are retried with backoff that honors Retry-After.
+@property (nonatomic, class) NSUInteger maximumConcurrentRequestsPerHost;
+/// Overrides @c maximumConcurrentRequestsPerHost for a single host, pass 0 to remove the override.
++ (void)setMaximumConcurrentRequests:(const NSUInteger)maximumConcurrentRequests forHost:(NSString *const)host;
+/// Smooths bursts of requests across all hosts with a token bucket. Defaults to 0, which doesn't limit the rate.
+@property (nonatomic, class) double maximumRequestsPerSecond;
+/// File info, shared link, space usage and account information calls share a single request between identical callers while it's in flight, and successful responses are reused for this long afterwards (default 5 seconds, 0 disables caching but not sharing).
+/// Uploads, moves, copies, deletes and folder creation made through TJDropbox clear the cached responses for their credential.
+@property (nonatomic, class) NSTimeInterval cachedResponseLifetime;
+/// The least recently used responses are evicted beyond this many (default 256).
+@property (nonatomic, class) NSUInteger maximumCachedResponseCount;
++ (NSDictionary<NSString *, NSNumber *> *)responseCacheStatistics;
++ (void)removeAllCachedResponses;
+/// When enabled each credential gets its own set of session pools rather than sharing them, so one account's transfers can't tie up another's connections. Applies to requests started afterwards, defaults to @c NO.
+@property (nonatomic, class) BOOL usesSessionPoolsPerCredential;
+/// When enabled, uploads sample the middle of each file and skip gzip if the sample doesn't compress, which saves CPU on photos, videos and archives but can miss mixed-content files whose sample happens to be incompressible. Defaults to @c NO, which always tries gzip.
+@property (nonatomic, class) BOOL skipsCompressionOfIncompressibleFiles;
+/// When enabled, large uploads started without an explicit chunk size grow or shrink their chunks (up to 148MB) so each takes around 8 seconds to send at the measured throughput. Fewer round trips on fast links, at the cost of holding larger chunks in memory. Defaults to @c NO, which keeps chunks at 10MB.
+@property (nonatomic, class) BOOL adjustsLargeUploadChunkSize;
 
 // Authentication
 
@@ -118,24 +222,56 @@ __attribute__((objc_direct_members))
 
 + (void)listFolderWithPath:(NSString *const)path cursor:(nullable NSString *const)cursor includeDeleted:(const BOOL)includeDeleted credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray<NSDictionary *> *_Nullable entries, NSString *_Nullable cursor, NSError *_Nullable error))completion;
 
+/// Calls @c pageHandler with each page of entries as it arrives rather than accumulating them. Return @c NO from @c pageHandler to stop early, @c completion is then passed the cursor following the last page handled.
++ (void)listFolderWithPath:(NSString *const)path cursor:(nullable NSString *const)cursor includeDeleted:(const BOOL)includeDeleted credential:(TJDropboxCredential *const)credential pageHandler:(BOOL (^const)(NSArray<NSDictionary *> *entries, BOOL hasMore))pageHandler completion:(void (^const)(NSString *_Nullable cursor, NSError *_Nullable error))completion;
+
+/// Typed variant of the method above, each page is decoded into @c TJDropboxMetadata as it arrives and its dictionaries discarded.
++ (void)listFolderMetadataWithPath:(NSString *const)path cursor:(nullable NSString *const)cursor includeDeleted:(const BOOL)includeDeleted credential:(TJDropboxCredential *const)credential pageHandler:(BOOL (^const)(NSArray<TJDropboxMetadata *> *entries, BOOL hasMore))pageHandler completion:(void (^const)(NSString *_Nullable cursor, NSError *_Nullable error))completion;
+
 + (void)getFileInfoAtPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable entry, NSError *_Nullable error))completion;
++ (void)getMetadataAtPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential completion:(void (^const)(TJDropboxMetadata *_Nullable metadata, NSError *_Nullable error))completion;
+/// Fetches metadata for many paths with at most @c maximumConcurrentRequests requests in flight. @c results contains an @c NSDictionary or @c NSError for each path, in input order.
++ (void)getFileInfoAtPaths:(NSArray<NSString *> *const)remotePaths maximumConcurrentRequests:(const NSUInteger)maximumConcurrentRequests credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray *results))completion;
 
 // File Manipulation
 
 + (NSURLRequest *)requestToDownloadFileAtPath:(NSString *const)path credential:(TJDropboxCredential *const)credential;
 + (void)downloadFileAtPath:(NSString *const)remotePath toPath:(NSString *const)localPath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
 + (void)downloadFileAtPath:(NSString *const)remotePath toPath:(NSString *const)localPath credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
+/// Downloads using up to @c maximumConcurrentRanges parallel ranged requests. Progress is saved next to @c localPath as the download proceeds, so calling this again with the same paths after a failure, cancellation or relaunch resumes where it left off.
++ (void)downloadLargeFileAtPath:(NSString *const)remotePath toPath:(NSString *const)localPath maximumConcurrentRanges:(const NSUInteger)maximumConcurrentRanges credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
+/// Reads @c length bytes starting at @c offset into memory using a ranged request, or everything from @c offset on if @c length is 0. Suited to headers, indexes and other small parts of large files.
++ (void)readFileAtPath:(NSString *const)remotePath offset:(const unsigned long long)offset length:(const NSUInteger)length credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSData *_Nullable data, NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
+/// Streams the same range to @c dataHandler in order as it arrives, on an internal queue. Return @c NO to stop early, in which case @c completion is called without an error.
++ (void)readFileAtPath:(NSString *const)remotePath offset:(const unsigned long long)offset length:(const unsigned long long)length credential:(TJDropboxCredential *const)credential dataHandler:(BOOL (^const)(NSData *data))dataHandler completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
+/// Fetches a whole file into memory without touching the filesystem, verifying its content hash. Intended for small files.
++ (void)fetchFileAtPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSData *_Nullable data, NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
 + (void)uploadFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
 + (void)uploadFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath contentHash:(nullable NSData *const)contentHash overwriteExisting:(const BOOL)overwriteExisting muteDesktopNotifications:(const BOOL)muteDesktopNotifications credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
-/// Intended for files larger than 150MB. Performs chunked uploads, 10MB per chunk.
+/// Compares the file's content hash against the file at @c remotePath and only uploads, overwriting it, if they differ. If they match @c completion is passed the existing file's metadata.
++ (void)uploadFileIfChangedAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath muteDesktopNotifications:(const BOOL)muteDesktopNotifications credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
+/// Intended for files larger than 150MB. Performs chunked uploads of 10MB per chunk, adapting the compression level to the measured throughput as the upload proceeds. See @c adjustsLargeUploadChunkSize to adapt the chunk size too.
 + (void)uploadLargeFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
 + (void)uploadLargeFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath overwriteExisting:(const BOOL)overwriteExisting muteDesktopNotifications:(const BOOL)muteDesktopNotifications credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
+/// Uploads using a concurrent upload session with up to @c maximumConcurrentChunks appends in flight at once. @c chunkSize is rounded up to a multiple of 4MB (capped at 148MB) and kept fixed, the compression level still adapts. Passing 1 for @c maximumConcurrentChunks performs a sequential upload.
++ (void)uploadLargeFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath overwriteExisting:(const BOOL)overwriteExisting muteDesktopNotifications:(const BOOL)muteDesktopNotifications chunkSize:(NSUInteger)chunkSize maximumConcurrentChunks:(const NSUInteger)maximumConcurrentChunks credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
+/// Large uploads record their session on disk as chunks are acknowledged. Returns whether an earlier upload between these paths can be picked up with the method below.
++ (BOOL)hasResumableLargeFileUploadAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath;
+/// Continues an upload started by one of the methods above that failed, was cancelled, or was interrupted by a relaunch, skipping chunks the server has acknowledged. Fails if the session has expired or the file has changed since.
++ (void)resumeLargeFileUploadAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
+/// Uploads many files using one upload session per file and commits them together, which avoids the write contention of separate uploads. @c localPaths and @c remotePaths correspond by index. @c results contains an @c NSDictionary of metadata or an @c NSError for each file, in input order.
++ (void)uploadFilesAtPaths:(NSArray<NSString *> *const)localPaths toPaths:(NSArray<NSString *> *const)remotePaths overwriteExisting:(const BOOL)overwriteExisting muteDesktopNotifications:(const BOOL)muteDesktopNotifications credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSArray *results))completion;
 + (void)createFolderAtPath:(NSString *const)path credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
 + (void)saveContentsOfURL:(NSURL *const)url toPath:(NSString *const)path credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
 + (void)deleteFileAtPath:(NSString *const)path credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
 
 + (void)moveFileAtPath:(NSString *const)fromPath toPath:(NSString *const)toPath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
 
+/// Batch variants of the methods above, performed in groups of up to 1000 entries. @c results contains an @c NSDictionary of metadata or an @c NSError for each entry, in input order.
++ (void)deleteFilesAtPaths:(NSArray<NSString *> *const)paths credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray *results))completion;
++ (void)moveFilesAtPaths:(NSArray<NSString *> *const)fromPaths toPaths:(NSArray<NSString *> *const)toPaths credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray *results))completion;
++ (void)copyFilesAtPaths:(NSArray<NSString *> *const)fromPaths toPaths:(NSArray<NSString *> *const)toPaths credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray *results))completion;
+
 // Previews
 
 + (NSURLRequest *)requestToDownloadThumbnailAtPath:(NSString *const)path size:(const TJDropboxThumbnailSize)thumbnailSize credential:(TJDropboxCredential *const)credential;
@@ -143,7 +279,13 @@ __attribute__((objc_direct_members))
 
 // Search
 
+/// Returns only the first page of matches, use the paginated variant below for large result sets.
 + (void)searchForFilesAtPath:(NSString *const)path matchingQuery:(NSString *const)query options:(NSDictionary *const)additionalOptions credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray *_Nullable entries, NSError *_Nullable error))completion;
+/// Delivers pages of matches to @c pageHandler in order as they arrive, following search/continue_v2 until there are no more, @c pageHandler returns @c NO, or @c maximumResultCount matches have been delivered (pass 0 for no limit).
+/// With @c prefetchesNextPage the next page is requested before @c pageHandler is called so it's on its way while the current one is processed.
++ (void)searchForFilesAtPath:(NSString *const)path matchingQuery:(NSString *const)query options:(NSDictionary *const)additionalOptions maximumResultCount:(const NSUInteger)maximumResultCount prefetchesNextPage:(const BOOL)prefetchesNextPage credential:(TJDropboxCredential *const)credential pageHandler:(BOOL (^const)(NSArray *matches, BOOL hasMore))pageHandler completion:(void (^const)(NSError *_Nullable error))completion;
+/// Typed variant of the method above, returning the metadata of each match.
++ (void)searchForMetadataAtPath:(NSString *const)path matchingQuery:(NSString *const)query options:(NSDictionary *const)additionalOptions credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray<TJDropboxMetadata *> *_Nullable entries, NSError *_Nullable error))completion;
 
 // Sharing
 
@@ -156,11 +298,77 @@ __attribute__((objc_direct_members))
 
 // Request Management
 
+/// Requests started within @c block deliver their progress and completion callbacks on @c callbackQueue instead of an internal background queue.
++ (void)performWithCallbackQueue:(dispatch_queue_t const)callbackQueue block:(NS_NOESCAPE dispatch_block_t const)block;
 + (void)cancelAllRequests;
++ (void)cancelAllRequestsInSessionPool:(const TJDropboxSessionPool)sessionPool;
++ (void)cancelAllRequestsForCredential:(TJDropboxCredential *const)credential;
+
+@end
+
+/// Keeps an on-disk index of everything beneath a folder current. After an initial listing it waits on list_folder/longpoll and applies only what changed since its cursor, so refreshes cost as much as the changes rather than the size of the tree.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxSync : NSObject
+
+/// The cursor and index are persisted to @c stateURL shortly after changes are applied, and picked up from there by later instances for the same path.
+- (instancetype)initWithPath:(NSString *const)path credential:(TJDropboxCredential *const)credential stateURL:(NSURL *const)stateURL NS_DESIGNATED_INITIALIZER;
+- (instancetype)init NS_UNAVAILABLE;
++ (instancetype)new NS_UNAVAILABLE;
+
+@property (nonatomic, copy, readonly) NSString *path;
+@property (nonatomic, readonly) TJDropboxCredential *credential;
+
+/// Called after each batch of changes is applied, with the entries that were added or modified and the lowercased paths that were removed.
+/// Like other callbacks this is called on an internal queue unless @c -start is called within @c +[TJDropbox performWithCallbackQueue:block:].
+@property (nonatomic, copy, nullable) void (^changeHandler)(NSArray<NSDictionary *> *updatedEntries, NSArray<NSString *> *deletedPaths);
+/// Called when listing or polling fails. Syncing carries on after a backoff.
+@property (nonatomic, copy, nullable) void (^errorHandler)(NSError *error);
+
+- (void)start;
+/// Stops applying changes, a longpoll that's already in flight is left to time out.
+- (void)stop;
+@property (nonatomic, readonly, getter=isRunning) BOOL running;
+
+/// The current index, keyed by lowercased path.
+@property (nonatomic, readonly) NSDictionary<NSString *, NSDictionary *> *entries;
+- (nullable NSDictionary *)entryForPath:(NSString *const)path;
+
+@end
+
+/// Loads thumbnails through get_thumbnail_batch, grouping requests made close together into calls of up to 25 and sharing duplicate requests that are in flight.
+/// Thumbnails are cached in memory and on disk (least recently used are evicted first), keyed by path, rev and size.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxThumbnailLoader : NSObject
+
+- (instancetype)initWithCredential:(TJDropboxCredential *const)credential cacheDirectoryPath:(NSString *const)cacheDirectoryPath NS_DESIGNATED_INITIALIZER;
+- (instancetype)init NS_UNAVAILABLE;
++ (instancetype)new NS_UNAVAILABLE;
+
+@property (nonatomic, readonly) TJDropboxCredential *credential;
+@property (nonatomic) NSUInteger maximumMemoryCacheByteCount; // Defaults to 16MB
+@property (nonatomic) unsigned long long maximumDiskCacheByteCount; // Defaults to 128MB
+
+/// Passing the file's @c rev keeps thumbnails of earlier versions from being returned, if it's @c nil any cached thumbnail for the path is used.
+/// @c completion may be called before this returns if the thumbnail is in memory. The returned token can be passed to @c -cancelThumbnailRequest:, for example when a cell scrolls off screen.
+- (id)loadThumbnailAtPath:(NSString *const)path rev:(nullable NSString *const)rev size:(const TJDropboxThumbnailSize)thumbnailSize completion:(void (^const)(NSData *_Nullable thumbnailData, NSError *_Nullable error))completion;
+/// @c completion won't be called for a cancelled request. If no one else is waiting on the same thumbnail and it hasn't been sent yet it's dropped from its batch.
+- (void)cancelThumbnailRequest:(id const)token;
+- (void)removeAllCachedThumbnails;
 
 @end
 
+/// Hashes are cached on disk by file identity (device, inode, size and modification time), so unchanged files are only read once. The cache holds up to 50,000 files, least recently used are evicted first.
 extern NSData * _Nullable TJDropboxFileContentHash(NSString *const filePath);
+/// Returns the cached hashes for whichever of @c filePaths have one that's still valid, without reading any files.
+extern NSDictionary<NSString *, NSData *> *TJDropboxCachedFileContentHashes(NSArray<NSString *> *const filePaths);
+/// Drops cached hashes for files that have since been deleted or modified, on a background queue. Worth calling once at launch.
+extern void TJDropboxPruneFileContentHashCache(void);
+/// Forgets every cached hash, so each file is read again the next time it's hashed.
+extern void TJDropboxRemoveAllCachedFileContentHashes(void);
 
 #if defined(__has_attribute) && __has_attribute(objc_direct_members)
 __attribute__((objc_direct_members))
@@ -8,7 +8,11 @@
 
 #import "TJDropbox.h"
 #import <CommonCrypto/CommonDigest.h>
+#import <fcntl.h>
 #import <os/lock.h>
+#import <sys/stat.h>
+#import <time.h>
+#import <unistd.h>
 #import <zlib.h>
 
 NSString *const TJDropboxErrorDomain = @"TJDropboxErrorDomain";
@@ -16,6 +20,36 @@ NSString *const TJDropboxErrorUserInfoKeyResponse = @"response";
 NSString *const TJDropboxErrorUserInfoKeyDropboxError = @"dropboxError";
 NSString *const TJDropboxErrorUserInfoKeyErrorString = @"errorString";
 
+NSString *const TJDropboxMetricsKeyEndpoint = @"endpoint";
+NSString *const TJDropboxMetricsKeyDuration = @"duration";
+NSString *const TJDropboxMetricsKeyRefreshWaitDuration = @"refreshWaitDuration";
+NSString *const TJDropboxMetricsKeyRequestBuildDuration = @"requestBuildDuration";
+NSString *const TJDropboxMetricsKeyDomainLookupDuration = @"domainLookupDuration";
+NSString *const TJDropboxMetricsKeyConnectDuration = @"connectDuration";
+NSString *const TJDropboxMetricsKeySecureConnectionDuration = @"secureConnectionDuration";
+NSString *const TJDropboxMetricsKeyTimeToFirstByte = @"timeToFirstByte";
+NSString *const TJDropboxMetricsKeyTransferDuration = @"transferDuration";
+NSString *const TJDropboxMetricsKeyInputByteCount = @"inputByteCount";
+NSString *const TJDropboxMetricsKeyOutputByteCount = @"outputByteCount";
+NSString *const TJDropboxMetricsKeyStatusCode = @"statusCode";
+NSString *const TJDropboxMetricsKeyFailed = @"failed";
+NSString *const TJDropboxMetricsKeyCount = @"count";
+NSString *const TJDropboxMetricsKeyFailureCount = @"failureCount";
+NSString *const TJDropboxMetricsKeyLatencyHistogram = @"latencyHistogram";
+NSString *const TJDropboxMetricsKeyMedianLatency = @"medianLatency";
+NSString *const TJDropboxMetricsKeyP99Latency = @"p99Latency";
+NSString *const TJDropboxMetricsKeyChunkSize = @"chunkSize";
+NSString *const TJDropboxMetricsKeyCompressionLevel = @"compressionLevel";
+NSString *const TJDropboxMetricsKeyThroughput = @"throughput";
+
+NSString *const TJDropboxMetricsEndpointCompression = @"compression";
+NSString *const TJDropboxMetricsEndpointContentHash = @"content_hash";
+NSString *const TJDropboxMetricsEndpointUploadTuning = @"upload_tuning";
+
+NSString *const TJDropboxResponseCacheKeyHitCount = @"hitCount";
+NSString *const TJDropboxResponseCacheKeyMissCount = @"missCount";
+NSString *const TJDropboxResponseCacheKeyCoalescedCount = @"coalescedCount";
+
 NSNotificationName const TJDropboxCredentialDidRefreshAccessTokenNotification = @"TJDropboxCredentialDidRefreshAccessTokenNotification";
 
 #if defined(__has_attribute) && __has_attribute(objc_direct_members)
@@ -31,10 +65,15 @@ __attribute__((objc_direct_members))
 @property (nonatomic, readwrite) NSDate *expirationDate;
 @property (nonatomic, copy, readwrite) NSString *clientIdentifier;
 
-@property (nonatomic) NSMutableArray<void (^)(NSDictionary *, NSError *)> *refreshCompletionBlocks;
+@property (nonatomic) NSMutableArray<void (^)(NSDictionary *, NSError *)> *refreshCompletionBlocks; // Non-nil while a refresh is in flight
+@property (nonatomic) NSMutableDictionary<NSNumber *, NSURLSession *> *sessionsForPools; // Only used when +usesSessionPoolsPerCredential is enabled
+
+- (void)refreshAccessTokenWithCompletion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion;
 
 @end
 
+static void _refreshCredential(TJDropboxCredential *const credential, void (^completion)(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error));
+
 @implementation TJDropboxCredential
 
 - (instancetype)initWithAccessToken:(NSString *const)accessToken
@@ -46,6 +85,14 @@ __attribute__((objc_direct_members))
     return self;
 }
 
+- (void)dealloc
+{
+    // Sessions retain their delegate until invalidated, anything still running is left to finish.
+    for (NSURLSession *const session in _sessionsForPools.objectEnumerator) {
+        [session finishTasksAndInvalidate];
+    }
+}
+
 - (instancetype)initWithAccessToken:(NSString *const)accessToken
                        refreshToken:(NSString *const)refreshToken
                      expirationDate:(NSDate *const)expirationDate
@@ -128,1308 +175,6618 @@ __attribute__((objc_direct_members))
     os_unfair_lock_unlock(&_lock);
 }
 
+/// Refreshes are single-flight, if one is already in progress @c completion is called when it finishes instead of starting another.
+- (void)refreshAccessTokenWithCompletion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    __block BOOL startRefresh = NO;
+    [self performSynchronized:^{
+        if (!self.refreshCompletionBlocks) {
+            self.refreshCompletionBlocks = [NSMutableArray new];
+            startRefresh = YES;
+        }
+        if (completion) {
+            [self.refreshCompletionBlocks addObject:completion];
+        }
+    }];
+    
+    if (startRefresh) {
+        _refreshCredential(self, ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+            __block NSArray<void (^)(NSDictionary *, NSError *)> *refreshCompletionBlocks;
+            [self performSynchronized:^{
+                refreshCompletionBlocks = self.refreshCompletionBlocks;
+                self.refreshCompletionBlocks = nil;
+            }];
+            for (void (^block)(NSDictionary *, NSError *) in refreshCompletionBlocks) {
+                block(parsedResponse, error);
+            }
+        });
+    }
+}
+
 @end
 
+#pragma mark - Metadata
+
+// The parent directory of a set of entries, shared between all of them when they're decoded together.
 #if defined(__has_attribute) && __has_attribute(objc_direct_members)
 __attribute__((objc_direct_members))
 #endif
-@interface TJDropboxURLSessionTaskDelegate : NSObject <NSURLSessionDataDelegate, NSURLSessionDownloadDelegate>
+@interface TJDropboxMetadataPathPrefix : NSObject
 
-/**
- * Outside classes (such as TJDropbox) should not access these properties directly!
- * They should be accessed via -setProgressBlock:completionBlock:for*Task: ONLY to ensure safety is maintained.
- */
+@property (nonatomic, copy) NSString *pathDisplay;
+@property (nonatomic, copy) NSString *pathLower;
 
-@property (nonatomic) NSMutableDictionary<NSURLSessionTask *, void (^)(CGFloat)> *progressBlocksForTasks;
-@property (nonatomic) NSMutableDictionary<NSURLSessionTask *, NSMutableData *> *accumulatedDataForDataTasks;
-@property (nonatomic) NSMutableDictionary *completionBlocksForTasks;
+@end
 
-// This serial queue must be used for the following:
-//   - as the NSURLSession delegateQueue
-//   - when accessing the task delegate's block and accumulatedData dictionaries
-// This ensures that these dictionaries are only accessed by one thread at once.
-@property (nonatomic) NSOperationQueue *serialOperationQueue;
+@implementation TJDropboxMetadataPathPrefix
 
 @end
 
+static const uint32_t kMetadataStringNotFound = UINT32_MAX;
+
+static BOOL _parseContentHash(NSString *const string, uint8_t *const contentHash)
+{
+    if (![string isKindOfClass:[NSString class]] || string.length != CC_SHA256_DIGEST_LENGTH * 2) {
+        return NO;
+    }
+    const char *const characters = string.UTF8String;
+    for (NSUInteger i = 0; i < CC_SHA256_DIGEST_LENGTH; i++) {
+        uint8_t byte = 0;
+        for (NSUInteger j = 0; j < 2; j++) {
+            const char character = characters[i * 2 + j];
+            byte <<= 4;
+            if (character >= '0' && character <= '9') {
+                byte |= character - '0';
+            } else if (character >= 'a' && character <= 'f') {
+                byte |= character - 'a' + 10;
+            } else if (character >= 'A' && character <= 'F') {
+                byte |= character - 'A' + 10;
+            } else {
+                return NO;
+            }
+        }
+        contentHash[i] = byte;
+    }
+    return YES;
+}
+
+/// Parses the "2015-05-12T15:50:38Z" timestamps Dropbox uses without going through a date formatter.
+static BOOL _parseTimestamp(NSString *const string, int64_t *const timestamp)
+{
+    if (![string isKindOfClass:[NSString class]]) {
+        return NO;
+    }
+    struct tm components = {0};
+    char zone = 0;
+    if (sscanf(string.UTF8String, "%4d-%2d-%2dT%2d:%2d:%2d%c", &components.tm_year, &components.tm_mon, &components.tm_mday, &components.tm_hour, &components.tm_min, &components.tm_sec, &zone) != 7 || zone != 'Z') {
+        return NO;
+    }
+    components.tm_year -= 1900;
+    components.tm_mon -= 1;
+    *timestamp = timegm(&components);
+    return YES;
+}
+
 #if defined(__has_attribute) && __has_attribute(objc_direct_members)
 __attribute__((objc_direct_members))
 #endif
-@implementation TJDropboxURLSessionTaskDelegate
+@interface TJDropboxMetadata () {
+    TJDropboxMetadataPathPrefix *_pathPrefix; // nil if the path couldn't be split, full paths are stored in _strings instead
+    char *_strings; // NUL-terminated UTF-8, addressed by the offsets below
+    uint32_t _pathDisplayOffset;
+    uint32_t _pathLowerOffset;
+    uint32_t _identifierOffset;
+    uint32_t _revOffset;
+    int64_t _serverModifiedTimestamp;
+    int64_t _clientModifiedTimestamp;
+    uint8_t _contentHash[CC_SHA256_DIGEST_LENGTH];
+    BOOL _hasServerModifiedTimestamp;
+    BOOL _hasClientModifiedTimestamp;
+    BOOL _hasContentHash;
+}
 
-- (instancetype)init
+- (instancetype)initWithDictionary:(NSDictionary *const)dictionary pathPrefixes:(NSMutableDictionary<NSString *, TJDropboxMetadataPathPrefix *> *const)pathPrefixes;
+
+@end
+
+@implementation TJDropboxMetadata
+
+- (instancetype)initWithDictionary:(NSDictionary *const)dictionary
 {
+    return [self initWithDictionary:dictionary pathPrefixes:nil];
+}
+
+/// @c pathPrefixes interns parent directories across every entry decoded with the same dictionary, keyed by their display path so entries whose parents differ only in case keep their own casing.
+- (instancetype)initWithDictionary:(NSDictionary *const)dictionary pathPrefixes:(NSMutableDictionary<NSString *, TJDropboxMetadataPathPrefix *> *const)pathPrefixes
+{
+    if (![dictionary isKindOfClass:[NSDictionary class]]) {
+        return nil;
+    }
+    NSString *const tag = dictionary[@".tag"];
+    NSString *const name = dictionary[@"name"];
+    if (![name isKindOfClass:[NSString class]]) {
+        return nil;
+    }
+    TJDropboxMetadataType type;
+    if ([tag isEqualToString:@"file"]) {
+        type = TJDropboxMetadataTypeFile;
+    } else if ([tag isEqualToString:@"folder"]) {
+        type = TJDropboxMetadataTypeFolder;
+    } else if ([tag isEqualToString:@"deleted"]) {
+        type = TJDropboxMetadataTypeDeleted;
+    } else {
+        return nil;
+    }
+    
     if (self = [super init]) {
-        self.accumulatedDataForDataTasks = [NSMutableDictionary new];
-        self.progressBlocksForTasks = [NSMutableDictionary new];
-        self.completionBlocksForTasks = [NSMutableDictionary new];
+        _type = type;
         
-        NSOperationQueue *serialOperationQueue = [NSOperationQueue new];
-        // make serial
-        serialOperationQueue.maxConcurrentOperationCount = 1;
-        serialOperationQueue.qualityOfService = NSQualityOfServiceUserInitiated;
-        self.serialOperationQueue = serialOperationQueue;
+        NSString *pathDisplay = dictionary[@"path_display"];
+        NSString *pathLower = dictionary[@"path_lower"];
+        pathDisplay = [pathDisplay isKindOfClass:[NSString class]] ? pathDisplay : nil;
+        pathLower = [pathLower isKindOfClass:[NSString class]] ? pathLower : nil;
+        if (pathDisplay && pathLower && [pathDisplay hasSuffix:name] && pathDisplay.length > name.length && [pathDisplay characterAtIndex:pathDisplay.length - name.length - 1] == '/') {
+            const NSRange lowerSeparatorRange = [pathLower rangeOfString:@"/" options:NSBackwardsSearch];
+            if (lowerSeparatorRange.location != NSNotFound) {
+                NSString *const parentPathDisplay = [pathDisplay substringToIndex:pathDisplay.length - name.length - 1];
+                NSString *const parentPathLower = [pathLower substringToIndex:lowerSeparatorRange.location];
+                TJDropboxMetadataPathPrefix *pathPrefix = pathPrefixes[parentPathDisplay];
+                if (!pathPrefix || ![pathPrefix.pathLower isEqualToString:parentPathLower]) {
+                    pathPrefix = [TJDropboxMetadataPathPrefix new];
+                    pathPrefix.pathDisplay = parentPathDisplay;
+                    pathPrefix.pathLower = parentPathLower;
+                    pathPrefixes[parentPathDisplay] = pathPrefix;
+                }
+                _pathPrefix = pathPrefix;
+                pathDisplay = nil; // Derived from the prefix and name
+                pathLower = [pathLower substringFromIndex:NSMaxRange(lowerSeparatorRange)];
+            }
+        }
+        
+        NSString *identifier = dictionary[@"id"];
+        NSString *rev = dictionary[@"rev"];
+        identifier = [identifier isKindOfClass:[NSString class]] ? identifier : nil;
+        rev = [rev isKindOfClass:[NSString class]] ? rev : nil;
+        
+        // Pack every string into a single allocation, name first.
+        NSString *const strings[] = {name, pathDisplay, pathLower, identifier, rev};
+        uint32_t *const offsets[] = {NULL, &_pathDisplayOffset, &_pathLowerOffset, &_identifierOffset, &_revOffset};
+        const char *utf8Strings[5];
+        size_t lengths[5];
+        size_t totalLength = 0;
+        for (NSUInteger i = 0; i < 5; i++) {
+            utf8Strings[i] = strings[i].UTF8String;
+            lengths[i] = utf8Strings[i] ? strlen(utf8Strings[i]) + 1 : 0;
+            totalLength += lengths[i];
+        }
+        _strings = malloc(totalLength);
+        uint32_t offset = 0;
+        for (NSUInteger i = 0; i < 5; i++) {
+            if (offsets[i]) {
+                *offsets[i] = utf8Strings[i] ? offset : kMetadataStringNotFound;
+            }
+            if (utf8Strings[i]) {
+                memcpy(_strings + offset, utf8Strings[i], lengths[i]);
+                offset += (uint32_t)lengths[i];
+            }
+        }
+        
+        const id size = dictionary[@"size"];
+        _size = [size isKindOfClass:[NSNumber class]] ? [size unsignedLongLongValue] : 0;
+        _hasServerModifiedTimestamp = _parseTimestamp(dictionary[@"server_modified"], &_serverModifiedTimestamp);
+        _hasClientModifiedTimestamp = _parseTimestamp(dictionary[@"client_modified"], &_clientModifiedTimestamp);
+        _hasContentHash = _parseContentHash(dictionary[@"content_hash"], _contentHash);
     }
     return self;
 }
 
-- (void)setProgressBlock:(nullable void (^const)(CGFloat progress))progressBlock
-         completionBlock:(nullable void (^const)(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error))completionBlock
-             forDataTask:(NSURLSessionDataTask *const)task
+- (void)dealloc
 {
-    [self _setProgressBlock:progressBlock
-            completionBlock:completionBlock
-                    forTask:task
-              expectedClass:[NSURLSessionDataTask class]];
-    if (@available(iOS 14.5, macOS 11.3, *)) {
-        if (!progressBlock) {
-            task.prefersIncrementalDelivery = NO;
-        }
-    }
+    free(_strings);
 }
 
-- (void)setProgressBlock:(nullable void (^const)(CGFloat progress))progressBlock
-         completionBlock:(nullable void (^const)(NSURL * _Nullable location, NSURLResponse * _Nullable response, NSError * _Nullable error))completionBlock
-         forDownloadTask:(NSURLSessionDownloadTask *const)task
+- (NSString *)stringAtOffset:(const uint32_t)offset
 {
-        [self _setProgressBlock:progressBlock
-                completionBlock:completionBlock
-                        forTask:task
-                  expectedClass:[NSURLSessionDownloadTask class]];
+    return offset != kMetadataStringNotFound ? [NSString stringWithUTF8String:_strings + offset] : nil;
 }
 
-- (void)_setProgressBlock:(nullable void (^const)(CGFloat progress))progressBlock
-          completionBlock:(nullable const id)completionBlock
-                  forTask:(NSURLSessionTask *const)task
-            expectedClass:(Class)expectedClass
+- (NSString *)name
 {
-    if ([task isKindOfClass:expectedClass]) {
-        [self.serialOperationQueue addOperationWithBlock:^{
-            if (progressBlock) {
-                [self.progressBlocksForTasks setObject:progressBlock forKey:task];
-            }
-            if (completionBlock) {
-                [self.completionBlocksForTasks setObject:completionBlock forKey:task];
-            }
-        }];
-    } else {
-        NSAssert(NO, @"Adding wrong completion setup for task with type %@, was expecting %@.", NSStringFromClass([task class]), NSStringFromClass(expectedClass));
-    }
+    return [self stringAtOffset:0];
 }
 
-- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didSendBodyData:(int64_t)bytesSent totalBytesSent:(int64_t)totalBytesSent totalBytesExpectedToSend:(int64_t)totalBytesExpectedToSend
+- (NSString *)pathInDirectory:(NSString *const)directory withComponentAtOffset:(const uint32_t)offset
 {
-    void (^progressBlock)(CGFloat progress) = self.progressBlocksForTasks[task];
-    
-    if (progressBlock && totalBytesExpectedToSend > 0) {
-        progressBlock((CGFloat)totalBytesSent / totalBytesExpectedToSend);
-    }
+    NSString *const component = [self stringAtOffset:offset];
+    NSMutableString *const path = [NSMutableString stringWithCapacity:directory.length + 1 + component.length];
+    [path appendString:directory];
+    [path appendString:@"/"];
+    [path appendString:component];
+    return path;
 }
 
-- (void)URLSession:(NSURLSession *)session downloadTask:(NSURLSessionDownloadTask *)task didWriteData:(int64_t)bytesWritten totalBytesWritten:(int64_t)totalBytesWritten totalBytesExpectedToWrite:(int64_t)totalBytesExpectedToWrite
+- (NSString *)pathDisplay
 {
-    void (^progressBlock)(CGFloat progress) = self.progressBlocksForTasks[task];
-    
-    if (progressBlock && totalBytesExpectedToWrite > 0) {
-        progressBlock((CGFloat)totalBytesWritten / totalBytesExpectedToWrite);
+    if (_pathPrefix) {
+        return [self pathInDirectory:_pathPrefix.pathDisplay withComponentAtOffset:0];
     }
+    return [self stringAtOffset:_pathDisplayOffset];
 }
 
-- (void)URLSession:(NSURLSession *)session dataTask:(NSURLSessionDataTask *)task didReceiveData:(NSData *)data
+- (NSString *)pathLower
 {
-    NSMutableData *accumulatedData = self.accumulatedDataForDataTasks[task];
-    if (accumulatedData) {
-        [accumulatedData appendData:data];
-    } else {
-        self.accumulatedDataForDataTasks[task] = [data mutableCopy];
+    if (_pathPrefix) {
+        return [self pathInDirectory:_pathPrefix.pathLower withComponentAtOffset:_pathLowerOffset];
     }
+    return [self stringAtOffset:_pathLowerOffset];
 }
 
-- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didCompleteWithError:(NSError *)error
+- (NSString *)identifier
 {
-    // Catches the case where the task failed.
-    [self tryCompleteTask:task location:nil data:self.accumulatedDataForDataTasks[task]];
-    
-    [self.progressBlocksForTasks removeObjectForKey:task];
-    [self.accumulatedDataForDataTasks removeObjectForKey:task];
-    [self.completionBlocksForTasks removeObjectForKey:task];
+    return [self stringAtOffset:_identifierOffset];
 }
 
-- (void)URLSession:(NSURLSession *)session downloadTask:(NSURLSessionDownloadTask *)task didFinishDownloadingToURL:(NSURL *)location
+- (NSString *)rev
 {
-    // Catches the case where the file was downloaded successfully.
-    [self tryCompleteTask:task location:location data:nil];
+    return [self stringAtOffset:_revOffset];
 }
 
-- (void)tryCompleteTask:(NSURLSessionTask *const)task location:(NSURL *const)location data:(NSData *const)data
+- (NSDate *)serverModifiedDate
 {
-    if ([task isKindOfClass:[NSURLSessionDownloadTask class]]) {
-        void (^downloadCompletionBlock)(NSURL * _Nullable location, NSURLResponse * _Nullable response, NSError * _Nullable error) = self.completionBlocksForTasks[task];
-        if (downloadCompletionBlock) {
-            downloadCompletionBlock(location, task.response, task.error);
-        }
-    } else if ([task isKindOfClass:[NSURLSessionDataTask class]]) {
-        void (^dataCompletionBlock)(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) = self.completionBlocksForTasks[task];
-        if (dataCompletionBlock) {
-            dataCompletionBlock(self.accumulatedDataForDataTasks[task], task.response, task.error);
-        }
-    } else {
-        NSAssert(NO, @"This shouldn't be reached");
-    }
-    [self.completionBlocksForTasks removeObjectForKey:task];
+    return _hasServerModifiedTimestamp ? [NSDate dateWithTimeIntervalSince1970:_serverModifiedTimestamp] : nil;
+}
+
+- (NSDate *)clientModifiedDate
+{
+    return _hasClientModifiedTimestamp ? [NSDate dateWithTimeIntervalSince1970:_clientModifiedTimestamp] : nil;
+}
+
+- (NSData *)contentHash
+{
+    return _hasContentHash ? [NSData dataWithBytes:_contentHash length:sizeof(_contentHash)] : nil;
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<%@: %p; path = %@>", [self class], self, self.pathDisplay ?: self.name];
 }
 
 @end
 
+#pragma mark - Metrics
+
+static BOOL _tj_metricsEnabled;
+static void (^_tj_metricsSink)(NSDictionary<NSString *, id> *);
+
+static const NSUInteger kLatencyHistogramBucketCount = 24; // Bucket i counts latencies below 2^i ms, the last bucket also holds anything slower
+
+static uint64_t _metricsTimestamp(void)
+{
+    return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+}
+
+static NSTimeInterval _metricsDuration(const uint64_t startTimestamp, const uint64_t endTimestamp)
+{
+    return (NSTimeInterval)(endTimestamp - startTimestamp) / NSEC_PER_SEC;
+}
+
+// Running totals for a single endpoint (or local operation like compression).
 #if defined(__has_attribute) && __has_attribute(objc_direct_members)
 __attribute__((objc_direct_members))
 #endif
-@implementation TJDropbox
+@interface TJDropboxEndpointMetrics : NSObject {
+    @public
+    NSUInteger _count;
+    NSUInteger _failureCount;
+    NSTimeInterval _duration;
+    NSTimeInterval _refreshWaitDuration;
+    NSTimeInterval _requestBuildDuration;
+    NSTimeInterval _connectDuration;
+    NSTimeInterval _timeToFirstByte;
+    NSTimeInterval _transferDuration;
+    unsigned long long _inputByteCount;
+    unsigned long long _outputByteCount;
+    NSUInteger _latencyHistogram[kLatencyHistogramBucketCount];
+}
 
-static void (^_tj_requestModifier)(NSMutableURLRequest *);
+@end
 
-+ (void)setRequestModifier:(void (^)(NSMutableURLRequest * _Nonnull))requestModifier
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropboxEndpointMetrics
+
+/// Approximates a latency percentile using the upper bound of the histogram bucket it falls in.
+- (NSTimeInterval)latencyAtPercentile:(const double)percentile
 {
-    _tj_requestModifier = requestModifier;
+    const NSUInteger targetCount = (NSUInteger)ceil(_count * percentile);
+    NSUInteger count = 0;
+    for (NSUInteger i = 0; i < kLatencyHistogramBucketCount; i++) {
+        count += _latencyHistogram[i];
+        if (count >= targetCount && count > 0) {
+            return (double)(1ULL << i) / 1000.0;
+        }
+    }
+    return 0.0;
 }
 
-+ (void (^)(NSMutableURLRequest * _Nonnull))requestModifier
+- (NSDictionary<NSString *, id> *)snapshot
 {
-    return _tj_requestModifier;
+    NSMutableArray<NSNumber *> *const latencyHistogram = [NSMutableArray arrayWithCapacity:kLatencyHistogramBucketCount];
+    for (NSUInteger i = 0; i < kLatencyHistogramBucketCount; i++) {
+        [latencyHistogram addObject:@(_latencyHistogram[i])];
+    }
+    return @{
+        TJDropboxMetricsKeyCount: @(_count),
+        TJDropboxMetricsKeyFailureCount: @(_failureCount),
+        TJDropboxMetricsKeyDuration: @(_duration),
+        TJDropboxMetricsKeyRefreshWaitDuration: @(_refreshWaitDuration),
+        TJDropboxMetricsKeyRequestBuildDuration: @(_requestBuildDuration),
+        TJDropboxMetricsKeyTimeToFirstByte: @(_timeToFirstByte),
+        TJDropboxMetricsKeyTransferDuration: @(_transferDuration),
+        TJDropboxMetricsKeyConnectDuration: @(_connectDuration),
+        TJDropboxMetricsKeyInputByteCount: @(_inputByteCount),
+        TJDropboxMetricsKeyOutputByteCount: @(_outputByteCount),
+        TJDropboxMetricsKeyLatencyHistogram: latencyHistogram,
+        TJDropboxMetricsKeyMedianLatency: @([self latencyAtPercentile:0.5]),
+        TJDropboxMetricsKeyP99Latency: @([self latencyAtPercentile:0.99]),
+    };
 }
 
-#pragma mark - Authentication
+@end
 
-// Copied from https://tijo.link/k2OViy
-static NSString *_codeChallengeFromCodeVerifier(NSString *const codeVerifier)
-{
-  // Creates code challenge according to [RFC7636 4.2] (https://tools.ietf.org/html/rfc7636#section-4.2)
-  // 1. Covert code verifier to ascii encoded string.
-  // 2. Compute the SHA256 hash of the ascii string.
-  // 3. Base64 encode the resulting hash.
-  // 4. Make the Base64 string URL safe by replacing a few characters. (https://tools.ietf.org/html/rfc4648#section-5)
-  const char *asciiString = [codeVerifier cStringUsingEncoding:NSASCIIStringEncoding];
-  NSData *data = [NSData dataWithBytes:asciiString length:strlen(asciiString)];
-  unsigned char digest[CC_SHA256_DIGEST_LENGTH] = {0};
-  CC_SHA256(data.bytes, (CC_LONG)data.length, digest);
-  NSData *sha256Data = [NSData dataWithBytes:digest length:CC_SHA256_DIGEST_LENGTH];
-  NSString *base64String = [sha256Data base64EncodedStringWithOptions:kNilOptions];
-  base64String = [base64String stringByReplacingOccurrencesOfString:@"/" withString:@"_"];
-  base64String = [base64String stringByReplacingOccurrencesOfString:@"+" withString:@"-"];
-  base64String = [base64String stringByReplacingOccurrencesOfString:@"=" withString:@""];
-  return base64String;
-}
+static os_unfair_lock _metricsLock = OS_UNFAIR_LOCK_INIT;
+static NSMutableDictionary<NSString *, TJDropboxEndpointMetrics *> *_metricsForEndpoints; // Only accessed within _metricsLock
 
-+ (NSURL *)tokenAuthenticationURLWithClientIdentifier:(NSString *const)clientIdentifier
-                                          redirectURL:(nullable NSURL *)redirectURL
-                                         codeVerifier:(nullable NSString *const)codeVerifier
-                                 generateRefreshToken:(const BOOL)generateRefreshToken
+/// Folds an event into its endpoint's totals and forwards it to the sink. Callers should check _tj_metricsEnabled first to avoid building events needlessly.
+static void _recordMetricsEvent(NSDictionary<NSString *, id> *const event)
 {
-    // https://www.dropbox.com/developers/documentation/http/documentation#auth
+    NSString *const endpoint = event[TJDropboxMetricsKeyEndpoint];
+    if (!endpoint) {
+        return;
+    }
     
-    if (!redirectURL) {
-        redirectURL = [self defaultTokenAuthenticationRedirectURLWithClientIdentifier:clientIdentifier];
+    const NSTimeInterval duration = [event[TJDropboxMetricsKeyDuration] doubleValue];
+    const double latencyMilliseconds = duration * 1000.0;
+    NSUInteger bucket = 0;
+    while (bucket < kLatencyHistogramBucketCount - 1 && latencyMilliseconds >= (double)(1ULL << bucket)) {
+        bucket++;
     }
-    NSString *const codeChallenge = codeVerifier ? _codeChallengeFromCodeVerifier(codeVerifier) : nil;
     
-    NSURLComponents *const components = [NSURLComponents componentsWithURL:[NSURL URLWithString:@"https://www.dropbox.com/oauth2/authorize"] resolvingAgainstBaseURL:NO];
-    NSMutableArray<NSURLQueryItem *> *const queryItems = [NSMutableArray arrayWithObjects:
-                                                          [NSURLQueryItem queryItemWithName:@"client_id" value:clientIdentifier],
-                                                          [NSURLQueryItem queryItemWithName:@"redirect_uri" value:redirectURL.absoluteString],
-                                                          [NSURLQueryItem queryItemWithName:@"response_type" value:codeChallenge ? @"code" : @"token"],
-                                                          [NSURLQueryItem queryItemWithName:@"disable_signup" value:@"true"],
-                                                          // Following params only apply if verifier is supplied
-                                                          codeChallenge ? [NSURLQueryItem queryItemWithName:@"code_challenge" value:codeChallenge] : nil,
-                                                          [NSURLQueryItem queryItemWithName:@"code_challenge_method" value:@"S256"],
-                                                          nil
-                                                          ];
-    if (generateRefreshToken) {
-        [queryItems addObject:[NSURLQueryItem queryItemWithName:@"token_access_type" value:@"offline"]]; // https://dropbox.tech/developers/migrating-app-permissions-and-access-tokens#updating-access-token-type
+    os_unfair_lock_lock(&_metricsLock);
+    if (!_metricsForEndpoints) {
+        _metricsForEndpoints = [NSMutableDictionary new];
+    }
+    TJDropboxEndpointMetrics *metrics = _metricsForEndpoints[endpoint];
+    if (!metrics) {
+        metrics = [TJDropboxEndpointMetrics new];
+        _metricsForEndpoints[endpoint] = metrics;
+    }
+    metrics->_count++;
+    if ([event[TJDropboxMetricsKeyFailed] boolValue]) {
+        metrics->_failureCount++;
+    }
+    metrics->_duration += duration;
+    metrics->_refreshWaitDuration += [event[TJDropboxMetricsKeyRefreshWaitDuration] doubleValue];
+    metrics->_requestBuildDuration += [event[TJDropboxMetricsKeyRequestBuildDuration] doubleValue];
+    metrics->_timeToFirstByte += [event[TJDropboxMetricsKeyTimeToFirstByte] doubleValue];
+    metrics->_transferDuration += [event[TJDropboxMetricsKeyTransferDuration] doubleValue];
+    metrics->_connectDuration += [event[TJDropboxMetricsKeyConnectDuration] doubleValue];
+    metrics->_inputByteCount += [event[TJDropboxMetricsKeyInputByteCount] unsignedLongLongValue];
+    metrics->_outputByteCount += [event[TJDropboxMetricsKeyOutputByteCount] unsignedLongLongValue];
+    metrics->_latencyHistogram[bucket]++;
+    os_unfair_lock_unlock(&_metricsLock);
+    
+    void (^const sink)(NSDictionary<NSString *, id> *) = _tj_metricsSink;
+    if (sink) {
+        sink(event);
     }
-    components.queryItems = queryItems;
-    return components.URL;
 }
 
-+ (NSURL *)defaultTokenAuthenticationRedirectURLWithClientIdentifier:(NSString *const)clientIdentifier
+/// Records a local operation (compression, hashing) that started at @c startTimestamp.
+static void _recordOperationMetrics(NSString *const endpoint, const uint64_t startTimestamp, const unsigned long long inputByteCount, const unsigned long long outputByteCount)
 {
-    return [NSURL URLWithString:[NSString stringWithFormat:@"db-%@://2/token", clientIdentifier]];
+    _recordMetricsEvent(@{
+        TJDropboxMetricsKeyEndpoint: endpoint,
+        TJDropboxMetricsKeyDuration: @(_metricsDuration(startTimestamp, _metricsTimestamp())),
+        TJDropboxMetricsKeyInputByteCount: @(inputByteCount),
+        TJDropboxMetricsKeyOutputByteCount: @(outputByteCount),
+    });
 }
 
-+ (nullable TJDropboxCredential *)credentialFromURL:(NSURL *const)url withRedirectURL:(NSURL *const)redirectURL
+#pragma mark - Callback Queues
+
+static NSString *const kCallbackQueueThreadDictionaryKey = @"TJDropboxCallbackQueue";
+
+// Heavy per-task work (data handling, hashing, parsing) runs here rather than on the session's delegate queue.
+static dispatch_queue_t _workerQueue(void)
 {
-    TJDropboxCredential *credential = nil;
-    if ([url.absoluteString hasPrefix:redirectURL.absoluteString]) {
-        NSString *const fragment = url.fragment;
-        NSURLComponents *const components = [NSURLComponents new];
-        components.query = fragment;
-        for (NSURLQueryItem *const item in components.queryItems) {
-            if ([item.name isEqualToString:@"access_token"]) {
-                credential = [[TJDropboxCredential alloc] initWithAccessToken:item.value];
-                break;
-            }
-        }
-    }
-    return credential;
+    static dispatch_queue_t workerQueue;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        workerQueue = dispatch_queue_create("com.tijo.TJDropbox.worker", dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_CONCURRENT, QOS_CLASS_USER_INITIATED, 0));
+    });
+    return workerQueue;
 }
 
-+ (nullable TJDropboxCredential *)credentialFromURL:(NSURL *const)url withClientIdentifier:(NSString *const)clientIdentifier
+/// The queue requests started on the current thread should deliver their callbacks on, if any.
+static dispatch_queue_t _currentCallbackQueue(void)
 {
-    return [self credentialFromURL:url withRedirectURL:[self defaultTokenAuthenticationRedirectURLWithClientIdentifier:clientIdentifier]];
+    return [NSThread currentThread].threadDictionary[kCallbackQueueThreadDictionaryKey];
 }
 
-+ (void)credentialFromCode:(NSString *const)code
-      withClientIdentifier:(NSString *const)clientIdentifier
-              codeVerifier:(NSString *const)codeVerifier
-               redirectURL:(NSURL *const)redirectURL
-                completion:(void (^const)(TJDropboxCredential *_Nullable, NSError *_Nullable))completion
+static void _performWithCallbackQueue(dispatch_queue_t const callbackQueue, NS_NOESCAPE dispatch_block_t block)
 {
-    // https://www.dropbox.com/developers/documentation/http/documentation#oauth2-token
-    // https://tijo.link/BmeoVo
-    
-    _performAPIRequest(nil,
-                       ^NSURLRequest *{
-        NSMutableURLRequest *const request = _apiRequest(@"/oauth2/token", nil, nil);
-        NSURLComponents *const components = [NSURLComponents new];
-        components.queryItems = @[
-            [NSURLQueryItem queryItemWithName:@"grant_type" value:@"authorization_code"],
-            [NSURLQueryItem queryItemWithName:@"code" value:code],
-            [NSURLQueryItem queryItemWithName:@"client_id" value:clientIdentifier],
-            [NSURLQueryItem queryItemWithName:@"code_verifier" value:codeVerifier],
-            [NSURLQueryItem queryItemWithName:@"redirect_uri" value:redirectURL.absoluteString],
-        ];
-        request.HTTPBody = [components.query dataUsingEncoding:NSUTF8StringEncoding];
-        [request addValue:@"application/x-www-form-urlencoded; charset=utf-8" forHTTPHeaderField:@"Content-Type"];
-        return request;
-    },
-                       ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
-        NSString *const accessToken = parsedResponse[@"access_token"];
-        NSString *const refreshToken = parsedResponse[@"refresh_token"];
-        const id expiresInValue = parsedResponse[@"expires_in"];
-        NSDate *const expirationDate = expiresInValue != nil ? [NSDate dateWithTimeIntervalSinceNow:[expiresInValue doubleValue]] : nil;
-        completion([[TJDropboxCredential alloc] initPrivateWithAccessToken:accessToken
-                                                              refreshToken:refreshToken
-                                                            expirationDate:expirationDate
-                                                          clientIdentifier:clientIdentifier],
-                   error);
-    });
+    NSMutableDictionary *const threadDictionary = [NSThread currentThread].threadDictionary;
+    dispatch_queue_t const previousCallbackQueue = threadDictionary[kCallbackQueueThreadDictionaryKey];
+    threadDictionary[kCallbackQueueThreadDictionaryKey] = callbackQueue;
+    block();
+    threadDictionary[kCallbackQueueThreadDictionaryKey] = previousCallbackQueue;
 }
 
-+ (BOOL)isAuthenticationErrorURL:(NSURL *const)url withRedirectURL:(NSURL *const)redirectURL
+/// Wraps @c block so that it runs with the current callback queue, allowing follow-up requests made from it to honor it after hopping queues.
+static dispatch_block_t _callbackQueuePreservingBlock(dispatch_block_t const block)
 {
-    // when the user presses the cancel button on the website, this URL is returned:
-    // db-XXX://2/token#error_description=The+user+chose+not+to+give+your+app+access+to+their+Dropbox+account.&error=access_denied
-    if ([url.absoluteString hasPrefix:redirectURL.absoluteString]) {
-        NSString *const fragment = url.fragment;
-        NSURLComponents *const components = [NSURLComponents new];
-        components.query = fragment;
-        for (NSURLQueryItem *const item in components.queryItems) {
-            if ([item.name isEqualToString:@"error"]) {
-                return YES;
-            }
-        }
-    }
-    return NO;
+    dispatch_queue_t const callbackQueue = _currentCallbackQueue();
+    return ^{
+        _performWithCallbackQueue(callbackQueue, block);
+    };
 }
 
-+ (BOOL)isAuthenticationErrorURL:(NSURL *const)url withClientIdentifier:(NSString *const)clientIdentifier
+static void _dispatchAsync(dispatch_queue_t const queue, dispatch_block_t const block)
 {
-    return [self isAuthenticationErrorURL:url withRedirectURL:[self defaultTokenAuthenticationRedirectURLWithClientIdentifier:clientIdentifier]];
+    dispatch_async(queue, _callbackQueuePreservingBlock(block));
 }
 
-+ (NSURL *)dropboxAppAuthenticationURLWithClientIdentifier:(NSString *const)clientIdentifier
-                                              codeVerifier:(nullable NSString *const)codeVerifier
-                                      generateRefreshToken:(const BOOL)generateRefreshToken
+/// Runs @c block on the current callback queue if there is one, otherwise runs it immediately.
+static void _performCallback(dispatch_block_t const block)
 {
-    // https://github.com/dropbox/SwiftyDropbox/blob/master/Source/OAuth.swift#L288-L303
-    // https://github.com/dropbox/SwiftyDropbox/blob/master/Source/OAuth.swift#L274-L282
-    
-    NSURLComponents *const components = [NSURLComponents componentsWithString:@"dbapi-2://1/connect"];
-    
-    NSString *stateString;
-    NSString *extraQueryParams = nil;
-    if (codeVerifier) {
-        NSString *const codeChallenge = _codeChallengeFromCodeVerifier(codeVerifier);
-        stateString = [NSString stringWithFormat:@"oauth2code:%@:S256:", codeChallenge];
-        
-        if (generateRefreshToken) {
-            stateString = [stateString stringByAppendingString:@"offline"];
-        }
-        
-        NSURLComponents *const extraComponents = [NSURLComponents new];
-        
-        extraComponents.queryItems = [NSArray arrayWithObjects:
-                                      [NSURLQueryItem queryItemWithName:@"code_challenge" value:codeChallenge],
-                                      [NSURLQueryItem queryItemWithName:@"code_challenge_method" value:@"S256"],
-                                      [NSURLQueryItem queryItemWithName:@"response_type" value:@"code"],
-                                      generateRefreshToken ? [NSURLQueryItem queryItemWithName:@"token_access_type" value:@"offline"] : nil,
-                                      nil
-                                      ];
-        extraQueryParams = extraComponents.query;
+    dispatch_queue_t const callbackQueue = _currentCallbackQueue();
+    if (callbackQueue) {
+        _dispatchAsync(callbackQueue, block);
     } else {
-        NSString *const nonce = [[NSUUID UUID] UUIDString];
-        stateString = [NSString stringWithFormat:@"oauth2:%@", nonce];
+        block();
     }
-    
-    components.queryItems = [NSArray arrayWithObjects:
-                             [NSURLQueryItem queryItemWithName:@"k" value:clientIdentifier],
-                             [NSURLQueryItem queryItemWithName:@"s" value:@""],
-                             [NSURLQueryItem queryItemWithName:@"state" value:stateString],
-                             // Following params only apply if verifier is supplied https://tijo.link/QObA8d
-                             extraQueryParams != nil ? [NSURLQueryItem queryItemWithName:@"extra_query_params" value:extraQueryParams] : nil,
-                             nil
-                             ];
-    return components.URL;
 }
 
-+ (nullable TJDropboxCredential *)credentialFromDropboxAppAuthenticationURL:(NSURL *const)url
-{
-    // https://github.com/dropbox/SwiftyDropbox/blob/master/Source/OAuth.swift#L360-L383
-    
-    NSString *accessToken = nil;
-    if ([url.scheme hasPrefix:@"db-"] && [url.host isEqualToString:@"1"] && [url.path isEqualToString:@"/connect"]) {
-        NSURLComponents *const components = [NSURLComponents componentsWithURL:url resolvingAgainstBaseURL:NO];
-        for (NSURLQueryItem *queryItem in components.queryItems) {
-            if ([queryItem.name isEqualToString:@"oauth_token_secret"] && queryItem.value.length > 0) {
-                accessToken = queryItem.value;
-                break;
-            }
-            // Note: It seems that you cannot get refresh tokens from app-to-app auth.
-        }
-    }
-    return accessToken != nil ? [[TJDropboxCredential alloc] initWithAccessToken:accessToken] : nil;
-}
+#pragma mark - Response Cache
 
-+ (void)revokeCredential:(TJDropboxCredential *const)credential withCallback:(void (^const)(BOOL success, NSError *_Nullable error))completion
-{
-    // https://www.dropbox.com/developers/documentation/http/documentation#auth-token-revoke
-    
-    _performAPIRequest(credential,
-                       ^NSURLRequest *{
-        return _apiRequest(@"/2/auth/token/revoke", credential.accessToken, nil);
-    },
-                       ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
-        completion(error == nil, error);
-    });
-}
+static const NSTimeInterval kDefaultCachedResponseLifetime = 5.0;
+static const NSUInteger kDefaultMaximumCachedResponseCount = 256;
 
-#pragma mark - Generic
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxCachedResponse : NSObject
 
-static NSString *_asciiEncodeString(NSString *const string)
-{
-    // Inspired by: https://github.com/dropbox/SwiftyDropbox/blob/6747041b04e337efe0de8f3be14acaf3b6d6d19b/Source/Client.swift#L90-L104
-    // Useful: http://stackoverflow.com/a/1775880
-    // Useful: https://www.objc.io/issues/9-strings/unicode/
-    
-    const NSUInteger stringLength = string.length;
-    NSMutableString *const result = string != nil ? [NSMutableString stringWithCapacity:stringLength] : nil;
-    
-    for (NSUInteger i = 0; i < stringLength; i++) {
-        const unichar character = [string characterAtIndex:i];
-        if (character > 127) {
-            [result appendFormat:@"\\u%04x", character];
-        } else {
-            [result appendFormat:@"%c", character];
-        }
-    }
-    
-    return result;
-}
+@property (nonatomic) NSDictionary *parsedResponse;
+@property (nonatomic, weak) TJDropboxCredential *credential; // Keys contain the credential's address, this guards against a new credential reusing it
+@property (nonatomic) uint64_t expirationTimestamp;
 
-static NSString * _parameterStringForParameters(NSDictionary<NSString *, id> *parameters)
-{
-    NSString *parameterString = nil;
-    if (parameters.count > 0) {
-        NSError *error = nil;
-        NSJSONWritingOptions options = 0;
-        if (@available(iOS 13.0, macOS 10.15, *)) {
-            options = NSJSONWritingWithoutEscapingSlashes;
-        }
-        NSData *const parameterData = [NSJSONSerialization dataWithJSONObject:parameters options:options error:&error];
-        if (error) {
-            NSLog(@"[TJDropbox] - Error in %s: %@", __PRETTY_FUNCTION__, error);
-        } else {
-            parameterString = [[NSString alloc] initWithData:parameterData encoding:NSUTF8StringEncoding];
-            
-            // Ugh http://stackoverflow.com/a/24807307
-            // Asian characters are formatted as ASCII using +asciiEncodeString:, which adds a leading '\'.
-            // NSJSONSerialization likes to turn '\' into '\\', which Dropbox doesn't tolerate.
-            // This is a gross way of fixing it, but it works.
-            // Sucks because we have to round trip from dictionary -> data -> string -> data in a lot of cases.
-            parameterString = [parameterString stringByReplacingOccurrencesOfString:@"\\\\" withString:@"\\"];
-        }
-    }
-    return parameterString;
+@end
+
+@implementation TJDropboxCachedResponse
+
+@end
+
+// Coalesces identical read-only requests that are in flight at the same time, and keeps their successful responses for a short while.
+// Keys combine the credential, endpoint and canonical arguments. Entries are dropped on expiry, least recently used first when over the limit, and for a whole credential when a write goes through.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxResponseCache : NSObject {
+    os_unfair_lock _lock;
 }
 
-static NSMutableURLRequest *_baseRequest(NSString *const baseURLString, NSString *const path, NSString *const accessToken)
+// All of these must be accessed within -performSynchronized:
+@property (nonatomic) NSMutableDictionary<NSString *, TJDropboxCachedResponse *> *cachedResponsesForKeys;
+@property (nonatomic) NSMutableOrderedSet<NSString *> *recentlyUsedKeys; // Least recently used first
+@property (nonatomic) NSMutableDictionary<NSString *, NSMutableArray<void (^)(NSDictionary *, NSError *)> *> *waitingCompletionsForKeys;
+@property (nonatomic) NSUInteger generation; // Bumped on every invalidation so responses to requests that were already in flight aren't cached
+@property (nonatomic) NSTimeInterval lifetime;
+@property (nonatomic) NSUInteger maximumCount;
+@property (nonatomic) NSUInteger hitCount;
+@property (nonatomic) NSUInteger missCount;
+@property (nonatomic) NSUInteger coalescedCount;
+
+@end
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropboxResponseCache
+
+- (instancetype)init
 {
-    NSURLComponents *const components = [[NSURLComponents alloc] initWithString:baseURLString];
-    components.path = path;
-    
-    NSMutableURLRequest *const request = [[NSMutableURLRequest alloc] initWithURL:components.URL];
-    request.HTTPMethod = @"POST";
-    
-    if (accessToken) {
-        NSString *const authorization = [NSString stringWithFormat:@"Bearer %@", accessToken];
-        [request addValue:authorization forHTTPHeaderField:@"Authorization"];
-    }
-    
-    void (^requestModifier)(NSMutableURLRequest *) = [TJDropbox requestModifier];
-    if (requestModifier != nil) {
-        requestModifier(request);
+    if (self = [super init]) {
+        _lock = OS_UNFAIR_LOCK_INIT;
+        self.cachedResponsesForKeys = [NSMutableDictionary new];
+        self.recentlyUsedKeys = [NSMutableOrderedSet new];
+        self.waitingCompletionsForKeys = [NSMutableDictionary new];
+        self.lifetime = kDefaultCachedResponseLifetime;
+        self.maximumCount = kDefaultMaximumCachedResponseCount;
     }
-    
-    return request;
+    return self;
 }
 
-// Thanks Claude https://tijo.link/BGdVNx
-static NSData *_gzipCompressData(NSData *const data, NSError **error) {
-   if (!data.length) {
-       if (error) {
-           *error = [NSError errorWithDomain:@"CompressionErrorDomain" code:1
-               userInfo:@{NSLocalizedDescriptionKey: @"Invalid input data"}];
-       }
-       return nil;
-   }
-   
-   z_stream strm;
-   strm.zalloc = Z_NULL;
-   strm.zfree = Z_NULL;
-   strm.opaque = Z_NULL;
-   
-   // Initialize deflate with gzip format
-   if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
-       if (error) {
-           *error = [NSError errorWithDomain:@"CompressionErrorDomain" code:2
-               userInfo:@{NSLocalizedDescriptionKey: @"Failed to initialize compression"}];
-       }
-       return nil;
-   }
-   
-   // Set up input
-   strm.avail_in = (uInt)data.length;
-   strm.next_in = (Bytef *)data.bytes;
-   
-   // Prepare output buffer (compress can increase size)
-   NSMutableData *compressedData = [NSMutableData dataWithLength:data.length * 1.1 + 12];
-   strm.avail_out = (uInt)compressedData.length;
-   strm.next_out = compressedData.mutableBytes;
-   
-   // Compress
-   if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
-       deflateEnd(&strm);
-       if (error) {
-           *error = [NSError errorWithDomain:@"CompressionErrorDomain" code:3
-               userInfo:@{NSLocalizedDescriptionKey: @"Compression failed"}];
-       }
-       return nil;
-   }
-   
-   // Cleanup and finalize
-   [compressedData setLength:strm.total_out];
-   deflateEnd(&strm);
-   
-   return compressedData;
+- (void)performSynchronized:(NS_NOESCAPE dispatch_block_t)block {
+    os_unfair_lock_lock(&_lock);
+    block();
+    os_unfair_lock_unlock(&_lock);
 }
 
-// Computes Dropbox content_hash as specified in https://www.dropbox.com/developers/reference/content-hash
-// The content_hash is computed by dividing the file into 4MB blocks, SHA-256 hashing each block,
-// then SHA-256 hashing the concatenated block hashes, and finally hex-encoding the result.
-static NSString *_dropboxContentHashForData(NSData *const data) {
-    // Hex encode the result
-    NSMutableString *hexString = [NSMutableString stringWithCapacity:data.length * 2];
-    const unsigned char *bytes = data.bytes;
-    for (NSUInteger i = 0; i < data.length; i++) {
-        [hexString appendFormat:@"%02x", bytes[i]];
-    }
-    return hexString;
+/// Must be called while synchronized.
+- (void)removeCachedResponseForKey:(NSString *const)key
+{
+    [self.cachedResponsesForKeys removeObjectForKey:key];
+    [self.recentlyUsedKeys removeObject:key];
 }
 
-NSData * _Nullable TJDropboxFileContentHash(NSString *const filePath) {
-    NSFileHandle *fileHandle = [NSFileHandle fileHandleForReadingAtPath:filePath];
-    if (!fileHandle) {
-        return nil;
+/// Must be called while synchronized.
+- (void)trimToMaximumCount
+{
+    while (self.recentlyUsedKeys.count > self.maximumCount) {
+        [self removeCachedResponseForKey:self.recentlyUsedKeys.firstObject];
     }
-    
-    static const NSUInteger kBlockSize = 4 * 1024 * 1024; // 4 MB blocks
-    
-    // Hash the concatenated block hashes
-    CC_SHA256_CTX hashContext;
-    CC_SHA256_Init(&hashContext);
-    
-    NSData *block;
-    do {
-        @autoreleasepool {
-            block = [fileHandle readDataOfLength:kBlockSize];
-            
-            // Hash this block
-            unsigned char blockHash[CC_SHA256_DIGEST_LENGTH];
-            CC_SHA256(block.bytes, (CC_LONG)block.length, blockHash);
-            CC_SHA256_Update(&hashContext, blockHash, CC_SHA256_DIGEST_LENGTH);
-        }
-    } while (block.length == kBlockSize);
-    
-    unsigned char finalHash[CC_SHA256_DIGEST_LENGTH];
-    CC_SHA256_Final(finalHash, &hashContext);
-    
-    return [NSData dataWithBytes:finalHash length:CC_SHA256_DIGEST_LENGTH];
 }
 
-static NSMutableURLRequest *_apiRequest(NSString *const path, NSString *const accessToken, NSDictionary<NSString *, id> *const parameters)
+- (void)removeCachedResponsesForCredential:(TJDropboxCredential *const)credential
 {
-    NSMutableURLRequest *const request = _baseRequest(@"https://api.dropboxapi.com", path, accessToken);
-    request.HTTPBody = [_parameterStringForParameters(parameters) dataUsingEncoding:NSUTF8StringEncoding];
-    request.cachePolicy = NSURLRequestReloadIgnoringLocalAndRemoteCacheData;
-    
-    if (request.HTTPBody != nil) {
-        [request addValue:@"application/json" forHTTPHeaderField:@"Content-Type"];
-    }
-    
-    return request;
+    [self performSynchronized:^{
+        self.generation++;
+        NSMutableArray<NSString *> *const keys = [NSMutableArray new];
+        [self.cachedResponsesForKeys enumerateKeysAndObjectsUsingBlock:^(NSString * _Nonnull key, TJDropboxCachedResponse * _Nonnull cachedResponse, BOOL * _Nonnull stop) {
+            TJDropboxCredential *const cachedCredential = cachedResponse.credential;
+            if (!cachedCredential || cachedCredential == credential) {
+                [keys addObject:key];
+            }
+        }];
+        for (NSString *const key in keys) {
+            [self removeCachedResponseForKey:key];
+        }
+    }];
 }
 
-static NSMutableURLRequest *_contentRequest(NSString *const path, NSString *const accessToken, NSDictionary<NSString *, id> *const parameters)
+- (void)removeAllCachedResponses
 {
-    NSMutableURLRequest *const request = _baseRequest(@"https://content.dropboxapi.com", path, accessToken);
-    NSString *const parameterString = _parameterStringForParameters(parameters);
-    [request setValue:parameterString forHTTPHeaderField:@"Dropbox-API-Arg"];
-    return request;
+    [self performSynchronized:^{
+        self.generation++;
+        [self.cachedResponsesForKeys removeAllObjects];
+        [self.recentlyUsedKeys removeAllObjects];
+        self.hitCount = 0;
+        self.missCount = 0;
+        self.coalescedCount = 0;
+    }];
 }
 
-static TJDropboxURLSessionTaskDelegate *_taskDelegate(void)
+@end
+
+static TJDropboxResponseCache *_responseCache(void)
 {
-    static TJDropboxURLSessionTaskDelegate *taskDelegate;
+    static TJDropboxResponseCache *responseCache;
     static dispatch_once_t onceToken;
     dispatch_once(&onceToken, ^{
-        taskDelegate = [TJDropboxURLSessionTaskDelegate new];
+        responseCache = [TJDropboxResponseCache new];
     });
-    return taskDelegate;
+    return responseCache;
 }
 
-static NSURLSession *_session(void)
+/// Clears the credential's cached responses once a request that may have changed files or space usage completes.
+static void _invalidateCachedResponsesAfterRequest(NSURLRequest *const request, TJDropboxCredential *const credential)
 {
-    static NSURLSession *session;
+    static NSArray<NSString *> *writeEndpoints;
     static dispatch_once_t onceToken;
     dispatch_once(&onceToken, ^{
-        TJDropboxURLSessionTaskDelegate *taskDelegate = _taskDelegate();
-        NSURLSessionConfiguration *const configuration = [NSURLSessionConfiguration ephemeralSessionConfiguration];
-        configuration.shouldUseExtendedBackgroundIdleMode = YES; // Allows requests to run better when the app is backgrounded https://twitter.com/BigZaphod/status/1164977540479553543
-        configuration.waitsForConnectivity = YES;
-        configuration.timeoutIntervalForResource = 60;
-        
-        if (@available(iOS 18.4, macOS 15.4, *)) {
-            configuration.usesClassicLoadingMode = NO;
-            if (@available(iOS 26.0, macOS 26.0, *)) {
-                configuration.enablesEarlyData = YES;
-            }
-        }
-        session = [NSURLSession sessionWithConfiguration:configuration delegate:taskDelegate delegateQueue:taskDelegate.serialOperationQueue];
-        session.sessionDescription = @"TJDropbox";
+        // Batch jobs finish asynchronously, so their status checks invalidate too.
+        writeEndpoints = @[
+            @"/2/files/upload",
+            @"/2/files/upload_session/finish",
+            @"/2/files/upload_session/finish_batch_v2",
+            @"/2/files/upload_session/finish_batch/check",
+            @"/2/files/create_folder",
+            @"/2/files/delete_v2",
+            @"/2/files/delete_batch",
+            @"/2/files/delete_batch/check",
+            @"/2/files/move_v2",
+            @"/2/files/move_batch_v2",
+            @"/2/files/move_batch/check_v2",
+            @"/2/files/copy_batch_v2",
+            @"/2/files/copy_batch/check_v2",
+            @"/2/files/save_url",
+        ];
     });
-    return session;
-}
-
-static void _addTask(TJDropboxCredential *credential,
-                     NSURLSessionTask *(^taskBlock)(void),
-                     void (^const refreshErrorCompletion)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))
-{
-    dispatch_block_t performTaskBlock = ^{
-        NSURLSessionTask *task = taskBlock();
-        [task resume];
-    };
-    __block BOOL runBlock;
-    if (credential) {
-        [credential performSynchronized:^{
-            if (credential.expirationDate != nil && credential.expirationDate.timeIntervalSinceNow < 600.0) { // Refresh if there are fewer than 10 minutes until expiration
-                void (^refreshCompletionBlock)(NSDictionary *, NSError *) = ^(NSDictionary *parsedResponse, NSError *error) {
-                    if (error) {
-                        refreshErrorCompletion(parsedResponse, error);
-                    } else {
-                        performTaskBlock();
-                    }
-                };
-                if (credential.refreshCompletionBlocks) {
-                    [credential.refreshCompletionBlocks addObject:refreshErrorCompletion];
-                } else {
-                    credential.refreshCompletionBlocks = [NSMutableArray arrayWithObject:refreshCompletionBlock];
-                    _refreshCredential(credential, ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
-                        for (void (^block)(NSDictionary *, NSError *) in credential.refreshCompletionBlocks) {
-                            block(parsedResponse, error);
-                        }
-                        credential.refreshCompletionBlocks = nil;
-                    });
-                }
-                runBlock = NO;
-            } else {
-                runBlock = YES;
-            }
-        }];
-    } else {
-        runBlock = YES;
+    if (!credential) {
+        return;
     }
-    
-    if (runBlock) {
-        performTaskBlock();
+    // Base URLs may carry a path prefix when pointed at a local server.
+    NSString *const path = request.URL.path;
+    for (NSString *const writeEndpoint in writeEndpoints) {
+        if ([path hasSuffix:writeEndpoint]) {
+            [_responseCache() removeCachedResponsesForCredential:credential];
+            break;
+        }
     }
 }
 
-static void _performAPIRequest(TJDropboxCredential *credential, NSURLRequest *(^requestBlock)(void), void (^const completion)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))
-{
-    _addTask(credential,
-             ^NSURLSessionTask *{
-        return [_session() dataTaskWithRequest:requestBlock() completionHandler:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
-            NSDictionary *parsedResult = nil;
-            _processResult(data, response, &error, &parsedResult);
-            completion(parsedResult, error);
-        }];
-    },
-             completion);
-}
+#pragma mark - Scheduling
 
-static void _refreshCredential(TJDropboxCredential *const credential, void (^completion)(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error))
-{
-    _performAPIRequest(nil,
-                       ^NSURLRequest *{
-        // https://www.dropbox.com/developers/documentation/http/documentation#oauth2-token
-        // https://tijo.link/BmeoVo
-        NSMutableURLRequest *const request = _apiRequest(@"/oauth2/token", nil, nil);
-        NSURLComponents *const components = [NSURLComponents new];
-        components.queryItems = @[
-            [NSURLQueryItem queryItemWithName:@"grant_type" value:@"refresh_token"],
-            [NSURLQueryItem queryItemWithName:@"refresh_token" value:credential.refreshToken],
-            [NSURLQueryItem queryItemWithName:@"client_id" value:credential.clientIdentifier],
-        ];
-        request.HTTPBody = [components.query dataUsingEncoding:NSUTF8StringEncoding];
-        [request addValue:@"application/x-www-form-urlencoded; charset=utf-8" forHTTPHeaderField:@"Content-Type"];
-        return request;
-    },
-                       ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
-        
-        NSString *const accessToken = parsedResponse[@"access_token"];
-        const id expiresInValue = parsedResponse[@"expires_in"];
-        NSDate *const expirationDate = expiresInValue != nil ? [NSDate dateWithTimeIntervalSinceNow:[expiresInValue doubleValue]] : nil;
-        if (accessToken && expirationDate) {
-            [credential performSynchronized:^{
-                credential.accessToken = accessToken;
-                credential.expirationDate = expirationDate;
-            }];
-            [[NSNotificationCenter defaultCenter] postNotificationName:TJDropboxCredentialDidRefreshAccessTokenNotification
-                                                                object:credential];
-        }
-        completion(parsedResponse, error);
-    });
-}
+// Chosen by the caller for the kind of work a request does, regardless of the host it's sent to.
+typedef NS_ENUM(NSUInteger, TJDropboxRequestLane) {
+    TJDropboxRequestLaneInteractive, // Metadata calls, thumbnails and small reads, started ahead of anything waiting in the bulk lane
+    TJDropboxRequestLaneBulk,        // File transfers and long polls
+    TJDropboxRequestLaneCount
+};
 
-static NSData *_resultDataForContentRequestResponse(NSURLResponse *const response)
-{
-    NSHTTPURLResponse *const httpURLResponse = [response isKindOfClass:[NSHTTPURLResponse class]] ? (NSHTTPURLResponse *)response : nil;
-    NSString *resultString;
-    static NSString *const kDropboxAPIResultHeaderFieldKey = @"Dropbox-API-Result";
-    if (@available(iOS 13.0, macOS 10.15, *)) {
-        resultString = [httpURLResponse valueForHTTPHeaderField:kDropboxAPIResultHeaderFieldKey];
-    } else {
-        resultString = httpURLResponse.allHeaderFields[kDropboxAPIResultHeaderFieldKey];
-    }
-    NSData *const resultData = [resultString dataUsingEncoding:NSUTF8StringEncoding];
-    return resultData;
+static const NSUInteger kSessionPoolCount = TJDropboxSessionPoolBackground + 1;
+
+static const NSUInteger kMaximumRetryCount = 4;
+static const NSTimeInterval kInitialRetryDelay = 1.0;
+static const NSTimeInterval kMaximumRetryDelay = 60.0;
+
+// A request waiting for, or occupying, a slot in the scheduler.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxScheduledRequest : NSObject
+
+@property (nonatomic, copy) NSURLSessionTask *(^taskBlock)(void); // Invoked once the request is started, and again to create a fresh task for each retry
+@property (nonatomic, copy) void (^failureBlock)(NSDictionary *_Nullable parsedResponse, NSError *error); // Delivers an error in place of the task's completion when the request ends without a task to complete
+@property (nonatomic) TJDropboxCredential *credential;
+@property (nonatomic) NSURLSessionTask *task;
+@property (nonatomic, copy) NSString *host;
+@property (nonatomic) TJDropboxRequestLane lane;
+@property (nonatomic) TJDropboxSessionPool sessionPool;
+@property (nonatomic) NSUInteger retryCount;
+@property (nonatomic) BOOL inFlight;
+@property (nonatomic) BOOL cancelled; // Set if requests are cancelled while this one is building its task or waiting to be retried
+@property (nonatomic) BOOL retriedWithRefreshedAccessToken;
+
+@end
+
+@implementation TJDropboxScheduledRequest
+
+@end
+
+// Sits between _addTask and -[NSURLSessionTask resume]. Requests are started in lane order subject to optional per-host concurrency limits and token bucket,
+// and requests that are rate limited (429) or hit an unavailable server (503) are retried with jittered exponential backoff that honors Retry-After.
+// Tasks aren't created until their request is started, so queued requests don't hold request bodies or authorization that may go stale.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxScheduler : NSObject {
+    os_unfair_lock _lock;
 }
 
-static BOOL _processResult(NSData *const jsonData, NSURLResponse *const response, NSError **error, NSDictionary **parsedResult)
+// All of these must be accessed within -performSynchronized:
+@property (nonatomic) NSArray<NSMutableArray<TJDropboxScheduledRequest *> *> *queuedRequestsForLanes;
+@property (nonatomic) NSHashTable<TJDropboxScheduledRequest *> *startingRequests; // Started, but still building their tasks
+@property (nonatomic) NSMapTable<NSURLSessionTask *, TJDropboxScheduledRequest *> *requestsForTasks;
+@property (nonatomic) NSHashTable<TJDropboxScheduledRequest *> *requestsAwaitingRetry;
+@property (nonatomic) NSMutableDictionary<NSString *, NSNumber *> *inFlightCountsForHosts;
+@property (nonatomic) NSMutableDictionary<NSString *, NSNumber *> *maximumConcurrentRequestsForHosts;
+@property (nonatomic) NSUInteger defaultMaximumConcurrentRequestsPerHost; // 0 doesn't limit
+@property (nonatomic) double maximumRequestsPerSecond; // 0 disables the token bucket
+@property (nonatomic) double availableTokens;
+@property (nonatomic) uint64_t lastTokenRefillTimestamp;
+@property (nonatomic) BOOL pumpScheduled;
+
+@end
+
+static BOOL _isExpiredAccessTokenResponseBody(NSData *const responseBody)
 {
-    NSString *errorString = nil;
-    if (jsonData.length > 0) {
-        id result = [NSJSONSerialization JSONObjectWithData:jsonData options:0 error:nil];
-        if ([result isKindOfClass:[NSDictionary class]]) {
-            *parsedResult = result;
-        } else {
-            errorString = [[NSString alloc] initWithData:jsonData encoding:NSUTF8StringEncoding];
-        }
+    if (!responseBody) {
+        return NO;
     }
-    
-    // Things leading to errors
-    // 1. error returned to this block
-    // 2. dropboxAPIErrorDictionary populated
-    // 3. Status code >= 400
-    // 4. errorString populated
-    
-    NSHTTPURLResponse *const httpURLResponse = [response isKindOfClass:[NSHTTPURLResponse class]] ? (NSHTTPURLResponse *)response : nil;
-    const NSInteger statusCode = [httpURLResponse statusCode];
-    NSDictionary *const dropboxAPIErrorDictionary = [*parsedResult objectForKey:@"error"];
-    
-    if (!*error) {
-        if (statusCode >= 400 || dropboxAPIErrorDictionary || (!*parsedResult && statusCode != 200)) {
-            NSMutableDictionary *const userInfo = [NSMutableDictionary new];
-            if (response) {
-                [userInfo setObject:response forKey:TJDropboxErrorUserInfoKeyResponse];
-            }
-            if ([dropboxAPIErrorDictionary isKindOfClass:[NSDictionary class]]) {
-                [userInfo setObject:dropboxAPIErrorDictionary forKey:TJDropboxErrorUserInfoKeyDropboxError];
-            }
-            if (errorString) {
-                [userInfo setObject:errorString forKey:TJDropboxErrorUserInfoKeyErrorString];
-            }
-            *error = [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:userInfo];
-        }
+    // https://www.dropbox.com/developers/documentation/http/documentation#error-handling
+    NSDictionary *const parsedResponse = [NSJSONSerialization JSONObjectWithData:responseBody options:0 error:nil];
+    if (![parsedResponse isKindOfClass:[NSDictionary class]]) {
+        return NO;
     }
-    
-    return *error == nil;
+    NSDictionary *const error = parsedResponse[@"error"];
+    if ([error isKindOfClass:[NSDictionary class]] && [error[@".tag"] isKindOfClass:[NSString class]]) {
+        return [error[@".tag"] isEqualToString:@"expired_access_token"];
+    }
+    NSString *const errorSummary = parsedResponse[@"error_summary"];
+    return [errorSummary isKindOfClass:[NSString class]] && [errorSummary hasPrefix:@"expired_access_token"];
 }
 
-#pragma mark - Account Info
-
-+ (void)getAccountInformationWithCredential:(TJDropboxCredential *)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+static NSError *_cancelledError(void)
 {
-    _performAPIRequest(credential,
-                       ^NSURLRequest *{
-        return _apiRequest(@"/2/users/get_current_account", credential.accessToken, nil);
-    },
-                       completion);
+    return [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCancelled userInfo:nil];
 }
 
-#pragma mark - File Inspection
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropboxScheduler
 
-static NSURLRequest *_listFolderRequest(NSString *const filePath, NSString *const accessToken, NSString *_Nullable const cursor, const BOOL includeDeleted)
+- (instancetype)init
 {
-    NSString *const urlPath = cursor.length > 0 ? @"/2/files/list_folder/continue" : @"/2/files/list_folder";
-    NSMutableDictionary *const parameters = [NSMutableDictionary new];
-    if (cursor.length > 0) {
-        [parameters setObject:cursor forKey:@"cursor"];
-    } else {
-        [parameters setObject:_asciiEncodeString(filePath) forKey:@"path"];
-        [parameters setObject:@NO forKey:@"include_non_downloadable_files"];
-        if (includeDeleted) {
-            [parameters setObject:@YES forKey:@"include_deleted"];
+    if (self = [super init]) {
+        _lock = OS_UNFAIR_LOCK_INIT;
+        NSMutableArray<NSMutableArray<TJDropboxScheduledRequest *> *> *const queuedRequestsForLanes = [NSMutableArray arrayWithCapacity:TJDropboxRequestLaneCount];
+        for (NSUInteger lane = 0; lane < TJDropboxRequestLaneCount; lane++) {
+            [queuedRequestsForLanes addObject:[NSMutableArray new]];
         }
+        self.queuedRequestsForLanes = queuedRequestsForLanes;
+        self.startingRequests = [NSHashTable hashTableWithOptions:NSPointerFunctionsObjectPointerPersonality];
+        self.requestsForTasks = [NSMapTable strongToStrongObjectsMapTable];
+        self.requestsAwaitingRetry = [NSHashTable hashTableWithOptions:NSPointerFunctionsObjectPointerPersonality];
+        self.inFlightCountsForHosts = [NSMutableDictionary new];
+        self.maximumConcurrentRequestsForHosts = [NSMutableDictionary new];
     }
-    if (!cursor) {
-        [parameters setObject:@(2000) forKey:@"limit"];
-    }
-    return _apiRequest(urlPath, accessToken, parameters);
+    return self;
 }
 
-+ (void)listFolderWithPath:(NSString *const)path credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray<NSDictionary *> *_Nullable entries, NSString *_Nullable cursor, NSError *_Nullable error))completion
-{
-    [self listFolderWithPath:path credential:credential cursor:nil includeDeleted:NO accumulatedFiles:nil completion:completion];
+- (void)performSynchronized:(NS_NOESCAPE dispatch_block_t)block {
+    os_unfair_lock_lock(&_lock);
+    block();
+    os_unfair_lock_unlock(&_lock);
 }
 
-+ (void)listFolderWithPath:(NSString *const)path cursor:(nullable NSString *const)cursor includeDeleted:(const BOOL)includeDeleted credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray<NSDictionary *> *_Nullable entries, NSString *_Nullable cursor, NSError *_Nullable error))completion
+- (void)enqueueTaskBlock:(NSURLSessionTask *(^const)(void))taskBlock
+                    lane:(const TJDropboxRequestLane)lane
+             sessionPool:(const TJDropboxSessionPool)sessionPool
+                 baseURL:(NSURL *const)baseURL
+              credential:(TJDropboxCredential *const)credential
+            failureBlock:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *error))failureBlock
 {
-    [self listFolderWithPath:path credential:credential cursor:cursor includeDeleted:includeDeleted accumulatedFiles:nil completion:completion];
+    TJDropboxScheduledRequest *const request = [TJDropboxScheduledRequest new];
+    request.taskBlock = taskBlock;
+    request.failureBlock = failureBlock;
+    request.credential = credential;
+    request.lane = lane;
+    request.host = baseURL.host ?: @"";
+    request.sessionPool = sessionPool;
+    [self enqueueRequest:request atFront:NO];
 }
 
-+ (void)listFolderWithPath:(NSString *const)path credential:(TJDropboxCredential *const)credential cursor:(NSString *const)inCursor includeDeleted:(const BOOL)includeDeleted accumulatedFiles:(NSArray *const)accumulatedFiles completion:(void (^const)(NSArray<NSDictionary *> *_Nullable entries, NSString *_Nullable cursor, NSError *_Nullable error))completion
+- (void)enqueueRequest:(TJDropboxScheduledRequest *const)request atFront:(const BOOL)atFront
 {
-    _performAPIRequest(credential,
-                       ^NSURLRequest *{
-        return _listFolderRequest(path, credential.accessToken, inCursor, includeDeleted);
-    },
-                       ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
-        NSArray *const files = [parsedResponse objectForKey:@"entries"];
-        id hasMoreObject = [parsedResponse objectForKey:@"has_more"];
-        if (!error && files != nil && [hasMoreObject isKindOfClass:[NSNumber class]]) {
-            NSArray *newlyAccumulatedFiles;
-            
-            if ([files isKindOfClass:[NSArray class]]) {
-                newlyAccumulatedFiles = accumulatedFiles.count > 0 ? [accumulatedFiles arrayByAddingObjectsFromArray:files] : files;
-            } else {
-                newlyAccumulatedFiles = nil;
-                completion(nil, nil, error != nil ? error : [NSError errorWithDomain:TJDropboxErrorDomain code:3 userInfo:nil]);
-                return;
-            }
-            
-            const BOOL hasMore = [(NSNumber *)hasMoreObject boolValue];
-            const id outCursorObject = [parsedResponse objectForKey:@"cursor"];
-            NSString *const outCursor = [outCursorObject isKindOfClass:[NSString class]] ? outCursorObject : nil;
-            if (hasMore) {
-                if (outCursor) {
-                    // Fetch next page
-                    [self listFolderWithPath:path credential:credential cursor:outCursor includeDeleted:includeDeleted accumulatedFiles:newlyAccumulatedFiles completion:completion];
-                } else {
-                    // We can't load more without a cursor
-                    completion(nil, nil, error != nil ? error : [NSError errorWithDomain:TJDropboxErrorDomain code:1 userInfo:nil]);
-                }
-            } else {
-                // All files fetched, finish.
-                completion(newlyAccumulatedFiles, outCursor, error);
-            }
+    [self performSynchronized:^{
+        NSMutableArray<TJDropboxScheduledRequest *> *const queuedRequests = self.queuedRequestsForLanes[request.lane];
+        if (atFront) {
+            [queuedRequests insertObject:request atIndex:0];
         } else {
-            completion(nil, nil, error != nil ? error : [NSError errorWithDomain:TJDropboxErrorDomain code:2 userInfo:nil]);
+            [queuedRequests addObject:request];
         }
-    });
+    }];
+    [self pump];
 }
 
-+ (void)getFileInfoAtPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable entry, NSError *_Nullable error))completion
+/// Must be called while synchronized.
+- (BOOL)takeTokenIfAvailable
 {
-    _performAPIRequest(credential, ^NSURLRequest *{
-        return _apiRequest(@"/2/files/get_metadata", credential.accessToken,
-                           @{
-                               @"path" : _asciiEncodeString(remotePath)
-                           });
-    },
-                       completion);
+    if (self.maximumRequestsPerSecond <= 0.0) {
+        return YES;
+    }
+    const uint64_t timestamp = _metricsTimestamp();
+    const double burst = MAX(self.maximumRequestsPerSecond, 1.0);
+    if (self.lastTokenRefillTimestamp == 0) {
+        self.availableTokens = burst;
+    } else {
+        self.availableTokens = MIN(burst, self.availableTokens + _metricsDuration(self.lastTokenRefillTimestamp, timestamp) * self.maximumRequestsPerSecond);
+    }
+    self.lastTokenRefillTimestamp = timestamp;
+    if (self.availableTokens >= 1.0) {
+        self.availableTokens -= 1.0;
+        return YES;
+    }
+    return NO;
 }
 
-#pragma mark - File Manipulation
-
-+ (NSURLRequest *)requestToDownloadFileAtPath:(NSString *const)path credential:(TJDropboxCredential *const)credential
+/// Must be called while synchronized.
+- (void)releaseSlotForRequest:(TJDropboxScheduledRequest *const)request
 {
-    return _contentRequest(@"/2/files/download",
-                           credential.accessToken,
-                           @{
-                               @"path": _asciiEncodeString(path)
-                           });
+    if (request.inFlight) {
+        request.inFlight = NO;
+        self.inFlightCountsForHosts[request.host] = @(self.inFlightCountsForHosts[request.host].unsignedIntegerValue - 1);
+    }
 }
 
-+ (void)downloadFileAtPath:(NSString *const)remotePath toPath:(NSString *const)localPath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+- (void)pump
 {
-    [self downloadFileAtPath:remotePath toPath:localPath credential:credential progressBlock:nil completion:completion];
+    NSMutableArray<TJDropboxScheduledRequest *> *const requestsToStart = [NSMutableArray new];
+    __block NSTimeInterval tokenDelay = 0.0;
+    [self performSynchronized:^{
+        for (NSMutableArray<TJDropboxScheduledRequest *> *const queuedRequests in self.queuedRequestsForLanes) {
+            NSMutableIndexSet *const startedIndexes = [NSMutableIndexSet new];
+            [queuedRequests enumerateObjectsUsingBlock:^(TJDropboxScheduledRequest * _Nonnull request, NSUInteger i, BOOL * _Nonnull stop) {
+                const NSUInteger inFlightCount = self.inFlightCountsForHosts[request.host].unsignedIntegerValue;
+                const NSUInteger maximumConcurrentRequests = self.maximumConcurrentRequestsForHosts[request.host].unsignedIntegerValue ?: self.defaultMaximumConcurrentRequestsPerHost;
+                if (maximumConcurrentRequests > 0 && inFlightCount >= maximumConcurrentRequests) {
+                    // Requests to other hosts may still be able to start.
+                    return;
+                }
+                if (![self takeTokenIfAvailable]) {
+                    tokenDelay = (1.0 - self.availableTokens) / self.maximumRequestsPerSecond;
+                    *stop = YES;
+                    return;
+                }
+                self.inFlightCountsForHosts[request.host] = @(inFlightCount + 1);
+                request.inFlight = YES;
+                [self.startingRequests addObject:request];
+                [startedIndexes addIndex:i];
+                [requestsToStart addObject:request];
+            }];
+            [queuedRequests removeObjectsAtIndexes:startedIndexes];
+            if (tokenDelay > 0.0) {
+                break;
+            }
+        }
+        if (tokenDelay > 0.0 && !self.pumpScheduled) {
+            self.pumpScheduled = YES;
+        } else {
+            tokenDelay = 0.0;
+        }
+    }];
+    
+    // Tasks are built outside the lock, building one may hash or compress a file.
+    BOOL releasedSlots = NO;
+    for (TJDropboxScheduledRequest *const request in requestsToStart) {
+        NSURLSessionTask *const task = request.taskBlock();
+        __block BOOL cancelled = NO;
+        [self performSynchronized:^{
+            [self.startingRequests removeObject:request];
+            if (task) {
+                request.task = task;
+                [self.requestsForTasks setObject:request forKey:task];
+                cancelled = request.cancelled;
+            } else {
+                [self releaseSlotForRequest:request];
+            }
+        }];
+        if (!task) {
+            releasedSlots = YES;
+            continue;
+        }
+        task.priority = request.lane == TJDropboxRequestLaneInteractive ? NSURLSessionTaskPriorityHigh : NSURLSessionTaskPriorityDefault;
+        if (cancelled) {
+            // Cancelling a task that was never resumed still delivers its completion, which frees its slot.
+            [task cancel];
+        } else {
+            [task resume];
+        }
+    }
+    
+    if (tokenDelay > 0.0) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(tokenDelay * NSEC_PER_SEC)), _workerQueue(), ^{
+            [self performSynchronized:^{
+                self.pumpScheduled = NO;
+            }];
+            [self pump];
+        });
+    }
+    if (releasedSlots) {
+        [self pump];
+    }
 }
 
-+ (void)downloadFileAtPath:(NSString *const)remotePath toPath:(NSString *const)localPath credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+/// Called as every task completes to free its slot. Returns @c YES if the task will be retried, in which case its completion shouldn't be delivered.
+/// @c responseBody is only needed for unauthorized responses, to tell an expired access token from one that was revoked.
+- (BOOL)shouldRetryCompletedTask:(NSURLSessionTask *const)task responseBody:(NSData *const)responseBody
 {
-    _addTask(credential,
-             ^NSURLSessionTask *{
-        NSURLRequest *const request = [self requestToDownloadFileAtPath:remotePath credential:credential];
-        
-        NSURLSessionDownloadTask *const task = [_session() downloadTaskWithRequest:request];
-        
-        [_taskDelegate() setProgressBlock:progressBlock
-                          completionBlock:^(NSURL * _Nullable location, NSURLResponse * _Nullable response, NSError * _Nullable error) {
-            NSDictionary *parsedResult = nil;
-            NSData *const resultData = _resultDataForContentRequestResponse(response);
-            _processResult(resultData, response, &error, &parsedResult);
-            
-            // Verify content hash matches
-            NSString *contentHash = parsedResult[@"content_hash"];
-            if (!error && location && contentHash) {
-                if (![contentHash isEqual:_dropboxContentHashForData(TJDropboxFileContentHash(location.path))]) {
-                    error = [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"content_hash_mimatch"}];
-                }
-            }
-            
-            if (!error && location) {
-                NSFileManager *fileManager = [NSFileManager defaultManager];
-                
-                // remove file if it exists
-                if ([fileManager fileExistsAtPath:localPath]) {
-                    [fileManager removeItemAtPath:localPath error:&error];
-                }
-                if (!error) {
-                    // Move file into place
-                    [fileManager moveItemAtURL:location toURL:[NSURL fileURLWithPath:localPath isDirectory:NO] error:&error];
-                }
+    NSHTTPURLResponse *const response = [task.response isKindOfClass:[NSHTTPURLResponse class]] ? (NSHTTPURLResponse *)task.response : nil;
+    const BOOL isRetryableStatusCode = response.statusCode == 429 || response.statusCode == 503;
+    __block TJDropboxScheduledRequest *request;
+    __block BOOL shouldRetry = NO;
+    __block BOOL shouldRetryWithRefreshedAccessToken = NO;
+    [self performSynchronized:^{
+        request = [self.requestsForTasks objectForKey:task];
+        if (!request) {
+            return;
+        }
+        [self.requestsForTasks removeObjectForKey:task];
+        [self releaseSlotForRequest:request];
+        shouldRetry = isRetryableStatusCode && !task.error && request.retryCount < kMaximumRetryCount;
+        if (shouldRetry) {
+            request.retryCount++;
+            [self.requestsAwaitingRetry addObject:request];
+        } else if (response.statusCode == 401 && !task.error && request.credential.refreshToken && !request.retriedWithRefreshedAccessToken && _isExpiredAccessTokenResponseBody(responseBody)) {
+            // Refresh the expired access token and retry once, other unauthorized responses (e.g. a revoked token) are delivered as they are.
+            request.retriedWithRefreshedAccessToken = YES;
+            [self.requestsAwaitingRetry addObject:request];
+            shouldRetryWithRefreshedAccessToken = YES;
+        }
+    }];
+    
+    if (shouldRetryWithRefreshedAccessToken) {
+        TJDropboxCredential *const credential = request.credential;
+        NSString *const authorization = [task.originalRequest valueForHTTPHeaderField:@"Authorization"];
+        __block BOOL accessTokenChanged;
+        [credential performSynchronized:^{
+            accessTokenChanged = ![authorization isEqualToString:[@"Bearer " stringByAppendingString:credential.accessToken]];
+        }];
+        void (^const retryBlock)(NSDictionary *, NSError *) = ^(NSDictionary *parsedResponse, NSError *error) {
+            if (error) {
+                [self performSynchronized:^{
+                    [self.requestsAwaitingRetry removeObject:request];
+                }];
+                request.failureBlock(parsedResponse, error);
+            } else {
+                [self retryRequest:request];
             }
-            
-            completion(parsedResult, error);
+        };
+        if (accessTokenChanged) {
+            // Another request already refreshed the token since this one was built.
+            retryBlock(nil, nil);
+        } else {
+            [credential refreshAccessTokenWithCompletion:retryBlock];
         }
-                          forDownloadTask:task];
-        return task;
-    },
-             completion);
+        [self pump];
+        return YES;
+    }
+    
+    if (shouldRetry) {
+        NSString *retryAfterString;
+        if (@available(iOS 13.0, macOS 10.15, *)) {
+            retryAfterString = [response valueForHTTPHeaderField:@"Retry-After"];
+        } else {
+            retryAfterString = response.allHeaderFields[@"Retry-After"];
+        }
+        // Full backoff plus up to 25% jitter so that requests limited at the same time don't all return at once.
+        const NSTimeInterval backoff = MIN(kInitialRetryDelay * pow(2.0, request.retryCount - 1), kMaximumRetryDelay);
+        const NSTimeInterval delay = MIN(MAX(retryAfterString.doubleValue, backoff), kMaximumRetryDelay) * (1.0 + 0.25 * arc4random_uniform(1001) / 1000.0);
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), _workerQueue(), ^{
+            [self retryRequest:request];
+        });
+    }
+    
+    if (request) {
+        if (!shouldRetry) {
+            _invalidateCachedResponsesAfterRequest(task.originalRequest, request.credential);
+        }
+        [self pump];
+    }
+    return shouldRetry;
 }
 
-+ (void)uploadFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+- (void)retryRequest:(TJDropboxScheduledRequest *const)request
 {
-    [self uploadFileAtPath:localPath toPath:remotePath contentHash:nil overwriteExisting:NO muteDesktopNotifications:NO credential:credential progressBlock:nil completion:completion];
+    __block BOOL cancelled;
+    [self performSynchronized:^{
+        [self.requestsAwaitingRetry removeObject:request];
+        cancelled = request.cancelled;
+    }];
+    if (cancelled) {
+        request.failureBlock(nil, _cancelledError());
+    } else {
+        [self enqueueRequest:request atFront:YES];
+    }
 }
 
-+ (void)uploadFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath contentHash:(NSData *const)contentHash overwriteExisting:(const BOOL)overwriteExisting muteDesktopNotifications:(const BOOL)muteDesktopNotifications credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+/// Cancels running tasks for matching requests, completes queued ones as cancelled, and stops those waiting to be retried from starting again.
+- (void)cancelRequestsPassingTest:(BOOL (^const)(TJDropboxScheduledRequest *request))predicate
 {
-    _addTask(credential,
-             ^NSURLSessionTask *{
-        NSMutableDictionary<NSString *, id> *const parameters = [NSMutableDictionary new];
-        parameters[@"path"] = _asciiEncodeString(remotePath);
-        if (overwriteExisting) {
-            parameters[@"mode"] = @{@".tag": @"overwrite"};
+    NSMutableArray<TJDropboxScheduledRequest *> *const cancelledQueuedRequests = [NSMutableArray new];
+    NSMutableArray<NSURLSessionTask *> *const tasksToCancel = [NSMutableArray new];
+    [self performSynchronized:^{
+        for (NSMutableArray<TJDropboxScheduledRequest *> *const queuedRequests in self.queuedRequestsForLanes) {
+            NSIndexSet *const indexes = [queuedRequests indexesOfObjectsPassingTest:^BOOL(TJDropboxScheduledRequest * _Nonnull request, NSUInteger i, BOOL * _Nonnull stop) {
+                return predicate(request);
+            }];
+            [cancelledQueuedRequests addObjectsFromArray:[queuedRequests objectsAtIndexes:indexes]];
+            [queuedRequests removeObjectsAtIndexes:indexes];
         }
-        if (muteDesktopNotifications) {
+        for (TJDropboxScheduledRequest *const request in self.startingRequests) {
+            if (predicate(request)) {
+                request.cancelled = YES;
+            }
+        }
+        for (TJDropboxScheduledRequest *const request in self.requestsAwaitingRetry) {
+            if (predicate(request)) {
+                request.cancelled = YES;
+            }
+        }
+        for (NSURLSessionTask *const task in self.requestsForTasks) {
+            if (predicate([self.requestsForTasks objectForKey:task])) {
+                [tasksToCancel addObject:task];
+            }
+        }
+    }];
+    for (TJDropboxScheduledRequest *const request in cancelledQueuedRequests) {
+        request.failureBlock(nil, _cancelledError());
+    }
+    [tasksToCancel makeObjectsPerformSelector:@selector(cancel)];
+}
+
+@end
+
+static TJDropboxScheduler *_scheduler(void)
+{
+    static TJDropboxScheduler *scheduler;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        scheduler = [TJDropboxScheduler new];
+    });
+    return scheduler;
+}
+
+// The blocks and accumulated data for a single task.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxTaskState : NSObject
+
+@property (nonatomic, copy) void (^progressBlock)(CGFloat progress);
+@property (nonatomic, copy) BOOL (^dataBlock)(NSData *data, NSURLResponse *response);
+@property (nonatomic, copy) id completionBlock;
+@property (nonatomic, copy) NSInputStream *(^bodyStreamBlock)(void);
+@property (nonatomic) NSInputStream *bodyStream; // The last stream produced by bodyStreamBlock, closed once it's replaced or the task completes so its producer stops
+
+@property (nonatomic) NSMutableData *accumulatedData; // Only accessed on queue
+@property (nonatomic) NSURL *downloadLocation; // Where a finished download task's file was moved to
+@property (nonatomic) NSTimeInterval refreshWaitDuration; // Time spent waiting on a token refresh before the task was created, only tracked when metrics are enabled
+@property (nonatomic) NSTimeInterval requestBuildDuration;
+
+// Serial and targets the worker queue. Data blocks run here so they're delivered in order, progress and completion blocks are funneled through it so they land after any data that preceded them.
+@property (nonatomic) dispatch_queue_t queue;
+@property (nonatomic) dispatch_queue_t callbackQueue; // Chosen using +performWithCallbackQueue:block:, progress and completion blocks are delivered here if set.
+
+@end
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropboxTaskState
+
+- (instancetype)init
+{
+    if (self = [super init]) {
+        self.queue = dispatch_queue_create_with_target("com.tijo.TJDropbox.task", DISPATCH_QUEUE_SERIAL, _workerQueue());
+        self.callbackQueue = _currentCallbackQueue();
+    }
+    return self;
+}
+
+- (void)performBlock:(dispatch_block_t const)block
+{
+    dispatch_queue_t const callbackQueue = self.callbackQueue;
+    dispatch_async(self.queue, ^{
+        if (callbackQueue) {
+            dispatch_async(callbackQueue, ^{
+                _performWithCallbackQueue(callbackQueue, block);
+            });
+        } else {
+            block();
+        }
+    });
+}
+
+@end
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxURLSessionTaskDelegate : NSObject <NSURLSessionDataDelegate, NSURLSessionDownloadDelegate> {
+    os_unfair_lock _lock;
+}
+
+/**
+ * Outside classes (such as TJDropbox) should not access these properties directly!
+ * They should be accessed via -setProgressBlock:completionBlock:for*Task: ONLY to ensure safety is maintained.
+ */
+
+@property (nonatomic) NSMutableDictionary<NSURLSessionTask *, TJDropboxTaskState *> *statesForTasks; // Only accessed within -stateForTask:
+
+// Used as the NSURLSession delegateQueue so that callbacks for each task arrive in order.
+// Only bookkeeping happens here, all other work is handed off to each task's own queue so one slow task can't hold up the others.
+@property (nonatomic) NSOperationQueue *serialOperationQueue;
+
+@end
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropboxURLSessionTaskDelegate
+
+- (instancetype)init
+{
+    if (self = [super init]) {
+        _lock = OS_UNFAIR_LOCK_INIT;
+        self.statesForTasks = [NSMutableDictionary new];
+        
+        NSOperationQueue *serialOperationQueue = [NSOperationQueue new];
+        // make serial
+        serialOperationQueue.maxConcurrentOperationCount = 1;
+        serialOperationQueue.qualityOfService = NSQualityOfServiceUserInitiated;
+        self.serialOperationQueue = serialOperationQueue;
+    }
+    return self;
+}
+
+- (TJDropboxTaskState *)stateForTask:(NSURLSessionTask *const)task create:(const BOOL)create remove:(const BOOL)remove
+{
+    TJDropboxTaskState *state;
+    os_unfair_lock_lock(&_lock);
+    state = self.statesForTasks[task];
+    if (!state && create) {
+        state = [TJDropboxTaskState new];
+        self.statesForTasks[task] = state;
+    }
+    if (remove) {
+        [self.statesForTasks removeObjectForKey:task];
+    }
+    os_unfair_lock_unlock(&_lock);
+    return state;
+}
+
+- (void)setProgressBlock:(nullable void (^const)(CGFloat progress))progressBlock
+         completionBlock:(nullable void (^const)(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error))completionBlock
+             forDataTask:(NSURLSessionDataTask *const)task
+{
+    [self setProgressBlock:progressBlock
+                 dataBlock:nil
+           completionBlock:completionBlock
+               forDataTask:task];
+}
+
+/// @c dataBlock is handed response data as it arrives, it should return @c NO for data that should be accumulated and passed to @c completionBlock instead (e.g. error responses).
+- (void)setProgressBlock:(nullable void (^const)(CGFloat progress))progressBlock
+               dataBlock:(nullable BOOL (^const)(NSData *data, NSURLResponse *response))dataBlock
+         completionBlock:(nullable void (^const)(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error))completionBlock
+             forDataTask:(NSURLSessionDataTask *const)task
+{
+    [self _setProgressBlock:progressBlock
+            completionBlock:completionBlock
+                    forTask:task
+              expectedClass:[NSURLSessionDataTask class]];
+    if (dataBlock) {
+        [self stateForTask:task create:YES remove:NO].dataBlock = dataBlock;
+    }
+    if (@available(iOS 14.5, macOS 11.3, *)) {
+        if (!progressBlock && !dataBlock) {
+            task.prefersIncrementalDelivery = NO;
+        }
+    }
+}
+
+- (void)setProgressBlock:(nullable void (^const)(CGFloat progress))progressBlock
+         completionBlock:(nullable void (^const)(NSURL * _Nullable location, NSURLResponse * _Nullable response, NSError * _Nullable error))completionBlock
+         forDownloadTask:(NSURLSessionDownloadTask *const)task
+{
+        [self _setProgressBlock:progressBlock
+                completionBlock:completionBlock
+                        forTask:task
+                  expectedClass:[NSURLSessionDownloadTask class]];
+}
+
+- (void)setBodyStreamBlock:(NSInputStream *(^const)(void))bodyStreamBlock forUploadTask:(NSURLSessionUploadTask *const)task
+{
+    [self stateForTask:task create:YES remove:NO].bodyStreamBlock = bodyStreamBlock;
+}
+
+- (void)_setProgressBlock:(nullable void (^const)(CGFloat progress))progressBlock
+          completionBlock:(nullable const id)completionBlock
+                  forTask:(NSURLSessionTask *const)task
+            expectedClass:(Class)expectedClass
+{
+    if ([task isKindOfClass:expectedClass]) {
+        // Tasks aren't resumed until after their blocks are set, so there's no need to synchronize access to the state's blocks beyond the registry itself.
+        TJDropboxTaskState *const state = [self stateForTask:task create:YES remove:NO];
+        state.progressBlock = progressBlock;
+        state.completionBlock = completionBlock;
+    } else {
+        NSAssert(NO, @"Adding wrong completion setup for task with type %@, was expecting %@.", NSStringFromClass([task class]), NSStringFromClass(expectedClass));
+    }
+}
+
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task needNewBodyStream:(void (^)(NSInputStream * _Nullable))completionHandler
+{
+    // Invoked for tasks created with -uploadTaskWithStreamedRequest:, and again if the body needs to be resent.
+    TJDropboxTaskState *const state = [self stateForTask:task create:NO remove:NO];
+    NSInputStream *const bodyStream = state.bodyStreamBlock ? state.bodyStreamBlock() : nil;
+    [state.bodyStream close];
+    state.bodyStream = bodyStream;
+    completionHandler(bodyStream);
+}
+
+- (void)reportProgress:(const int64_t)completedCount ofTotal:(const int64_t)totalCount forTask:(NSURLSessionTask *const)task
+{
+    TJDropboxTaskState *const state = [self stateForTask:task create:NO remove:NO];
+    void (^progressBlock)(CGFloat progress) = state.progressBlock;
+    
+    if (progressBlock && totalCount > 0) {
+        [state performBlock:^{
+            progressBlock((CGFloat)completedCount / totalCount);
+        }];
+    }
+}
+
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didSendBodyData:(int64_t)bytesSent totalBytesSent:(int64_t)totalBytesSent totalBytesExpectedToSend:(int64_t)totalBytesExpectedToSend
+{
+    [self reportProgress:totalBytesSent ofTotal:totalBytesExpectedToSend forTask:task];
+}
+
+- (void)URLSession:(NSURLSession *)session downloadTask:(NSURLSessionDownloadTask *)task didWriteData:(int64_t)bytesWritten totalBytesWritten:(int64_t)totalBytesWritten totalBytesExpectedToWrite:(int64_t)totalBytesExpectedToWrite
+{
+    [self reportProgress:totalBytesWritten ofTotal:totalBytesExpectedToWrite forTask:task];
+}
+
+- (void)URLSession:(NSURLSession *)session dataTask:(NSURLSessionDataTask *)task didReceiveData:(NSData *)data
+{
+    if (![task isKindOfClass:[NSURLSessionUploadTask class]]) {
+        [self reportProgress:task.countOfBytesReceived ofTotal:task.countOfBytesExpectedToReceive forTask:task];
+    }
+    
+    TJDropboxTaskState *const state = [self stateForTask:task create:NO remove:NO];
+    if (!state) {
+        return;
+    }
+    BOOL (^dataBlock)(NSData *, NSURLResponse *) = state.dataBlock;
+    NSURLResponse *const response = task.response;
+    dispatch_async(state.queue, ^{
+        if (dataBlock && dataBlock(data, response)) {
+            return;
+        }
+        
+        if (state.accumulatedData) {
+            [state.accumulatedData appendData:data];
+        } else {
+            state.accumulatedData = [data mutableCopy];
+        }
+    });
+}
+
+- (void)setRefreshWaitDuration:(const NSTimeInterval)refreshWaitDuration requestBuildDuration:(const NSTimeInterval)requestBuildDuration forTask:(NSURLSessionTask *const)task
+{
+    TJDropboxTaskState *const state = [self stateForTask:task create:YES remove:NO];
+    state.refreshWaitDuration = refreshWaitDuration;
+    state.requestBuildDuration = requestBuildDuration;
+}
+
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didFinishCollectingMetrics:(NSURLSessionTaskMetrics *)metrics
+{
+    if (!_tj_metricsEnabled) {
+        return;
+    }
+    
+    TJDropboxTaskState *const state = [self stateForTask:task create:NO remove:NO];
+    NSURLSessionTaskTransactionMetrics *const transactionMetrics = metrics.transactionMetrics.lastObject;
+    NSMutableDictionary<NSString *, id> *const event = [NSMutableDictionary new];
+    event[TJDropboxMetricsKeyEndpoint] = task.originalRequest.URL.path;
+    event[TJDropboxMetricsKeyDuration] = @(metrics.taskInterval.duration);
+    event[TJDropboxMetricsKeyRefreshWaitDuration] = @(state.refreshWaitDuration);
+    event[TJDropboxMetricsKeyRequestBuildDuration] = @(state.requestBuildDuration);
+    if (transactionMetrics.domainLookupStartDate && transactionMetrics.domainLookupEndDate) {
+        event[TJDropboxMetricsKeyDomainLookupDuration] = @([transactionMetrics.domainLookupEndDate timeIntervalSinceDate:transactionMetrics.domainLookupStartDate]);
+    }
+    if (transactionMetrics.connectStartDate && transactionMetrics.connectEndDate) {
+        event[TJDropboxMetricsKeyConnectDuration] = @([transactionMetrics.connectEndDate timeIntervalSinceDate:transactionMetrics.connectStartDate]);
+    }
+    if (transactionMetrics.secureConnectionStartDate && transactionMetrics.secureConnectionEndDate) {
+        event[TJDropboxMetricsKeySecureConnectionDuration] = @([transactionMetrics.secureConnectionEndDate timeIntervalSinceDate:transactionMetrics.secureConnectionStartDate]);
+    }
+    if (transactionMetrics.requestStartDate && transactionMetrics.responseStartDate) {
+        event[TJDropboxMetricsKeyTimeToFirstByte] = @([transactionMetrics.responseStartDate timeIntervalSinceDate:transactionMetrics.requestStartDate]);
+    }
+    if (transactionMetrics.responseStartDate && transactionMetrics.responseEndDate) {
+        event[TJDropboxMetricsKeyTransferDuration] = @([transactionMetrics.responseEndDate timeIntervalSinceDate:transactionMetrics.responseStartDate]);
+    }
+    event[TJDropboxMetricsKeyInputByteCount] = @(task.countOfBytesSent);
+    event[TJDropboxMetricsKeyOutputByteCount] = @(task.countOfBytesReceived);
+    const NSInteger statusCode = [task.response isKindOfClass:[NSHTTPURLResponse class]] ? [(NSHTTPURLResponse *)task.response statusCode] : 0;
+    event[TJDropboxMetricsKeyStatusCode] = @(statusCode);
+    event[TJDropboxMetricsKeyFailed] = @(task.error != nil || statusCode >= 400);
+    
+    // Recorded on the task's queue so the delegate queue only does bookkeeping.
+    dispatch_async(state ? state.queue : _workerQueue(), ^{
+        _recordMetricsEvent(event);
+    });
+}
+
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didCompleteWithError:(NSError *)error
+{
+    TJDropboxTaskState *const state = [self stateForTask:task create:NO remove:YES];
+    [state.bodyStream close];
+    NSData *responseBody = nil;
+    if ([task.response isKindOfClass:[NSHTTPURLResponse class]] && ((NSHTTPURLResponse *)task.response).statusCode == 401) {
+        // Error bodies are small, waiting for any data still being accumulated on the task's queue is cheap.
+        if (state.downloadLocation) {
+            responseBody = [NSData dataWithContentsOfURL:state.downloadLocation];
+        } else if (state) {
+            __block NSData *accumulatedData;
+            dispatch_sync(state.queue, ^{
+                accumulatedData = [state.accumulatedData copy];
+            });
+            responseBody = accumulatedData;
+        }
+    }
+    if ([_scheduler() shouldRetryCompletedTask:task responseBody:responseBody]) {
+        // A fresh task is created for the retry, this one's completion is never delivered.
+        if (state.downloadLocation) {
+            unlink(state.downloadLocation.fileSystemRepresentation);
+        }
+        return;
+    }
+    id completionBlock = state.completionBlock;
+    if (!completionBlock) {
+        return;
+    }
+    
+    NSURLResponse *const response = task.response;
+    NSError *const taskError = task.error;
+    if ([task isKindOfClass:[NSURLSessionDownloadTask class]]) {
+        NSURL *const location = state.downloadLocation;
+        [state performBlock:^{
+            ((void (^)(NSURL *, NSURLResponse *, NSError *))completionBlock)(location, response, taskError);
+            if (location) {
+                // Clean up if the completion block didn't move the file elsewhere.
+                unlink(location.fileSystemRepresentation);
+            }
+        }];
+    } else if ([task isKindOfClass:[NSURLSessionDataTask class]]) {
+        [state performBlock:^{
+            ((void (^)(NSData *, NSURLResponse *, NSError *))completionBlock)(state.accumulatedData, response, taskError);
+        }];
+    } else {
+        NSAssert(NO, @"This shouldn't be reached");
+    }
+}
+
+- (void)URLSession:(NSURLSession *)session downloadTask:(NSURLSessionDownloadTask *)task didFinishDownloadingToURL:(NSURL *)location
+{
+    // The file at location is deleted as soon as this returns, so it's moved aside here and handed to the completion block once the task completes.
+    TJDropboxTaskState *const state = [self stateForTask:task create:NO remove:NO];
+    if (state.completionBlock) {
+        NSURL *const downloadLocation = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:[NSString stringWithFormat:@".%@.tjdropbox-download", [NSUUID UUID].UUIDString]] isDirectory:NO];
+        if ([[NSFileManager defaultManager] moveItemAtURL:location toURL:downloadLocation error:nil]) {
+            state.downloadLocation = downloadLocation;
+        }
+    }
+}
+
+@end
+
+// A chunk of a large upload that has been read from disk and (possibly) compressed, ready to be sent.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxUploadChunk : NSObject
+
+@property (nonatomic) unsigned long long offset;
+@property (nonatomic) NSUInteger length; // Uncompressed length
+@property (nonatomic) NSData *data;
+@property (nonatomic) BOOL compressed;
+@property (nonatomic) BOOL isLastChunk;
+@property (nonatomic) NSUInteger generation; // The upload's generation when this chunk was read, chunks from earlier generations are discarded.
+
+@end
+
+@implementation TJDropboxUploadChunk
+
+@end
+
+static const NSUInteger kUploadSessionChunkAlignment = 4 * 1024 * 1024; // Concurrent upload sessions require chunks to be multiples of 4MB https://www.dropbox.com/developers/documentation/http/documentation#files-upload_session-start
+static const NSUInteger kUploadSessionMaximumChunkSize = 148 * 1024 * 1024; // Requests are limited to 150MB, this is the largest multiple of 4MB below that.
+
+// Tunes a large upload from what it measures as chunks are compressed and sent, must be accessed within the upload's -performSynchronized:.
+// Chunks are compressed ahead of being sent, so compression only costs time when deflate can't keep up with the link:
+// the level steps down from the default to 1 and then off while that's the case, and back up once deflate has plenty of headroom.
+// For sequential sessions the chunk size also tracks the throughput, sized so a chunk takes around kTargetChunkDuration to send.
+// That means fewer round trips on fast links and less to resend on slow, lossy ones.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxUploadTuner : NSObject
+
+@property (nonatomic) NSUInteger chunkSize;
+@property (nonatomic) BOOL adjustsChunkSize;
+@property (nonatomic) int compressionLevel; // Z_NO_COMPRESSION once compression has been turned off
+@property (nonatomic) double throughput; // Bytes per second on the wire, smoothed
+@property (nonatomic) double compressionRate; // Uncompressed bytes per second through deflate, smoothed
+@property (nonatomic) double compressionRatio; // Compressed over uncompressed size, smoothed
+
+@end
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropboxUploadTuner
+
+static const NSTimeInterval kTargetChunkDuration = 8.0;
+static const double kSmoothingFactor = 0.5; // Weight of the newest sample, links change quickly on mobile
+static const double kIncompressibleRatio = 0.97;
+
+static double _smoothedValue(const double value, const double sample)
+{
+    return value > 0.0 ? value + kSmoothingFactor * (sample - value) : sample;
+}
+
+- (instancetype)init
+{
+    if (self = [super init]) {
+        self.compressionLevel = Z_DEFAULT_COMPRESSION;
+    }
+    return self;
+}
+
+/// @c compressedLength is 0 if compression was abandoned because the data wasn't getting smaller. Returns whether anything changed.
+- (BOOL)recordCompressionOfLength:(const NSUInteger)length compressedLength:(const NSUInteger)compressedLength duration:(const NSTimeInterval)duration
+{
+    if (length == 0 || duration <= 0.0) {
+        return NO;
+    }
+    self.compressionRatio = _smoothedValue(self.compressionRatio, compressedLength > 0 ? (double)compressedLength / length : 1.0);
+    self.compressionRate = _smoothedValue(self.compressionRate, length / duration);
+    return [self adjustCompressionLevel];
+}
+
+/// Returns whether anything changed.
+- (BOOL)recordTransferOfLength:(const NSUInteger)length duration:(const NSTimeInterval)duration
+{
+    if (length == 0 || duration <= 0.0) {
+        return NO;
+    }
+    self.throughput = _smoothedValue(self.throughput, length / duration);
+    BOOL changed = [self adjustCompressionLevel];
+    
+    if (self.adjustsChunkSize) {
+        // Size against the rate the file is consumed at, which is higher than the wire rate when chunks compress well.
+        const double fileThroughput = self.throughput / (self.compressionLevel != Z_NO_COMPRESSION && self.compressionRatio > 0.0 ? self.compressionRatio : 1.0);
+        // Grow at most 2x at a time so one fast sample doesn't commit a slow link to a huge chunk, but shrink straight away.
+        const double targetChunkSize = MIN(fileThroughput * kTargetChunkDuration, self.chunkSize * 2.0);
+        NSUInteger chunkSize = (NSUInteger)(targetChunkSize / kUploadSessionChunkAlignment) * kUploadSessionChunkAlignment;
+        chunkSize = MIN(MAX(chunkSize, kUploadSessionChunkAlignment), kUploadSessionMaximumChunkSize);
+        if (chunkSize != self.chunkSize) {
+            self.chunkSize = chunkSize;
+            changed = YES;
+        }
+    }
+    return changed;
+}
+
+- (BOOL)adjustCompressionLevel
+{
+    if (self.compressionLevel == Z_NO_COMPRESSION || self.throughput <= 0.0 || self.compressionRate <= 0.0) {
+        return NO;
+    }
+    int compressionLevel = self.compressionLevel;
+    if (self.compressionRatio >= kIncompressibleRatio) {
+        compressionLevel = Z_NO_COMPRESSION;
+    } else if (self.compressionRate < self.throughput / self.compressionRatio) {
+        // Deflate is the bottleneck.
+        compressionLevel = compressionLevel == Z_BEST_SPEED ? Z_NO_COMPRESSION : Z_BEST_SPEED;
+    } else if (compressionLevel == Z_BEST_SPEED && self.compressionRate > 4.0 * self.throughput / self.compressionRatio) {
+        // Plenty of headroom, spend it on a better ratio.
+        compressionLevel = Z_DEFAULT_COMPRESSION;
+    }
+    if (compressionLevel != self.compressionLevel) {
+        self.compressionLevel = compressionLevel;
+        return YES;
+    }
+    return NO;
+}
+
+/// Built while synchronized and recorded after, so the metrics sink isn't called with the upload locked.
+- (NSDictionary<NSString *, id> *)metricsEvent
+{
+    return @{
+        TJDropboxMetricsKeyEndpoint: TJDropboxMetricsEndpointUploadTuning,
+        TJDropboxMetricsKeyChunkSize: @(self.chunkSize),
+        // Z_DEFAULT_COMPRESSION is -1, report the level it stands for.
+        TJDropboxMetricsKeyCompressionLevel: @(self.compressionLevel == Z_DEFAULT_COMPRESSION ? 6 : self.compressionLevel),
+        TJDropboxMetricsKeyThroughput: @(self.throughput),
+    };
+}
+
+@end
+
+static BOOL _readFileBlock(const int fileDescriptor, void *const buffer, const size_t length, const off_t offset);
+
+// Holds the state of an in-progress upload_session based upload.
+// All mutable bookkeeping must be accessed within -performSynchronized: since chunk completions may arrive concurrently.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxLargeUpload : NSObject {
+    os_unfair_lock _lock;
+}
+
+@property (nonatomic) int fileDescriptor; // -1 until the file is opened, closed once the upload has completed and no chunk is being read from it
+@property (nonatomic) unsigned long long fileSize;
+@property (nonatomic) NSDate *fileModificationDate;
+@property (nonatomic, copy) NSString *localPath;
+@property (nonatomic, copy) NSString *remotePath;
+@property (nonatomic) BOOL overwriteExisting;
+@property (nonatomic) BOOL muteDesktopNotifications;
+@property (nonatomic) TJDropboxCredential *credential;
+@property (nonatomic) NSUInteger chunkSize;
+@property (nonatomic) NSUInteger maximumConcurrentChunks;
+@property (nonatomic, readonly) BOOL isConcurrent;
+@property (nonatomic, copy) void (^progressBlock)(CGFloat progress);
+@property (nonatomic, copy) void (^completion)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error);
+
+@property (nonatomic, copy) NSString *sessionIdentifier;
+@property (nonatomic) NSDate *sessionStartDate;
+@property (nonatomic) unsigned long long nextReadOffset; // Offset of the next chunk to be read and compressed
+@property (nonatomic) unsigned long long nextSendOffset; // Offset of the next chunk to be sent
+@property (nonatomic) BOOL allChunksRead;
+@property (nonatomic) NSUInteger preparingChunkCount;
+@property (nonatomic) unsigned long long bufferedByteCount; // Uncompressed length of the chunks being prepared, prepared and in flight
+@property (nonatomic) NSMutableDictionary<NSNumber *, TJDropboxUploadChunk *> *preparedChunksForOffsets;
+@property (nonatomic) unsigned long long committedByteCount; // Bytes acknowledged by the server
+@property (nonatomic) NSMutableSet<NSNumber *> *committedChunkOffsets; // Offsets of chunks acknowledged by the server, only used for concurrent sessions
+@property (nonatomic) NSUInteger generation; // Bumped when the upload rewinds to an offset reported by the server
+@property (nonatomic, readonly) BOOL isFullyCommitted;
+@property (nonatomic) NSUInteger inFlightChunkCount;
+@property (nonatomic) NSMutableDictionary<NSNumber *, NSNumber *> *sentByteCountsForInFlightOffsets;
+@property (nonatomic) BOOL completed;
+@property (nonatomic) TJDropboxUploadTuner *tuner;
+
+@property (nonatomic) dispatch_queue_t journalQueue;
+@property (nonatomic, readonly) NSString *journalPath;
+
+@end
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropboxLargeUpload
+
+static NSString *const kLargeUploadJournalSessionIdentifierKey = @"sessionIdentifier";
+static NSString *const kLargeUploadJournalSessionStartDateKey = @"sessionStartDate";
+static NSString *const kLargeUploadJournalLocalPathKey = @"localPath";
+static NSString *const kLargeUploadJournalRemotePathKey = @"remotePath";
+static NSString *const kLargeUploadJournalFileSizeKey = @"fileSize";
+static NSString *const kLargeUploadJournalFileModificationDateKey = @"fileModificationDate";
+static NSString *const kLargeUploadJournalOverwriteExistingKey = @"overwriteExisting";
+static NSString *const kLargeUploadJournalMuteDesktopNotificationsKey = @"muteDesktopNotifications";
+static NSString *const kLargeUploadJournalChunkSizeKey = @"chunkSize";
+static NSString *const kLargeUploadJournalMaximumConcurrentChunksKey = @"maximumConcurrentChunks";
+static NSString *const kLargeUploadJournalAdjustsChunkSizeKey = @"adjustsChunkSize";
+static NSString *const kLargeUploadJournalCommittedByteCountKey = @"committedByteCount";
+static NSString *const kLargeUploadJournalCommittedChunkOffsetsKey = @"committedChunkOffsets";
+
+static const NSTimeInterval kLargeUploadSessionLifetime = 6.0 * 24.0 * 60.0 * 60.0; // Sessions are valid for 7 days https://www.dropbox.com/developers/documentation/http/documentation#files-upload_session-start, leave a day of slack.
+
+- (instancetype)init
+{
+    if (self = [super init]) {
+        _lock = OS_UNFAIR_LOCK_INIT;
+        self.fileDescriptor = -1;
+        self.preparedChunksForOffsets = [NSMutableDictionary new];
+        self.sentByteCountsForInFlightOffsets = [NSMutableDictionary new];
+        self.committedChunkOffsets = [NSMutableSet new];
+        self.tuner = [TJDropboxUploadTuner new];
+        self.journalQueue = dispatch_queue_create("com.tijo.TJDropbox.large-upload-journal", DISPATCH_QUEUE_SERIAL);
+    }
+    return self;
+}
+
+/// Journals live in Application Support rather than next to the file since the file's directory may not be writable.
++ (NSString *)journalPathForLocalPath:(NSString *const)localPath remotePath:(NSString *const)remotePath
+{
+    NSData *const key = [[NSString stringWithFormat:@"%@\n%@", localPath, remotePath] dataUsingEncoding:NSUTF8StringEncoding];
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(key.bytes, (CC_LONG)key.length, digest);
+    NSMutableString *const fileName = [NSMutableString stringWithCapacity:CC_SHA256_DIGEST_LENGTH * 2 + 6];
+    for (NSUInteger i = 0; i < CC_SHA256_DIGEST_LENGTH; i++) {
+        [fileName appendFormat:@"%02x", digest[i]];
+    }
+    [fileName appendString:@".plist"];
+    
+    NSString *const applicationSupportPath = NSSearchPathForDirectoriesInDomains(NSApplicationSupportDirectory, NSUserDomainMask, YES).firstObject ?: NSTemporaryDirectory();
+    return [[applicationSupportPath stringByAppendingPathComponent:@"TJDropbox/UploadSessions"] stringByAppendingPathComponent:fileName];
+}
+
+/// Returns an upload restored from its journal, or @c nil if there isn't one or it can no longer be resumed.
++ (instancetype)largeUploadFromJournalForLocalPath:(NSString *const)localPath remotePath:(NSString *const)remotePath
+{
+    NSString *const journalPath = [self journalPathForLocalPath:localPath remotePath:remotePath];
+    NSDictionary *const journal = [NSDictionary dictionaryWithContentsOfFile:journalPath];
+    NSString *const sessionIdentifier = journal[kLargeUploadJournalSessionIdentifierKey];
+    NSDate *const sessionStartDate = journal[kLargeUploadJournalSessionStartDateKey];
+    if (!sessionIdentifier || !sessionStartDate) {
+        return nil;
+    }
+    
+    // The session must still be alive and the file must be unchanged since it was started.
+    NSDictionary *const attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:localPath error:nil];
+    const unsigned long long fileSize = [journal[kLargeUploadJournalFileSizeKey] unsignedLongLongValue];
+    const BOOL canResume = -sessionStartDate.timeIntervalSinceNow < kLargeUploadSessionLifetime
+    && [journal[kLargeUploadJournalLocalPathKey] isEqual:localPath]
+    && [journal[kLargeUploadJournalRemotePathKey] isEqual:remotePath]
+    && fileSize > 0
+    && attributes.fileSize == fileSize
+    && [attributes.fileModificationDate isEqual:journal[kLargeUploadJournalFileModificationDateKey]];
+    if (!canResume) {
+        unlink(journalPath.fileSystemRepresentation);
+        return nil;
+    }
+    
+    TJDropboxLargeUpload *const upload = [TJDropboxLargeUpload new];
+    upload.localPath = localPath;
+    upload.remotePath = remotePath;
+    upload.fileSize = fileSize;
+    upload.fileModificationDate = attributes.fileModificationDate;
+    upload.overwriteExisting = [journal[kLargeUploadJournalOverwriteExistingKey] boolValue];
+    upload.muteDesktopNotifications = [journal[kLargeUploadJournalMuteDesktopNotificationsKey] boolValue];
+    upload.chunkSize = [journal[kLargeUploadJournalChunkSizeKey] unsignedIntegerValue];
+    upload.maximumConcurrentChunks = MAX([journal[kLargeUploadJournalMaximumConcurrentChunksKey] unsignedIntegerValue], 1);
+    upload.tuner.chunkSize = upload.chunkSize;
+    upload.tuner.adjustsChunkSize = [journal[kLargeUploadJournalAdjustsChunkSizeKey] boolValue] && !upload.isConcurrent;
+    upload.sessionIdentifier = sessionIdentifier;
+    upload.sessionStartDate = sessionStartDate;
+    if (upload.chunkSize == 0) {
+        unlink(journalPath.fileSystemRepresentation);
+        return nil;
+    }
+    
+    if (upload.isConcurrent) {
+        // Chunk boundaries are fixed, so acknowledged chunks are skipped individually.
+        for (NSNumber *const offset in journal[kLargeUploadJournalCommittedChunkOffsetsKey]) {
+            if (offset.unsignedLongLongValue < fileSize && offset.unsignedLongLongValue % upload.chunkSize == 0) {
+                [upload.committedChunkOffsets addObject:offset];
+                upload.committedByteCount += [upload chunkLengthAtOffset:offset.unsignedLongLongValue];
+            }
+        }
+    } else {
+        // Sequential sessions are acknowledged in order, so everything before the committed offset is done.
+        upload.committedByteCount = MIN([journal[kLargeUploadJournalCommittedByteCountKey] unsignedLongLongValue], fileSize);
+        upload.nextReadOffset = upload.committedByteCount;
+        upload.nextSendOffset = upload.committedByteCount;
+    }
+    
+    return upload;
+}
+
+- (BOOL)isConcurrent
+{
+    return self.maximumConcurrentChunks > 1;
+}
+
+- (void)performSynchronized:(NS_NOESCAPE dispatch_block_t)block {
+    os_unfair_lock_lock(&_lock);
+    block();
+    os_unfair_lock_unlock(&_lock);
+}
+
+- (NSString *)journalPath
+{
+    return [TJDropboxLargeUpload journalPathForLocalPath:self.localPath remotePath:self.remotePath];
+}
+
+- (NSUInteger)chunkLengthAtOffset:(const unsigned long long)offset
+{
+    return (NSUInteger)MIN((unsigned long long)self.chunkSize, self.fileSize - offset);
+}
+
+/// Whether every byte of the file has been acknowledged and the session closed, meaning only the finish call remains.
+- (BOOL)isFullyCommitted
+{
+    __block BOOL isFullyCommitted;
+    [self performSynchronized:^{
+        if (self.isConcurrent) {
+            // The closing chunk is only sent once all others have been acknowledged.
+            const unsigned long long lastChunkOffset = self.fileSize > 0 ? ((self.fileSize - 1) / self.chunkSize) * self.chunkSize : 0;
+            isFullyCommitted = [self.committedChunkOffsets containsObject:@(lastChunkOffset)];
+        } else {
+            isFullyCommitted = self.fileSize > 0 && self.committedByteCount >= self.fileSize;
+        }
+    }];
+    return isFullyCommitted;
+}
+
+/// Records the session and acknowledged chunks so the upload can be resumed after a failure or relaunch.
+- (void)writeJournal
+{
+    [self performSynchronized:^{
+        NSMutableDictionary *const journal = [NSMutableDictionary dictionaryWithDictionary:@{
+            kLargeUploadJournalSessionIdentifierKey: self.sessionIdentifier,
+            kLargeUploadJournalSessionStartDateKey: self.sessionStartDate,
+            kLargeUploadJournalLocalPathKey: self.localPath,
+            kLargeUploadJournalRemotePathKey: self.remotePath,
+            kLargeUploadJournalFileSizeKey: @(self.fileSize),
+            kLargeUploadJournalOverwriteExistingKey: @(self.overwriteExisting),
+            kLargeUploadJournalMuteDesktopNotificationsKey: @(self.muteDesktopNotifications),
+            kLargeUploadJournalChunkSizeKey: @(self.chunkSize),
+            kLargeUploadJournalMaximumConcurrentChunksKey: @(self.maximumConcurrentChunks),
+            kLargeUploadJournalAdjustsChunkSizeKey: @(self.tuner.adjustsChunkSize),
+            kLargeUploadJournalCommittedByteCountKey: @(self.committedByteCount),
+            kLargeUploadJournalCommittedChunkOffsetsKey: self.committedChunkOffsets.allObjects,
+        }];
+        if (self.fileModificationDate) {
+            journal[kLargeUploadJournalFileModificationDateKey] = self.fileModificationDate;
+        }
+        NSString *const journalPath = self.journalPath;
+        // Enqueued while locked so that snapshots are written in order.
+        dispatch_async(self.journalQueue, ^{
+            [[NSFileManager defaultManager] createDirectoryAtPath:journalPath.stringByDeletingLastPathComponent withIntermediateDirectories:YES attributes:nil error:nil];
+            NSData *const data = [NSPropertyListSerialization dataWithPropertyList:journal format:NSPropertyListBinaryFormat_v1_0 options:0 error:nil];
+            [data writeToFile:journalPath atomically:YES];
+        });
+    }];
+}
+
+- (void)removeJournal
+{
+    NSString *const journalPath = self.journalPath;
+    dispatch_async(self.journalQueue, ^{
+        unlink(journalPath.fileSystemRepresentation);
+    });
+}
+
+/// Only called for chunks counted in preparingChunkCount, which keeps the file descriptor open. Returns @c nil if the file couldn't be read in full.
+- (NSData *)readChunkAtOffset:(const unsigned long long)offset length:(const NSUInteger)length
+{
+    NSMutableData *const chunk = [NSMutableData dataWithLength:length];
+    if (!chunk || !_readFileBlock(self.fileDescriptor, chunk.mutableBytes, length, (off_t)offset)) {
+        return nil;
+    }
+    return chunk;
+}
+
+/// Must be called while synchronized. Hands over the file descriptor for the caller to close once the upload has completed and nothing is reading from it, otherwise returns -1.
+- (int)takeFileDescriptorIfIdle
+{
+    if (!self.completed || self.preparingChunkCount > 0) {
+        return -1;
+    }
+    const int fileDescriptor = self.fileDescriptor;
+    self.fileDescriptor = -1;
+    return fileDescriptor;
+}
+
+/// Invokes the completion block at most once, returns whether or not it was invoked.
+- (BOOL)completeWithParsedResponse:(NSDictionary *)parsedResponse error:(NSError *)error
+{
+    __block BOOL shouldComplete;
+    __block int fileDescriptor;
+    [self performSynchronized:^{
+        shouldComplete = !self.completed;
+        self.completed = YES;
+        fileDescriptor = [self takeFileDescriptorIfIdle];
+    }];
+    if (fileDescriptor >= 0) {
+        close(fileDescriptor);
+    }
+    if (shouldComplete) {
+        if (self.sessionIdentifier) {
+            // Keep the journal around after transient failures so the upload can be resumed, but drop it once the session is finished or gone.
+            NSDictionary *const dropboxError = error.userInfo[TJDropboxErrorUserInfoKeyDropboxError];
+            NSString *const tag = dropboxError[@".tag"];
+            NSString *const lookupErrorTag = [tag isEqualToString:@"lookup_failed"] ? dropboxError[tag][@".tag"] : tag;
+            if (!error || [lookupErrorTag isEqual:@"not_found"] || [lookupErrorTag isEqual:@"not_closed"]) {
+                [self removeJournal];
+            }
+        }
+        self.completion(parsedResponse, error);
+    }
+    return shouldComplete;
+}
+
+@end
+
+static const NSUInteger kContentHashBlockSize = 4 * 1024 * 1024; // 4 MB blocks
+
+// Incrementally computes a Dropbox content_hash as bytes are appended https://www.dropbox.com/developers/reference/content-hash
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxContentHasher : NSObject {
+    CC_SHA256_CTX _blockHashContext;
+    CC_SHA256_CTX _contentHashContext;
+    NSUInteger _blockLength;
+}
+
+/// Invoked with the hash of each 4MB block as it's completed.
+@property (nonatomic, copy) void (^blockHashHandler)(NSData *blockHash);
+
+- (void)appendBytes:(const void *)bytes length:(NSUInteger)length;
+- (void)appendData:(NSData *const)data;
+- (NSData *)finalizeContentHash;
+
+@end
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropboxContentHasher
+
+- (instancetype)init
+{
+    if (self = [super init]) {
+        CC_SHA256_Init(&_blockHashContext);
+        CC_SHA256_Init(&_contentHashContext);
+    }
+    return self;
+}
+
+- (void)finalizeBlock
+{
+    unsigned char blockHash[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256_Final(blockHash, &_blockHashContext);
+    CC_SHA256_Update(&_contentHashContext, blockHash, CC_SHA256_DIGEST_LENGTH);
+    CC_SHA256_Init(&_blockHashContext);
+    _blockLength = 0;
+    
+    if (self.blockHashHandler) {
+        self.blockHashHandler([NSData dataWithBytes:blockHash length:CC_SHA256_DIGEST_LENGTH]);
+    }
+}
+
+- (void)appendBytes:(const void *)bytes length:(NSUInteger)length
+{
+    while (length > 0) {
+        const NSUInteger blockBytesLength = MIN(length, kContentHashBlockSize - _blockLength);
+        CC_SHA256_Update(&_blockHashContext, bytes, (CC_LONG)blockBytesLength);
+        _blockLength += blockBytesLength;
+        bytes = (const uint8_t *)bytes + blockBytesLength;
+        length -= blockBytesLength;
+        
+        if (_blockLength == kContentHashBlockSize) {
+            [self finalizeBlock];
+        }
+    }
+}
+
+- (void)appendData:(NSData *const)data
+{
+    [data enumerateByteRangesUsingBlock:^(const void * _Nonnull bytes, NSRange byteRange, BOOL * _Nonnull stop) {
+        [self appendBytes:bytes length:byteRange.length];
+    }];
+}
+
+- (NSData *)finalizeContentHash
+{
+    if (_blockLength > 0) {
+        [self finalizeBlock];
+    }
+    unsigned char contentHash[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256_Final(contentHash, &_contentHashContext);
+    return [NSData dataWithBytes:contentHash length:CC_SHA256_DIGEST_LENGTH];
+}
+
+@end
+
+// Holds the state of a download performed using parallel ranged requests.
+// Completed 4MB blocks and their hashes are persisted to a small file next to the destination so interrupted downloads can be resumed, even across launches.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxRangedDownload : NSObject {
+    os_unfair_lock _lock;
+}
+
+@property (nonatomic, copy) NSString *localPath;
+@property (nonatomic) TJDropboxCredential *credential;
+@property (nonatomic) NSUInteger maximumConcurrentRanges;
+@property (nonatomic, copy) void (^progressBlock)(CGFloat progress);
+@property (nonatomic, copy) void (^completion)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error);
+
+@property (nonatomic, copy) NSDictionary *metadata;
+@property (nonatomic, copy) NSString *revision;
+@property (nonatomic) unsigned long long fileSize;
+@property (nonatomic) NSUInteger blockCount;
+@property (nonatomic) int fileDescriptor;
+
+@property (nonatomic) NSMutableDictionary<NSNumber *, NSData *> *blockHashes;
+@property (nonatomic) NSMutableArray<NSValue *> *pendingBlockRanges;
+@property (nonatomic) NSUInteger inFlightRangeCount;
+@property (nonatomic) unsigned long long receivedByteCount;
+@property (nonatomic) NSHashTable<NSURLSessionTask *> *tasks;
+@property (nonatomic) BOOL completed;
+@property (nonatomic) dispatch_queue_t resumeStateQueue;
+@property (nonatomic) BOOL resumeStateWriteScheduled;
+@property (nonatomic) BOOL resumeStateDiscarded; // Set once the download has finished and its resume state is removed
+
+@property (nonatomic, readonly) NSString *partialPath;
+@property (nonatomic, readonly) NSString *resumeStatePath;
+
+@end
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropboxRangedDownload
+
+static NSString *const kRangedDownloadResumeStateRevisionKey = @"rev";
+static NSString *const kRangedDownloadResumeStateSizeKey = @"size";
+static NSString *const kRangedDownloadResumeStateBlockHashesKey = @"blockHashes";
+
+static const NSTimeInterval kRangedDownloadResumeStateWriteDelay = 2.0; // Coalesces writes while blocks are arriving
+
+- (instancetype)init
+{
+    if (self = [super init]) {
+        _lock = OS_UNFAIR_LOCK_INIT;
+        self.fileDescriptor = -1;
+        self.blockHashes = [NSMutableDictionary new];
+        self.pendingBlockRanges = [NSMutableArray new];
+        self.tasks = [NSHashTable weakObjectsHashTable];
+        self.resumeStateQueue = dispatch_queue_create("com.tijo.TJDropbox.ranged-download-resume-state", DISPATCH_QUEUE_SERIAL);
+    }
+    return self;
+}
+
+- (void)performSynchronized:(NS_NOESCAPE dispatch_block_t)block {
+    os_unfair_lock_lock(&_lock);
+    block();
+    os_unfair_lock_unlock(&_lock);
+}
+
+- (NSString *)partialPath
+{
+    return [self.localPath stringByAppendingPathExtension:@"tjdropbox-partial"];
+}
+
+- (NSString *)resumeStatePath
+{
+    return [self.localPath stringByAppendingPathExtension:@"tjdropbox-resume"];
+}
+
+- (BOOL)prepareWithRangeBlockCount:(const NSUInteger)rangeBlockCount error:(NSError **)error
+{
+    // Pick up where a previous attempt left off if it was downloading the same revision.
+    NSDictionary *const resumeState = [NSDictionary dictionaryWithContentsOfFile:self.resumeStatePath];
+    const BOOL canResume = [resumeState[kRangedDownloadResumeStateRevisionKey] isEqual:self.revision]
+    && [resumeState[kRangedDownloadResumeStateSizeKey] unsignedLongLongValue] == self.fileSize
+    && [[NSFileManager defaultManager] fileExistsAtPath:self.partialPath];
+    if (canResume) {
+        NSDictionary<NSString *, NSData *> *const blockHashes = resumeState[kRangedDownloadResumeStateBlockHashesKey];
+        [blockHashes enumerateKeysAndObjectsUsingBlock:^(NSString * _Nonnull key, NSData * _Nonnull blockHash, BOOL * _Nonnull stop) {
+            const NSUInteger blockIndex = (NSUInteger)key.integerValue;
+            if (blockIndex < self.blockCount && blockHash.length == CC_SHA256_DIGEST_LENGTH) {
+                self.blockHashes[@(blockIndex)] = blockHash;
+                self.receivedByteCount += MIN((unsigned long long)kContentHashBlockSize, self.fileSize - (unsigned long long)blockIndex * kContentHashBlockSize);
+            }
+        }];
+    } else {
+        unlink(self.partialPath.fileSystemRepresentation);
+    }
+    
+    // Open the file and preallocate it so ranges can be written at any offset.
+    self.fileDescriptor = open(self.partialPath.fileSystemRepresentation, O_RDWR | O_CREAT, 0644);
+    if (self.fileDescriptor < 0 || ftruncate(self.fileDescriptor, (off_t)self.fileSize) != 0) {
+        if (error) {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{NSFilePathErrorKey: self.partialPath}];
+        }
+        return NO;
+    }
+    
+    // Split the blocks that are still needed into contiguous ranges.
+    NSUInteger rangeStart = NSNotFound;
+    for (NSUInteger blockIndex = 0; blockIndex <= self.blockCount; blockIndex++) {
+        const BOOL isMissing = blockIndex < self.blockCount && self.blockHashes[@(blockIndex)] == nil;
+        if (rangeStart != NSNotFound && (!isMissing || blockIndex - rangeStart == rangeBlockCount)) {
+            [self.pendingBlockRanges addObject:[NSValue valueWithRange:NSMakeRange(rangeStart, blockIndex - rangeStart)]];
+            rangeStart = NSNotFound;
+        }
+        if (isMissing && rangeStart == NSNotFound) {
+            rangeStart = blockIndex;
+        }
+    }
+    
+    return YES;
+}
+
+- (void)didReceiveByteCount:(const NSUInteger)byteCount
+{
+    __block unsigned long long receivedByteCount;
+    [self performSynchronized:^{
+        self.receivedByteCount += byteCount;
+        receivedByteCount = self.receivedByteCount;
+    }];
+    if (self.progressBlock && self.fileSize > 0) {
+        self.progressBlock((CGFloat)receivedByteCount / self.fileSize);
+    }
+}
+
+- (void)didHashBlockAtIndex:(const NSUInteger)blockIndex hash:(NSData *const)blockHash
+{
+    __block BOOL shouldSchedule = NO;
+    [self performSynchronized:^{
+        self.blockHashes[@(blockIndex)] = blockHash;
+        if (!self.resumeStateWriteScheduled) {
+            self.resumeStateWriteScheduled = YES;
+            shouldSchedule = YES;
+        }
+    }];
+    // Rewriting the state for every block would be quadratic in the file size, so blocks that complete close together share a write.
+    if (shouldSchedule) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kRangedDownloadResumeStateWriteDelay * NSEC_PER_SEC)), self.resumeStateQueue, ^{
+            [self writeResumeState];
+        });
+    }
+}
+
+/// Persists the hashes of all completed blocks. Must be called on resumeStateQueue.
+- (void)writeResumeState
+{
+    __block NSDictionary *resumeState = nil;
+    [self performSynchronized:^{
+        self.resumeStateWriteScheduled = NO;
+        if (self.resumeStateDiscarded) {
+            return;
+        }
+        NSMutableDictionary<NSString *, NSData *> *const blockHashes = [NSMutableDictionary dictionaryWithCapacity:self.blockHashes.count];
+        [self.blockHashes enumerateKeysAndObjectsUsingBlock:^(NSNumber * _Nonnull key, NSData * _Nonnull obj, BOOL * _Nonnull stop) {
+            blockHashes[key.stringValue] = obj;
+        }];
+        resumeState = @{
+            kRangedDownloadResumeStateRevisionKey: self.revision,
+            kRangedDownloadResumeStateSizeKey: @(self.fileSize),
+            kRangedDownloadResumeStateBlockHashesKey: blockHashes,
+        };
+    }];
+    if (resumeState) {
+        NSData *const data = [NSPropertyListSerialization dataWithPropertyList:resumeState format:NSPropertyListBinaryFormat_v1_0 options:0 error:nil];
+        [data writeToFile:self.resumeStatePath atomically:YES];
+    }
+}
+
+/// Prevents any further resume state writes and waits for one in progress to land, so the state can be removed.
+- (void)discardResumeState
+{
+    [self performSynchronized:^{
+        self.resumeStateDiscarded = YES;
+    }];
+    dispatch_sync(self.resumeStateQueue, ^{});
+}
+
+/// The file is only closed once no ranges are in flight so that a late write can't land in a reused file descriptor. Must be called while synchronized.
+- (void)closeFileIfIdle
+{
+    if (self.completed && self.inFlightRangeCount == 0 && self.fileDescriptor >= 0) {
+        close(self.fileDescriptor);
+        self.fileDescriptor = -1;
+    }
+}
+
+/// Invokes the completion block at most once.
+- (void)completeWithParsedResponse:(NSDictionary *)parsedResponse error:(NSError *)error
+{
+    __block BOOL shouldComplete;
+    __block NSArray<NSURLSessionTask *> *tasks;
+    [self performSynchronized:^{
+        shouldComplete = !self.completed;
+        self.completed = YES;
+        tasks = self.tasks.allObjects;
+        [self closeFileIfIdle];
+    }];
+    if (shouldComplete) {
+        if (error) {
+            [tasks makeObjectsPerformSelector:@selector(cancel)];
+            // Save the blocks completed since the last write so a retry can resume from them.
+            dispatch_async(self.resumeStateQueue, ^{
+                [self writeResumeState];
+            });
+        }
+        self.completion(parsedResponse, error);
+    }
+}
+
+@end
+
+// Holds the state of a set of files uploaded with one upload session each and committed together using upload_session/finish_batch_v2.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxBatchUpload : NSObject {
+    os_unfair_lock _lock;
+}
+
+@property (nonatomic, copy) NSArray<NSString *> *localPaths;
+@property (nonatomic, copy) NSArray<NSString *> *remotePaths;
+@property (nonatomic) BOOL overwriteExisting;
+@property (nonatomic) BOOL muteDesktopNotifications;
+@property (nonatomic) TJDropboxCredential *credential;
+@property (nonatomic, copy) void (^progressBlock)(CGFloat progress);
+@property (nonatomic, copy) void (^completion)(NSArray *results);
+
+@property (nonatomic) NSMutableArray<NSNumber *> *fileSizes; // Updated to the number of bytes actually sent once a file's session is closed
+@property (nonatomic) unsigned long long totalByteCount;
+@property (nonatomic) unsigned long long committedByteCount;
+@property (nonatomic) NSMutableDictionary<NSNumber *, NSNumber *> *sentByteCountsForInFlightIndexes;
+@property (nonatomic) NSMutableArray *results; // NSNull until a file has succeeded or failed
+
+@end
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropboxBatchUpload
+
+- (instancetype)initWithLocalPaths:(NSArray<NSString *> *const)localPaths remotePaths:(NSArray<NSString *> *const)remotePaths
+{
+    if (self = [super init]) {
+        _lock = OS_UNFAIR_LOCK_INIT;
+        self.localPaths = localPaths;
+        self.remotePaths = remotePaths;
+        self.fileSizes = [NSMutableArray arrayWithCapacity:localPaths.count];
+        self.results = [NSMutableArray arrayWithCapacity:localPaths.count];
+        for (NSString *const localPath in localPaths) {
+            const unsigned long long fileSize = [[NSFileManager defaultManager] attributesOfItemAtPath:localPath error:nil].fileSize;
+            [self.fileSizes addObject:@(fileSize)];
+            [self.results addObject:[NSNull null]];
+            self.totalByteCount += fileSize;
+        }
+        self.sentByteCountsForInFlightIndexes = [NSMutableDictionary new];
+    }
+    return self;
+}
+
+- (void)performSynchronized:(NS_NOESCAPE dispatch_block_t)block {
+    os_unfair_lock_lock(&_lock);
+    block();
+    os_unfair_lock_unlock(&_lock);
+}
+
+- (BOOL)hasResultAtIndex:(const NSUInteger)index
+{
+    __block BOOL hasResult;
+    [self performSynchronized:^{
+        hasResult = self.results[index] != [NSNull null];
+    }];
+    return hasResult;
+}
+
+- (void)setResult:(id const)result atIndex:(const NSUInteger)index
+{
+    [self performSynchronized:^{
+        self.results[index] = result;
+        [self.sentByteCountsForInFlightIndexes removeObjectForKey:@(index)];
+    }];
+}
+
+/// Pass @c committed once the server has acknowledged the bytes, otherwise @c byteCount is the progress of the in-flight append for @c index.
+- (void)didSendByteCount:(const unsigned long long)byteCount forIndex:(const NSUInteger)index committed:(const BOOL)committed
+{
+    __block unsigned long long totalBytesSent;
+    [self performSynchronized:^{
+        if (committed) {
+            self.committedByteCount += byteCount;
+            [self.sentByteCountsForInFlightIndexes removeObjectForKey:@(index)];
+        } else {
+            self.sentByteCountsForInFlightIndexes[@(index)] = @(byteCount);
+        }
+        totalBytesSent = self.committedByteCount;
+        for (NSNumber *const sentByteCount in self.sentByteCountsForInFlightIndexes.objectEnumerator) {
+            totalBytesSent += sentByteCount.unsignedLongLongValue;
+        }
+    }];
+    if (self.progressBlock && self.totalByteCount > 0) {
+        self.progressBlock((CGFloat)totalBytesSent / self.totalByteCount);
+    }
+}
+
+@end
+
+// Holds the state of a search paged through with search/continue_v2.
+// Pages are handed to the caller one at a time and in order, a prefetched page that arrives while the previous one is still being handled waits here until it's done.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxSearch : NSObject {
+    os_unfair_lock _lock;
+}
+
+@property (nonatomic) TJDropboxCredential *credential;
+@property (nonatomic) NSUInteger maximumResultCount; // 0 for no limit
+@property (nonatomic) BOOL prefetchesNextPage;
+@property (nonatomic, copy) BOOL (^pageHandler)(NSArray *matches, BOOL hasMore);
+@property (nonatomic, copy) void (^completion)(NSError *error);
+
+@property (nonatomic) NSUInteger deliveredResultCount; // Only accessed while handling a page
+
+// All of these must be accessed within -performSynchronized:
+@property (nonatomic) BOOL handlingPage;
+@property (nonatomic) BOOL hasPendingResult;
+@property (nonatomic) NSDictionary *pendingResponse;
+@property (nonatomic) NSError *pendingError;
+@property (nonatomic) BOOL finished;
+
+@end
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropboxSearch
+
+- (instancetype)init
+{
+    if (self = [super init]) {
+        _lock = OS_UNFAIR_LOCK_INIT;
+    }
+    return self;
+}
+
+- (void)performSynchronized:(NS_NOESCAPE dispatch_block_t)block {
+    os_unfair_lock_lock(&_lock);
+    block();
+    os_unfair_lock_unlock(&_lock);
+}
+
+/// Returns @c YES if the page should be handled now, otherwise it's held until the current page is done (or dropped if the search has finished).
+- (BOOL)beginHandlingResponse:(NSDictionary *const)parsedResponse error:(NSError *const)error
+{
+    __block BOOL shouldHandle = NO;
+    [self performSynchronized:^{
+        if (self.finished) {
+            return;
+        }
+        if (self.handlingPage) {
+            self.hasPendingResult = YES;
+            self.pendingResponse = parsedResponse;
+            self.pendingError = error;
+        } else {
+            self.handlingPage = YES;
+            shouldHandle = YES;
+        }
+    }];
+    return shouldHandle;
+}
+
+/// Returns @c YES with the held page if one arrived in the meantime, which should be handled next.
+- (BOOL)endHandlingPageTakingPendingResponse:(NSDictionary **const)parsedResponse error:(NSError **const)error
+{
+    __block BOOL hasPendingResult;
+    [self performSynchronized:^{
+        hasPendingResult = self.hasPendingResult && !self.finished;
+        if (hasPendingResult) {
+            *parsedResponse = self.pendingResponse;
+            *error = self.pendingError;
+        } else {
+            self.handlingPage = NO;
+        }
+        self.hasPendingResult = NO;
+        self.pendingResponse = nil;
+        self.pendingError = nil;
+    }];
+    return hasPendingResult;
+}
+
+- (void)finishWithError:(NSError *const)error
+{
+    __block BOOL alreadyFinished;
+    [self performSynchronized:^{
+        alreadyFinished = self.finished;
+        self.finished = YES;
+        self.hasPendingResult = NO;
+        self.pendingResponse = nil;
+        self.pendingError = nil;
+    }];
+    if (!alreadyFinished) {
+        self.completion(error);
+    }
+}
+
+@end
+
+#pragma mark - Streamed Compression
+
+// Feeds the gzipped contents of a file into the output half of a bound stream pair.
+// Work happens on the producer's own serial queue and only when the stream reports space available, so a stream that's never drained doesn't hold a thread.
+// Production stops at the end of the file, on any read, deflate or write error, and once the input half is closed (the task delegate closes body streams that are replaced or outlive their task).
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxGzipStreamProducer : NSObject {
+    z_stream _stream;
+}
+
+- (instancetype)initWithPath:(NSString *const)path
+                 inputStream:(NSInputStream *const)inputStream
+                outputStream:(NSOutputStream *const)outputStream
+               progressBlock:(void (^const)(unsigned long long bytesRead))progressBlock;
+
+- (void)start;
+
+// All of these must be accessed on queue
+@property (nonatomic, readonly) dispatch_queue_t queue;
+@property (nonatomic, readonly) NSString *path;
+@property (nonatomic, readonly) NSInputStream *inputStream; // Only used to notice when the consumer has closed it
+@property (nonatomic, readonly) NSOutputStream *outputStream;
+@property (nonatomic, copy, readonly) void (^progressBlock)(unsigned long long bytesRead);
+@property (nonatomic) NSFileHandle *fileHandle;
+@property (nonatomic) dispatch_source_t abandonmentTimer;
+@property (nonatomic) NSMutableData *pendingData;
+@property (nonatomic) NSUInteger pendingDataOffset;
+@property (nonatomic) unsigned long long bytesRead;
+@property (nonatomic) BOOL deflating;
+@property (nonatomic) BOOL finishedDeflating;
+@property (nonatomic) BOOL stopped;
+
+@end
+
+static void _gzipStreamProducerCallback(CFWriteStreamRef stream, CFStreamEventType type, void *info);
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropboxGzipStreamProducer
+
+static const NSUInteger kGzipStreamBufferSize = 256 * 1024;
+static const NSTimeInterval kGzipStreamAbandonmentCheckInterval = 1.0;
+
+- (instancetype)initWithPath:(NSString *const)path
+                 inputStream:(NSInputStream *const)inputStream
+                outputStream:(NSOutputStream *const)outputStream
+               progressBlock:(void (^const)(unsigned long long bytesRead))progressBlock
+{
+    if (self = [super init]) {
+        _queue = dispatch_queue_create("com.tijo.TJDropbox.gzip-stream", dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_UTILITY, 0));
+        _path = [path copy];
+        _inputStream = inputStream;
+        _outputStream = outputStream;
+        _progressBlock = [progressBlock copy];
+    }
+    return self;
+}
+
+- (void)start
+{
+    dispatch_async(self.queue, ^{
+        self.fileHandle = [NSFileHandle fileHandleForReadingAtPath:self.path];
+        self->_stream.zalloc = Z_NULL;
+        self->_stream.zfree = Z_NULL;
+        self->_stream.opaque = Z_NULL;
+        self.deflating = self.fileHandle != nil && deflateInit2(&self->_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        if (!self.deflating) {
+            // Closing the output without writing anything gives the consumer an empty body, which the server rejects.
+            [self.outputStream open];
+            [self stop];
+            return;
+        }
+        
+        // The stream retains the producer until its client is cleared in -stop.
+        CFStreamClientContext context = {0, (__bridge void *)self, CFRetain, CFRelease, NULL};
+        CFWriteStreamRef const outputStream = (__bridge CFWriteStreamRef)self.outputStream;
+        CFWriteStreamSetClient(outputStream, kCFStreamEventCanAcceptBytes | kCFStreamEventErrorOccurred | kCFStreamEventEndEncountered, _gzipStreamProducerCallback, &context);
+        CFWriteStreamSetDispatchQueue(outputStream, self.queue);
+        [self.outputStream open];
+        
+        // Bound streams don't notify the writer when the reader is closed without being drained, so check for that periodically.
+        dispatch_source_t const timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, self.queue);
+        const uint64_t interval = (uint64_t)(kGzipStreamAbandonmentCheckInterval * NSEC_PER_SEC);
+        dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, interval), interval, interval / 10);
+        dispatch_source_set_event_handler(timer, ^{
+            const NSStreamStatus status = self.inputStream.streamStatus;
+            if (status == NSStreamStatusClosed || status == NSStreamStatusError) {
+                [self stop];
+            }
+        });
+        self.abandonmentTimer = timer;
+        dispatch_resume(timer);
+    });
+}
+
+- (void)handleEvent:(const CFStreamEventType)type
+{
+    if (type == kCFStreamEventCanAcceptBytes) {
+        [self writePendingData];
+    } else {
+        [self stop];
+    }
+}
+
+- (void)writePendingData
+{
+    while (!self.stopped && self.outputStream.hasSpaceAvailable) {
+        if (self.pendingDataOffset >= self.pendingData.length) {
+            if (self.finishedDeflating) {
+                // Closing the output marks the end of the body.
+                [self stop];
+                return;
+            }
+            if (![self deflateNextBlock]) {
+                [self stop];
+                return;
+            }
+            continue;
+        }
+        
+        const NSInteger writtenLength = [self.outputStream write:(const uint8_t *)self.pendingData.bytes + self.pendingDataOffset maxLength:self.pendingData.length - self.pendingDataOffset];
+        if (writtenLength < 0) {
+            [self stop];
+            return;
+        } else if (writtenLength == 0) {
+            return;
+        }
+        self.pendingDataOffset += writtenLength;
+    }
+}
+
+- (BOOL)deflateNextBlock
+{
+    BOOL success = YES;
+    @autoreleasepool {
+        NSData *const input = [self.fileHandle readDataOfLength:kGzipStreamBufferSize];
+        self.bytesRead += input.length;
+        const int flush = input.length < kGzipStreamBufferSize ? Z_FINISH : Z_NO_FLUSH;
+        
+        NSMutableData *const output = self.pendingData ?: [NSMutableData dataWithCapacity:kGzipStreamBufferSize];
+        output.length = 0;
+        _stream.next_in = (Bytef *)input.bytes;
+        _stream.avail_in = (uInt)input.length;
+        do {
+            const NSUInteger outputLength = output.length;
+            output.length = outputLength + kGzipStreamBufferSize;
+            _stream.next_out = (Bytef *)output.mutableBytes + outputLength;
+            _stream.avail_out = (uInt)kGzipStreamBufferSize;
+            success = deflate(&_stream, flush) != Z_STREAM_ERROR;
+            output.length = outputLength + kGzipStreamBufferSize - _stream.avail_out;
+        } while (success && _stream.avail_out == 0);
+        
+        self.pendingData = output;
+        self.pendingDataOffset = 0;
+        self.finishedDeflating = flush == Z_FINISH;
+    }
+    
+    if (success && self.progressBlock) {
+        self.progressBlock(self.bytesRead);
+    }
+    return success;
+}
+
+- (void)stop
+{
+    if (self.stopped) {
+        return;
+    }
+    self.stopped = YES;
+    
+    if (self.abandonmentTimer) {
+        dispatch_source_cancel(self.abandonmentTimer);
+        self.abandonmentTimer = nil;
+    }
+    if (self.deflating) {
+        deflateEnd(&_stream);
+        self.deflating = NO;
+    }
+    [self.fileHandle closeFile];
+    self.fileHandle = nil;
+    self.pendingData = nil;
+    _inputStream = nil;
+    
+    CFWriteStreamRef const outputStream = (__bridge CFWriteStreamRef)self.outputStream;
+    CFWriteStreamSetDispatchQueue(outputStream, NULL);
+    [self.outputStream close];
+    // Releases the stream's reference to the producer, must come last.
+    CFWriteStreamSetClient(outputStream, kCFStreamEventNone, NULL, NULL);
+}
+
+@end
+
+static void _gzipStreamProducerCallback(CFWriteStreamRef stream, CFStreamEventType type, void *info)
+{
+    [(__bridge TJDropboxGzipStreamProducer *)info handleEvent:type];
+}
+
+#pragma mark - Content Hash Cache
+
+static NSString *const kContentHashCachePathKey = @"path";
+static NSString *const kContentHashCacheSizeKey = @"size";
+static NSString *const kContentHashCacheModificationTimeKey = @"mtime";
+static NSString *const kContentHashCacheContentHashKey = @"hash";
+
+static const NSTimeInterval kContentHashCacheWriteDelay = 2.0; // Coalesces writes while many files are being hashed
+static const NSUInteger kContentHashCacheMaximumCount = 50000; // Roughly 10 MB on disk
+
+typedef struct {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    int64_t modificationTime; // Nanoseconds
+} TJDropboxFileIdentity;
+
+static BOOL _fileIdentity(NSString *const filePath, TJDropboxFileIdentity *const identity)
+{
+    struct stat fileStatus;
+    if (stat(filePath.fileSystemRepresentation, &fileStatus) != 0 || !S_ISREG(fileStatus.st_mode)) {
+        return NO;
+    }
+    identity->device = fileStatus.st_dev;
+    identity->inode = fileStatus.st_ino;
+    identity->size = fileStatus.st_size;
+    identity->modificationTime = (int64_t)fileStatus.st_mtimespec.tv_sec * NSEC_PER_SEC + fileStatus.st_mtimespec.tv_nsec;
+    return YES;
+}
+
+static BOOL _fileIdentitiesEqual(const TJDropboxFileIdentity first, const TJDropboxFileIdentity second)
+{
+    return first.device == second.device && first.inode == second.inode && first.size == second.size && first.modificationTime == second.modificationTime;
+}
+
+// Content hashes of local files, keyed by device and inode and only used while the file's size and modification time are unchanged.
+// Persisted to Application Support so rescans of large libraries after a relaunch don't read unchanged files again. The least recently used are evicted beyond kContentHashCacheMaximumCount.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxContentHashCache : NSObject {
+    os_unfair_lock _lock;
+}
+
+// All of these must be accessed within -performSynchronized:
+@property (nonatomic) NSMutableDictionary<NSString *, NSDictionary *> *entries;
+@property (nonatomic) NSMutableOrderedSet<NSString *> *recentlyUsedKeys; // Least recently used first
+@property (nonatomic) BOOL writeScheduled;
+
+@property (nonatomic, copy) NSString *cachePath;
+@property (nonatomic) dispatch_queue_t writeQueue;
+
+@end
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropboxContentHashCache
+
+- (instancetype)init
+{
+    if (self = [super init]) {
+        _lock = OS_UNFAIR_LOCK_INIT;
+        NSString *const applicationSupportPath = NSSearchPathForDirectoriesInDomains(NSApplicationSupportDirectory, NSUserDomainMask, YES).firstObject ?: NSTemporaryDirectory();
+        self.cachePath = [applicationSupportPath stringByAppendingPathComponent:@"TJDropbox/ContentHashes.plist"];
+        self.writeQueue = dispatch_queue_create_with_target("com.tijo.TJDropbox.content-hash-cache", DISPATCH_QUEUE_SERIAL, _workerQueue());
+        NSData *const cacheData = [NSData dataWithContentsOfFile:self.cachePath];
+        NSMutableDictionary *const entries = cacheData ? [NSPropertyListSerialization propertyListWithData:cacheData options:NSPropertyListMutableContainers format:nil error:nil] : nil;
+        self.entries = [entries isKindOfClass:[NSMutableDictionary class]] ? entries : [NSMutableDictionary new];
+        // Use isn't persisted, entries from disk start out ordered by when their file was last modified.
+        NSArray<NSString *> *const keys = [self.entries keysSortedByValueUsingComparator:^NSComparisonResult(NSDictionary * _Nonnull entry1, NSDictionary * _Nonnull entry2) {
+            return [entry1[kContentHashCacheModificationTimeKey] compare:entry2[kContentHashCacheModificationTimeKey]];
+        }];
+        self.recentlyUsedKeys = [NSMutableOrderedSet orderedSetWithArray:keys];
+        [self trimToMaximumCount];
+    }
+    return self;
+}
+
+- (void)performSynchronized:(NS_NOESCAPE dispatch_block_t)block {
+    os_unfair_lock_lock(&_lock);
+    block();
+    os_unfair_lock_unlock(&_lock);
+}
+
+/// Must be called while synchronized.
+- (void)trimToMaximumCount
+{
+    while (self.recentlyUsedKeys.count > kContentHashCacheMaximumCount) {
+        [self.entries removeObjectForKey:self.recentlyUsedKeys.firstObject];
+        [self.recentlyUsedKeys removeObjectAtIndex:0];
+    }
+}
+
+static NSString *_contentHashCacheKey(const TJDropboxFileIdentity identity)
+{
+    return [NSString stringWithFormat:@"%llx:%llx", (unsigned long long)identity.device, (unsigned long long)identity.inode];
+}
+
+static BOOL _contentHashCacheEntryMatchesIdentity(NSDictionary *const entry, const TJDropboxFileIdentity identity)
+{
+    return [entry[kContentHashCacheSizeKey] longLongValue] == identity.size && [entry[kContentHashCacheModificationTimeKey] longLongValue] == identity.modificationTime;
+}
+
+- (NSData *)contentHashForFileIdentity:(const TJDropboxFileIdentity)identity
+{
+    NSString *const key = _contentHashCacheKey(identity);
+    __block NSData *contentHash = nil;
+    [self performSynchronized:^{
+        NSDictionary *const entry = self.entries[key];
+        if (_contentHashCacheEntryMatchesIdentity(entry, identity)) {
+            contentHash = entry[kContentHashCacheContentHashKey];
+            [self.recentlyUsedKeys removeObject:key];
+            [self.recentlyUsedKeys addObject:key];
+        }
+    }];
+    return contentHash;
+}
+
+- (void)setContentHash:(NSData *const)contentHash forFileIdentity:(const TJDropboxFileIdentity)identity path:(NSString *const)path
+{
+    NSDictionary *const entry = @{
+        kContentHashCachePathKey: path,
+        kContentHashCacheSizeKey: @(identity.size),
+        kContentHashCacheModificationTimeKey: @(identity.modificationTime),
+        kContentHashCacheContentHashKey: contentHash,
+    };
+    NSString *const key = _contentHashCacheKey(identity);
+    [self performSynchronized:^{
+        self.entries[key] = entry;
+        [self.recentlyUsedKeys removeObject:key];
+        [self.recentlyUsedKeys addObject:key];
+        [self trimToMaximumCount];
+    }];
+    [self scheduleWrite];
+}
+
+/// Drops entries whose file has been deleted, replaced or modified since it was hashed.
+- (void)prune
+{
+    __block NSDictionary<NSString *, NSDictionary *> *entries;
+    [self performSynchronized:^{
+        entries = [self.entries copy];
+    }];
+    NSMutableArray<NSString *> *const staleKeys = [NSMutableArray new];
+    [entries enumerateKeysAndObjectsUsingBlock:^(NSString * _Nonnull key, NSDictionary * _Nonnull entry, BOOL * _Nonnull stop) {
+        TJDropboxFileIdentity identity;
+        if (!_fileIdentity(entry[kContentHashCachePathKey], &identity) || ![_contentHashCacheKey(identity) isEqualToString:key] || !_contentHashCacheEntryMatchesIdentity(entry, identity)) {
+            [staleKeys addObject:key];
+        }
+    }];
+    if (staleKeys.count > 0) {
+        [self performSynchronized:^{
+            for (NSString *const key in staleKeys) {
+                // Skip anything rehashed while this was running.
+                if (self.entries[key] == entries[key]) {
+                    [self.entries removeObjectForKey:key];
+                    [self.recentlyUsedKeys removeObject:key];
+                }
+            }
+        }];
+        [self scheduleWrite];
+    }
+}
+
+- (void)removeAllContentHashes
+{
+    [self performSynchronized:^{
+        [self.entries removeAllObjects];
+        [self.recentlyUsedKeys removeAllObjects];
+    }];
+    [self scheduleWrite];
+}
+
+- (void)scheduleWrite
+{
+    __block BOOL shouldSchedule = NO;
+    [self performSynchronized:^{
+        if (!self.writeScheduled) {
+            self.writeScheduled = YES;
+            shouldSchedule = YES;
+        }
+    }];
+    if (!shouldSchedule) {
+        return;
+    }
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kContentHashCacheWriteDelay * NSEC_PER_SEC)), self.writeQueue, ^{
+        __block NSDictionary *entries;
+        [self performSynchronized:^{
+            entries = [self.entries copy];
+            self.writeScheduled = NO;
+        }];
+        NSError *error = nil;
+        NSData *const cacheData = [NSPropertyListSerialization dataWithPropertyList:entries format:NSPropertyListBinaryFormat_v1_0 options:0 error:&error];
+        if (cacheData) {
+            [[NSFileManager defaultManager] createDirectoryAtPath:[self.cachePath stringByDeletingLastPathComponent] withIntermediateDirectories:YES attributes:nil error:nil];
+            [cacheData writeToFile:self.cachePath options:NSDataWritingAtomic error:&error];
+        }
+        if (error) {
+            NSLog(@"[TJDropbox] - Error in %s: %@", __PRETTY_FUNCTION__, error);
+        }
+    });
+}
+
+@end
+
+static TJDropboxContentHashCache *_contentHashCache(void)
+{
+    static TJDropboxContentHashCache *contentHashCache;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        contentHashCache = [TJDropboxContentHashCache new];
+    });
+    return contentHashCache;
+}
+
+/// Records a hash that's already known to be correct, for example one verified while downloading the file.
+static void _cacheFileContentHash(NSString *const filePath, NSData *const contentHash)
+{
+    TJDropboxFileIdentity identity;
+    if (contentHash && _fileIdentity(filePath, &identity)) {
+        [_contentHashCache() setContentHash:contentHash forFileIdentity:identity path:filePath];
+    }
+}
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@implementation TJDropbox
+
+static void (^_tj_requestModifier)(NSMutableURLRequest *);
+static BOOL _tj_adjustsLargeUploadChunkSize;
+
++ (void)setRequestModifier:(void (^)(NSMutableURLRequest * _Nonnull))requestModifier
+{
+    _tj_requestModifier = requestModifier;
+}
+
++ (void (^)(NSMutableURLRequest * _Nonnull))requestModifier
+{
+    return _tj_requestModifier;
+}
+
++ (void)setMetricsEnabled:(BOOL)metricsEnabled
+{
+    _tj_metricsEnabled = metricsEnabled;
+}
+
++ (BOOL)metricsEnabled
+{
+    return _tj_metricsEnabled;
+}
+
++ (void)setMetricsSink:(void (^)(NSDictionary<NSString *,id> * _Nonnull))metricsSink
+{
+    _tj_metricsSink = metricsSink;
+}
+
++ (void (^)(NSDictionary<NSString *,id> * _Nonnull))metricsSink
+{
+    return _tj_metricsSink;
+}
+
++ (NSDictionary<NSString *, NSDictionary<NSString *, id> *> *)metricsSnapshot
+{
+    NSMutableDictionary<NSString *, NSDictionary<NSString *, id> *> *const snapshot = [NSMutableDictionary new];
+    os_unfair_lock_lock(&_metricsLock);
+    [_metricsForEndpoints enumerateKeysAndObjectsUsingBlock:^(NSString * _Nonnull endpoint, TJDropboxEndpointMetrics * _Nonnull metrics, BOOL * _Nonnull stop) {
+        snapshot[endpoint] = [metrics snapshot];
+    }];
+    os_unfair_lock_unlock(&_metricsLock);
+    return snapshot;
+}
+
++ (void)resetMetrics
+{
+    os_unfair_lock_lock(&_metricsLock);
+    [_metricsForEndpoints removeAllObjects];
+    os_unfair_lock_unlock(&_metricsLock);
+}
+
++ (void)setMaximumConcurrentRequestsPerHost:(NSUInteger)maximumConcurrentRequestsPerHost
+{
+    TJDropboxScheduler *const scheduler = _scheduler();
+    [scheduler performSynchronized:^{
+        scheduler.defaultMaximumConcurrentRequestsPerHost = maximumConcurrentRequestsPerHost;
+    }];
+    [scheduler pump];
+}
+
++ (NSUInteger)maximumConcurrentRequestsPerHost
+{
+    TJDropboxScheduler *const scheduler = _scheduler();
+    __block NSUInteger maximumConcurrentRequestsPerHost;
+    [scheduler performSynchronized:^{
+        maximumConcurrentRequestsPerHost = scheduler.defaultMaximumConcurrentRequestsPerHost;
+    }];
+    return maximumConcurrentRequestsPerHost;
+}
+
++ (void)setMaximumConcurrentRequests:(const NSUInteger)maximumConcurrentRequests forHost:(NSString *const)host
+{
+    TJDropboxScheduler *const scheduler = _scheduler();
+    [scheduler performSynchronized:^{
+        scheduler.maximumConcurrentRequestsForHosts[host] = maximumConcurrentRequests > 0 ? @(maximumConcurrentRequests) : nil;
+    }];
+    [scheduler pump];
+}
+
++ (void)setMaximumRequestsPerSecond:(double)maximumRequestsPerSecond
+{
+    TJDropboxScheduler *const scheduler = _scheduler();
+    [scheduler performSynchronized:^{
+        scheduler.maximumRequestsPerSecond = MAX(maximumRequestsPerSecond, 0.0);
+        scheduler.lastTokenRefillTimestamp = 0;
+    }];
+    [scheduler pump];
+}
+
++ (void)setCachedResponseLifetime:(NSTimeInterval)cachedResponseLifetime
+{
+    TJDropboxResponseCache *const responseCache = _responseCache();
+    [responseCache performSynchronized:^{
+        responseCache.lifetime = MAX(cachedResponseLifetime, 0.0);
+    }];
+}
+
++ (NSTimeInterval)cachedResponseLifetime
+{
+    TJDropboxResponseCache *const responseCache = _responseCache();
+    __block NSTimeInterval cachedResponseLifetime;
+    [responseCache performSynchronized:^{
+        cachedResponseLifetime = responseCache.lifetime;
+    }];
+    return cachedResponseLifetime;
+}
+
++ (void)setMaximumCachedResponseCount:(NSUInteger)maximumCachedResponseCount
+{
+    TJDropboxResponseCache *const responseCache = _responseCache();
+    [responseCache performSynchronized:^{
+        responseCache.maximumCount = maximumCachedResponseCount;
+        [responseCache trimToMaximumCount];
+    }];
+}
+
++ (NSUInteger)maximumCachedResponseCount
+{
+    TJDropboxResponseCache *const responseCache = _responseCache();
+    __block NSUInteger maximumCachedResponseCount;
+    [responseCache performSynchronized:^{
+        maximumCachedResponseCount = responseCache.maximumCount;
+    }];
+    return maximumCachedResponseCount;
+}
+
++ (NSDictionary<NSString *, NSNumber *> *)responseCacheStatistics
+{
+    TJDropboxResponseCache *const responseCache = _responseCache();
+    __block NSDictionary<NSString *, NSNumber *> *statistics;
+    [responseCache performSynchronized:^{
+        statistics = @{
+            TJDropboxResponseCacheKeyHitCount: @(responseCache.hitCount),
+            TJDropboxResponseCacheKeyMissCount: @(responseCache.missCount),
+            TJDropboxResponseCacheKeyCoalescedCount: @(responseCache.coalescedCount),
+        };
+    }];
+    return statistics;
+}
+
++ (void)removeAllCachedResponses
+{
+    [_responseCache() removeAllCachedResponses];
+}
+
++ (void)setUsesSessionPoolsPerCredential:(BOOL)usesSessionPoolsPerCredential
+{
+    _tj_usesSessionPoolsPerCredential = usesSessionPoolsPerCredential;
+}
+
++ (BOOL)usesSessionPoolsPerCredential
+{
+    return _tj_usesSessionPoolsPerCredential;
+}
+
++ (void)setSkipsCompressionOfIncompressibleFiles:(BOOL)skipsCompressionOfIncompressibleFiles
+{
+    _tj_skipsCompressionOfIncompressibleFiles = skipsCompressionOfIncompressibleFiles;
+}
+
++ (BOOL)skipsCompressionOfIncompressibleFiles
+{
+    return _tj_skipsCompressionOfIncompressibleFiles;
+}
+
++ (void)setAdjustsLargeUploadChunkSize:(BOOL)adjustsLargeUploadChunkSize
+{
+    _tj_adjustsLargeUploadChunkSize = adjustsLargeUploadChunkSize;
+}
+
++ (BOOL)adjustsLargeUploadChunkSize
+{
+    return _tj_adjustsLargeUploadChunkSize;
+}
+
++ (double)maximumRequestsPerSecond
+{
+    TJDropboxScheduler *const scheduler = _scheduler();
+    __block double maximumRequestsPerSecond;
+    [scheduler performSynchronized:^{
+        maximumRequestsPerSecond = scheduler.maximumRequestsPerSecond;
+    }];
+    return maximumRequestsPerSecond;
+}
+
+static NSURL *_tj_apiBaseURL;
+static NSURL *_tj_contentBaseURL;
+static NSURL *_tj_notifyBaseURL;
+
++ (void)setApiBaseURL:(NSURL *)apiBaseURL
+{
+    _tj_apiBaseURL = [apiBaseURL copy];
+}
+
++ (NSURL *)apiBaseURL
+{
+    return _tj_apiBaseURL ?: [NSURL URLWithString:@"https://api.dropboxapi.com"];
+}
+
++ (void)setContentBaseURL:(NSURL *)contentBaseURL
+{
+    _tj_contentBaseURL = [contentBaseURL copy];
+}
+
++ (NSURL *)contentBaseURL
+{
+    return _tj_contentBaseURL ?: [NSURL URLWithString:@"https://content.dropboxapi.com"];
+}
+
++ (void)setNotifyBaseURL:(NSURL *)notifyBaseURL
+{
+    _tj_notifyBaseURL = [notifyBaseURL copy];
+}
+
++ (NSURL *)notifyBaseURL
+{
+    return _tj_notifyBaseURL ?: [NSURL URLWithString:@"https://notify.dropboxapi.com"];
+}
+
+#pragma mark - Authentication
+
+// Copied from https://tijo.link/k2OViy
+static NSString *_codeChallengeFromCodeVerifier(NSString *const codeVerifier)
+{
+  // Creates code challenge according to [RFC7636 4.2] (https://tools.ietf.org/html/rfc7636#section-4.2)
+  // 1. Covert code verifier to ascii encoded string.
+  // 2. Compute the SHA256 hash of the ascii string.
+  // 3. Base64 encode the resulting hash.
+  // 4. Make the Base64 string URL safe by replacing a few characters. (https://tools.ietf.org/html/rfc4648#section-5)
+  const char *asciiString = [codeVerifier cStringUsingEncoding:NSASCIIStringEncoding];
+  NSData *data = [NSData dataWithBytes:asciiString length:strlen(asciiString)];
+  unsigned char digest[CC_SHA256_DIGEST_LENGTH] = {0};
+  CC_SHA256(data.bytes, (CC_LONG)data.length, digest);
+  NSData *sha256Data = [NSData dataWithBytes:digest length:CC_SHA256_DIGEST_LENGTH];
+  NSString *base64String = [sha256Data base64EncodedStringWithOptions:kNilOptions];
+  base64String = [base64String stringByReplacingOccurrencesOfString:@"/" withString:@"_"];
+  base64String = [base64String stringByReplacingOccurrencesOfString:@"+" withString:@"-"];
+  base64String = [base64String stringByReplacingOccurrencesOfString:@"=" withString:@""];
+  return base64String;
+}
+
++ (NSURL *)tokenAuthenticationURLWithClientIdentifier:(NSString *const)clientIdentifier
+                                          redirectURL:(nullable NSURL *)redirectURL
+                                         codeVerifier:(nullable NSString *const)codeVerifier
+                                 generateRefreshToken:(const BOOL)generateRefreshToken
+{
+    // https://www.dropbox.com/developers/documentation/http/documentation#auth
+    
+    if (!redirectURL) {
+        redirectURL = [self defaultTokenAuthenticationRedirectURLWithClientIdentifier:clientIdentifier];
+    }
+    NSString *const codeChallenge = codeVerifier ? _codeChallengeFromCodeVerifier(codeVerifier) : nil;
+    
+    NSURLComponents *const components = [NSURLComponents componentsWithURL:[NSURL URLWithString:@"https://www.dropbox.com/oauth2/authorize"] resolvingAgainstBaseURL:NO];
+    NSMutableArray<NSURLQueryItem *> *const queryItems = [NSMutableArray arrayWithObjects:
+                                                          [NSURLQueryItem queryItemWithName:@"client_id" value:clientIdentifier],
+                                                          [NSURLQueryItem queryItemWithName:@"redirect_uri" value:redirectURL.absoluteString],
+                                                          [NSURLQueryItem queryItemWithName:@"response_type" value:codeChallenge ? @"code" : @"token"],
+                                                          [NSURLQueryItem queryItemWithName:@"disable_signup" value:@"true"],
+                                                          // Following params only apply if verifier is supplied
+                                                          codeChallenge ? [NSURLQueryItem queryItemWithName:@"code_challenge" value:codeChallenge] : nil,
+                                                          [NSURLQueryItem queryItemWithName:@"code_challenge_method" value:@"S256"],
+                                                          nil
+                                                          ];
+    if (generateRefreshToken) {
+        [queryItems addObject:[NSURLQueryItem queryItemWithName:@"token_access_type" value:@"offline"]]; // https://dropbox.tech/developers/migrating-app-permissions-and-access-tokens#updating-access-token-type
+    }
+    components.queryItems = queryItems;
+    return components.URL;
+}
+
++ (NSURL *)defaultTokenAuthenticationRedirectURLWithClientIdentifier:(NSString *const)clientIdentifier
+{
+    return [NSURL URLWithString:[NSString stringWithFormat:@"db-%@://2/token", clientIdentifier]];
+}
+
++ (nullable TJDropboxCredential *)credentialFromURL:(NSURL *const)url withRedirectURL:(NSURL *const)redirectURL
+{
+    TJDropboxCredential *credential = nil;
+    if ([url.absoluteString hasPrefix:redirectURL.absoluteString]) {
+        NSString *const fragment = url.fragment;
+        NSURLComponents *const components = [NSURLComponents new];
+        components.query = fragment;
+        for (NSURLQueryItem *const item in components.queryItems) {
+            if ([item.name isEqualToString:@"access_token"]) {
+                credential = [[TJDropboxCredential alloc] initWithAccessToken:item.value];
+                break;
+            }
+        }
+    }
+    return credential;
+}
+
++ (nullable TJDropboxCredential *)credentialFromURL:(NSURL *const)url withClientIdentifier:(NSString *const)clientIdentifier
+{
+    return [self credentialFromURL:url withRedirectURL:[self defaultTokenAuthenticationRedirectURLWithClientIdentifier:clientIdentifier]];
+}
+
++ (void)credentialFromCode:(NSString *const)code
+      withClientIdentifier:(NSString *const)clientIdentifier
+              codeVerifier:(NSString *const)codeVerifier
+               redirectURL:(NSURL *const)redirectURL
+                completion:(void (^const)(TJDropboxCredential *_Nullable, NSError *_Nullable))completion
+{
+    // https://www.dropbox.com/developers/documentation/http/documentation#oauth2-token
+    // https://tijo.link/BmeoVo
+    
+    _performAPIRequest(nil,
+                       ^NSURLRequest *{
+        NSMutableURLRequest *const request = _apiRequest(@"/oauth2/token", nil, nil);
+        NSURLComponents *const components = [NSURLComponents new];
+        components.queryItems = @[
+            [NSURLQueryItem queryItemWithName:@"grant_type" value:@"authorization_code"],
+            [NSURLQueryItem queryItemWithName:@"code" value:code],
+            [NSURLQueryItem queryItemWithName:@"client_id" value:clientIdentifier],
+            [NSURLQueryItem queryItemWithName:@"code_verifier" value:codeVerifier],
+            [NSURLQueryItem queryItemWithName:@"redirect_uri" value:redirectURL.absoluteString],
+        ];
+        request.HTTPBody = [components.query dataUsingEncoding:NSUTF8StringEncoding];
+        [request addValue:@"application/x-www-form-urlencoded; charset=utf-8" forHTTPHeaderField:@"Content-Type"];
+        return request;
+    },
+                       ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        NSString *const accessToken = parsedResponse[@"access_token"];
+        NSString *const refreshToken = parsedResponse[@"refresh_token"];
+        const id expiresInValue = parsedResponse[@"expires_in"];
+        NSDate *const expirationDate = expiresInValue != nil ? [NSDate dateWithTimeIntervalSinceNow:[expiresInValue doubleValue]] : nil;
+        completion([[TJDropboxCredential alloc] initPrivateWithAccessToken:accessToken
+                                                              refreshToken:refreshToken
+                                                            expirationDate:expirationDate
+                                                          clientIdentifier:clientIdentifier],
+                   error);
+    });
+}
+
++ (BOOL)isAuthenticationErrorURL:(NSURL *const)url withRedirectURL:(NSURL *const)redirectURL
+{
+    // when the user presses the cancel button on the website, this URL is returned:
+    // db-XXX://2/token#error_description=The+user+chose+not+to+give+your+app+access+to+their+Dropbox+account.&error=access_denied
+    if ([url.absoluteString hasPrefix:redirectURL.absoluteString]) {
+        NSString *const fragment = url.fragment;
+        NSURLComponents *const components = [NSURLComponents new];
+        components.query = fragment;
+        for (NSURLQueryItem *const item in components.queryItems) {
+            if ([item.name isEqualToString:@"error"]) {
+                return YES;
+            }
+        }
+    }
+    return NO;
+}
+
++ (BOOL)isAuthenticationErrorURL:(NSURL *const)url withClientIdentifier:(NSString *const)clientIdentifier
+{
+    return [self isAuthenticationErrorURL:url withRedirectURL:[self defaultTokenAuthenticationRedirectURLWithClientIdentifier:clientIdentifier]];
+}
+
++ (NSURL *)dropboxAppAuthenticationURLWithClientIdentifier:(NSString *const)clientIdentifier
+                                              codeVerifier:(nullable NSString *const)codeVerifier
+                                      generateRefreshToken:(const BOOL)generateRefreshToken
+{
+    // https://github.com/dropbox/SwiftyDropbox/blob/master/Source/OAuth.swift#L288-L303
+    // https://github.com/dropbox/SwiftyDropbox/blob/master/Source/OAuth.swift#L274-L282
+    
+    NSURLComponents *const components = [NSURLComponents componentsWithString:@"dbapi-2://1/connect"];
+    
+    NSString *stateString;
+    NSString *extraQueryParams = nil;
+    if (codeVerifier) {
+        NSString *const codeChallenge = _codeChallengeFromCodeVerifier(codeVerifier);
+        stateString = [NSString stringWithFormat:@"oauth2code:%@:S256:", codeChallenge];
+        
+        if (generateRefreshToken) {
+            stateString = [stateString stringByAppendingString:@"offline"];
+        }
+        
+        NSURLComponents *const extraComponents = [NSURLComponents new];
+        
+        extraComponents.queryItems = [NSArray arrayWithObjects:
+                                      [NSURLQueryItem queryItemWithName:@"code_challenge" value:codeChallenge],
+                                      [NSURLQueryItem queryItemWithName:@"code_challenge_method" value:@"S256"],
+                                      [NSURLQueryItem queryItemWithName:@"response_type" value:@"code"],
+                                      generateRefreshToken ? [NSURLQueryItem queryItemWithName:@"token_access_type" value:@"offline"] : nil,
+                                      nil
+                                      ];
+        extraQueryParams = extraComponents.query;
+    } else {
+        NSString *const nonce = [[NSUUID UUID] UUIDString];
+        stateString = [NSString stringWithFormat:@"oauth2:%@", nonce];
+    }
+    
+    components.queryItems = [NSArray arrayWithObjects:
+                             [NSURLQueryItem queryItemWithName:@"k" value:clientIdentifier],
+                             [NSURLQueryItem queryItemWithName:@"s" value:@""],
+                             [NSURLQueryItem queryItemWithName:@"state" value:stateString],
+                             // Following params only apply if verifier is supplied https://tijo.link/QObA8d
+                             extraQueryParams != nil ? [NSURLQueryItem queryItemWithName:@"extra_query_params" value:extraQueryParams] : nil,
+                             nil
+                             ];
+    return components.URL;
+}
+
++ (nullable TJDropboxCredential *)credentialFromDropboxAppAuthenticationURL:(NSURL *const)url
+{
+    // https://github.com/dropbox/SwiftyDropbox/blob/master/Source/OAuth.swift#L360-L383
+    
+    NSString *accessToken = nil;
+    if ([url.scheme hasPrefix:@"db-"] && [url.host isEqualToString:@"1"] && [url.path isEqualToString:@"/connect"]) {
+        NSURLComponents *const components = [NSURLComponents componentsWithURL:url resolvingAgainstBaseURL:NO];
+        for (NSURLQueryItem *queryItem in components.queryItems) {
+            if ([queryItem.name isEqualToString:@"oauth_token_secret"] && queryItem.value.length > 0) {
+                accessToken = queryItem.value;
+                break;
+            }
+            // Note: It seems that you cannot get refresh tokens from app-to-app auth.
+        }
+    }
+    return accessToken != nil ? [[TJDropboxCredential alloc] initWithAccessToken:accessToken] : nil;
+}
+
++ (void)revokeCredential:(TJDropboxCredential *const)credential withCallback:(void (^const)(BOOL success, NSError *_Nullable error))completion
+{
+    // https://www.dropbox.com/developers/documentation/http/documentation#auth-token-revoke
+    
+    _performAPIRequest(credential,
+                       ^NSURLRequest *{
+        return _apiRequest(@"/2/auth/token/revoke", credential.accessToken, nil);
+    },
+                       ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        completion(error == nil, error);
+    });
+}
+
+#pragma mark - Generic
+
+// Request arguments are written as JSON directly into a byte buffer in a single pass. Anything outside printable ASCII is \uXXXX-escaped,
+// which is what Dropbox requires for the Dropbox-API-Arg header and keeps API request bodies identical to it.
+// Inspired by: https://github.com/dropbox/SwiftyDropbox/blob/6747041b04e337efe0de8f3be14acaf3b6d6d19b/Source/Client.swift#L90-L104
+// Useful: https://www.dropbox.com/developers/reference/json-encoding
+
+enum {
+    kJSONWriterInlineCapacity = 1024 // Enough for nearly all arguments, larger ones move to the heap
+};
+
+typedef struct {
+    char *bytes;
+    NSUInteger length;
+    NSUInteger capacity;
+    char inlineBytes[kJSONWriterInlineCapacity];
+} TJDropboxJSONWriter;
+
+static void _jsonWriterInitialize(TJDropboxJSONWriter *const writer)
+{
+    writer->bytes = writer->inlineBytes;
+    writer->length = 0;
+    writer->capacity = kJSONWriterInlineCapacity;
+}
+
+/// Returns space for at least @c length more bytes at the end of the buffer, the caller advances @c writer->length by however many it uses.
+static char *_jsonWriterReserve(TJDropboxJSONWriter *const writer, const NSUInteger length)
+{
+    if (writer->length + length > writer->capacity) {
+        NSUInteger capacity = writer->capacity * 2;
+        while (capacity < writer->length + length) {
+            capacity *= 2;
+        }
+        if (writer->bytes == writer->inlineBytes) {
+            char *const bytes = malloc(capacity);
+            memcpy(bytes, writer->inlineBytes, writer->length);
+            writer->bytes = bytes;
+        } else {
+            writer->bytes = reallocf(writer->bytes, capacity);
+        }
+        writer->capacity = capacity;
+    }
+    return writer->bytes + writer->length;
+}
+
+static void _jsonWriterAppendBytes(TJDropboxJSONWriter *const writer, const char *const bytes, const NSUInteger length)
+{
+    memcpy(_jsonWriterReserve(writer, length), bytes, length);
+    writer->length += length;
+}
+
+static void _jsonWriterAppendString(TJDropboxJSONWriter *const writer, NSString *const string)
+{
+    static const char kHexDigits[] = "0123456789abcdef";
+    CFStringRef const cfString = (__bridge CFStringRef)string;
+    const CFIndex length = CFStringGetLength(cfString);
+    char *const start = _jsonWriterReserve(writer, length * 6 + 2); // Worst case every character is \uXXXX-escaped
+    char *cursor = start;
+    *cursor++ = '"';
+    CFStringInlineBuffer buffer;
+    CFStringInitInlineBuffer(cfString, &buffer, CFRangeMake(0, length));
+    for (CFIndex i = 0; i < length; i++) {
+        const UniChar character = CFStringGetCharacterFromInlineBuffer(&buffer, i);
+        if (character == '"' || character == '\\') {
+            *cursor++ = '\\';
+            *cursor++ = (char)character;
+        } else if (character >= 0x20 && character < 0x7f) {
+            *cursor++ = (char)character;
+        } else {
+            // Non-ASCII and control characters, neither of which can appear in a header value. Surrogate pairs are written as two escapes.
+            *cursor++ = '\\';
+            *cursor++ = 'u';
+            *cursor++ = kHexDigits[(character >> 12) & 0xf];
+            *cursor++ = kHexDigits[(character >> 8) & 0xf];
+            *cursor++ = kHexDigits[(character >> 4) & 0xf];
+            *cursor++ = kHexDigits[character & 0xf];
+        }
+    }
+    *cursor++ = '"';
+    writer->length += cursor - start;
+}
+
+static BOOL _jsonWriterAppendValue(TJDropboxJSONWriter *const writer, const id value)
+{
+    if ([value isKindOfClass:[NSString class]]) {
+        _jsonWriterAppendString(writer, value);
+    } else if ([value isKindOfClass:[NSNumber class]]) {
+        NSNumber *const number = value;
+        char string[32];
+        int length;
+        if ((__bridge CFBooleanRef)number == kCFBooleanTrue) {
+            length = snprintf(string, sizeof(string), "true");
+        } else if ((__bridge CFBooleanRef)number == kCFBooleanFalse) {
+            length = snprintf(string, sizeof(string), "false");
+        } else if (CFNumberIsFloatType((__bridge CFNumberRef)number)) {
+            const double doubleValue = number.doubleValue;
+            if (!isfinite(doubleValue)) {
+                return NO;
+            }
+            length = snprintf(string, sizeof(string), "%.17g", doubleValue);
+        } else if (*number.objCType == 'Q') {
+            length = snprintf(string, sizeof(string), "%llu", number.unsignedLongLongValue);
+        } else {
+            length = snprintf(string, sizeof(string), "%lld", number.longLongValue);
+        }
+        _jsonWriterAppendBytes(writer, string, length);
+    } else if ([value isKindOfClass:[NSDictionary class]]) {
+        _jsonWriterAppendBytes(writer, "{", 1);
+        __block BOOL isFirst = YES;
+        __block BOOL success = YES;
+        [(NSDictionary *)value enumerateKeysAndObjectsUsingBlock:^(id _Nonnull key, id _Nonnull object, BOOL * _Nonnull stop) {
+            if (![key isKindOfClass:[NSString class]]) {
+                success = NO;
+                *stop = YES;
+                return;
+            }
+            if (!isFirst) {
+                _jsonWriterAppendBytes(writer, ",", 1);
+            }
+            isFirst = NO;
+            _jsonWriterAppendString(writer, key);
+            _jsonWriterAppendBytes(writer, ":", 1);
+            if (!_jsonWriterAppendValue(writer, object)) {
+                success = NO;
+                *stop = YES;
+            }
+        }];
+        if (!success) {
+            return NO;
+        }
+        _jsonWriterAppendBytes(writer, "}", 1);
+    } else if ([value isKindOfClass:[NSArray class]]) {
+        _jsonWriterAppendBytes(writer, "[", 1);
+        BOOL isFirst = YES;
+        for (id object in (NSArray *)value) {
+            if (!isFirst) {
+                _jsonWriterAppendBytes(writer, ",", 1);
+            }
+            isFirst = NO;
+            if (!_jsonWriterAppendValue(writer, object)) {
+                return NO;
+            }
+        }
+        _jsonWriterAppendBytes(writer, "]", 1);
+    } else if (value == [NSNull null]) {
+        _jsonWriterAppendBytes(writer, "null", 4);
+    } else {
+        return NO;
+    }
+    return YES;
+}
+
+/// Writes @c parameters and hands the finished buffer to @c block, which takes ownership of it if @c isHeapAllocated is set.
+static void _writeParameters(NSDictionary<NSString *, id> *const parameters, NS_NOESCAPE void (^const block)(char *bytes, NSUInteger length, BOOL isHeapAllocated))
+{
+    TJDropboxJSONWriter writer;
+    _jsonWriterInitialize(&writer);
+    if (_jsonWriterAppendValue(&writer, parameters)) {
+        block(writer.bytes, writer.length, writer.bytes != writer.inlineBytes);
+    } else {
+        NSLog(@"[TJDropbox] - Error in %s: Unsupported value in %@", __PRETTY_FUNCTION__, parameters);
+        if (writer.bytes != writer.inlineBytes) {
+            free(writer.bytes);
+        }
+    }
+}
+
+static NSData *_parameterDataForParameters(NSDictionary<NSString *, id> *const parameters)
+{
+    __block NSData *parameterData = nil;
+    if (parameters.count > 0) {
+        _writeParameters(parameters, ^(char *bytes, NSUInteger length, BOOL isHeapAllocated) {
+            if (isHeapAllocated) {
+                parameterData = [NSData dataWithBytesNoCopy:bytes length:length freeWhenDone:YES];
+            } else {
+                parameterData = [NSData dataWithBytes:bytes length:length];
+            }
+        });
+    }
+    return parameterData;
+}
+
+static NSString *_parameterStringForParameters(NSDictionary<NSString *, id> *const parameters)
+{
+    __block NSString *parameterString = nil;
+    if (parameters.count > 0) {
+        _writeParameters(parameters, ^(char *bytes, NSUInteger length, BOOL isHeapAllocated) {
+            if (isHeapAllocated) {
+                parameterString = [[NSString alloc] initWithBytesNoCopy:bytes length:length encoding:NSASCIIStringEncoding freeWhenDone:YES];
+            } else {
+                parameterString = [[NSString alloc] initWithBytes:bytes length:length encoding:NSASCIIStringEncoding];
+            }
+        });
+    }
+    return parameterString;
+}
+
+#if TJDROPBOX_BENCHMARK
+// Lets Benchmarks/TJDropboxBenchmark.m compare the JSON writer with the NSJSONSerialization based encoding it replaced.
+NSString * _Nullable TJDropboxParameterStringForParameters(NSDictionary<NSString *, id> *const parameters) {
+    return _parameterStringForParameters(parameters);
+}
+#endif
+
+static NSMutableURLRequest *_baseRequest(NSURL *const baseURL, NSString *const path, NSString *const accessToken)
+{
+    NSURLComponents *const components = [[NSURLComponents alloc] initWithURL:baseURL resolvingAgainstBaseURL:NO];
+    // Base URLs may include a path prefix, for instance when pointed at a proxy.
+    NSString *const pathPrefix = [components.path hasSuffix:@"/"] ? [components.path substringToIndex:components.path.length - 1] : components.path;
+    components.path = pathPrefix.length > 0 ? [pathPrefix stringByAppendingString:path] : path;
+    
+    NSMutableURLRequest *const request = [[NSMutableURLRequest alloc] initWithURL:components.URL];
+    request.HTTPMethod = @"POST";
+    
+    if (accessToken) {
+        NSString *const authorization = [NSString stringWithFormat:@"Bearer %@", accessToken];
+        [request addValue:authorization forHTTPHeaderField:@"Authorization"];
+    }
+    
+    void (^requestModifier)(NSMutableURLRequest *) = [TJDropbox requestModifier];
+    if (requestModifier != nil) {
+        requestModifier(request);
+    }
+    
+    return request;
+}
+
+// Thanks Claude https://tijo.link/BGdVNx
+// Deflates the input in slices and gives up as soon as the output is clearly not going to be smaller than the input.
+// Returns nil if the data isn't worth compressing.
+static NSData *_gzipCompressDataIfSmallerAtLevel(NSData *const data, const int level)
+{
+    static const NSUInteger kSliceSize = 1024 * 1024;
+    static const uLong kIncompressibleOutputPercentage = 97; // Deflate buffers a little internally, so output that's this close to the input size after a slice won't end up meaningfully smaller.
+    
+    if (!data.length) {
+        return nil;
+    }
+    
+    const uint64_t startTimestamp = _tj_metricsEnabled ? _metricsTimestamp() : 0;
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    if (deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return nil;
+    }
+    
+    // deflateBound guarantees every slice is fully consumed by a single deflate call.
+    NSMutableData *const compressedData = [NSMutableData dataWithLength:deflateBound(&strm, data.length)];
+    strm.avail_out = (uInt)compressedData.length;
+    strm.next_out = compressedData.mutableBytes;
+    
+    NSUInteger consumedLength = 0;
+    int status = Z_OK;
+    while (status == Z_OK) {
+        const NSUInteger sliceLength = MIN(kSliceSize, data.length - consumedLength);
+        strm.next_in = (Bytef *)data.bytes + consumedLength;
+        strm.avail_in = (uInt)sliceLength;
+        consumedLength += sliceLength;
+        const BOOL isLastSlice = consumedLength == data.length;
+    
+        status = deflate(&strm, isLastSlice ? Z_FINISH : Z_NO_FLUSH);
+    
+        if (status == Z_OK && strm.total_out * 100 >= strm.total_in * kIncompressibleOutputPercentage) {
+            break;
+        }
+    }
+    
+    const BOOL success = status == Z_STREAM_END && strm.total_out < data.length;
+    [compressedData setLength:strm.total_out];
+    deflateEnd(&strm);
+    
+    if (startTimestamp) {
+        _recordOperationMetrics(TJDropboxMetricsEndpointCompression, startTimestamp, strm.total_in, strm.total_out);
+    }
+    
+    return success ? compressedData : nil;
+}
+
+static NSData *_gzipCompressDataIfSmaller(NSData *const data)
+{
+    return _gzipCompressDataIfSmallerAtLevel(data, Z_DEFAULT_COMPRESSION);
+}
+
+static BOOL _tj_skipsCompressionOfIncompressibleFiles;
+
+// Estimates whether a file is worth gzipping by compressing a small sample from the middle of it, which skips past headers that tend to compress well even in JPEGs, videos, archives, etc.
+static BOOL _shouldCompressFile(NSString *const path, const unsigned long long fileSize)
+{
+    static const NSUInteger kSampleSize = 64 * 1024;
+    static const NSUInteger kMaximumSampleOutputPercentage = 90;
+    
+    NSFileHandle *const fileHandle = [NSFileHandle fileHandleForReadingAtPath:path];
+    if (fileSize > kSampleSize * 2) {
+        [fileHandle seekToFileOffset:fileSize / 2];
+    }
+    NSData *const sample = [fileHandle readDataOfLength:kSampleSize];
+    [fileHandle closeFile];
+    
+    NSData *const compressedSample = _gzipCompressDataIfSmaller(sample);
+    return compressedSample != nil && compressedSample.length * 100 < sample.length * kMaximumSampleOutputPercentage;
+}
+
+// Returns a stream that produces the gzipped contents of the file at the given path.
+// The file is read and deflated as the stream is consumed, so memory use is bounded by the stream buffer size rather than the file size.
+// progressBlock is invoked on the producer's queue, callers are expected to forward it to their task's callback queue.
+static NSInputStream *_gzipCompressedInputStreamForFile(NSString *const path, void (^const progressBlock)(unsigned long long bytesRead))
+{
+    NSInputStream *inputStream = nil;
+    NSOutputStream *outputStream = nil;
+    [NSStream getBoundStreamsWithBufferSize:kGzipStreamBufferSize inputStream:&inputStream outputStream:&outputStream];
+    
+    [[[TJDropboxGzipStreamProducer alloc] initWithPath:path
+                                           inputStream:inputStream
+                                          outputStream:outputStream
+                                         progressBlock:progressBlock] start];
+    
+    return inputStream;
+}
+
+// Computes Dropbox content_hash as specified in https://www.dropbox.com/developers/reference/content-hash
+// The content_hash is computed by dividing the file into 4MB blocks, SHA-256 hashing each block,
+// then SHA-256 hashing the concatenated block hashes, and finally hex-encoding the result.
+static NSString *_dropboxContentHashForData(NSData *const data) {
+    // Hex encode the result
+    NSMutableString *hexString = [NSMutableString stringWithCapacity:data.length * 2];
+    const unsigned char *bytes = data.bytes;
+    for (NSUInteger i = 0; i < data.length; i++) {
+        [hexString appendFormat:@"%02x", bytes[i]];
+    }
+    return hexString;
+}
+
+// Used for files whose size can't be known up front (anything that isn't a regular file), or if block buffers can't be allocated.
+static NSData * _Nullable _fileContentHashSequential(NSString *const filePath) {
+    NSFileHandle *fileHandle = [NSFileHandle fileHandleForReadingAtPath:filePath];
+    if (!fileHandle) {
+        return nil;
+    }
+    
+    TJDropboxContentHasher *const hasher = [TJDropboxContentHasher new];
+    NSData *block;
+    do {
+        @autoreleasepool {
+            block = [fileHandle readDataOfLength:kContentHashBlockSize];
+            [hasher appendData:block];
+        }
+    } while (block.length == kContentHashBlockSize);
+    
+    return [hasher finalizeContentHash];
+}
+
+// Reads exactly length bytes at offset, returns NO on error or if the file ends early.
+static BOOL _readFileBlock(const int fileDescriptor, void *const buffer, const size_t length, const off_t offset)
+{
+    size_t totalLength = 0;
+    while (totalLength < length) {
+        const ssize_t readLength = pread(fileDescriptor, (char *)buffer + totalLength, length - totalLength, offset + totalLength);
+        if (readLength < 0 && errno == EINTR) {
+            continue;
+        } else if (readLength <= 0) {
+            return NO;
+        }
+        totalLength += readLength;
+    }
+    return YES;
+}
+
+static NSData * _Nullable _fileContentHash(NSString *const filePath) {
+    // Blocks are read with pread and hashed in parallel, then their hashes are folded together in order.
+    // Reading rather than mapping the file means a file that's truncated while it's hashed fails the hash instead of faulting.
+    const int fileDescriptor = open(filePath.fileSystemRepresentation, O_RDONLY | O_CLOEXEC);
+    if (fileDescriptor < 0) {
+        return nil;
+    }
+    struct stat fileStatus;
+    if (fstat(fileDescriptor, &fileStatus) != 0 || !S_ISREG(fileStatus.st_mode)) {
+        close(fileDescriptor);
+        return _fileContentHashSequential(filePath);
+    }
+    
+    const unsigned long long length = fileStatus.st_size;
+    const size_t blockCount = (size_t)((length + kContentHashBlockSize - 1) / kContentHashBlockSize);
+    unsigned char *const blockHashes = malloc(MAX(blockCount, 1) * CC_SHA256_DIGEST_LENGTH);
+    bool *const failedBlocks = calloc(MAX(blockCount, 1), sizeof(bool));
+    if (!blockHashes || !failedBlocks) {
+        free(blockHashes);
+        free(failedBlocks);
+        close(fileDescriptor);
+        return _fileContentHashSequential(filePath);
+    }
+    
+    dispatch_apply(blockCount, DISPATCH_APPLY_AUTO, ^(size_t i) {
+        const unsigned long long offset = (unsigned long long)i * kContentHashBlockSize;
+        const size_t blockLength = (size_t)MIN((unsigned long long)kContentHashBlockSize, length - offset);
+        void *const buffer = malloc(blockLength);
+        if (buffer && _readFileBlock(fileDescriptor, buffer, blockLength, (off_t)offset)) {
+            CC_SHA256(buffer, (CC_LONG)blockLength, blockHashes + i * CC_SHA256_DIGEST_LENGTH);
+        } else {
+            failedBlocks[i] = true;
+        }
+        free(buffer);
+    });
+    close(fileDescriptor);
+    
+    BOOL failed = NO;
+    for (size_t i = 0; i < blockCount && !failed; i++) {
+        failed = failedBlocks[i];
+    }
+    free(failedBlocks);
+    if (failed) {
+        free(blockHashes);
+        return nil;
+    }
+    
+    unsigned char finalHash[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(blockHashes, (CC_LONG)(blockCount * CC_SHA256_DIGEST_LENGTH), finalHash);
+    free(blockHashes);
+    
+    return [NSData dataWithBytes:finalHash length:CC_SHA256_DIGEST_LENGTH];
+}
+
+static NSData * _Nullable _measuredFileContentHash(NSString *const filePath) {
+    if (!_tj_metricsEnabled) {
+        return _fileContentHash(filePath);
+    }
+    const uint64_t startTimestamp = _metricsTimestamp();
+    NSData *const contentHash = _fileContentHash(filePath);
+    _recordOperationMetrics(TJDropboxMetricsEndpointContentHash, startTimestamp, [[NSFileManager defaultManager] attributesOfItemAtPath:filePath error:nil].fileSize, contentHash.length);
+    return contentHash;
+}
+
+NSData * _Nullable TJDropboxFileContentHash(NSString *const filePath) {
+    TJDropboxFileIdentity identity;
+    const BOOL hasIdentity = _fileIdentity(filePath, &identity);
+    NSData *contentHash = hasIdentity ? [_contentHashCache() contentHashForFileIdentity:identity] : nil;
+    if (!contentHash) {
+        contentHash = _measuredFileContentHash(filePath);
+        // Only cache the hash if the file didn't change while it was being read.
+        TJDropboxFileIdentity identityAfterHashing;
+        if (contentHash && hasIdentity && _fileIdentity(filePath, &identityAfterHashing) && _fileIdentitiesEqual(identity, identityAfterHashing)) {
+            [_contentHashCache() setContentHash:contentHash forFileIdentity:identity path:filePath];
+        }
+    }
+    return contentHash;
+}
+
+NSDictionary<NSString *, NSData *> *TJDropboxCachedFileContentHashes(NSArray<NSString *> *const filePaths) {
+    TJDropboxContentHashCache *const contentHashCache = _contentHashCache();
+    NSMutableDictionary<NSString *, NSData *> *const contentHashes = [NSMutableDictionary dictionaryWithCapacity:filePaths.count];
+    for (NSString *const filePath in filePaths) {
+        TJDropboxFileIdentity identity;
+        if (_fileIdentity(filePath, &identity)) {
+            contentHashes[filePath] = [contentHashCache contentHashForFileIdentity:identity];
+        }
+    }
+    return contentHashes;
+}
+
+void TJDropboxPruneFileContentHashCache(void) {
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+        [_contentHashCache() prune];
+    });
+}
+
+void TJDropboxRemoveAllCachedFileContentHashes(void) {
+    [_contentHashCache() removeAllContentHashes];
+}
+
+#if TJDROPBOX_BENCHMARK
+// Lets Benchmarks/TJDropboxBenchmark.m compare TJDropboxFileContentHash() with the sequential path, bypassing the cache.
+NSData * _Nullable TJDropboxFileContentHashSequential(NSString *const filePath) {
+    return _fileContentHashSequential(filePath);
+}
+#endif
+
+static NSMutableURLRequest *_apiRequest(NSString *const path, NSString *const accessToken, NSDictionary<NSString *, id> *const parameters)
+{
+    NSMutableURLRequest *const request = _baseRequest([TJDropbox apiBaseURL], path, accessToken);
+    request.HTTPBody = _parameterDataForParameters(parameters);
+    request.cachePolicy = NSURLRequestReloadIgnoringLocalAndRemoteCacheData;
+    
+    if (request.HTTPBody != nil) {
+        [request addValue:@"application/json" forHTTPHeaderField:@"Content-Type"];
+    }
+    
+    return request;
+}
+
+static NSMutableURLRequest *_contentRequest(NSString *const path, NSString *const accessToken, NSDictionary<NSString *, id> *const parameters)
+{
+    NSMutableURLRequest *const request = _baseRequest([TJDropbox contentBaseURL], path, accessToken);
+    NSString *const parameterString = _parameterStringForParameters(parameters);
+    [request setValue:parameterString forHTTPHeaderField:@"Dropbox-API-Arg"];
+    return request;
+}
+
+/// For the few endpoints on the content host that take their arguments in the body rather than the Dropbox-API-Arg header.
+static NSMutableURLRequest *_contentRPCRequest(NSString *const path, NSString *const accessToken, NSDictionary<NSString *, id> *const parameters)
+{
+    NSMutableURLRequest *const request = _baseRequest([TJDropbox contentBaseURL], path, accessToken);
+    request.HTTPBody = _parameterDataForParameters(parameters);
+    request.cachePolicy = NSURLRequestReloadIgnoringLocalAndRemoteCacheData;
+    [request addValue:@"application/json" forHTTPHeaderField:@"Content-Type"];
+    return request;
+}
+
+static NSMutableURLRequest *_notifyRequest(NSString *const path, NSDictionary<NSString *, id> *const parameters)
+{
+    // Notification requests aren't authenticated, the cursor identifies what's being watched.
+    NSMutableURLRequest *const request = _baseRequest([TJDropbox notifyBaseURL], path, nil);
+    request.HTTPBody = _parameterDataForParameters(parameters);
+    request.cachePolicy = NSURLRequestReloadIgnoringLocalAndRemoteCacheData;
+    [request addValue:@"application/json" forHTTPHeaderField:@"Content-Type"];
+    return request;
+}
+
+static TJDropboxURLSessionTaskDelegate *_taskDelegate(void)
+{
+    static TJDropboxURLSessionTaskDelegate *taskDelegate;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        taskDelegate = [TJDropboxURLSessionTaskDelegate new];
+    });
+    return taskDelegate;
+}
+
+static BOOL _tj_usesSessionPoolsPerCredential;
+static os_unfair_lock _tj_sessionsLock = OS_UNFAIR_LOCK_INIT;
+static NSURLSession *_tj_sharedSessions[kSessionPoolCount]; // Only accessed while holding _tj_sessionsLock
+static NSHashTable<TJDropboxCredential *> *_tj_credentialsWithSessions; // Only accessed while holding _tj_sessionsLock
+
+static NSURLSession *_makeSession(const TJDropboxSessionPool sessionPool)
+{
+    static const NSTimeInterval kBulkTransferMaximumDuration = 24.0 * 60.0 * 60.0;
+    static const NSTimeInterval kBackgroundRequestMaximumDuration = 10.0 * 60.0;
+    static const NSInteger kBulkMaximumConnectionsPerHost = 8;
+    
+    NSURLSessionConfiguration *const configuration = [NSURLSessionConfiguration ephemeralSessionConfiguration];
+    configuration.shouldUseExtendedBackgroundIdleMode = YES; // Allows requests to run better when the app is backgrounded https://twitter.com/BigZaphod/status/1164977540479553543
+    configuration.waitsForConnectivity = YES;
+    // Each pool has its own connections, so over HTTP/2 bulk transfers don't share a multiplexed connection (and its flow control window) with RPC requests.
+    // The connection limits only matter for HTTP/1.1 since HTTP/2 multiplexes everything to a host over one connection.
+    NSString *sessionDescription;
+    switch (sessionPool) {
+        case TJDropboxSessionPoolInteractive:
+            configuration.timeoutIntervalForResource = 60;
+            configuration.HTTPMaximumConnectionsPerHost = 4;
+            if (@available(iOS 12.0, macOS 10.14, *)) {
+                configuration.networkServiceType = NSURLNetworkServiceTypeResponsiveData;
+            }
+            sessionDescription = @"TJDropbox Interactive";
+            break;
+        case TJDropboxSessionPoolBulk:
+            // Large transfers on slow links can take far longer than any fixed limit, so these only time out once data stops moving for timeoutIntervalForRequest.
+            configuration.timeoutIntervalForResource = kBulkTransferMaximumDuration;
+            configuration.HTTPMaximumConnectionsPerHost = kBulkMaximumConnectionsPerHost;
+            sessionDescription = @"TJDropbox Bulk";
+            break;
+        case TJDropboxSessionPoolBackground:
+            // Longpolls set their own request timeout, which can run past a minute once Dropbox's jitter is added.
+            configuration.timeoutIntervalForResource = kBackgroundRequestMaximumDuration;
+            configuration.HTTPMaximumConnectionsPerHost = 2;
+            configuration.networkServiceType = NSURLNetworkServiceTypeBackground;
+            sessionDescription = @"TJDropbox Background";
+            break;
+    }
+    
+    if (@available(iOS 18.4, macOS 15.4, *)) {
+        configuration.usesClassicLoadingMode = NO;
+        if (@available(iOS 26.0, macOS 26.0, *)) {
+            configuration.enablesEarlyData = YES;
+        }
+    }
+    TJDropboxURLSessionTaskDelegate *const taskDelegate = _taskDelegate();
+    NSURLSession *const session = [NSURLSession sessionWithConfiguration:configuration delegate:taskDelegate delegateQueue:taskDelegate.serialOperationQueue];
+    session.sessionDescription = sessionDescription;
+    return session;
+}
+
+/// The session for @c sessionPool, per credential if enabled.
+static NSURLSession *_session(const TJDropboxSessionPool sessionPool, TJDropboxCredential *const credential)
+{
+    __block NSURLSession *session;
+    if (credential && _tj_usesSessionPoolsPerCredential) {
+        __block BOOL isFirstSession = NO;
+        [credential performSynchronized:^{
+            if (!credential.sessionsForPools) {
+                credential.sessionsForPools = [NSMutableDictionary new];
+                isFirstSession = YES;
+            }
+            session = credential.sessionsForPools[@(sessionPool)];
+            if (!session) {
+                session = _makeSession(sessionPool);
+                credential.sessionsForPools[@(sessionPool)] = session;
+            }
+        }];
+        if (isFirstSession) {
+            os_unfair_lock_lock(&_tj_sessionsLock);
+            if (!_tj_credentialsWithSessions) {
+                _tj_credentialsWithSessions = [NSHashTable weakObjectsHashTable];
+            }
+            [_tj_credentialsWithSessions addObject:credential];
+            os_unfair_lock_unlock(&_tj_sessionsLock);
+        }
+    } else {
+        os_unfair_lock_lock(&_tj_sessionsLock);
+        session = _tj_sharedSessions[sessionPool];
+        if (!session) {
+            session = _makeSession(sessionPool);
+            _tj_sharedSessions[sessionPool] = session;
+        }
+        os_unfair_lock_unlock(&_tj_sessionsLock);
+    }
+    return session;
+}
+
+/// Every session created so far, shared and per credential.
+static NSArray<NSURLSession *> *_allSessions(void)
+{
+    NSMutableArray<NSURLSession *> *const sessions = [NSMutableArray new];
+    os_unfair_lock_lock(&_tj_sessionsLock);
+    for (NSUInteger i = 0; i < kSessionPoolCount; i++) {
+        if (_tj_sharedSessions[i]) {
+            [sessions addObject:_tj_sharedSessions[i]];
+        }
+    }
+    NSArray<TJDropboxCredential *> *const credentials = _tj_credentialsWithSessions.allObjects;
+    os_unfair_lock_unlock(&_tj_sessionsLock);
+    for (TJDropboxCredential *const credential in credentials) {
+        [credential performSynchronized:^{
+            [sessions addObjectsFromArray:credential.sessionsForPools.allValues];
+        }];
+    }
+    return sessions;
+}
+
+static const NSTimeInterval kAccessTokenRefreshThreshold = 600.0; // Start refreshing in the background when there are fewer than 10 minutes until expiration
+static const NSTimeInterval kAccessTokenMinimumRemainingLifetime = 60.0; // Below this requests wait for the refresh rather than racing expiration
+
+/// @c taskBlock is handed the session for @c sessionPool to create its task with.
+static void _addTask(TJDropboxCredential *credential,
+                     const TJDropboxRequestLane lane,
+                     const TJDropboxSessionPool sessionPool,
+                     NSURL *const baseURL,
+                     NSURLSessionTask *(^taskBlock)(NSURLSession *session),
+                     void (^const failureCompletion)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))
+{
+    // Tasks may be created later on another thread (e.g. after a refresh), so carry the callback queue along.
+    dispatch_queue_t const callbackQueue = _currentCallbackQueue();
+    const uint64_t addTimestamp = _tj_metricsEnabled ? _metricsTimestamp() : 0;
+    void (^const deliverFailure)(NSDictionary *, NSError *) = ^(NSDictionary *parsedResponse, NSError *error) {
+        _performWithCallbackQueue(callbackQueue, ^{
+            _performCallback(^{
+                failureCompletion(parsedResponse, error);
+            });
+        });
+    };
+    dispatch_block_t performTaskBlock = ^{
+        const uint64_t enqueueTimestamp = _tj_metricsEnabled ? _metricsTimestamp() : 0;
+        // The scheduler invokes this once the request is started, and again if it needs to be retried.
+        [_scheduler() enqueueTaskBlock:^NSURLSessionTask *{
+            __block NSURLSessionTask *task;
+            _performWithCallbackQueue(callbackQueue, ^{
+                const uint64_t buildTimestamp = _tj_metricsEnabled ? _metricsTimestamp() : 0;
+                task = taskBlock(_session(sessionPool, credential));
+                if (_tj_metricsEnabled && addTimestamp && task) {
+                    [_taskDelegate() setRefreshWaitDuration:_metricsDuration(addTimestamp, enqueueTimestamp) requestBuildDuration:_metricsDuration(buildTimestamp, _metricsTimestamp()) forTask:task];
+                }
+            });
+            return task;
+        }
+                                  lane:lane
+                           sessionPool:sessionPool
+                               baseURL:baseURL
+                            credential:credential
+                          failureBlock:deliverFailure];
+    };
+    __block BOOL shouldWaitForRefresh = NO;
+    __block BOOL shouldRefresh = NO;
+    if (credential) {
+        [credential performSynchronized:^{
+            if (credential.expirationDate != nil) {
+                const NSTimeInterval remainingLifetime = credential.expirationDate.timeIntervalSinceNow;
+                // Tokens are refreshed in the background once they're close to expiring, requests only wait if the current one is (nearly) unusable.
+                shouldRefresh = remainingLifetime < kAccessTokenRefreshThreshold;
+                shouldWaitForRefresh = remainingLifetime < kAccessTokenMinimumRemainingLifetime;
+            }
+        }];
+    }
+    
+    if (shouldWaitForRefresh) {
+        [credential refreshAccessTokenWithCompletion:^(NSDictionary *parsedResponse, NSError *error) {
+            if (error) {
+                deliverFailure(parsedResponse, error);
+            } else {
+                performTaskBlock();
+            }
+        }];
+    } else {
+        if (shouldRefresh) {
+            [credential refreshAccessTokenWithCompletion:nil];
+        }
+        performTaskBlock();
+    }
+}
+
+static void _performRequest(TJDropboxCredential *credential, const TJDropboxRequestLane lane, const TJDropboxSessionPool sessionPool, NSURL *const baseURL, NSURLRequest *(^requestBlock)(void), void (^const completion)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))
+{
+    _addTask(credential,
+             lane,
+             sessionPool,
+             baseURL,
+             ^NSURLSessionTask *(NSURLSession *session) {
+        NSURLRequest *const request = requestBlock();
+        NSURLSessionDataTask *const task = [session dataTaskWithRequest:request];
+        [_taskDelegate() setProgressBlock:nil
+                          completionBlock:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
+            NSDictionary *parsedResult = nil;
+            _processResult(data, response, &error, &parsedResult);
+            completion(parsedResult, error);
+        }
+                              forDataTask:task];
+        return task;
+    },
+             completion);
+}
+
+static void _performAPIRequest(TJDropboxCredential *credential, NSURLRequest *(^requestBlock)(void), void (^const completion)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))
+{
+    _performRequest(credential, TJDropboxRequestLaneInteractive, TJDropboxSessionPoolInteractive, [TJDropbox apiBaseURL], requestBlock, completion);
+}
+
+/// Sends read-only requests through the response cache. Identical calls made while a request is in flight wait on it rather than sending their own,
+/// and responses accepted by @c isCacheable (successful ones if nil) are reused until they expire. Completions are always called asynchronously on the caller's callback queue.
+static void _performCachedAPIRequest(TJDropboxCredential *credential, NSString *const endpoint, NSString *const arguments, NSURLRequest *(^requestBlock)(void), BOOL (^const isCacheable)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error), void (^const completion)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))
+{
+    NSString *const key = [NSString stringWithFormat:@"%p\n%@\n%@", credential, endpoint, arguments];
+    dispatch_queue_t const callbackQueue = _currentCallbackQueue();
+    void (^const deliveryBlock)(NSDictionary *, NSError *) = ^(NSDictionary *parsedResponse, NSError *error) {
+        dispatch_async(callbackQueue ?: _workerQueue(), ^{
+            _performWithCallbackQueue(callbackQueue, ^{
+                completion(parsedResponse, error);
+            });
+        });
+    };
+    
+    TJDropboxResponseCache *const responseCache = _responseCache();
+    __block NSDictionary *cachedParsedResponse = nil;
+    __block BOOL isInFlight = NO;
+    __block NSUInteger generation = 0;
+    [responseCache performSynchronized:^{
+        TJDropboxCachedResponse *const cachedResponse = responseCache.cachedResponsesForKeys[key];
+        if (cachedResponse) {
+            if (cachedResponse.credential == credential && _metricsTimestamp() < cachedResponse.expirationTimestamp) {
+                responseCache.hitCount++;
+                [responseCache.recentlyUsedKeys removeObject:key];
+                [responseCache.recentlyUsedKeys addObject:key];
+                cachedParsedResponse = cachedResponse.parsedResponse;
+                return;
+            }
+            [responseCache removeCachedResponseForKey:key];
+        }
+        NSMutableArray<void (^)(NSDictionary *, NSError *)> *const waitingCompletions = responseCache.waitingCompletionsForKeys[key];
+        if (waitingCompletions) {
+            responseCache.coalescedCount++;
+            [waitingCompletions addObject:deliveryBlock];
+            isInFlight = YES;
+            return;
+        }
+        responseCache.missCount++;
+        responseCache.waitingCompletionsForKeys[key] = [NSMutableArray arrayWithObject:deliveryBlock];
+        generation = responseCache.generation;
+    }];
+    
+    if (cachedParsedResponse) {
+        deliveryBlock(cachedParsedResponse, nil);
+        return;
+    }
+    if (isInFlight) {
+        return;
+    }
+    
+    _performAPIRequest(credential, requestBlock, ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        const BOOL shouldCache = isCacheable ? isCacheable(parsedResponse, error) : (!error && parsedResponse != nil);
+        __block NSArray<void (^)(NSDictionary *, NSError *)> *waitingCompletions;
+        [responseCache performSynchronized:^{
+            waitingCompletions = responseCache.waitingCompletionsForKeys[key];
+            [responseCache.waitingCompletionsForKeys removeObjectForKey:key];
+            if (shouldCache && responseCache.lifetime > 0.0 && responseCache.generation == generation) {
+                TJDropboxCachedResponse *const cachedResponse = [TJDropboxCachedResponse new];
+                cachedResponse.parsedResponse = parsedResponse;
+                cachedResponse.credential = credential;
+                cachedResponse.expirationTimestamp = _metricsTimestamp() + (uint64_t)(responseCache.lifetime * NSEC_PER_SEC);
+                responseCache.cachedResponsesForKeys[key] = cachedResponse;
+                [responseCache.recentlyUsedKeys removeObject:key];
+                [responseCache.recentlyUsedKeys addObject:key];
+                [responseCache trimToMaximumCount];
+            }
+        }];
+        for (void (^const waitingCompletion)(NSDictionary *, NSError *) in waitingCompletions) {
+            waitingCompletion(parsedResponse, error);
+        }
+    });
+}
+
+static void _refreshCredential(TJDropboxCredential *const credential, void (^completion)(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error))
+{
+    _performAPIRequest(nil,
+                       ^NSURLRequest *{
+        // https://www.dropbox.com/developers/documentation/http/documentation#oauth2-token
+        // https://tijo.link/BmeoVo
+        NSMutableURLRequest *const request = _apiRequest(@"/oauth2/token", nil, nil);
+        NSURLComponents *const components = [NSURLComponents new];
+        components.queryItems = @[
+            [NSURLQueryItem queryItemWithName:@"grant_type" value:@"refresh_token"],
+            [NSURLQueryItem queryItemWithName:@"refresh_token" value:credential.refreshToken],
+            [NSURLQueryItem queryItemWithName:@"client_id" value:credential.clientIdentifier],
+        ];
+        request.HTTPBody = [components.query dataUsingEncoding:NSUTF8StringEncoding];
+        [request addValue:@"application/x-www-form-urlencoded; charset=utf-8" forHTTPHeaderField:@"Content-Type"];
+        return request;
+    },
+                       ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        
+        NSString *const accessToken = parsedResponse[@"access_token"];
+        const id expiresInValue = parsedResponse[@"expires_in"];
+        NSDate *const expirationDate = expiresInValue != nil ? [NSDate dateWithTimeIntervalSinceNow:[expiresInValue doubleValue]] : nil;
+        if (accessToken && expirationDate) {
+            [credential performSynchronized:^{
+                credential.accessToken = accessToken;
+                credential.expirationDate = expirationDate;
+            }];
+            [[NSNotificationCenter defaultCenter] postNotificationName:TJDropboxCredentialDidRefreshAccessTokenNotification
+                                                                object:credential];
+        }
+        completion(parsedResponse, error);
+    });
+}
+
+static NSData *_resultDataForContentRequestResponse(NSURLResponse *const response)
+{
+    NSHTTPURLResponse *const httpURLResponse = [response isKindOfClass:[NSHTTPURLResponse class]] ? (NSHTTPURLResponse *)response : nil;
+    NSString *resultString;
+    static NSString *const kDropboxAPIResultHeaderFieldKey = @"Dropbox-API-Result";
+    if (@available(iOS 13.0, macOS 10.15, *)) {
+        resultString = [httpURLResponse valueForHTTPHeaderField:kDropboxAPIResultHeaderFieldKey];
+    } else {
+        resultString = httpURLResponse.allHeaderFields[kDropboxAPIResultHeaderFieldKey];
+    }
+    NSData *const resultData = [resultString dataUsingEncoding:NSUTF8StringEncoding];
+    return resultData;
+}
+
+static BOOL _processResult(NSData *const jsonData, NSURLResponse *const response, NSError **error, NSDictionary **parsedResult)
+{
+    NSString *errorString = nil;
+    if (jsonData.length > 0) {
+        id result = [NSJSONSerialization JSONObjectWithData:jsonData options:0 error:nil];
+        if ([result isKindOfClass:[NSDictionary class]]) {
+            *parsedResult = result;
+        } else {
+            errorString = [[NSString alloc] initWithData:jsonData encoding:NSUTF8StringEncoding];
+        }
+    }
+    
+    // Things leading to errors
+    // 1. error returned to this block
+    // 2. dropboxAPIErrorDictionary populated
+    // 3. Status code >= 400
+    // 4. errorString populated
+    
+    NSHTTPURLResponse *const httpURLResponse = [response isKindOfClass:[NSHTTPURLResponse class]] ? (NSHTTPURLResponse *)response : nil;
+    const NSInteger statusCode = [httpURLResponse statusCode];
+    NSDictionary *const dropboxAPIErrorDictionary = [*parsedResult objectForKey:@"error"];
+    
+    if (!*error) {
+        if (statusCode >= 400 || dropboxAPIErrorDictionary || (!*parsedResult && statusCode != 200)) {
+            NSMutableDictionary *const userInfo = [NSMutableDictionary new];
+            if (response) {
+                [userInfo setObject:response forKey:TJDropboxErrorUserInfoKeyResponse];
+            }
+            if ([dropboxAPIErrorDictionary isKindOfClass:[NSDictionary class]]) {
+                [userInfo setObject:dropboxAPIErrorDictionary forKey:TJDropboxErrorUserInfoKeyDropboxError];
+            }
+            if (errorString) {
+                [userInfo setObject:errorString forKey:TJDropboxErrorUserInfoKeyErrorString];
+            }
+            *error = [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:userInfo];
+        }
+    }
+    
+    return *error == nil;
+}
+
+// Converts an entry from a batch endpoint's results into its metadata, or an error if that entry failed.
+static id _resultForBatchEntry(NSDictionary *const entry)
+{
+    NSString *const tag = [entry isKindOfClass:[NSDictionary class]] ? entry[@".tag"] : nil;
+    if ([tag isEqualToString:@"success"]) {
+        // Depending on the endpoint the metadata is either nested or inlined into the entry.
+        NSDictionary *const metadata = entry[@"metadata"] ?: entry[@"success"];
+        if ([metadata isKindOfClass:[NSDictionary class]]) {
+            return metadata;
+        }
+        NSMutableDictionary *const inlinedMetadata = [entry mutableCopy];
+        [inlinedMetadata removeObjectForKey:@".tag"];
+        return inlinedMetadata;
+    }
+    NSDictionary *const failure = [entry isKindOfClass:[NSDictionary class]] ? entry[@"failure"] : nil;
+    return [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:[failure isKindOfClass:[NSDictionary class]] ? @{TJDropboxErrorUserInfoKeyDropboxError: failure} : nil];
+}
+
+static void _pollAsyncJob(TJDropboxCredential *const credential, NSString *const checkPath, NSString *const asyncJobIdentifier, const NSTimeInterval delay, void (^const completion)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))
+{
+    static const NSTimeInterval kMaximumAsyncJobPollInterval = 5.0;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), _callbackQueuePreservingBlock(^{
+        _performAPIRequest(credential,
+                           ^NSURLRequest *{
+            return _apiRequest(checkPath, credential.accessToken,
+                               @{
+                                   @"async_job_id": asyncJobIdentifier
+                               });
+        },
+                           ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+            NSString *const tag = parsedResponse[@".tag"];
+            if ([tag isEqualToString:@"in_progress"]) {
+                _pollAsyncJob(credential, checkPath, asyncJobIdentifier, MIN(delay * 2.0, kMaximumAsyncJobPollInterval), completion);
+            } else if ([tag isEqualToString:@"failed"]) {
+                NSDictionary *const failure = [parsedResponse[tag] isKindOfClass:[NSDictionary class]] ? parsedResponse[tag] : parsedResponse;
+                completion(nil, error ?: [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{TJDropboxErrorUserInfoKeyDropboxError: failure}]);
+            } else {
+                completion(parsedResponse, error);
+            }
+        });
+    }));
+}
+
+// Performs a request to a batch endpoint, if the server responds with an async job it's polled using @c checkPath until it's complete.
+static void _performBatchAPIRequest(TJDropboxCredential *credential, NSURLRequest *(^requestBlock)(void), NSString *const checkPath, void (^const completion)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))
+{
+    _performAPIRequest(credential, requestBlock, ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        NSString *const asyncJobIdentifier = [parsedResponse[@".tag"] isEqual:@"async_job_id"] ? parsedResponse[@"async_job_id"] : nil;
+        if (asyncJobIdentifier) {
+            _pollAsyncJob(credential, checkPath, asyncJobIdentifier, 0.5, completion);
+        } else {
+            completion(parsedResponse, error);
+        }
+    });
+}
+
+// Runs @c block for each index in [0, count) with at most @c maximumConcurrency outstanding at once, each must call its @c done block exactly once.
+static void _performWithMaximumConcurrency(const NSUInteger count, const NSUInteger maximumConcurrency, void (^const block)(NSUInteger index, dispatch_block_t done), dispatch_block_t completion)
+{
+    if (count == 0) {
+        completion();
+        return;
+    }
+    
+    dispatch_queue_t const queue = dispatch_queue_create("com.tijo.TJDropbox.maximum-concurrency", DISPATCH_QUEUE_SERIAL);
+    __block NSUInteger nextIndex = 0;
+    __block NSUInteger remainingCount = count;
+    __block dispatch_block_t startNext; // Only accessed on queue, cleared once finished to break the retain cycle
+    startNext = ^{
+        const NSUInteger index = nextIndex++;
+        _dispatchAsync(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+            block(index, ^{
+                _dispatchAsync(queue, ^{
+                    remainingCount--;
+                    if (nextIndex < count) {
+                        startNext();
+                    } else if (remainingCount == 0) {
+                        startNext = nil;
+                        _performCallback(completion);
+                    }
+                });
+            });
+        });
+    };
+    _dispatchAsync(queue, ^{
+        for (NSUInteger i = 0; i < MIN(count, MAX(maximumConcurrency, 1)); i++) {
+            startNext();
+        }
+    });
+}
+
+#pragma mark - Account Info
+
++ (void)getAccountInformationWithCredential:(TJDropboxCredential *)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    _performCachedAPIRequest(credential, @"/2/users/get_current_account", @"",
+                             ^NSURLRequest *{
+        return _apiRequest(@"/2/users/get_current_account", credential.accessToken, nil);
+    },
+                             nil,
+                             completion);
+}
+
+#pragma mark - File Inspection
+
+static NSURLRequest *_listFolderRequest(NSString *const filePath, NSString *const accessToken, NSString *_Nullable const cursor, const BOOL includeDeleted, const BOOL recursive)
+{
+    NSString *const urlPath = cursor.length > 0 ? @"/2/files/list_folder/continue" : @"/2/files/list_folder";
+    NSMutableDictionary *const parameters = [NSMutableDictionary new];
+    if (cursor.length > 0) {
+        [parameters setObject:cursor forKey:@"cursor"];
+    } else {
+        [parameters setObject:filePath forKey:@"path"];
+        [parameters setObject:@NO forKey:@"include_non_downloadable_files"];
+        if (includeDeleted) {
+            [parameters setObject:@YES forKey:@"include_deleted"];
+        }
+        if (recursive) {
+            [parameters setObject:@YES forKey:@"recursive"];
+        }
+    }
+    if (!cursor) {
+        [parameters setObject:@(2000) forKey:@"limit"];
+    }
+    return _apiRequest(urlPath, accessToken, parameters);
+}
+
++ (void)listFolderWithPath:(NSString *const)path credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray<NSDictionary *> *_Nullable entries, NSString *_Nullable cursor, NSError *_Nullable error))completion
+{
+    [self listFolderWithPath:path cursor:nil includeDeleted:NO credential:credential completion:completion];
+}
+
++ (void)listFolderWithPath:(NSString *const)path cursor:(nullable NSString *const)cursor includeDeleted:(const BOOL)includeDeleted credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray<NSDictionary *> *_Nullable entries, NSString *_Nullable cursor, NSError *_Nullable error))completion
+{
+    NSMutableArray<NSDictionary *> *const accumulatedFiles = [NSMutableArray new];
+    [self listFolderWithPath:path
+                      cursor:cursor
+              includeDeleted:includeDeleted
+                  credential:credential
+                 pageHandler:^BOOL(NSArray<NSDictionary *> * _Nonnull entries, BOOL hasMore) {
+        [accumulatedFiles addObjectsFromArray:entries];
+        return YES;
+    }
+                  completion:^(NSString * _Nullable outCursor, NSError * _Nullable error) {
+        if (error) {
+            completion(nil, nil, error);
+        } else {
+            completion(accumulatedFiles, outCursor, nil);
+        }
+    }];
+}
+
+static void _listFolder(NSString *const path, NSString *_Nullable const cursor, const BOOL includeDeleted, const BOOL recursive, TJDropboxCredential *const credential, BOOL (^const pageHandler)(NSArray<NSDictionary *> *entries, BOOL hasMore), void (^const completion)(NSString *_Nullable cursor, NSError *_Nullable error))
+{
+    _performAPIRequest(credential,
+                       ^NSURLRequest *{
+        return _listFolderRequest(path, credential.accessToken, cursor, includeDeleted, recursive);
+    },
+                       ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        NSArray *const files = [parsedResponse objectForKey:@"entries"];
+        id hasMoreObject = [parsedResponse objectForKey:@"has_more"];
+        if (!error && files != nil && [hasMoreObject isKindOfClass:[NSNumber class]]) {
+            if (![files isKindOfClass:[NSArray class]]) {
+                completion(nil, error != nil ? error : [NSError errorWithDomain:TJDropboxErrorDomain code:3 userInfo:nil]);
+                return;
+            }
+            
+            const BOOL hasMore = [(NSNumber *)hasMoreObject boolValue];
+            const id outCursorObject = [parsedResponse objectForKey:@"cursor"];
+            NSString *const outCursor = [outCursorObject isKindOfClass:[NSString class]] ? outCursorObject : nil;
+            if (hasMore && !outCursor) {
+                // We can't load more without a cursor
+                completion(nil, error != nil ? error : [NSError errorWithDomain:TJDropboxErrorDomain code:1 userInfo:nil]);
+            } else if (pageHandler(files, hasMore) && hasMore) {
+                // Fetch next page
+                _listFolder(path, outCursor, includeDeleted, recursive, credential, pageHandler, completion);
+            } else {
+                // All files fetched or the caller stopped early, finish.
+                completion(outCursor, error);
+            }
+        } else {
+            completion(nil, error != nil ? error : [NSError errorWithDomain:TJDropboxErrorDomain code:2 userInfo:nil]);
+        }
+    });
+}
+
++ (void)listFolderWithPath:(NSString *const)path cursor:(nullable NSString *const)cursor includeDeleted:(const BOOL)includeDeleted credential:(TJDropboxCredential *const)credential pageHandler:(BOOL (^const)(NSArray<NSDictionary *> *entries, BOOL hasMore))pageHandler completion:(void (^const)(NSString *_Nullable cursor, NSError *_Nullable error))completion
+{
+    _listFolder(path, cursor, includeDeleted, NO, credential, pageHandler, completion);
+}
+
+static NSArray<TJDropboxMetadata *> *_metadataForListFolderEntries(NSArray<NSDictionary *> *const entries, NSMutableDictionary<NSString *, TJDropboxMetadataPathPrefix *> *const pathPrefixes)
+{
+    NSMutableArray<TJDropboxMetadata *> *const metadataEntries = [NSMutableArray arrayWithCapacity:entries.count];
+    for (NSDictionary *const entry in entries) {
+        TJDropboxMetadata *const metadata = [[TJDropboxMetadata alloc] initWithDictionary:entry pathPrefixes:pathPrefixes];
+        if (metadata) {
+            [metadataEntries addObject:metadata];
+        }
+    }
+    return metadataEntries;
+}
+
+#if TJDROPBOX_BENCHMARK
+// Lets Benchmarks/TJDropboxBenchmark.m time decoding listing pages the way +listFolderMetadataWithPath: does. Pass the same pathPrefixes for every page of a listing.
+NSArray<TJDropboxMetadata *> *TJDropboxMetadataForListFolderEntries(NSArray<NSDictionary *> *const entries, NSMutableDictionary *const pathPrefixes) {
+    return _metadataForListFolderEntries(entries, pathPrefixes);
+}
+#endif
+
++ (void)listFolderMetadataWithPath:(NSString *const)path cursor:(nullable NSString *const)cursor includeDeleted:(const BOOL)includeDeleted credential:(TJDropboxCredential *const)credential pageHandler:(BOOL (^const)(NSArray<TJDropboxMetadata *> *entries, BOOL hasMore))pageHandler completion:(void (^const)(NSString *_Nullable cursor, NSError *_Nullable error))completion
+{
+    // Every entry of a listing and its continuations shares the listed folder as its parent, so it's interned once across all pages.
+    NSMutableDictionary<NSString *, TJDropboxMetadataPathPrefix *> *const pathPrefixes = [NSMutableDictionary new];
+    [self listFolderWithPath:path
+                      cursor:cursor
+              includeDeleted:includeDeleted
+                  credential:credential
+                 pageHandler:^BOOL(NSArray<NSDictionary *> * _Nonnull entries, BOOL hasMore) {
+        return pageHandler(_metadataForListFolderEntries(entries, pathPrefixes), hasMore);
+    }
+                  completion:completion];
+}
+
+static NSURLRequest *_getMetadataRequest(NSString *const remotePath, NSString *const accessToken)
+{
+    return _apiRequest(@"/2/files/get_metadata", accessToken,
+                       @{
+                           @"path" : remotePath
+                       });
+}
+
++ (void)getFileInfoAtPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable entry, NSError *_Nullable error))completion
+{
+    _performCachedAPIRequest(credential, @"/2/files/get_metadata", remotePath, ^NSURLRequest *{
+        return _getMetadataRequest(remotePath, credential.accessToken);
+    },
+                             nil,
+                             completion);
+}
+
++ (void)getMetadataAtPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential completion:(void (^const)(TJDropboxMetadata *_Nullable metadata, NSError *_Nullable error))completion
+{
+    [self getFileInfoAtPath:remotePath
+                 credential:credential
+                 completion:^(NSDictionary * _Nullable entry, NSError * _Nullable error) {
+        TJDropboxMetadata *const metadata = entry ? [[TJDropboxMetadata alloc] initWithDictionary:entry] : nil;
+        if (!error && !metadata) {
+            error = [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"Unexpected metadata response"}];
+        }
+        completion(metadata, error);
+    }];
+}
+
++ (void)getFileInfoAtPaths:(NSArray<NSString *> *const)remotePaths maximumConcurrentRequests:(const NSUInteger)maximumConcurrentRequests credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray *results))completion
+{
+    // There's no batch endpoint for get_metadata, so fan out with a bounded number of requests in flight.
+    NSMutableArray *const results = [NSMutableArray arrayWithCapacity:remotePaths.count];
+    for (NSUInteger i = 0; i < remotePaths.count; i++) {
+        [results addObject:[NSNull null]];
+    }
+    _performWithMaximumConcurrency(remotePaths.count, maximumConcurrentRequests, ^(NSUInteger index, dispatch_block_t done) {
+        [self getFileInfoAtPath:remotePaths[index] credential:credential completion:^(NSDictionary * _Nullable entry, NSError * _Nullable error) {
+            @synchronized (results) {
+                results[index] = entry ?: error ?: [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:nil];
+            }
+            done();
+        }];
+    }, ^{
+        completion(results);
+    });
+}
+
+#pragma mark - File Manipulation
+
++ (NSURLRequest *)requestToDownloadFileAtPath:(NSString *const)path credential:(TJDropboxCredential *const)credential
+{
+    return _contentRequest(@"/2/files/download",
+                           credential.accessToken,
+                           @{
+                               @"path": path
+                           });
+}
+
++ (void)downloadFileAtPath:(NSString *const)remotePath toPath:(NSString *const)localPath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    [self downloadFileAtPath:remotePath toPath:localPath credential:credential progressBlock:nil completion:completion];
+}
+
+static int _openFileForWriting(NSString *const path, NSError **error)
+{
+    const int fileDescriptor = open(path.fileSystemRepresentation, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fileDescriptor < 0 && error) {
+        *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{NSFilePathErrorKey: path}];
+    }
+    return fileDescriptor;
+}
+
+static BOOL _writeDataToFile(const int fileDescriptor, NSData *const data, const off_t offset, NSError **error)
+{
+    __block off_t writeOffset = offset;
+    __block int writeErrorNumber = 0;
+    [data enumerateByteRangesUsingBlock:^(const void * _Nonnull bytes, NSRange byteRange, BOOL * _Nonnull stop) {
+        const uint8_t *remainingBytes = bytes;
+        size_t remainingLength = byteRange.length;
+        while (remainingLength > 0) {
+            const ssize_t writtenLength = pwrite(fileDescriptor, remainingBytes, remainingLength, writeOffset);
+            if (writtenLength < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                writeErrorNumber = errno;
+                *stop = YES;
+                return;
+            }
+            remainingBytes += writtenLength;
+            remainingLength -= writtenLength;
+            writeOffset += writtenLength;
+        }
+    }];
+    if (writeErrorNumber != 0 && error) {
+        *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:writeErrorNumber userInfo:nil];
+    }
+    return writeErrorNumber == 0;
+}
+
++ (void)downloadFileAtPath:(NSString *const)remotePath toPath:(NSString *const)localPath credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    _addTask(credential,
+             TJDropboxRequestLaneBulk,
+             TJDropboxSessionPoolBulk,
+             [TJDropbox contentBaseURL],
+             ^NSURLSessionTask *(NSURLSession *session) {
+        NSURLRequest *const request = [self requestToDownloadFileAtPath:remotePath credential:credential];
+        
+        NSURLSessionDataTask *const task = [session dataTaskWithRequest:request];
+        
+        // The file is written next to its destination as it arrives and hashed along the way, so verifying it doesn't require reading it back.
+        // It's renamed into place once verified, leaving any existing file untouched if the download fails.
+        NSString *const temporaryPath = [[localPath stringByDeletingLastPathComponent] stringByAppendingPathComponent:[NSString stringWithFormat:@".%@.tjdropbox-download", [[NSUUID UUID] UUIDString]]];
+        TJDropboxContentHasher *const hasher = [TJDropboxContentHasher new];
+        __block int fileDescriptor = -1;
+        __block off_t fileLength = 0;
+        __block NSError *writeError = nil;
+        
+        BOOL (^const dataBlock)(NSData *, NSURLResponse *) = ^BOOL(NSData *data, NSURLResponse *response) {
+            if ([(NSHTTPURLResponse *)response statusCode] != 200) {
+                // Error responses are accumulated and parsed in the completion block.
+                return NO;
+            }
+            if (!writeError && fileDescriptor < 0) {
+                fileDescriptor = _openFileForWriting(temporaryPath, &writeError);
+            }
+            if (!writeError && _writeDataToFile(fileDescriptor, data, fileLength, &writeError)) {
+                fileLength += data.length;
+                [hasher appendData:data];
+            }
+            if (writeError) {
+                [task cancel];
+            }
+            return YES;
+        };
+        
+        [_taskDelegate() setProgressBlock:progressBlock
+                                dataBlock:dataBlock
+                          completionBlock:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
+            if (fileDescriptor < 0 && !writeError && !error && [(NSHTTPURLResponse *)response statusCode] == 200) {
+                // Empty files never receive any data.
+                fileDescriptor = _openFileForWriting(temporaryPath, &writeError);
+            }
+            if (fileDescriptor >= 0) {
+                close(fileDescriptor);
+            }
+            
+            NSDictionary *parsedResult = nil;
+            NSData *const resultData = _resultDataForContentRequestResponse(response) ?: data;
+            _processResult(resultData, response, &error, &parsedResult);
+            // Write errors are only possible for successful responses, where they take the place of the cancellation they caused. They never mask an error from the API.
+            if (writeError && (!error || ([error.domain isEqualToString:NSURLErrorDomain] && error.code == NSURLErrorCancelled))) {
+                error = writeError;
+            }
+            
+            // Verify content hash matches
+            NSString *contentHash = parsedResult[@"content_hash"];
+            NSData *downloadedContentHash = nil;
+            if (!error && contentHash) {
+                downloadedContentHash = [hasher finalizeContentHash];
+                if (![contentHash isEqual:_dropboxContentHashForData(downloadedContentHash)]) {
+                    error = [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"content_hash_mimatch"}];
+                }
+            }
+            
+            // Move file into place, replacing any existing file
+            if (!error && rename(temporaryPath.fileSystemRepresentation, localPath.fileSystemRepresentation) != 0) {
+                error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{NSFilePathErrorKey: localPath}];
+            }
+            if (error) {
+                unlink(temporaryPath.fileSystemRepresentation);
+            } else {
+                _cacheFileContentHash(localPath, downloadedContentHash);
+            }
+            
+            completion(parsedResult, error);
+        }
+                              forDataTask:task];
+        return task;
+    },
+             completion);
+}
+
+static const unsigned long long kInteractiveReadMaximumLength = 1024 * 1024; // Longer or open ended reads may outlast the interactive pool's timeout
+
+/// Streams the bytes of @c remotePath from @c offset to @c dataHandler, @c length bytes or to the end of the file if @c length is 0.
+/// The content hash is only verified when reading the whole file since it covers every byte.
+static void _readFile(NSString *const remotePath, const unsigned long long offset, const unsigned long long length, TJDropboxCredential *const credential, BOOL (^const dataHandler)(NSData *data), void (^const completion)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))
+{
+    const BOOL isEntireFile = offset == 0 && length == 0;
+    const unsigned long long endOffset = length > 0 ? offset + length : ULLONG_MAX;
+    _addTask(credential,
+             TJDropboxRequestLaneInteractive,
+             length > 0 && length <= kInteractiveReadMaximumLength ? TJDropboxSessionPoolInteractive : TJDropboxSessionPoolBulk,
+             [TJDropbox contentBaseURL],
+             ^NSURLSessionTask *(NSURLSession *session) {
+        NSMutableURLRequest *const request = _contentRequest(@"/2/files/download",
+                                                             credential.accessToken,
+                                                             @{
+                                                                 @"path": remotePath
+                                                             });
+        if (length > 0) {
+            [request setValue:[NSString stringWithFormat:@"bytes=%llu-%llu", offset, endOffset - 1] forHTTPHeaderField:@"Range"];
+        } else if (offset > 0) {
+            [request setValue:[NSString stringWithFormat:@"bytes=%llu-", offset] forHTTPHeaderField:@"Range"];
+        }
+        NSURLSessionDataTask *const task = [session dataTaskWithRequest:request];
+        
+        TJDropboxContentHasher *const hasher = isEntireFile ? [TJDropboxContentHasher new] : nil;
+        __block unsigned long long receivedOffset = 0; // File offset just past the last byte received
+        __block BOOL receivedData = NO;
+        __block BOOL stopped = NO; // Set once the caller has stopped early, or has everything it asked for from a response that ignored the range
+        
+        BOOL (^const dataBlock)(NSData *, NSURLResponse *) = ^BOOL(NSData *data, NSURLResponse *response) {
+            const NSInteger statusCode = [(NSHTTPURLResponse *)response statusCode];
+            if (statusCode >= 300) {
+                // Error responses are accumulated and parsed in the completion block.
+                return NO;
+            }
+            if (!receivedData) {
+                // A full response to a ranged request starts from the beginning of the file, skip ahead to the requested bytes.
+                receivedOffset = statusCode == 206 ? offset : 0;
+                receivedData = YES;
+            }
+            if (stopped) {
+                return YES;
+            }
+            const unsigned long long dataOffset = receivedOffset;
+            receivedOffset += data.length;
+            [hasher appendData:data];
+            
+            const unsigned long long sliceStartOffset = MAX(dataOffset, offset);
+            const unsigned long long sliceEndOffset = MIN(receivedOffset, endOffset);
+            if (sliceStartOffset < sliceEndOffset) {
+                NSData *const slice = sliceStartOffset == dataOffset && sliceEndOffset == receivedOffset ? data : [data subdataWithRange:NSMakeRange((NSUInteger)(sliceStartOffset - dataOffset), (NSUInteger)(sliceEndOffset - sliceStartOffset))];
+                stopped = !dataHandler(slice);
+            }
+            if (statusCode != 206 && receivedOffset >= endOffset) {
+                stopped = YES;
+            }
+            if (stopped) {
+                [task cancel];
+            }
+            return YES;
+        };
+        
+        [_taskDelegate() setProgressBlock:nil
+                                dataBlock:dataBlock
+                          completionBlock:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
+            NSDictionary *parsedResult = nil;
+            NSData *const resultData = _resultDataForContentRequestResponse(response) ?: data;
+            _processResult(resultData, response, &error, &parsedResult);
+            if (stopped && [error.domain isEqualToString:NSURLErrorDomain] && error.code == NSURLErrorCancelled) {
+                error = nil;
+            }
+            
+            // Verify content hash matches
+            NSString *const contentHash = parsedResult[@"content_hash"];
+            if (!error && hasher && !stopped && contentHash && ![contentHash isEqual:_dropboxContentHashForData([hasher finalizeContentHash])]) {
+                error = [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"content_hash_mimatch"}];
+            }
+            
+            completion(parsedResult, error);
+        }
+                              forDataTask:task];
+        return task;
+    },
+             completion);
+}
+
++ (void)readFileAtPath:(NSString *const)remotePath offset:(const unsigned long long)offset length:(const NSUInteger)length credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSData *_Nullable data, NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    static const NSUInteger kMaximumInitialCapacity = 1024 * 1024;
+    NSMutableData *const data = [NSMutableData dataWithCapacity:MIN(length, kMaximumInitialCapacity)];
+    _readFile(remotePath, offset, length, credential, ^BOOL(NSData *receivedData) {
+        [data appendData:receivedData];
+        return YES;
+    }, ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        completion(error ? nil : data, parsedResponse, error);
+    });
+}
+
++ (void)readFileAtPath:(NSString *const)remotePath offset:(const unsigned long long)offset length:(const unsigned long long)length credential:(TJDropboxCredential *const)credential dataHandler:(BOOL (^const)(NSData *data))dataHandler completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    _readFile(remotePath, offset, length, credential, dataHandler, completion);
+}
+
++ (void)fetchFileAtPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSData *_Nullable data, NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    [self readFileAtPath:remotePath offset:0 length:0 credential:credential completion:completion];
+}
+
++ (void)downloadLargeFileAtPath:(NSString *const)remotePath toPath:(NSString *const)localPath maximumConcurrentRanges:(const NSUInteger)maximumConcurrentRanges credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    static const NSUInteger kRangeBlockCount = 4; // Each range request covers up to 16MB
+    
+    // Look up the current revision first so that every range (and any later resumption) reads the same version of the file.
+    // This bypasses the response cache, which may be a few seconds behind changes made elsewhere.
+    _performAPIRequest(credential,
+                       ^NSURLRequest *{
+        return _getMetadataRequest(remotePath, credential.accessToken);
+    },
+                       ^(NSDictionary * _Nullable entry, NSError * _Nullable error) {
+        NSString *const revision = entry[@"rev"];
+        NSNumber *const size = entry[@"size"];
+        if (error || ![revision isKindOfClass:[NSString class]] || ![size isKindOfClass:[NSNumber class]]) {
+            completion(entry, error ?: [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"not_a_file"}]);
+            return;
+        }
+        
+        TJDropboxRangedDownload *const download = [TJDropboxRangedDownload new];
+        download.localPath = localPath;
+        download.credential = credential;
+        download.maximumConcurrentRanges = MAX(maximumConcurrentRanges, 1);
+        download.progressBlock = progressBlock;
+        download.completion = completion;
+        download.metadata = entry;
+        download.revision = revision;
+        download.fileSize = size.unsignedLongLongValue;
+        download.blockCount = (NSUInteger)((download.fileSize + kContentHashBlockSize - 1) / kContentHashBlockSize);
+        
+        if ([download prepareWithRangeBlockCount:kRangeBlockCount error:&error]) {
+            if (download.blockHashes.count == download.blockCount) {
+                _finishRangedDownload(download);
+            } else {
+                _downloadNextRanges(download);
+            }
+        } else {
+            [download completeWithParsedResponse:nil error:error];
+        }
+    });
+}
+
+static void _downloadNextRanges(TJDropboxRangedDownload *const download)
+{
+    NSMutableArray<NSValue *> *const blockRanges = [NSMutableArray new];
+    [download performSynchronized:^{
+        while (!download.completed && download.inFlightRangeCount < download.maximumConcurrentRanges && download.pendingBlockRanges.count > 0) {
+            [blockRanges addObject:download.pendingBlockRanges.firstObject];
+            [download.pendingBlockRanges removeObjectAtIndex:0];
+            download.inFlightRangeCount++;
+        }
+    }];
+    for (NSValue *const blockRange in blockRanges) {
+        _downloadRange(download, blockRange.rangeValue);
+    }
+}
+
+static void _downloadRange(TJDropboxRangedDownload *const download, const NSRange blockRange)
+{
+    TJDropboxCredential *const credential = download.credential;
+    void (^const completion)(NSDictionary *, NSError *) = ^(NSDictionary *parsedResponse, NSError *error) {
+        [download performSynchronized:^{
+            download.inFlightRangeCount--;
+        }];
+        [download completeWithParsedResponse:parsedResponse error:error];
+    };
+    _addTask(credential,
+             TJDropboxRequestLaneBulk,
+             TJDropboxSessionPoolBulk,
+             [TJDropbox contentBaseURL],
+             ^NSURLSessionTask *(NSURLSession *session) {
+        const unsigned long long startOffset = (unsigned long long)blockRange.location * kContentHashBlockSize;
+        const unsigned long long endOffset = MIN((unsigned long long)NSMaxRange(blockRange) * kContentHashBlockSize, download.fileSize);
+        const BOOL isEntireFile = startOffset == 0 && endOffset == download.fileSize;
+        
+        NSMutableURLRequest *const request = _contentRequest(@"/2/files/download",
+                                                             credential.accessToken,
+                                                             @{
+                                                                 @"path": [@"rev:" stringByAppendingString:download.revision]
+                                                             });
+        [request setValue:[NSString stringWithFormat:@"bytes=%llu-%llu", startOffset, endOffset - 1] forHTTPHeaderField:@"Range"];
+        NSURLSessionDataTask *const task = [session dataTaskWithRequest:request];
+        [download performSynchronized:^{
+            [download.tasks addObject:task];
+        }];
+        
+        // Hash each block as it arrives, recording it marks the block as complete in the resume state.
+        TJDropboxContentHasher *const hasher = [TJDropboxContentHasher new];
+        __block NSUInteger blockIndex = blockRange.location;
+        hasher.blockHashHandler = ^(NSData *blockHash) {
+            [download didHashBlockAtIndex:blockIndex++ hash:blockHash];
+        };
+        __block unsigned long long writeOffset = startOffset;
+        __block NSError *writeError = nil;
+        
+        BOOL (^const dataBlock)(NSData *, NSURLResponse *) = ^BOOL(NSData *data, NSURLResponse *response) {
+            const NSInteger statusCode = [(NSHTTPURLResponse *)response statusCode];
+            if (statusCode >= 300) {
+                // Error responses are accumulated and parsed in the completion block.
+                return NO;
+            }
+            if (!writeError && statusCode != 206 && !isEntireFile) {
+                writeError = [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"range_not_satisfied"}];
+            }
+            if (!writeError && !download.completed && _writeDataToFile(download.fileDescriptor, data, writeOffset, &writeError)) {
+                writeOffset += data.length;
+                [hasher appendData:data];
+                [download didReceiveByteCount:data.length];
+            }
+            if (writeError) {
+                [task cancel];
+            }
+            return YES;
+        };
+        
+        [_taskDelegate() setProgressBlock:nil
+                                dataBlock:dataBlock
+                          completionBlock:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
+            NSDictionary *parsedResult = nil;
+            NSData *const resultData = _resultDataForContentRequestResponse(response) ?: data;
+            _processResult(resultData, response, &error, &parsedResult);
+            if (writeError) {
+                error = writeError;
+            } else if (!error && writeOffset != endOffset) {
+                error = [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"incomplete_range"}];
+            }
+            
+            if (error) {
+                completion(parsedResult, error);
+            } else {
+                // Flushes the final partial block of the file, if this range contains it.
+                [hasher finalizeContentHash];
+                
+                __block BOOL isFinished;
+                [download performSynchronized:^{
+                    download.inFlightRangeCount--;
+                    isFinished = !download.completed && download.inFlightRangeCount == 0 && download.blockHashes.count == download.blockCount;
+                    [download closeFileIfIdle];
+                }];
+                if (isFinished) {
+                    _finishRangedDownload(download);
+                } else {
+                    _downloadNextRanges(download);
+                }
+            }
+        }
+                              forDataTask:task];
+        return task;
+    },
+             completion);
+}
+
+static void _finishRangedDownload(TJDropboxRangedDownload *const download)
+{
+    // The content hash is the hash of the concatenated block hashes, so verifying the file doesn't require reading it back.
+    NSMutableData *const blockHashes = [NSMutableData dataWithCapacity:download.blockCount * CC_SHA256_DIGEST_LENGTH];
+    for (NSUInteger blockIndex = 0; blockIndex < download.blockCount; blockIndex++) {
+        [blockHashes appendData:download.blockHashes[@(blockIndex)]];
+    }
+    unsigned char contentHash[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(blockHashes.bytes, (CC_LONG)blockHashes.length, contentHash);
+    
+    NSData *const downloadedContentHash = [NSData dataWithBytes:contentHash length:CC_SHA256_DIGEST_LENGTH];
+    NSError *error = nil;
+    if (![download.metadata[@"content_hash"] isEqual:_dropboxContentHashForData(downloadedContentHash)]) {
+        error = [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"content_hash_mimatch"}];
+    }
+    
+    [download performSynchronized:^{
+        if (download.fileDescriptor >= 0) {
+            close(download.fileDescriptor);
+            download.fileDescriptor = -1;
+        }
+    }];
+    
+    if (!error && rename(download.partialPath.fileSystemRepresentation, download.localPath.fileSystemRepresentation) != 0) {
+        error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{NSFilePathErrorKey: download.localPath}];
+    } else {
+        if (!error) {
+            _cacheFileContentHash(download.localPath, downloadedContentHash);
+        }
+        // Either the file was moved into place or it's corrupt, neither should be resumed.
+        [download discardResumeState];
+        unlink(download.partialPath.fileSystemRepresentation);
+        unlink(download.resumeStatePath.fileSystemRepresentation);
+    }
+    
+    [download completeWithParsedResponse:download.metadata error:error];
+}
+
++ (void)uploadFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    [self uploadFileAtPath:localPath toPath:remotePath contentHash:nil overwriteExisting:NO muteDesktopNotifications:NO credential:credential progressBlock:nil completion:completion];
+}
+
++ (void)uploadFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath contentHash:(NSData *const)contentHash overwriteExisting:(const BOOL)overwriteExisting muteDesktopNotifications:(const BOOL)muteDesktopNotifications credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    _addTask(credential,
+             TJDropboxRequestLaneBulk,
+             TJDropboxSessionPoolBulk,
+             [TJDropbox contentBaseURL],
+             ^NSURLSessionTask *(NSURLSession *session) {
+        NSMutableDictionary<NSString *, id> *const parameters = [NSMutableDictionary new];
+        parameters[@"path"] = remotePath;
+        if (overwriteExisting) {
+            parameters[@"mode"] = @{@".tag": @"overwrite"};
+        }
+        if (muteDesktopNotifications) {
             parameters[@"mute"] = @YES;
         }
-        
-        // Compute content_hash for the file
-        NSData *contentHashBytes = contentHash;
-        if (contentHashBytes == nil) {
-            contentHashBytes = TJDropboxFileContentHash(localPath);
+        
+        // Compute content_hash for the file
+        NSData *contentHashBytes = contentHash;
+        if (contentHashBytes == nil) {
+            contentHashBytes = TJDropboxFileContentHash(localPath);
+        }
+        NSString *const contentHash = _dropboxContentHashForData(contentHashBytes);
+        if (contentHash) {
+            parameters[@"content_hash"] = contentHash;
+        }
+        
+        NSMutableURLRequest *const request = _contentRequest(@"/2/files/upload", credential.accessToken, parameters);
+        [request setValue:@"application/octet-stream" forHTTPHeaderField:@"Content-Type"];
+        
+        // Files above this size are gzipped as they're streamed rather than in memory up front.
+        static const unsigned long long kStreamingCompressionThreshold = 16 * 1024 * 1024;
+        const unsigned long long fileSize = [[[NSFileManager defaultManager] attributesOfItemAtPath:localPath error:nil] fileSize];
+        const BOOL shouldCompress = !_tj_skipsCompressionOfIncompressibleFiles || _shouldCompressFile(localPath, fileSize);
+        
+        NSURLSessionUploadTask *task;
+        if (shouldCompress && fileSize > kStreamingCompressionThreshold) {
+            [request setValue:@"gzip" forHTTPHeaderField:@"Content-Encoding"];
+            task = [session uploadTaskWithStreamedRequest:request];
+            // The length of the compressed body isn't known up front, so progress is reported based on how much of the file has been read.
+            // It's routed through the task delegate so it's delivered on the task's callback queue and stops once the task completes.
+            __weak NSURLSessionUploadTask *const weakTask = task;
+            void (^const streamProgressBlock)(unsigned long long) = progressBlock ? ^(unsigned long long bytesRead) {
+                NSURLSessionUploadTask *const task = weakTask;
+                if (task) {
+                    [_taskDelegate() reportProgress:bytesRead ofTotal:fileSize forTask:task];
+                }
+            } : nil;
+            [_taskDelegate() setBodyStreamBlock:^NSInputStream *{
+                return _gzipCompressedInputStreamForFile(localPath, streamProgressBlock);
+            }
+                                  forUploadTask:task];
+        } else {
+            NSData *const compressedData = shouldCompress ? _gzipCompressDataIfSmaller([NSData dataWithContentsOfFile:localPath]) : nil;
+            if (compressedData) {
+                [request setValue:@"gzip" forHTTPHeaderField:@"Content-Encoding"];
+                task = [session uploadTaskWithRequest:request fromData:compressedData];
+            } else {
+                task = [session uploadTaskWithRequest:request fromFile:[NSURL fileURLWithPath:localPath isDirectory:NO]];
+            }
+        }
+        
+        if (@available(iOS 14.5, macOS 11.3, *)) {
+            if (!progressBlock) {
+                task.prefersIncrementalDelivery = NO;
+            }
+        }
+            
+        [_taskDelegate() setProgressBlock:progressBlock
+                          completionBlock:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
+            NSDictionary *parsedResult = nil;
+            _processResult(data, response, &error, &parsedResult);
+            
+            completion(parsedResult, error);
+        }
+                              forDataTask:task];
+        return task;
+    },
+             completion);
+}
+
++ (void)uploadFileIfChangedAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath muteDesktopNotifications:(const BOOL)muteDesktopNotifications credential:(TJDropboxCredential *const)credential progressBlock:(void (^_Nullable const)(CGFloat progress))progressBlock completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    static const unsigned long long kMaximumSingleRequestUploadSize = 150 * 1024 * 1024; // Larger files have to use an upload session
+    
+    // Hash the local file while the remote metadata is being fetched, for files hashed before this is usually a cache hit.
+    dispatch_group_t const group = dispatch_group_create();
+    __block NSData *localContentHash;
+    __block NSDictionary *remoteMetadata;
+    __block NSError *remoteMetadataError;
+    dispatch_group_enter(group);
+    _dispatchAsync(_workerQueue(), ^{
+        localContentHash = TJDropboxFileContentHash(localPath);
+        dispatch_group_leave(group);
+    });
+    dispatch_group_enter(group);
+    // Bypasses the response cache, deciding from a stale entry could skip an upload that's needed.
+    _performAPIRequest(credential,
+                       ^NSURLRequest *{
+        return _getMetadataRequest(remotePath, credential.accessToken);
+    },
+                       ^(NSDictionary * _Nullable entry, NSError * _Nullable error) {
+        remoteMetadata = entry;
+        remoteMetadataError = error;
+        dispatch_group_leave(group);
+    });
+    dispatch_group_notify(group, _workerQueue(), _callbackQueuePreservingBlock(^{
+        if (remoteMetadataError && !remoteMetadataError.tj_isPathNotFoundError) {
+            _performCallback(^{
+                completion(nil, remoteMetadataError);
+            });
+        } else if (localContentHash && [remoteMetadata[@"content_hash"] isEqual:_dropboxContentHashForData(localContentHash)]) {
+            _performCallback(^{
+                completion(remoteMetadata, nil);
+            });
+        } else if ([[[NSFileManager defaultManager] attributesOfItemAtPath:localPath error:nil] fileSize] > kMaximumSingleRequestUploadSize) {
+            [self uploadLargeFileAtPath:localPath toPath:remotePath overwriteExisting:YES muteDesktopNotifications:muteDesktopNotifications credential:credential progressBlock:progressBlock completion:completion];
+        } else {
+            [self uploadFileAtPath:localPath toPath:remotePath contentHash:localContentHash overwriteExisting:YES muteDesktopNotifications:muteDesktopNotifications credential:credential progressBlock:progressBlock completion:completion];
+        }
+    }));
+}
+
++ (void)uploadLargeFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    [self uploadLargeFileAtPath:localPath toPath:remotePath overwriteExisting:NO muteDesktopNotifications:NO credential:credential progressBlock:nil completion:completion];
+}
+
++ (void)uploadLargeFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath overwriteExisting:(const BOOL)overwriteExisting muteDesktopNotifications:(const BOOL)muteDesktopNotifications credential:(TJDropboxCredential *const)credential progressBlock:(void (^const _Nullable)(CGFloat))progressBlock completion:(nonnull void (^const)(NSDictionary * _Nullable, NSError * _Nullable))completion
+{
+    static const NSUInteger kChunkSize = 10 * 1024 * 1024; // use 10 MB - same as the official Obj-C Dropbox SDK
+    _startLargeUpload(localPath, remotePath, overwriteExisting, muteDesktopNotifications, kChunkSize, 1, _tj_adjustsLargeUploadChunkSize, credential, progressBlock, completion);
+}
+
++ (void)uploadLargeFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath overwriteExisting:(const BOOL)overwriteExisting muteDesktopNotifications:(const BOOL)muteDesktopNotifications chunkSize:(NSUInteger)chunkSize maximumConcurrentChunks:(const NSUInteger)maximumConcurrentChunks credential:(TJDropboxCredential *const)credential progressBlock:(void (^const _Nullable)(CGFloat))progressBlock completion:(nonnull void (^const)(NSDictionary * _Nullable, NSError * _Nullable))completion
+{
+    _startLargeUpload(localPath, remotePath, overwriteExisting, muteDesktopNotifications, chunkSize, maximumConcurrentChunks, NO, credential, progressBlock, completion);
+}
+
+// Chunk sizes only adapt for sequential sessions, concurrent sessions skip acknowledged chunks by offset and so need a fixed grid.
+static void _startLargeUpload(NSString *const localPath, NSString *const remotePath, const BOOL overwriteExisting, const BOOL muteDesktopNotifications, NSUInteger chunkSize, const NSUInteger maximumConcurrentChunks, const BOOL adjustsChunkSize, TJDropboxCredential *const credential, void (^const progressBlock)(CGFloat), void (^const completion)(NSDictionary *, NSError *))
+{
+    TJDropboxLargeUpload *const upload = [TJDropboxLargeUpload new];
+    upload.localPath = localPath;
+    upload.remotePath = remotePath;
+    upload.overwriteExisting = overwriteExisting;
+    upload.muteDesktopNotifications = muteDesktopNotifications;
+    upload.credential = credential;
+    upload.maximumConcurrentChunks = MAX(maximumConcurrentChunks, 1);
+    if (upload.isConcurrent) {
+        chunkSize = ((chunkSize + kUploadSessionChunkAlignment - 1) / kUploadSessionChunkAlignment) * kUploadSessionChunkAlignment;
+    }
+    upload.chunkSize = MIN(MAX(chunkSize, kUploadSessionChunkAlignment), kUploadSessionMaximumChunkSize);
+    upload.tuner.chunkSize = upload.chunkSize;
+    upload.tuner.adjustsChunkSize = adjustsChunkSize && !upload.isConcurrent;
+    upload.progressBlock = progressBlock;
+    upload.completion = completion;
+    
+    _addTask(credential,
+             TJDropboxRequestLaneBulk,
+             TJDropboxSessionPoolBulk,
+             [TJDropbox contentBaseURL],
+             ^NSURLSessionTask *(NSURLSession *session) {
+        NSDictionary *const parameters = upload.isConcurrent ? @{@"session_type": @{@".tag": @"concurrent"}} : nil;
+        NSMutableURLRequest *const request = _contentRequest(@"/2/files/upload_session/start", credential.accessToken, parameters);
+        [request addValue:@"application/octet-stream" forHTTPHeaderField:@"Content-Type"];
+        
+        NSURLSessionDataTask *const task = [session dataTaskWithRequest:request];
+        [_taskDelegate() setProgressBlock:nil
+                          completionBlock:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
+            NSDictionary *parsedResult = nil;
+            _processResult(data, response, &error, &parsedResult);
+            
+            NSString *const sessionIdentifier = parsedResult[@"session_id"];
+            if (sessionIdentifier) {
+                upload.sessionIdentifier = sessionIdentifier;
+                upload.sessionStartDate = [NSDate date];
+                _beginLargeUpload(upload);
+            } else {
+                completion(parsedResult, error);
+            }
+        }
+                              forDataTask:task];
+        
+        return task;
+    },
+             completion);
+}
+
++ (BOOL)hasResumableLargeFileUploadAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath
+{
+    return [TJDropboxLargeUpload largeUploadFromJournalForLocalPath:localPath remotePath:remotePath] != nil;
+}
+
++ (void)resumeLargeFileUploadAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential progressBlock:(void (^const _Nullable)(CGFloat))progressBlock completion:(nonnull void (^const)(NSDictionary * _Nullable, NSError * _Nullable))completion
+{
+    TJDropboxLargeUpload *const upload = [TJDropboxLargeUpload largeUploadFromJournalForLocalPath:localPath remotePath:remotePath];
+    if (!upload) {
+        completion(nil, [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"No resumable upload session"}]);
+        return;
+    }
+    upload.credential = credential;
+    upload.progressBlock = progressBlock;
+    upload.completion = completion;
+    _beginLargeUpload(upload);
+}
+
+static void _pumpLargeUpload(TJDropboxLargeUpload *const upload);
+static void _uploadChunk(TJDropboxLargeUpload *const upload, TJDropboxUploadChunk *const chunk);
+static void _rewindLargeUpload(TJDropboxLargeUpload *const upload, const unsigned long long offset, const NSUInteger rejectedChunkLength);
+static void _finishLargeUpload(TJDropboxLargeUpload *const upload);
+
+// Opens the file and starts sending chunks for an upload whose session has been started (or restored from its journal).
+static void _beginLargeUpload(TJDropboxLargeUpload *const upload)
+{
+    const int fileDescriptor = open(upload.localPath.fileSystemRepresentation, O_RDONLY | O_CLOEXEC);
+    if (fileDescriptor < 0) {
+        [upload completeWithParsedResponse:nil error:[NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadNoSuchFileError userInfo:@{NSFilePathErrorKey: upload.localPath}]];
+        return;
+    }
+    __block BOOL completed;
+    [upload performSynchronized:^{
+        completed = upload.completed;
+        if (!completed) {
+            upload.fileDescriptor = fileDescriptor;
+        }
+    }];
+    if (completed) {
+        close(fileDescriptor);
+        return;
+    }
+    if (!upload.fileModificationDate) {
+        struct stat fileStatus;
+        upload.fileSize = fstat(fileDescriptor, &fileStatus) == 0 ? (unsigned long long)fileStatus.st_size : 0;
+        upload.fileModificationDate = [[NSFileManager defaultManager] attributesOfItemAtPath:upload.localPath error:nil].fileModificationDate;
+    }
+    
+    if (upload.fileSize > 0) {
+        [upload writeJournal];
+    }
+    
+    if (upload.isFullyCommitted) {
+        // Everything was acknowledged before the previous attempt stopped.
+        _finishLargeUpload(upload);
+    } else {
+        _pumpLargeUpload(upload);
+    }
+}
+
+// Keeps the upload pipeline full. Chunks are read and compressed on a background queue ahead of being sent so that CPU and network work overlap,
+// at most kPrefetchedChunkCount chunks beyond the in-flight ones are held in memory at once, and no more than kBufferedByteBudget of file data across all of them.
+// A chunk larger than the budget is still read once nothing else is held, so those uploads go one chunk at a time.
+// The closing chunk is held back until all other chunks have been acknowledged since no appends are accepted after a session is closed.
+static void _pumpLargeUpload(TJDropboxLargeUpload *const upload)
+{
+    static const NSUInteger kPrefetchedChunkCount = 2;
+    static const unsigned long long kBufferedByteBudget = 40 * 1024 * 1024;
+    
+    NSMutableArray<TJDropboxUploadChunk *> *const chunksToPrepare = [NSMutableArray new];
+    NSMutableArray<TJDropboxUploadChunk *> *const chunksToSend = [NSMutableArray new];
+    [upload performSynchronized:^{
+        if (upload.completed) {
+            return;
+        }
+        
+        while (!upload.allChunksRead && upload.inFlightChunkCount + upload.preparingChunkCount + upload.preparedChunksForOffsets.count < upload.maximumConcurrentChunks + kPrefetchedChunkCount) {
+            const unsigned long long offset = upload.nextReadOffset;
+            const NSUInteger length = [upload chunkLengthAtOffset:offset];
+            // Acknowledged before the upload was resumed.
+            const BOOL isCommitted = [upload.committedChunkOffsets containsObject:@(offset)];
+            if (!isCommitted && upload.bufferedByteCount > 0 && upload.bufferedByteCount + length > kBufferedByteBudget) {
+                break;
+            }
+            TJDropboxUploadChunk *const chunk = [TJDropboxUploadChunk new];
+            chunk.offset = offset;
+            chunk.length = length;
+            chunk.isLastChunk = chunk.offset + chunk.length >= upload.fileSize;
+            chunk.generation = upload.generation;
+            upload.nextReadOffset = chunk.offset + chunk.length;
+            upload.allChunksRead = chunk.isLastChunk;
+            if (isCommitted) {
+                continue;
+            }
+            upload.preparingChunkCount++;
+            upload.bufferedByteCount += chunk.length;
+            [chunksToPrepare addObject:chunk];
+        }
+        
+        while (upload.inFlightChunkCount < upload.maximumConcurrentChunks) {
+            if (upload.nextSendOffset < upload.fileSize && [upload.committedChunkOffsets containsObject:@(upload.nextSendOffset)]) {
+                upload.nextSendOffset += [upload chunkLengthAtOffset:upload.nextSendOffset];
+                continue;
+            }
+            TJDropboxUploadChunk *const chunk = upload.preparedChunksForOffsets[@(upload.nextSendOffset)];
+            if (!chunk || (chunk.isLastChunk && upload.inFlightChunkCount > 0)) {
+                break;
+            }
+            [upload.preparedChunksForOffsets removeObjectForKey:@(chunk.offset)];
+            upload.nextSendOffset = chunk.offset + chunk.length;
+            upload.inFlightChunkCount++;
+            [chunksToSend addObject:chunk];
+        }
+    }];
+    
+    for (TJDropboxUploadChunk *const chunk in chunksToPrepare) {
+        _dispatchAsync(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+            __block BOOL shouldRead;
+            __block int compressionLevel;
+            [upload performSynchronized:^{
+                shouldRead = !upload.completed && chunk.generation == upload.generation;
+                compressionLevel = upload.tuner.compressionLevel;
+            }];
+            NSData *const data = shouldRead ? [upload readChunkAtOffset:chunk.offset length:chunk.length] : nil;
+            if (!data) {
+                __block int fileDescriptor;
+                [upload performSynchronized:^{
+                    upload.preparingChunkCount--;
+                    upload.bufferedByteCount -= chunk.length;
+                    fileDescriptor = [upload takeFileDescriptorIfIdle];
+                }];
+                if (fileDescriptor >= 0) {
+                    close(fileDescriptor);
+                }
+                if (shouldRead) {
+                    // Most likely the file was truncated after the upload started.
+                    [upload completeWithParsedResponse:nil error:[NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"Couldn't read the file being uploaded"}]];
+                } else {
+                    _pumpLargeUpload(upload);
+                }
+                return;
+            }
+            NSData *compressedData = nil;
+            NSTimeInterval compressionDuration = 0.0;
+            if (compressionLevel != Z_NO_COMPRESSION) {
+                const uint64_t startTimestamp = _metricsTimestamp();
+                compressedData = _gzipCompressDataIfSmallerAtLevel(data, compressionLevel);
+                compressionDuration = _metricsDuration(startTimestamp, _metricsTimestamp());
+            }
+            chunk.data = compressedData ?: data;
+            chunk.compressed = compressedData != nil;
+            
+            __block NSDictionary *tuningEvent = nil;
+            __block int fileDescriptor;
+            [upload performSynchronized:^{
+                upload.preparingChunkCount--;
+                if (!upload.completed && chunk.generation == upload.generation) {
+                    upload.preparedChunksForOffsets[@(chunk.offset)] = chunk;
+                } else {
+                    upload.bufferedByteCount -= chunk.length;
+                }
+                if (compressionLevel != Z_NO_COMPRESSION && [upload.tuner recordCompressionOfLength:data.length compressedLength:compressedData.length duration:compressionDuration]) {
+                    tuningEvent = upload.tuner.metricsEvent;
+                }
+                fileDescriptor = [upload takeFileDescriptorIfIdle];
+            }];
+            if (fileDescriptor >= 0) {
+                close(fileDescriptor);
+            }
+            if (tuningEvent && _tj_metricsEnabled) {
+                _recordMetricsEvent(tuningEvent);
+            }
+            _pumpLargeUpload(upload);
+        });
+    }
+    
+    for (TJDropboxUploadChunk *const chunk in chunksToSend) {
+        _uploadChunk(upload, chunk);
+    }
+}
+
+static void _uploadChunk(TJDropboxLargeUpload *const upload, TJDropboxUploadChunk *const chunk)
+{
+    TJDropboxCredential *const credential = upload.credential;
+    void (^const completion)(NSDictionary *, NSError *) = ^(NSDictionary *parsedResponse, NSError *error) {
+        [upload completeWithParsedResponse:parsedResponse error:error];
+    };
+    const unsigned long long offset = chunk.offset;
+    const NSUInteger chunkLength = chunk.length;
+    _addTask(credential,
+             TJDropboxRequestLaneBulk,
+             TJDropboxSessionPoolBulk,
+             [TJDropbox contentBaseURL],
+             ^NSURLSessionTask *(NSURLSession *session) {
+        const uint64_t startTimestamp = _metricsTimestamp();
+        NSMutableURLRequest *const request = _contentRequest(@"/2/files/upload_session/append_v2", credential.accessToken,
+                                                             @{
+                                                                 @"cursor": @{
+                                                                         @"session_id": upload.sessionIdentifier,
+                                                                         @"offset": @(offset)
+                                                                 },
+                                                                 @"close": @(chunk.isLastChunk)
+                                                             });
+        [request addValue:@"application/octet-stream" forHTTPHeaderField:@"Content-Type"];
+        if (chunk.compressed) {
+            [request setValue:@"gzip" forHTTPHeaderField:@"Content-Encoding"];
+        }
+        NSURLSessionUploadTask *const task = [session uploadTaskWithRequest:request fromData:chunk.data];
+        
+        void (^totalProgressBlock)(CGFloat);
+        if (upload.progressBlock && upload.fileSize > 0) {
+            totalProgressBlock = ^(CGFloat progress) {
+                __block unsigned long long totalBytesSent;
+                [upload performSynchronized:^{
+                    upload.sentByteCountsForInFlightOffsets[@(offset)] = @((unsigned long long)(chunkLength * progress));
+                    totalBytesSent = upload.committedByteCount;
+                    for (NSNumber *const sentByteCount in upload.sentByteCountsForInFlightOffsets.objectEnumerator) {
+                        totalBytesSent += sentByteCount.unsignedLongLongValue;
+                    }
+                }];
+                upload.progressBlock((CGFloat)totalBytesSent / upload.fileSize);
+            };
+        } else {
+            totalProgressBlock = nil;
+        }
+        
+        if (@available(iOS 14.5, macOS 11.3, *)) {
+            if (!totalProgressBlock) {
+                task.prefersIncrementalDelivery = NO;
+            }
+        }
+        [_taskDelegate() setProgressBlock:totalProgressBlock
+                          completionBlock:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
+            NSDictionary *parsedResult = nil;
+            _processResult(data, response, &error, &parsedResult);
+            
+            NSDictionary *const dropboxError = error.userInfo[TJDropboxErrorUserInfoKeyDropboxError];
+            if ([dropboxError[@".tag"] isEqual:@"incorrect_offset"] && !upload.isConcurrent) {
+                // The server has a different idea of how much it's received (for instance if a response was lost), continue from its offset.
+                _rewindLargeUpload(upload, [dropboxError[@"correct_offset"] unsignedLongLongValue], chunkLength);
+            } else if (error && [(NSHTTPURLResponse *)response statusCode] != 200) {
+                // Error encountered
+                completion(parsedResult, error);
+            } else {
+                const NSTimeInterval duration = _metricsDuration(startTimestamp, _metricsTimestamp());
+                __block NSDictionary *tuningEvent = nil;
+                [upload performSynchronized:^{
+                    upload.inFlightChunkCount--;
+                    upload.bufferedByteCount -= chunkLength;
+                    upload.committedByteCount += chunkLength;
+                    if (upload.isConcurrent) {
+                        [upload.committedChunkOffsets addObject:@(offset)];
+                    }
+                    [upload.sentByteCountsForInFlightOffsets removeObjectForKey:@(offset)];
+                    if ([upload.tuner recordTransferOfLength:chunk.data.length duration:duration]) {
+                        // Chunks already read keep their size, the new one applies from the next read.
+                        upload.chunkSize = upload.tuner.chunkSize;
+                        tuningEvent = upload.tuner.metricsEvent;
+                    }
+                }];
+                if (tuningEvent && _tj_metricsEnabled) {
+                    _recordMetricsEvent(tuningEvent);
+                }
+                [upload writeJournal];
+                if (chunk.isLastChunk) {
+                    // Finish the upload
+                    _finishLargeUpload(upload);
+                } else {
+                    // Upload next chunk(s)
+                    _pumpLargeUpload(upload);
+                }
+            }
+        }
+                              forDataTask:task];
+        return task;
+    },
+             completion);
+}
+
+// Discards all read-ahead and restarts a sequential upload from the given offset. @c rejectedChunkLength is the length of the in-flight chunk the server turned down.
+static void _rewindLargeUpload(TJDropboxLargeUpload *const upload, const unsigned long long offset, const NSUInteger rejectedChunkLength)
+{
+    [upload performSynchronized:^{
+        upload.generation++;
+        upload.inFlightChunkCount--;
+        upload.bufferedByteCount -= rejectedChunkLength;
+        for (TJDropboxUploadChunk *const chunk in upload.preparedChunksForOffsets.objectEnumerator) {
+            upload.bufferedByteCount -= chunk.length;
+        }
+        [upload.preparedChunksForOffsets removeAllObjects];
+        [upload.sentByteCountsForInFlightOffsets removeAllObjects];
+        upload.committedByteCount = MIN(offset, upload.fileSize);
+        upload.nextReadOffset = upload.committedByteCount;
+        upload.nextSendOffset = upload.committedByteCount;
+        upload.allChunksRead = NO;
+    }];
+    [upload writeJournal];
+    if (upload.isFullyCommitted) {
+        _finishLargeUpload(upload);
+    } else {
+        _pumpLargeUpload(upload);
+    }
+}
+
+static void _finishLargeUpload(TJDropboxLargeUpload *const upload)
+{
+    TJDropboxCredential *const credential = upload.credential;
+    void (^const completion)(NSDictionary *, NSError *) = ^(NSDictionary *parsedResponse, NSError *error) {
+        [upload completeWithParsedResponse:parsedResponse error:error];
+    };
+    _addTask(credential,
+             TJDropboxRequestLaneBulk,
+             TJDropboxSessionPoolBulk,
+             [TJDropbox contentBaseURL],
+             ^NSURLSessionTask *(NSURLSession *session) {
+        NSMutableDictionary *const commit = [NSMutableDictionary new];
+        commit[@"path"] = upload.remotePath;
+        if (upload.overwriteExisting) {
+            commit[@"mode"] = @{@".tag": @"overwrite"};
+        }
+        if (upload.muteDesktopNotifications) {
+            commit[@"mute"] = @YES;
+        }
+        NSMutableURLRequest *const request = _contentRequest(@"/2/files/upload_session/finish", credential.accessToken,
+                                                             @{
+                                                                 @"cursor": @{
+                                                                         @"session_id": upload.sessionIdentifier,
+                                                                         @"offset": @(upload.fileSize)
+                                                                 },
+                                                                 @"commit": commit
+                                                             });
+        [request addValue:@"application/octet-stream" forHTTPHeaderField:@"Content-Type"];
+        
+        NSURLSessionDataTask *const task = [session dataTaskWithRequest:request];
+        [_taskDelegate() setProgressBlock:nil
+                          completionBlock:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
+            NSDictionary *parsedResult = nil;
+            _processResult(data, response, &error, &parsedResult);
+            completion(parsedResult, error);
+        }
+                              forDataTask:task];
+        return task;
+    },
+             completion);
+}
+
+static const NSUInteger kBatchUploadMaximumFileCount = 1000; // The most entries upload_session/finish_batch_v2 accepts https://www.dropbox.com/developers/documentation/http/documentation#files-upload_session-finish_batch
+static const NSUInteger kBatchUploadMaximumConcurrentFiles = 8;
+
++ (void)uploadFilesAtPaths:(NSArray<NSString *> *const)localPaths toPaths:(NSArray<NSString *> *const)remotePaths overwriteExisting:(const BOOL)overwriteExisting muteDesktopNotifications:(const BOOL)muteDesktopNotifications credential:(TJDropboxCredential *const)credential progressBlock:(void (^const _Nullable)(CGFloat))progressBlock completion:(void (^const)(NSArray * _Nonnull))completion
+{
+    NSParameterAssert(localPaths.count == remotePaths.count);
+    TJDropboxBatchUpload *const batch = [[TJDropboxBatchUpload alloc] initWithLocalPaths:localPaths remotePaths:remotePaths];
+    batch.overwriteExisting = overwriteExisting;
+    batch.muteDesktopNotifications = muteDesktopNotifications;
+    batch.credential = credential;
+    batch.progressBlock = progressBlock;
+    batch.completion = completion;
+    _uploadBatchGroup(batch, 0);
+}
+
+// Uploads up to kBatchUploadMaximumFileCount files starting at groupStart, then moves on to the next group.
+static void _uploadBatchGroup(TJDropboxBatchUpload *const batch, const NSUInteger groupStart)
+{
+    if (groupStart >= batch.localPaths.count) {
+        batch.completion(batch.results);
+        return;
+    }
+    
+    const NSRange group = NSMakeRange(groupStart, MIN(kBatchUploadMaximumFileCount, batch.localPaths.count - groupStart));
+    TJDropboxCredential *const credential = batch.credential;
+    _performAPIRequest(credential,
+                       ^NSURLRequest *{
+        return _apiRequest(@"/2/files/upload_session/start_batch", credential.accessToken,
+                           @{
+                               @"num_sessions": @(group.length)
+                           });
+    },
+                       ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        NSArray<NSString *> *const sessionIdentifiers = parsedResponse[@"session_ids"];
+        if (![sessionIdentifiers isKindOfClass:[NSArray class]] || sessionIdentifiers.count != group.length) {
+            _failBatchUploadGroup(batch, group, error);
+            return;
+        }
+        
+        _performWithMaximumConcurrency(group.length, kBatchUploadMaximumConcurrentFiles, ^(NSUInteger i, dispatch_block_t done) {
+            const NSUInteger index = group.location + i;
+            NSFileHandle *const fileHandle = [NSFileHandle fileHandleForReadingAtPath:batch.localPaths[index]];
+            if (fileHandle) {
+                _appendBatchUploadFile(batch, index, sessionIdentifiers[i], fileHandle, 0, done);
+            } else {
+                [batch setResult:[NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadNoSuchFileError userInfo:@{NSFilePathErrorKey: batch.localPaths[index]}] atIndex:index];
+                done();
+            }
+        }, ^{
+            _finishBatchUploadGroup(batch, group, sessionIdentifiers);
+        });
+    });
+}
+
+static void _failBatchUploadGroup(TJDropboxBatchUpload *const batch, const NSRange group, NSError *const error)
+{
+    NSError *const groupError = error ?: [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"Unexpected batch response"}];
+    for (NSUInteger index = group.location; index < NSMaxRange(group); index++) {
+        if (![batch hasResultAtIndex:index]) {
+            [batch setResult:groupError atIndex:index];
+        }
+    }
+    _uploadBatchGroup(batch, NSMaxRange(group));
+}
+
+// Sends a file to its own session, closing the session along with the final append. Files larger than a single request allows are sent in several appends.
+static void _appendBatchUploadFile(TJDropboxBatchUpload *const batch, const NSUInteger index, NSString *const sessionIdentifier, NSFileHandle *const fileHandle, const unsigned long long offset, dispatch_block_t const done)
+{
+    _dispatchAsync(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+        __block unsigned long long fileSize;
+        [batch performSynchronized:^{
+            fileSize = batch.fileSizes[index].unsignedLongLongValue;
+        }];
+        const NSUInteger requestedLength = (NSUInteger)MIN((unsigned long long)kUploadSessionMaximumChunkSize, fileSize - offset);
+        NSData *const data = [fileHandle readDataOfLength:requestedLength];
+        // Stop early if the file shrank, finish will then report the mismatch for this entry.
+        const BOOL close = offset + data.length >= fileSize || data.length < requestedLength;
+        NSData *const compressedData = _gzipCompressDataIfSmaller(data);
+        
+        TJDropboxCredential *const credential = batch.credential;
+        void (^const failure)(NSDictionary *, NSError *) = ^(NSDictionary *parsedResponse, NSError *error) {
+            [fileHandle closeFile];
+            [batch setResult:error atIndex:index];
+            done();
+        };
+        _addTask(credential,
+                 TJDropboxRequestLaneBulk,
+                 TJDropboxSessionPoolBulk,
+                 [TJDropbox contentBaseURL],
+                 ^NSURLSessionTask *(NSURLSession *session) {
+            NSMutableURLRequest *const request = _contentRequest(@"/2/files/upload_session/append_v2", credential.accessToken,
+                                                                 @{
+                                                                     @"cursor": @{
+                                                                             @"session_id": sessionIdentifier,
+                                                                             @"offset": @(offset)
+                                                                     },
+                                                                     @"close": @(close)
+                                                                 });
+            [request addValue:@"application/octet-stream" forHTTPHeaderField:@"Content-Type"];
+            if (compressedData) {
+                [request setValue:@"gzip" forHTTPHeaderField:@"Content-Encoding"];
+            }
+            NSURLSessionUploadTask *const task = [session uploadTaskWithRequest:request fromData:compressedData ?: data];
+            
+            void (^progressBlock)(CGFloat);
+            if (batch.progressBlock) {
+                progressBlock = ^(CGFloat progress) {
+                    [batch didSendByteCount:(unsigned long long)(data.length * progress) forIndex:index committed:NO];
+                };
+            } else {
+                progressBlock = nil;
+                if (@available(iOS 14.5, macOS 11.3, *)) {
+                    task.prefersIncrementalDelivery = NO;
+                }
+            }
+            [_taskDelegate() setProgressBlock:progressBlock
+                              completionBlock:^(NSData * _Nullable responseData, NSURLResponse * _Nullable response, NSError * _Nullable error) {
+                NSDictionary *parsedResult = nil;
+                _processResult(responseData, response, &error, &parsedResult);
+                
+                if (error && [(NSHTTPURLResponse *)response statusCode] != 200) {
+                    failure(parsedResult, error);
+                } else {
+                    [batch didSendByteCount:data.length forIndex:index committed:YES];
+                    if (close) {
+                        [fileHandle closeFile];
+                        [batch performSynchronized:^{
+                            batch.fileSizes[index] = @(offset + data.length);
+                        }];
+                        done();
+                    } else {
+                        _appendBatchUploadFile(batch, index, sessionIdentifier, fileHandle, offset + data.length, done);
+                    }
+                }
+            }
+                                  forDataTask:task];
+            return task;
+        },
+                 failure);
+    });
+}
+
+// Commits every file in the group whose appends succeeded with a single finish_batch_v2 call.
+static void _finishBatchUploadGroup(TJDropboxBatchUpload *const batch, const NSRange group, NSArray<NSString *> *const sessionIdentifiers)
+{
+    NSMutableArray<NSDictionary *> *const entries = [NSMutableArray arrayWithCapacity:group.length];
+    NSMutableArray<NSNumber *> *const entryIndexes = [NSMutableArray arrayWithCapacity:group.length];
+    for (NSUInteger index = group.location; index < NSMaxRange(group); index++) {
+        if ([batch hasResultAtIndex:index]) {
+            // Already failed
+            continue;
+        }
+        NSMutableDictionary *const commit = [NSMutableDictionary new];
+        commit[@"path"] = batch.remotePaths[index];
+        if (batch.overwriteExisting) {
+            commit[@"mode"] = @{@".tag": @"overwrite"};
+        }
+        if (batch.muteDesktopNotifications) {
+            commit[@"mute"] = @YES;
+        }
+        [entries addObject:@{
+            @"cursor": @{
+                    @"session_id": sessionIdentifiers[index - group.location],
+                    @"offset": batch.fileSizes[index]
+            },
+            @"commit": commit
+        }];
+        [entryIndexes addObject:@(index)];
+    }
+    
+    if (entries.count == 0) {
+        _uploadBatchGroup(batch, NSMaxRange(group));
+        return;
+    }
+    
+    TJDropboxCredential *const credential = batch.credential;
+    _performBatchAPIRequest(credential,
+                            ^NSURLRequest *{
+        return _apiRequest(@"/2/files/upload_session/finish_batch_v2", credential.accessToken,
+                           @{
+                               @"entries": entries
+                           });
+    },
+                            @"/2/files/upload_session/finish_batch/check",
+                            ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        NSArray<NSDictionary *> *const resultEntries = parsedResponse[@"entries"];
+        if (![resultEntries isKindOfClass:[NSArray class]] || resultEntries.count != entries.count) {
+            _failBatchUploadGroup(batch, group, error);
+            return;
+        }
+        [resultEntries enumerateObjectsUsingBlock:^(NSDictionary * _Nonnull entry, NSUInteger i, BOOL * _Nonnull stop) {
+            [batch setResult:_resultForBatchEntry(entry) atIndex:entryIndexes[i].unsignedIntegerValue];
+        }];
+        _uploadBatchGroup(batch, NSMaxRange(group));
+    });
+}
+
++ (void)createFolderAtPath:(NSString *const)path credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    _performAPIRequest(credential,
+                       ^NSURLRequest *{
+        return _apiRequest(@"/2/files/create_folder", credential.accessToken,
+                           @{
+                               @"path": path
+                           });
+    },
+                       completion);
+}
+
++ (void)saveContentsOfURL:(NSURL *const)url toPath:(NSString *const)path credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    _performAPIRequest(credential,
+                       ^NSURLRequest *{
+        return _apiRequest(@"/2/files/save_url", credential.accessToken,
+                           @{
+                               @"url": url.absoluteString,
+                               @"path": path
+                           });
+    },
+                       completion);
+}
+
++ (void)moveFileAtPath:(NSString *const)fromPath toPath:(NSString *const)toPath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    _performAPIRequest(credential,
+                       ^NSURLRequest *{
+        return _apiRequest(@"/2/files/move_v2", credential.accessToken,
+                           @{
+                               @"from_path" : fromPath,
+                               @"to_path" : toPath
+                           });
+    },
+                       completion);
+}
+
++ (void)deleteFileAtPath:(NSString *const)path credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    _performAPIRequest(credential, ^NSURLRequest *{
+        return _apiRequest(@"/2/files/delete_v2", credential.accessToken,
+                           @{
+                               @"path": path
+                           });
+    },
+                       completion);
+}
+
+static const NSUInteger kBatchOperationMaximumEntryCount = 1000; // The most entries delete_batch, move_batch_v2 and copy_batch_v2 accept
+
+// Performs entries in groups of kBatchOperationMaximumEntryCount against a batch endpoint, following async jobs, then reports a result for every entry in order.
+static void _performBatchOperation(TJDropboxCredential *const credential, NSString *const path, NSString *const checkPath, NSArray<NSDictionary *> *const entries, NSMutableArray *const results, void (^const completion)(NSArray *results))
+{
+    if (results.count >= entries.count) {
+        completion(results);
+        return;
+    }
+    
+    const NSRange group = NSMakeRange(results.count, MIN(kBatchOperationMaximumEntryCount, entries.count - results.count));
+    NSArray<NSDictionary *> *const groupEntries = [entries subarrayWithRange:group];
+    _performBatchAPIRequest(credential,
+                            ^NSURLRequest *{
+        return _apiRequest(path, credential.accessToken,
+                           @{
+                               @"entries": groupEntries
+                           });
+    },
+                            checkPath,
+                            ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        NSArray<NSDictionary *> *const resultEntries = parsedResponse[@"entries"];
+        if ([resultEntries isKindOfClass:[NSArray class]] && resultEntries.count == group.length) {
+            for (NSDictionary *const entry in resultEntries) {
+                [results addObject:_resultForBatchEntry(entry)];
+            }
+        } else {
+            NSError *const groupError = error ?: [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"Unexpected batch response"}];
+            for (NSUInteger i = 0; i < group.length; i++) {
+                [results addObject:groupError];
+            }
+        }
+        _performBatchOperation(credential, path, checkPath, entries, results, completion);
+    });
+}
+
++ (void)deleteFilesAtPaths:(NSArray<NSString *> *const)paths credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray *results))completion
+{
+    NSMutableArray<NSDictionary *> *const entries = [NSMutableArray arrayWithCapacity:paths.count];
+    for (NSString *const path in paths) {
+        [entries addObject:@{
+            @"path": path
+        }];
+    }
+    _performBatchOperation(credential, @"/2/files/delete_batch", @"/2/files/delete_batch/check", entries, [NSMutableArray arrayWithCapacity:paths.count], completion);
+}
+
+static NSArray<NSDictionary *> *_relocationEntries(NSArray<NSString *> *const fromPaths, NSArray<NSString *> *const toPaths)
+{
+    NSCParameterAssert(fromPaths.count == toPaths.count);
+    NSMutableArray<NSDictionary *> *const entries = [NSMutableArray arrayWithCapacity:fromPaths.count];
+    [fromPaths enumerateObjectsUsingBlock:^(NSString * _Nonnull fromPath, NSUInteger i, BOOL * _Nonnull stop) {
+        [entries addObject:@{
+            @"from_path": fromPath,
+            @"to_path": toPaths[i]
+        }];
+    }];
+    return entries;
+}
+
++ (void)moveFilesAtPaths:(NSArray<NSString *> *const)fromPaths toPaths:(NSArray<NSString *> *const)toPaths credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray *results))completion
+{
+    _performBatchOperation(credential, @"/2/files/move_batch_v2", @"/2/files/move_batch/check_v2", _relocationEntries(fromPaths, toPaths), [NSMutableArray arrayWithCapacity:fromPaths.count], completion);
+}
+
++ (void)copyFilesAtPaths:(NSArray<NSString *> *const)fromPaths toPaths:(NSArray<NSString *> *const)toPaths credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray *results))completion
+{
+    _performBatchOperation(credential, @"/2/files/copy_batch_v2", @"/2/files/copy_batch/check_v2", _relocationEntries(fromPaths, toPaths), [NSMutableArray arrayWithCapacity:fromPaths.count], completion);
+}
+
+static NSString *_thumbnailSizeValue(const TJDropboxThumbnailSize thumbnailSize)
+{
+    NSString *thumbnailSizeValue = nil;
+    switch (thumbnailSize) {
+        case TJDropboxThumbnailSize32Square:
+            thumbnailSizeValue = @"w32h32";
+            break;
+        case TJDropboxThumbnailSize64Square:
+            thumbnailSizeValue = @"w64h64";
+            break;
+        case TJDropboxThumbnailSize128Square:
+            thumbnailSizeValue = @"w128h128";
+            break;
+        case TJDropboxThumbnailSize640x480:
+            thumbnailSizeValue = @"w640h480";
+            break;
+        case TJDropboxThumbnailSize1024x768:
+            thumbnailSizeValue = @"w1024h768";
+            break;
+    }
+    return thumbnailSizeValue;
+}
+
++ (NSURLRequest *)requestToDownloadThumbnailAtPath:(NSString *const)path size:(const TJDropboxThumbnailSize)thumbnailSize credential:(TJDropboxCredential *const)credential
+{
+    // https://www.dropbox.com/developers/documentation/http/documentation#files-get_thumbnail
+    NSString *const thumbnailSizeValue = _thumbnailSizeValue(thumbnailSize);
+    NSMutableDictionary *parameters = [NSMutableDictionary new];
+    parameters[@"path"] = path;
+    if (thumbnailSizeValue) {
+        parameters[@"size"] = thumbnailSizeValue;
+    }
+    return _contentRequest(@"/2/files/get_thumbnail", credential.accessToken, parameters);
+}
+
++ (void)downloadThumbnailAtPath:(NSString *const)remotePath toPath:(NSString *const)localPath size:(const TJDropboxThumbnailSize)thumbnailSize credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary * _Nullable, NSError * _Nullable))completion
+{
+    _addTask(credential,
+             TJDropboxRequestLaneInteractive,
+             TJDropboxSessionPoolInteractive,
+             [TJDropbox contentBaseURL],
+             ^NSURLSessionTask *(NSURLSession *session) {
+        NSURLRequest *const request = [self requestToDownloadThumbnailAtPath:remotePath size:thumbnailSize credential:credential];
+        
+        NSURLSessionDownloadTask *const task = [session downloadTaskWithRequest:request];
+        
+        [_taskDelegate() setProgressBlock:nil
+                          completionBlock:^(NSURL * _Nullable location, NSURLResponse * _Nullable response, NSError * _Nullable error) {
+            NSDictionary *parsedResult = nil;
+            NSData *const resultData = _resultDataForContentRequestResponse(response);
+            _processResult(resultData, response, &error, &parsedResult);
+            
+            if (!error && location) {
+                NSFileManager *fileManager = [NSFileManager defaultManager];
+                
+                // remove file if it exists
+                if ([fileManager fileExistsAtPath:localPath]) {
+                    [fileManager removeItemAtPath:localPath error:&error];
+                }
+                if (!error) {
+                    // Move file into place
+                    [fileManager moveItemAtURL:location toURL:[NSURL fileURLWithPath:localPath isDirectory:NO] error:&error];
+                }
+            }
+            
+            completion(parsedResult, error);
+        }
+                          forDownloadTask:task];
+        return task;
+    },
+             completion);
+}
+
+#pragma mark - Search
+
++ (void)searchForFilesAtPath:(NSString *const)path matchingQuery:(NSString *const)query options:(NSDictionary *const)additionalOptions credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray *_Nullable entries, NSError *_Nullable error))completion
+{
+    _performAPIRequest(credential,
+                       ^NSURLRequest *{
+        // https://www.dropbox.com/developers/documentation/http/documentation?oref=e#files-search
+        NSMutableDictionary *const options = [NSMutableDictionary dictionaryWithObjectsAndKeys:path, @"path", nil];
+        [options addEntriesFromDictionary:additionalOptions];
+        return _apiRequest(@"/2/files/search_v2", credential.accessToken,
+                           @{
+                               @"query": query,
+                               @"options": options
+                           });
+    },
+                       ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        completion(parsedResponse[@"matches"], error);
+    });
+}
+
+static const NSUInteger kSearchMaximumPageSize = 1000; // The largest max_results search_v2 accepts
+
+static void _handleSearchResponse(TJDropboxSearch *const search, NSDictionary *parsedResponse, NSError *error);
+
+/// Requests the first page if @c cursor is nil, otherwise the page after @c cursor.
+static void _fetchSearchPage(TJDropboxSearch *const search, NSString *const path, NSString *const query, NSDictionary *const additionalOptions, NSString *const cursor)
+{
+    TJDropboxCredential *const credential = search.credential;
+    const NSUInteger maximumResultCount = search.maximumResultCount;
+    _performAPIRequest(credential,
+                       ^NSURLRequest *{
+        if (cursor) {
+            // https://www.dropbox.com/developers/documentation/http/documentation#files-search-continue
+            return _apiRequest(@"/2/files/search/continue_v2", credential.accessToken, @{@"cursor": cursor});
+        }
+        NSMutableDictionary *const options = [NSMutableDictionary dictionaryWithObjectsAndKeys:path, @"path", nil];
+        if (maximumResultCount > 0) {
+            // Don't fetch more than will be delivered, the caller's own page size still wins.
+            options[@"max_results"] = @(MIN(maximumResultCount, kSearchMaximumPageSize));
+        }
+        [options addEntriesFromDictionary:additionalOptions];
+        return _apiRequest(@"/2/files/search_v2", credential.accessToken,
+                           @{
+                               @"query": query,
+                               @"options": options
+                           });
+    },
+                       ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        if ([search beginHandlingResponse:parsedResponse error:error]) {
+            _handleSearchResponse(search, parsedResponse, error);
+        }
+    });
+}
+
+static void _handleSearchResponse(TJDropboxSearch *const search, NSDictionary *parsedResponse, NSError *error)
+{
+    do {
+        NSArray *matches = parsedResponse[@"matches"];
+        const id hasMoreObject = parsedResponse[@"has_more"];
+        if (error || ![matches isKindOfClass:[NSArray class]] || ![hasMoreObject isKindOfClass:[NSNumber class]]) {
+            [search finishWithError:error ?: [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"Unexpected search response"}]];
+            return;
+        }
+        
+        const id cursorObject = parsedResponse[@"cursor"];
+        NSString *const cursor = [cursorObject isKindOfClass:[NSString class]] ? cursorObject : nil;
+        BOOL hasMore = [hasMoreObject boolValue] && cursor != nil;
+        if (search.maximumResultCount > 0) {
+            const NSUInteger remainingResultCount = search.maximumResultCount - search.deliveredResultCount;
+            if (matches.count >= remainingResultCount) {
+                matches = [matches subarrayWithRange:NSMakeRange(0, remainingResultCount)];
+                hasMore = NO;
+            }
+        }
+        search.deliveredResultCount += matches.count;
+        
+        if (hasMore && search.prefetchesNextPage) {
+            // Start on the next page before handing this one over so it's already on its way.
+            _fetchSearchPage(search, nil, nil, nil, cursor);
+        }
+        if (!search.pageHandler(matches, hasMore) || !hasMore) {
+            // Finished, or the caller stopped early. A prefetched page that arrives afterwards is dropped.
+            [search finishWithError:nil];
+            return;
+        }
+        if (!search.prefetchesNextPage) {
+            _fetchSearchPage(search, nil, nil, nil, cursor);
+        }
+    } while ([search endHandlingPageTakingPendingResponse:&parsedResponse error:&error]);
+}
+
++ (void)searchForFilesAtPath:(NSString *const)path matchingQuery:(NSString *const)query options:(NSDictionary *const)additionalOptions maximumResultCount:(const NSUInteger)maximumResultCount prefetchesNextPage:(const BOOL)prefetchesNextPage credential:(TJDropboxCredential *const)credential pageHandler:(BOOL (^const)(NSArray *matches, BOOL hasMore))pageHandler completion:(void (^const)(NSError *_Nullable error))completion
+{
+    TJDropboxSearch *const search = [TJDropboxSearch new];
+    search.credential = credential;
+    search.maximumResultCount = maximumResultCount;
+    search.prefetchesNextPage = prefetchesNextPage;
+    search.pageHandler = pageHandler;
+    search.completion = completion;
+    _fetchSearchPage(search, path, query, additionalOptions, nil);
+}
+
++ (void)searchForMetadataAtPath:(NSString *const)path matchingQuery:(NSString *const)query options:(NSDictionary *const)additionalOptions credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray<TJDropboxMetadata *> *_Nullable entries, NSError *_Nullable error))completion
+{
+    [self searchForFilesAtPath:path
+                 matchingQuery:query
+                       options:additionalOptions
+                    credential:credential
+                    completion:^(NSArray * _Nullable matches, NSError * _Nullable error) {
+        NSMutableArray<TJDropboxMetadata *> *entries = nil;
+        if ([matches isKindOfClass:[NSArray class]]) {
+            NSMutableDictionary<NSString *, TJDropboxMetadataPathPrefix *> *const pathPrefixes = [NSMutableDictionary new];
+            entries = [NSMutableArray arrayWithCapacity:matches.count];
+            for (NSDictionary *const match in matches) {
+                // search_v2 wraps each entry as {"metadata": {".tag": "metadata", "metadata": {...}}}
+                NSDictionary *const matchMetadata = [match isKindOfClass:[NSDictionary class]] ? match[@"metadata"] : nil;
+                NSDictionary *const entry = [matchMetadata isKindOfClass:[NSDictionary class]] ? matchMetadata[@"metadata"] : nil;
+                TJDropboxMetadata *const metadata = [[TJDropboxMetadata alloc] initWithDictionary:entry pathPrefixes:pathPrefixes];
+                if (metadata) {
+                    [entries addObject:metadata];
+                }
+            }
+        }
+        completion(entries, error);
+    }];
+}
+
+#pragma mark - Sharing
+
++ (void)getSharedLinkForFileAtPath:(NSString *const)path credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSString *_Nullable urlString))completion
+{
+    [self getSharedLinkForFileAtPath:path linkType:TJDropboxSharedLinkTypeDefault uploadOrSaveInProgress:NO credential:credential completion:completion];
+}
+
++ (void)getSharedLinkForFileAtPath:(NSString *const)path linkType:(const TJDropboxSharedLinkType)linkType uploadOrSaveInProgress:(const BOOL)uploadOrSaveInProgress credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSString *_Nullable urlString))completion
+{
+    NSString *const arguments = [NSString stringWithFormat:@"%@\n%lu\n%d", path, (unsigned long)linkType, uploadOrSaveInProgress];
+    _performCachedAPIRequest(credential, @"/2/sharing/create_shared_link", arguments,
+                             ^NSURLRequest *{
+        // NOTE: create_shared_link has been deprecated, will likely be removed by Dropbox at some point. https://tijo.link/mluVlJ
+        NSString *const requestPath = linkType == TJDropboxSharedLinkTypeShort || uploadOrSaveInProgress ? @"/2/sharing/create_shared_link" : @"/2/sharing/create_shared_link_with_settings";
+        NSMutableDictionary *parameters = [NSMutableDictionary new];
+        [parameters setObject:path forKey:@"path"];
+        if (linkType == TJDropboxSharedLinkTypeShort) {
+            [parameters setObject:@YES forKey:@"short_url"];
+        }
+        if (uploadOrSaveInProgress) {
+            if (linkType == TJDropboxSharedLinkTypeDirect || linkType == TJDropboxSharedLinkTypeDirectDownload) {
+                NSLog(@"[TJDropbox] - Warning in %s: uploadOrSaveInProgress is not compatible with TJDropboxSharedLinkTypeDirect. Parameter is being ignored.", __PRETTY_FUNCTION__);
+            } else {
+                [parameters setObject:@"file" forKey:@"pending_upload"];
+            }
+        }
+        return _apiRequest(requestPath, credential.accessToken, parameters);
+    },
+                             ^BOOL(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        // Links that already exist come back as errors, but are just as reusable.
+        return [parsedResponse[@"url"] length] > 0 || [parsedResponse[@"error"][@"shared_link_already_exists"][@"metadata"][@"url"] length] > 0;
+    },
+                             ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        NSString *urlString = parsedResponse[@"url"];
+        if (urlString.length == 0) {
+            urlString = parsedResponse[@"error"][@"shared_link_already_exists"][@"metadata"][@"url"];
+        }
+        if (urlString.length > 0) {
+            NSURLComponents *const components = [NSURLComponents componentsWithString:urlString];
+            if (linkType == TJDropboxSharedLinkTypeDirect || linkType == TJDropboxSharedLinkTypeDirectDownload) {
+                NSMutableArray<NSURLQueryItem *> *items = [NSMutableArray arrayWithArray:components.queryItems];
+                [items filterUsingPredicate:[NSPredicate predicateWithBlock:^BOOL(NSURLQueryItem  *_Nullable evaluatedObject, NSDictionary<NSString *,id> * _Nullable bindings) {
+                    return ![evaluatedObject.name isEqualToString:@"dl"];
+                }]];
+                if (linkType == TJDropboxSharedLinkTypeDirect) {
+                    [items addObject:[NSURLQueryItem queryItemWithName:@"raw" value:@"1"]];
+                } else if (linkType == TJDropboxSharedLinkTypeDirectDownload) {
+                    [items addObject:[NSURLQueryItem queryItemWithName:@"dl" value:@"1"]];
+                }
+                components.queryItems = items;
+            } else if (linkType == TJDropboxSharedLinkTypeDefault) {
+                components.host = [components.host stringByReplacingOccurrencesOfString:@"www." withString:@""];
+            }
+            urlString = components.URL.absoluteString;
+        }
+        completion(urlString);
+    });
+}
+
+#pragma mark - Users
+
++ (void)getSpaceUsageForUserWithCredential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+{
+    _performCachedAPIRequest(credential, @"/2/users/get_space_usage", @"",
+                             ^NSURLRequest *{
+        return _apiRequest(@"/2/users/get_space_usage", credential.accessToken, nil);
+    },
+                             nil,
+                             completion);
+}
+
+#pragma mark - Request Management
+
++ (void)performWithCallbackQueue:(dispatch_queue_t const)callbackQueue block:(NS_NOESCAPE dispatch_block_t const)block
+{
+    _performWithCallbackQueue(callbackQueue, block);
+}
+
++ (void)cancelAllRequests
+{
+    [_scheduler() cancelRequestsPassingTest:^BOOL(TJDropboxScheduledRequest *request) {
+        return YES;
+    }];
+    for (NSURLSession *const session in _allSessions()) {
+        [session getAllTasksWithCompletionHandler:^(NSArray<__kindof NSURLSessionTask *> * _Nonnull tasks) {
+            [tasks makeObjectsPerformSelector:@selector(cancel)];
+        }];
+    }
+}
+
++ (void)cancelAllRequestsInSessionPool:(const TJDropboxSessionPool)sessionPool
+{
+    [_scheduler() cancelRequestsPassingTest:^BOOL(TJDropboxScheduledRequest *request) {
+        return request.sessionPool == sessionPool;
+    }];
+}
+
++ (void)cancelAllRequestsForCredential:(TJDropboxCredential *const)credential
+{
+    [_scheduler() cancelRequestsPassingTest:^BOOL(TJDropboxScheduledRequest *request) {
+        return request.credential == credential;
+    }];
+}
+
+@end
+
+#pragma mark - Sync
+
+static NSString *const kSyncStatePathKey = @"path";
+static NSString *const kSyncStateCursorKey = @"cursor";
+static NSString *const kSyncStateEntriesKey = @"entries";
+
+static const NSTimeInterval kSyncLongpollTimeout = 30.0; // Dropbox adds up to 90 seconds of jitter to this
+static const NSTimeInterval kSyncInitialRetryDelay = 5.0;
+static const NSTimeInterval kSyncMaximumRetryDelay = 300.0;
+static const NSTimeInterval kSyncStateWriteDelay = 5.0; // Coalesces writes of the whole index while changes keep arriving
+
+/// Applies a page of list_folder entries as changes on top of @c index, which is left as it is. Once listing completes, removing @c deletedPaths from @c index and adding @c updatedEntries brings it up to date.
+static void _applySyncEntries(NSArray<NSDictionary *> *const entries, NSDictionary<NSString *, NSDictionary *> *const index, NSMutableDictionary<NSString *, NSDictionary *> *const updatedEntries, NSMutableSet<NSString *> *const deletedPaths)
+{
+    for (NSDictionary *const entry in entries) {
+        NSString *const path = entry[@"path_lower"];
+        if (![path isKindOfClass:[NSString class]]) {
+            continue;
         }
-        NSString *const contentHash = _dropboxContentHashForData(contentHashBytes);
-        if (contentHash) {
-            parameters[@"content_hash"] = contentHash;
+        NSString *const tag = entry[@".tag"];
+        NSDictionary *const currentEntry = updatedEntries[path] ?: ([deletedPaths containsObject:path] ? nil : index[path]);
+        if ([currentEntry[@".tag"] isEqualToString:@"folder"] && ![tag isEqualToString:@"folder"]) {
+            // A folder that was deleted or replaced by a file takes everything beneath it along.
+            NSString *const descendantPrefix = [path stringByAppendingString:@"/"];
+            for (NSString *const descendantPath in index) {
+                if ([descendantPath hasPrefix:descendantPrefix]) {
+                    [deletedPaths addObject:descendantPath];
+                }
+            }
+            for (NSString *const descendantPath in updatedEntries.allKeys) {
+                if ([descendantPath hasPrefix:descendantPrefix]) {
+                    [updatedEntries removeObjectForKey:descendantPath];
+                }
+            }
         }
-        
-        NSMutableURLRequest *const request = _contentRequest(@"/2/files/upload", credential.accessToken, parameters);
-        [request setValue:@"application/octet-stream" forHTTPHeaderField:@"Content-Type"];
-        
-        NSData *const data = [NSData dataWithContentsOfFile:localPath];
-        NSError *error;
-        NSData *const compressedData = _gzipCompressData(data, &error); // TODO: We should probably limit this based on file size & RAM
-        
-        NSURLSessionUploadTask *task;
-        if (error == nil && compressedData.length > 0 && compressedData.length < data.length) {
-            [request setValue:@"gzip" forHTTPHeaderField:@"Content-Encoding"];
-            task = [_session() uploadTaskWithRequest:request fromData:compressedData];
+        if ([tag isEqualToString:@"deleted"]) {
+            if (index[path]) {
+                [deletedPaths addObject:path];
+            }
+            [updatedEntries removeObjectForKey:path];
         } else {
-            task = [_session() uploadTaskWithRequest:request fromFile:[NSURL fileURLWithPath:localPath isDirectory:NO]];
+            updatedEntries[path] = entry;
+            [deletedPaths removeObject:path];
         }
+    }
+}
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxSync () {
+    os_unfair_lock _lock;
+}
+
+// All of these must be accessed within -performSynchronized:
+@property (nonatomic, copy) NSString *cursor;
+@property (nonatomic) NSMutableDictionary<NSString *, NSDictionary *> *index;
+@property (nonatomic) NSUInteger generation; // Incremented on start and stop, work from earlier generations is dropped
+@property (nonatomic, readwrite, getter=isRunning) BOOL running;
+@property (nonatomic) NSUInteger consecutiveFailureCount;
+@property (nonatomic) BOOL stateWriteScheduled;
+
+@property (nonatomic) NSURL *stateURL;
+@property (nonatomic) dispatch_queue_t stateQueue; // Serializes writes of the state file
+
+@end
+
+@implementation TJDropboxSync
+
+- (instancetype)initWithPath:(NSString *const)path credential:(TJDropboxCredential *const)credential stateURL:(NSURL *const)stateURL
+{
+    if (self = [super init]) {
+        _lock = OS_UNFAIR_LOCK_INIT;
+        _path = [path copy];
+        _credential = credential;
+        self.stateURL = stateURL;
+        self.stateQueue = dispatch_queue_create_with_target("com.tijo.TJDropbox.sync", DISPATCH_QUEUE_SERIAL, _workerQueue());
+        self.index = [NSMutableDictionary new];
         
-        task.priority = NSURLSessionTaskPriorityHigh;
-        
-        if (@available(iOS 14.5, macOS 11.3, *)) {
-            if (!progressBlock) {
-                task.prefersIncrementalDelivery = NO;
-            }
+        NSData *const stateData = [NSData dataWithContentsOfURL:stateURL];
+        NSDictionary *const state = stateData ? [NSPropertyListSerialization propertyListWithData:stateData options:NSPropertyListMutableContainers format:nil error:nil] : nil;
+        NSString *const statePath = state[kSyncStatePathKey];
+        NSString *const cursor = state[kSyncStateCursorKey];
+        NSMutableDictionary *const entries = state[kSyncStateEntriesKey];
+        if ([statePath isKindOfClass:[NSString class]] && [statePath.lowercaseString isEqualToString:path.lowercaseString] && [cursor isKindOfClass:[NSString class]] && [entries isKindOfClass:[NSMutableDictionary class]]) {
+            self.cursor = cursor;
+            self.index = entries;
         }
-            
-        [_taskDelegate() setProgressBlock:progressBlock
-                          completionBlock:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
-            NSDictionary *parsedResult = nil;
-            _processResult(data, response, &error, &parsedResult);
-            
-            completion(parsedResult, error);
+    }
+    return self;
+}
+
+- (void)performSynchronized:(NS_NOESCAPE dispatch_block_t)block {
+    os_unfair_lock_lock(&_lock);
+    block();
+    os_unfair_lock_unlock(&_lock);
+}
+
+- (NSDictionary<NSString *, NSDictionary *> *)entries
+{
+    __block NSDictionary<NSString *, NSDictionary *> *entries;
+    [self performSynchronized:^{
+        entries = [self.index copy];
+    }];
+    return entries;
+}
+
+- (NSDictionary *)entryForPath:(NSString *const)path
+{
+    __block NSDictionary *entry;
+    [self performSynchronized:^{
+        entry = self.index[path.lowercaseString];
+    }];
+    return entry;
+}
+
+- (void)start
+{
+    __block NSUInteger generation;
+    __block BOOL started = NO;
+    [self performSynchronized:^{
+        if (!self.running) {
+            self.running = YES;
+            self.consecutiveFailureCount = 0;
+            generation = ++self.generation;
+            started = YES;
         }
-                              forDataTask:task];
-        return task;
-    },
-             completion);
+    }];
+    if (started) {
+        [self listChangesForGeneration:generation];
+    }
 }
 
-+ (void)uploadLargeFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+- (void)stop
 {
-    [self uploadLargeFileAtPath:localPath toPath:remotePath overwriteExisting:NO muteDesktopNotifications:NO credential:credential progressBlock:nil completion:completion];
+    [self performSynchronized:^{
+        if (self.running) {
+            self.running = NO;
+            self.generation++;
+        }
+    }];
 }
 
-+ (void)uploadLargeFileAtPath:(NSString *const)localPath toPath:(NSString *const)remotePath overwriteExisting:(const BOOL)overwriteExisting muteDesktopNotifications:(const BOOL)muteDesktopNotifications credential:(TJDropboxCredential *const)credential progressBlock:(void (^const _Nullable)(CGFloat))progressBlock completion:(nonnull void (^const)(NSDictionary * _Nullable, NSError * _Nullable))completion
+- (BOOL)isCurrentGeneration:(const NSUInteger)generation
 {
-    _addTask(credential,
-             ^NSURLSessionTask *{
-        NSMutableURLRequest *const request = _contentRequest(@"/2/files/upload_session/start", credential.accessToken, nil);
-        [request addValue:@"application/octet-stream" forHTTPHeaderField:@"Content-Type"];
-        
-        NSURLSessionTask *const task = [_session() dataTaskWithRequest:request completionHandler:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
-            NSDictionary *parsedResult = nil;
-            _processResult(data, response, &error, &parsedResult);
-            
-            NSString *const sessionIdentifier = parsedResult[@"session_id"];
-            if (sessionIdentifier) {
-                NSFileHandle *const fileHandle = [NSFileHandle fileHandleForReadingAtPath:localPath];
-                
-                unsigned long long fileSize = [fileHandle seekToEndOfFile];
-                [fileHandle seekToFileOffset:0];
-                
-                _uploadChunk(fileHandle, fileSize, sessionIdentifier, remotePath, overwriteExisting, muteDesktopNotifications, credential, progressBlock, completion);
-            } else {
-                completion(parsedResult, error);
-            }
-        }];
-        
-        return task;
-    },
-             completion);
+    __block BOOL isCurrentGeneration;
+    [self performSynchronized:^{
+        isCurrentGeneration = self.generation == generation;
+    }];
+    return isCurrentGeneration;
 }
 
-static void _uploadChunk(NSFileHandle *const fileHandle, unsigned long long fileSize, NSString *const sessionIdentifier, NSString *const remotePath, const BOOL overwriteExisting, const BOOL muteDesktopNotifications, TJDropboxCredential *credential, void (^progressBlock)(CGFloat progress), void (^completion)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))
+/// Lists from the saved cursor, or rebuilds the index from scratch if there isn't one.
+- (void)listChangesForGeneration:(const NSUInteger)generation
 {
-    _addTask(credential,
-             ^NSURLSessionTask *{
-        const unsigned long long offset = fileHandle.offsetInFile;
-        static const NSUInteger kChunkSize = 10 * 1024 * 1024; // use 10 MB - same as the official Obj-C Dropbox SDK
-        NSData *chunk = [fileHandle readDataOfLength:kChunkSize];
-        NSUInteger chunkLength = [chunk length];
-        const BOOL isLastChunk = chunkLength < kChunkSize;
-        
-        NSMutableURLRequest *const request = _contentRequest(@"/2/files/upload_session/append_v2", credential.accessToken,
-                                                             @{
-                                                                 @"cursor": @{
-                                                                         @"session_id": sessionIdentifier,
-                                                                         @"offset": @(offset)
-                                                                 },
-                                                                 @"close": @(isLastChunk)
-                                                             });
-        [request addValue:@"application/octet-stream" forHTTPHeaderField:@"Content-Type"];
-        
-        NSData *const compressedChunk = _gzipCompressData(chunk, nil); // TODO: It would be neat to parallelize this with the uploads.
-        if ([compressedChunk length] < [chunk length]) {
-            chunk = compressedChunk;
-            [request setValue:@"gzip" forHTTPHeaderField:@"Content-Encoding"];
+    __block NSString *cursor;
+    __block NSDictionary<NSString *, NSDictionary *> *previousIndex = nil;
+    [self performSynchronized:^{
+        cursor = self.cursor;
+        if (!cursor) {
+            previousIndex = self.index;
         }
-        NSURLSessionUploadTask *const task = [_session() uploadTaskWithRequest:request fromData:chunk];
-        
-        void (^totalProgressBlock)(CGFloat);
-        if (progressBlock) {
-            totalProgressBlock = ^(CGFloat progress) {
-                unsigned long long totalBytesRead = offset + chunkLength * progress;
-                CGFloat totalProgress = (CGFloat)totalBytesRead / fileSize;
-                progressBlock(totalProgress);
-            };
-        } else {
-            totalProgressBlock = nil;
+    }];
+    
+    // Pages are collected as changes on top of the saved index and only applied once listing completes, so a listing that fails partway is repeated
+    // from the saved cursor with nothing lost. Rebuilds collect every entry on top of nothing, and the result replaces the old index.
+    const BOOL rebuilding = previousIndex != nil;
+    NSMutableDictionary<NSString *, NSDictionary *> *const listedEntries = [NSMutableDictionary new];
+    NSMutableSet<NSString *> *const listedDeletedPaths = [NSMutableSet new];
+    _listFolder(self.path, cursor, NO, YES, self.credential, ^BOOL(NSArray<NSDictionary *> *entries, BOOL hasMore) {
+        if (![self isCurrentGeneration:generation]) {
+            return NO;
+        }
+        [self performSynchronized:^{
+            _applySyncEntries(entries, rebuilding ? nil : self.index, listedEntries, listedDeletedPaths);
+        }];
+        return YES;
+    }, ^(NSString *outCursor, NSError *error) {
+        if (![self isCurrentGeneration:generation]) {
+            return;
+        }
+        if (!error && !outCursor) {
+            error = [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"list_folder didn't return a cursor"}];
+        }
+        if (error) {
+            if (cursor && [[error.userInfo[TJDropboxErrorUserInfoKeyDropboxError] objectForKey:@".tag"] isEqualToString:@"reset"]) {
+                // Dropbox can invalidate cursors, the only way forward is to list everything again.
+                [self performSynchronized:^{
+                    self.cursor = nil;
+                }];
+                [self listChangesForGeneration:generation];
+            } else {
+                [self handleError:error forGeneration:generation];
+            }
+            return;
         }
         
-        if (@available(iOS 14.5, macOS 11.3, *)) {
-            if (!totalProgressBlock) {
-                task.prefersIncrementalDelivery = NO;
+        NSMutableDictionary<NSString *, NSDictionary *> *updatedEntries = listedEntries;
+        NSMutableSet<NSString *> *deletedPaths = listedDeletedPaths;
+        if (rebuilding) {
+            // Diff against what was there before so that consumers still see a minimal set of changes.
+            updatedEntries = [NSMutableDictionary new];
+            deletedPaths = [NSMutableSet new];
+            [listedEntries enumerateKeysAndObjectsUsingBlock:^(NSString * _Nonnull path, NSDictionary * _Nonnull entry, BOOL * _Nonnull stop) {
+                if (![previousIndex[path] isEqual:entry]) {
+                    updatedEntries[path] = entry;
+                }
+            }];
+            for (NSString *const path in previousIndex) {
+                if (!listedEntries[path]) {
+                    [deletedPaths addObject:path];
+                }
             }
         }
-        [_taskDelegate() setProgressBlock:totalProgressBlock
-                          completionBlock:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
-            NSDictionary *parsedResult = nil;
-            _processResult(data, response, &error, &parsedResult);
-            
-            if (error && [(NSHTTPURLResponse *)response statusCode] != 200) {
-                // Error encountered
-                completion(parsedResult, error);
-            } else if (isLastChunk) {
-                // Finish the upload
-                _finishLargeUpload(fileHandle, sessionIdentifier, remotePath, overwriteExisting, muteDesktopNotifications, credential, completion);
+        
+        [self performSynchronized:^{
+            if (rebuilding) {
+                self.index = listedEntries;
             } else {
-                // Upload next chunk
-                _uploadChunk(fileHandle, fileSize, sessionIdentifier, remotePath, overwriteExisting, muteDesktopNotifications, credential, progressBlock, completion);
+                [self.index removeObjectsForKeys:listedDeletedPaths.allObjects];
+                [self.index addEntriesFromDictionary:listedEntries];
             }
+            self.cursor = outCursor;
+            self.consecutiveFailureCount = 0;
+        }];
+        [self scheduleStateWrite];
+        
+        if ((updatedEntries.count > 0 || deletedPaths.count > 0) && self.changeHandler) {
+            self.changeHandler(updatedEntries.allValues, deletedPaths.allObjects);
         }
-                              forDataTask:task];
-        return task;
+        [self waitForChangesForGeneration:generation];
+    });
+}
+
+- (void)waitForChangesForGeneration:(const NSUInteger)generation
+{
+    __block NSString *cursor;
+    [self performSynchronized:^{
+        cursor = self.cursor;
+    }];
+    _performRequest(nil,
+                    TJDropboxRequestLaneBulk,
+                    TJDropboxSessionPoolBackground,
+                    [TJDropbox notifyBaseURL],
+                    ^NSURLRequest *{
+        // https://www.dropbox.com/developers/documentation/http/documentation#files-list_folder-longpoll
+        NSMutableURLRequest *const request = _notifyRequest(@"/2/files/list_folder/longpoll",
+                                                            @{
+                                                                @"cursor": cursor,
+                                                                @"timeout": @((NSUInteger)kSyncLongpollTimeout)
+                                                            });
+        request.timeoutInterval = kSyncLongpollTimeout + 90.0;
+        return request;
     },
-             completion);
+                    ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        if (![self isCurrentGeneration:generation]) {
+            return;
+        }
+        if ([error.domain isEqualToString:NSURLErrorDomain] && error.code == NSURLErrorTimedOut) {
+            // The session's resource timeout can be shorter than the longpoll's, that just means nothing changed.
+            [self waitForChangesForGeneration:generation];
+        } else if (error) {
+            if ([[error.userInfo[TJDropboxErrorUserInfoKeyDropboxError] objectForKey:@".tag"] isEqualToString:@"reset"]) {
+                [self performSynchronized:^{
+                    self.cursor = nil;
+                }];
+                [self listChangesForGeneration:generation];
+            } else {
+                [self handleError:error forGeneration:generation];
+            }
+        } else {
+            [self performSynchronized:^{
+                self.consecutiveFailureCount = 0;
+            }];
+            const id backoff = parsedResponse[@"backoff"];
+            const NSTimeInterval delay = [backoff isKindOfClass:[NSNumber class]] ? [backoff doubleValue] : 0.0;
+            const BOOL changes = [parsedResponse[@"changes"] boolValue];
+            // Dropbox asks clients to wait out the backoff before their next request of either kind.
+            [self afterDelay:delay forGeneration:generation performBlock:^{
+                if (changes) {
+                    [self listChangesForGeneration:generation];
+                } else {
+                    [self waitForChangesForGeneration:generation];
+                }
+            }];
+        }
+    });
 }
 
-static void _finishLargeUpload(NSFileHandle *const fileHandle, NSString *const sessionIdentifier, NSString *const remotePath, const BOOL overwriteExisting, const BOOL muteDesktopNotifications, TJDropboxCredential *const credential, void (^completion)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))
+- (void)handleError:(NSError *const)error forGeneration:(const NSUInteger)generation
 {
-    _addTask(credential,
-             ^NSURLSessionTask *{
-        NSNumber *const offset = @(fileHandle.offsetInFile);
-        
-        NSMutableDictionary *const commit = [NSMutableDictionary new];
-        commit[@"path"] = _asciiEncodeString(remotePath);
-        if (overwriteExisting) {
-            commit[@"mode"] = @{@".tag": @"overwrite"};
+    __block NSUInteger consecutiveFailureCount;
+    [self performSynchronized:^{
+        consecutiveFailureCount = ++self.consecutiveFailureCount;
+    }];
+    if (self.errorHandler) {
+        self.errorHandler(error);
+    }
+    const NSTimeInterval delay = MIN(kSyncInitialRetryDelay * pow(2.0, consecutiveFailureCount - 1), kSyncMaximumRetryDelay);
+    [self afterDelay:delay forGeneration:generation performBlock:^{
+        [self listChangesForGeneration:generation];
+    }];
+}
+
+- (void)afterDelay:(const NSTimeInterval)delay forGeneration:(const NSUInteger)generation performBlock:(dispatch_block_t const)block
+{
+    dispatch_block_t const generationCheckingBlock = _callbackQueuePreservingBlock(^{
+        if ([self isCurrentGeneration:generation]) {
+            block();
         }
-        if (muteDesktopNotifications) {
-            commit[@"mute"] = @YES;
+    });
+    if (delay > 0.0) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), _workerQueue(), generationCheckingBlock);
+    } else {
+        generationCheckingBlock();
+    }
+}
+
+- (void)scheduleStateWrite
+{
+    __block BOOL shouldSchedule = NO;
+    [self performSynchronized:^{
+        if (!self.stateWriteScheduled) {
+            self.stateWriteScheduled = YES;
+            shouldSchedule = YES;
         }
-        NSMutableURLRequest *const request = _contentRequest(@"/2/files/upload_session/finish", credential.accessToken,
-                                                             @{
-                                                                 @"cursor": @{
-                                                                         @"session_id": sessionIdentifier,
-                                                                         @"offset": offset
-                                                                 },
-                                                                 @"commit": commit
-                                                             });
-        [request addValue:@"application/octet-stream" forHTTPHeaderField:@"Content-Type"];
-        
-        NSURLSessionTask *const task = [_session() dataTaskWithRequest:request completionHandler:^(NSData * _Nullable data, NSURLResponse * _Nullable response, NSError * _Nullable error) {
-            NSDictionary *parsedResult = nil;
-            _processResult(data, response, &error, &parsedResult);
-            completion(parsedResult, error);
+    }];
+    if (!shouldSchedule) {
+        return;
+    }
+    NSURL *const stateURL = self.stateURL;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kSyncStateWriteDelay * NSEC_PER_SEC)), self.stateQueue, ^{
+        __block NSDictionary *state = nil;
+        [self performSynchronized:^{
+            self.stateWriteScheduled = NO;
+            // The cursor is cleared when Dropbox resets it, the state on disk is left for the rebuild to replace.
+            if (self.cursor) {
+                state = @{
+                    kSyncStatePathKey: self.path,
+                    kSyncStateCursorKey: self.cursor,
+                    kSyncStateEntriesKey: [self.index copy],
+                };
+            }
         }];
-        return task;
-    },
-             completion);
+        if (!state) {
+            return;
+        }
+        NSError *error = nil;
+        NSData *const stateData = [NSPropertyListSerialization dataWithPropertyList:state format:NSPropertyListBinaryFormat_v1_0 options:0 error:&error];
+        if (stateData) {
+            [[NSFileManager defaultManager] createDirectoryAtURL:[stateURL URLByDeletingLastPathComponent] withIntermediateDirectories:YES attributes:nil error:nil];
+            [stateData writeToURL:stateURL options:NSDataWritingAtomic error:&error];
+        }
+        if (error) {
+            NSLog(@"[TJDropbox] - Error in %s: %@", __PRETTY_FUNCTION__, error);
+        }
+    });
 }
 
-+ (void)createFolderAtPath:(NSString *const)path credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
-{
-    _performAPIRequest(credential,
-                       ^NSURLRequest *{
-        return _apiRequest(@"/2/files/create_folder", credential.accessToken,
-                           @{
-                               @"path": _asciiEncodeString(path)
-                           });
-    },
-                       completion);
+@end
+
+#pragma mark - Thumbnails
+
+static const NSUInteger kThumbnailBatchMaximumEntryCount = 25;
+static const NSTimeInterval kThumbnailBatchCoalescingInterval = 0.01; // Long enough to gather the requests from a screen of cells being laid out
+
+// Someone waiting on a thumbnail, returned from -loadThumbnailAtPath:... as the token to cancel with.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxThumbnailRequester : NSObject
+
+@property (nonatomic, copy) void (^completion)(NSData *, NSError *);
+@property (nonatomic) dispatch_queue_t callbackQueue;
+@property (nonatomic, weak) id request; // The TJDropboxThumbnailRequest this is waiting on
+
+@end
+
+@implementation TJDropboxThumbnailRequester
+
+@end
+
+// A single thumbnail being loaded, shared by everyone asking for it at the same time.
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxThumbnailRequest : NSObject
+
+@property (nonatomic, copy) NSString *key;
+@property (nonatomic, copy) NSString *path;
+@property (nonatomic, copy) NSString *rev;
+@property (nonatomic, copy) NSString *sizeValue;
+@property (nonatomic) NSMutableArray<TJDropboxThumbnailRequester *> *requesters;
+@property (nonatomic) BOOL sent;
+
+@end
+
+@implementation TJDropboxThumbnailRequest
+
+@end
+
+#if defined(__has_attribute) && __has_attribute(objc_direct_members)
+__attribute__((objc_direct_members))
+#endif
+@interface TJDropboxThumbnailLoader () {
+    os_unfair_lock _lock;
 }
 
-+ (void)saveContentsOfURL:(NSURL *const)url toPath:(NSString *const)path credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+// All of these must be accessed within -performSynchronized:
+@property (nonatomic) NSMutableDictionary<NSString *, TJDropboxThumbnailRequest *> *requestsForKeys;
+@property (nonatomic) NSMutableArray<TJDropboxThumbnailRequest *> *pendingRequests; // Not yet sent in a batch
+@property (nonatomic) BOOL flushScheduled;
+@property (nonatomic) long long diskCacheByteCount; // -1 until the cache directory has been measured
+
+@property (nonatomic, copy) NSString *cacheDirectoryPath;
+@property (nonatomic) NSCache<NSString *, NSData *> *memoryCache;
+@property (nonatomic) dispatch_queue_t diskQueue; // Serializes all access to the cache directory
+
+@end
+
+@implementation TJDropboxThumbnailLoader
+
+- (instancetype)initWithCredential:(TJDropboxCredential *const)credential cacheDirectoryPath:(NSString *const)cacheDirectoryPath
 {
-    _performAPIRequest(credential,
-                       ^NSURLRequest *{
-        return _apiRequest(@"/2/files/save_url", credential.accessToken,
-                           @{
-                               @"url": url.absoluteString,
-                               @"path": path
-                           });
-    },
-                       completion);
+    if (self = [super init]) {
+        _lock = OS_UNFAIR_LOCK_INIT;
+        _credential = credential;
+        self.cacheDirectoryPath = cacheDirectoryPath;
+        self.requestsForKeys = [NSMutableDictionary new];
+        self.pendingRequests = [NSMutableArray new];
+        self.diskCacheByteCount = -1;
+        self.memoryCache = [NSCache new];
+        self.maximumMemoryCacheByteCount = 16 * 1024 * 1024;
+        self.maximumDiskCacheByteCount = 128 * 1024 * 1024;
+        self.diskQueue = dispatch_queue_create_with_target("com.tijo.TJDropbox.thumbnails", DISPATCH_QUEUE_SERIAL, _workerQueue());
+    }
+    return self;
 }
 
-+ (void)moveFileAtPath:(NSString *const)fromPath toPath:(NSString *const)toPath credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+- (void)performSynchronized:(NS_NOESCAPE dispatch_block_t)block {
+    os_unfair_lock_lock(&_lock);
+    block();
+    os_unfair_lock_unlock(&_lock);
+}
+
+- (void)setMaximumMemoryCacheByteCount:(NSUInteger)maximumMemoryCacheByteCount
 {
-    _performAPIRequest(credential,
-                       ^NSURLRequest *{
-        return _apiRequest(@"/2/files/move_v2", credential.accessToken,
-                           @{
-                               @"from_path" : _asciiEncodeString(fromPath),
-                               @"to_path" : _asciiEncodeString(toPath)
-                           });
-    },
-                       completion);
+    _maximumMemoryCacheByteCount = maximumMemoryCacheByteCount;
+    self.memoryCache.totalCostLimit = maximumMemoryCacheByteCount;
 }
 
-+ (void)deleteFileAtPath:(NSString *const)path credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+static NSString *_thumbnailCacheKey(NSString *const path, NSString *const rev, NSString *const sizeValue)
 {
-    _performAPIRequest(credential, ^NSURLRequest *{
-        return _apiRequest(@"/2/files/delete_v2", credential.accessToken,
-                           @{
-                               @"path": _asciiEncodeString(path)
-                           });
-    },
-                       completion);
+    // Hashed so that the key can double as a file name.
+    NSData *const keyData = [[NSString stringWithFormat:@"%@\n%@\n%@", path.lowercaseString, rev ?: @"", sizeValue] dataUsingEncoding:NSUTF8StringEncoding];
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(keyData.bytes, (CC_LONG)keyData.length, digest);
+    return _dropboxContentHashForData([NSData dataWithBytes:digest length:CC_SHA256_DIGEST_LENGTH]);
 }
 
-+ (NSURLRequest *)requestToDownloadThumbnailAtPath:(NSString *const)path size:(const TJDropboxThumbnailSize)thumbnailSize credential:(TJDropboxCredential *const)credential
+- (id)loadThumbnailAtPath:(NSString *const)path rev:(NSString *const)rev size:(const TJDropboxThumbnailSize)thumbnailSize completion:(void (^const)(NSData *_Nullable thumbnailData, NSError *_Nullable error))completion
 {
-    // https://www.dropbox.com/developers/documentation/http/documentation#files-get_thumbnail
-    NSString *thumbnailSizeValue = nil;
-    switch (thumbnailSize) {
-        case TJDropboxThumbnailSize32Square:
-            thumbnailSizeValue = @"w32h32";
-            break;
-        case TJDropboxThumbnailSize64Square:
-            thumbnailSizeValue = @"w64h64";
-            break;
-        case TJDropboxThumbnailSize128Square:
-            thumbnailSizeValue = @"w128h128";
-            break;
-        case TJDropboxThumbnailSize640x480:
-            thumbnailSizeValue = @"w640h480";
-            break;
-        case TJDropboxThumbnailSize1024x768:
-            thumbnailSizeValue = @"w1024h768";
-            break;
+    NSString *const sizeValue = _thumbnailSizeValue(thumbnailSize);
+    NSString *const key = _thumbnailCacheKey(path, rev, sizeValue);
+    TJDropboxThumbnailRequester *const requester = [TJDropboxThumbnailRequester new];
+    requester.completion = completion;
+    requester.callbackQueue = _currentCallbackQueue();
+    
+    NSData *const cachedThumbnailData = [self.memoryCache objectForKey:key];
+    if (cachedThumbnailData) {
+        _performCallback(^{
+            completion(cachedThumbnailData, nil);
+        });
+        return requester;
     }
-    NSMutableDictionary *parameters = [NSMutableDictionary new];
-    parameters[@"path"] = _asciiEncodeString(path);
-    if (thumbnailSizeValue) {
-        parameters[@"size"] = thumbnailSizeValue;
+    
+    __block TJDropboxThumbnailRequest *newRequest = nil;
+    [self performSynchronized:^{
+        TJDropboxThumbnailRequest *request = self.requestsForKeys[key];
+        if (!request) {
+            request = [TJDropboxThumbnailRequest new];
+            request.key = key;
+            request.path = path;
+            request.rev = rev;
+            request.sizeValue = sizeValue;
+            request.requesters = [NSMutableArray new];
+            self.requestsForKeys[key] = request;
+            newRequest = request;
+        }
+        [request.requesters addObject:requester];
+        requester.request = request;
+    }];
+    
+    if (newRequest) {
+        dispatch_async(self.diskQueue, ^{
+            NSString *const cachePath = [self.cacheDirectoryPath stringByAppendingPathComponent:key];
+            NSData *const thumbnailData = [NSData dataWithContentsOfFile:cachePath];
+            if (thumbnailData) {
+                utimes(cachePath.fileSystemRepresentation, NULL); // Marks it as recently used
+                [self.memoryCache setObject:thumbnailData forKey:key cost:thumbnailData.length];
+                [self completeRequest:newRequest thumbnailData:thumbnailData error:nil];
+            } else {
+                [self enqueueRequest:newRequest];
+            }
+        });
     }
-    return _contentRequest(@"/2/files/get_thumbnail", credential.accessToken, parameters);
+    return requester;
 }
 
-+ (void)downloadThumbnailAtPath:(NSString *const)remotePath toPath:(NSString *const)localPath size:(const TJDropboxThumbnailSize)thumbnailSize credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary * _Nullable, NSError * _Nullable))completion
+- (void)cancelThumbnailRequest:(id const)token
 {
-    _addTask(credential,
-             ^NSURLSessionTask *{
-        NSURLRequest *const request = [self requestToDownloadThumbnailAtPath:remotePath size:thumbnailSize credential:credential];
-        
-        NSURLSessionDownloadTask *const task = [_session() downloadTaskWithRequest:request];
-        
-        [_taskDelegate() setProgressBlock:nil
-                          completionBlock:^(NSURL * _Nullable location, NSURLResponse * _Nullable response, NSError * _Nullable error) {
-            NSDictionary *parsedResult = nil;
-            NSData *const resultData = _resultDataForContentRequestResponse(response);
-            _processResult(resultData, response, &error, &parsedResult);
-            
-            if (!error && location) {
-                NSFileManager *fileManager = [NSFileManager defaultManager];
-                
-                // remove file if it exists
-                if ([fileManager fileExistsAtPath:localPath]) {
-                    [fileManager removeItemAtPath:localPath error:&error];
-                }
-                if (!error) {
-                    // Move file into place
-                    [fileManager moveItemAtURL:location toURL:[NSURL fileURLWithPath:localPath isDirectory:NO] error:&error];
-                }
-            }
-            
-            completion(parsedResult, error);
+    if (![token isKindOfClass:[TJDropboxThumbnailRequester class]]) {
+        return;
+    }
+    TJDropboxThumbnailRequester *const requester = token;
+    [self performSynchronized:^{
+        TJDropboxThumbnailRequest *const request = requester.request;
+        if (!request) {
+            return;
         }
-                          forDownloadTask:task];
-        return task;
-    },
-             completion);
+        [request.requesters removeObjectIdenticalTo:requester];
+        requester.request = nil;
+        if (request.requesters.count == 0 && !request.sent) {
+            // Nobody needs it anymore, drop it if it hasn't gone out. Requests already sent are left to finish and be cached.
+            [self.pendingRequests removeObjectIdenticalTo:request];
+            [self.requestsForKeys removeObjectForKey:request.key];
+        }
+    }];
 }
 
-#pragma mark - Search
-
-+ (void)searchForFilesAtPath:(NSString *const)path matchingQuery:(NSString *const)query options:(NSDictionary *const)additionalOptions credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSArray *_Nullable entries, NSError *_Nullable error))completion
+- (void)removeAllCachedThumbnails
 {
-    _performAPIRequest(credential,
-                       ^NSURLRequest *{
-        // https://www.dropbox.com/developers/documentation/http/documentation?oref=e#files-search
-        NSMutableDictionary *const options = [NSMutableDictionary dictionaryWithObjectsAndKeys:path, @"path", nil];
-        [options addEntriesFromDictionary:additionalOptions];
-        return _apiRequest(@"/2/files/search_v2", credential.accessToken,
-                           @{
-                               @"query": _asciiEncodeString(query),
-                               @"options": options
-                           });
-    },
-                       ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
-        completion(parsedResponse[@"matches"], error);
+    [self.memoryCache removeAllObjects];
+    dispatch_async(self.diskQueue, ^{
+        [[NSFileManager defaultManager] removeItemAtPath:self.cacheDirectoryPath error:nil];
+        [self performSynchronized:^{
+            self.diskCacheByteCount = -1; // Recreates the directory on the next write
+        }];
     });
 }
 
-#pragma mark - Sharing
-
-+ (void)getSharedLinkForFileAtPath:(NSString *const)path credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSString *_Nullable urlString))completion
+- (void)enqueueRequest:(TJDropboxThumbnailRequest *const)request
 {
-    [self getSharedLinkForFileAtPath:path linkType:TJDropboxSharedLinkTypeDefault uploadOrSaveInProgress:NO credential:credential completion:completion];
+    __block BOOL shouldFlushNow = NO;
+    __block BOOL shouldScheduleFlush = NO;
+    [self performSynchronized:^{
+        if (self.requestsForKeys[request.key] != request) {
+            // Cancelled while the disk cache was being checked.
+            return;
+        }
+        [self.pendingRequests addObject:request];
+        if (self.pendingRequests.count >= kThumbnailBatchMaximumEntryCount) {
+            shouldFlushNow = YES;
+        } else if (!self.flushScheduled) {
+            self.flushScheduled = YES;
+            shouldScheduleFlush = YES;
+        }
+    }];
+    if (shouldFlushNow) {
+        [self flush];
+    } else if (shouldScheduleFlush) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kThumbnailBatchCoalescingInterval * NSEC_PER_SEC)), _workerQueue(), ^{
+            [self performSynchronized:^{
+                self.flushScheduled = NO;
+            }];
+            [self flush];
+        });
+    }
 }
 
-+ (void)getSharedLinkForFileAtPath:(NSString *const)path linkType:(const TJDropboxSharedLinkType)linkType uploadOrSaveInProgress:(const BOOL)uploadOrSaveInProgress credential:(TJDropboxCredential *const)credential completion:(void (^const)(NSString *_Nullable urlString))completion
+/// Sends everything pending in batches of up to 25.
+- (void)flush
 {
-    _performAPIRequest(credential,
-                       ^NSURLRequest *{
-        // NOTE: create_shared_link has been deprecated, will likely be removed by Dropbox at some point. https://tijo.link/mluVlJ
-        NSString *const requestPath = linkType == TJDropboxSharedLinkTypeShort || uploadOrSaveInProgress ? @"/2/sharing/create_shared_link" : @"/2/sharing/create_shared_link_with_settings";
-        NSMutableDictionary *parameters = [NSMutableDictionary new];
-        [parameters setObject:_asciiEncodeString(path) forKey:@"path"];
-        if (linkType == TJDropboxSharedLinkTypeShort) {
-            [parameters setObject:@YES forKey:@"short_url"];
-        }
-        if (uploadOrSaveInProgress) {
-            if (linkType == TJDropboxSharedLinkTypeDirect || linkType == TJDropboxSharedLinkTypeDirectDownload) {
-                NSLog(@"[TJDropbox] - Warning in %s: uploadOrSaveInProgress is not compatible with TJDropboxSharedLinkTypeDirect. Parameter is being ignored.", __PRETTY_FUNCTION__);
-            } else {
-                [parameters setObject:@"file" forKey:@"pending_upload"];
+    while (YES) {
+        NSMutableArray<TJDropboxThumbnailRequest *> *const batch = [NSMutableArray arrayWithCapacity:kThumbnailBatchMaximumEntryCount];
+        [self performSynchronized:^{
+            const NSUInteger count = MIN(self.pendingRequests.count, kThumbnailBatchMaximumEntryCount);
+            [batch addObjectsFromArray:[self.pendingRequests subarrayWithRange:NSMakeRange(0, count)]];
+            [self.pendingRequests removeObjectsInRange:NSMakeRange(0, count)];
+            for (TJDropboxThumbnailRequest *const request in batch) {
+                request.sent = YES;
             }
+        }];
+        if (batch.count == 0) {
+            break;
         }
-        return _apiRequest(requestPath, credential.accessToken, parameters);
+        [self sendBatch:batch];
+    }
+}
+
+- (void)sendBatch:(NSArray<TJDropboxThumbnailRequest *> *const)batch
+{
+    TJDropboxCredential *const credential = self.credential;
+    NSMutableArray<NSDictionary *> *const entries = [NSMutableArray arrayWithCapacity:batch.count];
+    for (TJDropboxThumbnailRequest *const request in batch) {
+        NSMutableDictionary *const entry = [NSMutableDictionary new];
+        // Ask for the revision the thumbnail is cached under, the path alone returns whatever is there now.
+        entry[@"path"] = request.rev ? [@"rev:" stringByAppendingString:request.rev] : request.path;
+        if (request.sizeValue) {
+            entry[@"size"] = request.sizeValue;
+        }
+        [entries addObject:entry];
+    }
+    _performRequest(credential,
+                    TJDropboxRequestLaneInteractive,
+                    TJDropboxSessionPoolInteractive,
+                    [TJDropbox contentBaseURL],
+                    ^NSURLRequest *{
+        // https://www.dropbox.com/developers/documentation/http/documentation#files-get_thumbnail_batch
+        return _contentRPCRequest(@"/2/files/get_thumbnail_batch", credential.accessToken, @{@"entries": entries});
     },
-                       ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
-        NSString *urlString = parsedResponse[@"url"];
-        if (urlString.length == 0) {
-            urlString = parsedResponse[@"error"][@"shared_link_already_exists"][@"metadata"][@"url"];
+                    ^(NSDictionary * _Nullable parsedResponse, NSError * _Nullable error) {
+        NSArray *const resultEntries = parsedResponse[@"entries"];
+        if (!error && (![resultEntries isKindOfClass:[NSArray class]] || resultEntries.count != batch.count)) {
+            error = [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"Unexpected batch response"}];
         }
-        if (urlString.length > 0) {
-            NSURLComponents *const components = [NSURLComponents componentsWithString:urlString];
-            if (linkType == TJDropboxSharedLinkTypeDirect || linkType == TJDropboxSharedLinkTypeDirectDownload) {
-                NSMutableArray<NSURLQueryItem *> *items = [NSMutableArray arrayWithArray:components.queryItems];
-                [items filterUsingPredicate:[NSPredicate predicateWithBlock:^BOOL(NSURLQueryItem  *_Nullable evaluatedObject, NSDictionary<NSString *,id> * _Nullable bindings) {
-                    return ![evaluatedObject.name isEqualToString:@"dl"];
-                }]];
-                if (linkType == TJDropboxSharedLinkTypeDirect) {
-                    [items addObject:[NSURLQueryItem queryItemWithName:@"raw" value:@"1"]];
-                } else if (linkType == TJDropboxSharedLinkTypeDirectDownload) {
-                    [items addObject:[NSURLQueryItem queryItemWithName:@"dl" value:@"1"]];
-                }
-                components.queryItems = items;
-            } else if (linkType == TJDropboxSharedLinkTypeDefault) {
-                components.host = [components.host stringByReplacingOccurrencesOfString:@"www." withString:@""];
+        [batch enumerateObjectsUsingBlock:^(TJDropboxThumbnailRequest * _Nonnull request, NSUInteger i, BOOL * _Nonnull stop) {
+            if (error) {
+                [self completeRequest:request thumbnailData:nil error:error];
+                return;
             }
-            urlString = components.URL.absoluteString;
-        }
-        completion(urlString);
+            NSDictionary *const resultEntry = resultEntries[i];
+            NSString *const thumbnail = [resultEntry isKindOfClass:[NSDictionary class]] ? resultEntry[@"thumbnail"] : nil;
+            NSData *const thumbnailData = [thumbnail isKindOfClass:[NSString class]] ? [[NSData alloc] initWithBase64EncodedString:thumbnail options:0] : nil;
+            if (thumbnailData) {
+                [self.memoryCache setObject:thumbnailData forKey:request.key cost:thumbnailData.length];
+                [self writeThumbnailData:thumbnailData forKey:request.key];
+                [self completeRequest:request thumbnailData:thumbnailData error:nil];
+            } else {
+                const id entryResult = _resultForBatchEntry(resultEntry);
+                [self completeRequest:request thumbnailData:nil error:[entryResult isKindOfClass:[NSError class]] ? entryResult : [NSError errorWithDomain:TJDropboxErrorDomain code:0 userInfo:@{@"description": @"Missing thumbnail"}]];
+            }
+        }];
     });
 }
 
-#pragma mark - Users
-
-+ (void)getSpaceUsageForUserWithCredential:(TJDropboxCredential *const)credential completion:(void (^const)(NSDictionary *_Nullable parsedResponse, NSError *_Nullable error))completion
+- (void)completeRequest:(TJDropboxThumbnailRequest *const)request thumbnailData:(NSData *const)thumbnailData error:(NSError *const)error
 {
-    _performAPIRequest(credential,
-                       ^NSURLRequest *{
-        return _apiRequest(@"/2/users/get_space_usage", credential.accessToken, nil);
-    },
-                       completion);
+    __block NSArray<TJDropboxThumbnailRequester *> *requesters;
+    [self performSynchronized:^{
+        requesters = [request.requesters copy];
+        [request.requesters removeAllObjects];
+        if (self.requestsForKeys[request.key] == request) {
+            [self.requestsForKeys removeObjectForKey:request.key];
+        }
+    }];
+    for (TJDropboxThumbnailRequester *const requester in requesters) {
+        requester.request = nil;
+        _performWithCallbackQueue(requester.callbackQueue, ^{
+            _performCallback(^{
+                requester.completion(thumbnailData, error);
+            });
+        });
+    }
 }
 
-#pragma mark - Request Management
-
-+ (void)cancelAllRequests
+- (void)writeThumbnailData:(NSData *const)thumbnailData forKey:(NSString *const)key
 {
-    [_session() getAllTasksWithCompletionHandler:^(NSArray<__kindof NSURLSessionTask *> * _Nonnull tasks) {
-        [tasks makeObjectsPerformSelector:@selector(cancel)];
-    }];
+    dispatch_async(self.diskQueue, ^{
+        NSFileManager *const fileManager = [NSFileManager defaultManager];
+        __block long long diskCacheByteCount;
+        [self performSynchronized:^{
+            diskCacheByteCount = self.diskCacheByteCount;
+        }];
+        if (diskCacheByteCount < 0) {
+            // Measure once, after that the count is kept up to date as thumbnails are written and evicted.
+            [fileManager createDirectoryAtPath:self.cacheDirectoryPath withIntermediateDirectories:YES attributes:nil error:nil];
+            diskCacheByteCount = 0;
+            for (NSURL *const fileURL in [fileManager contentsOfDirectoryAtURL:[NSURL fileURLWithPath:self.cacheDirectoryPath isDirectory:YES] includingPropertiesForKeys:@[NSURLFileSizeKey] options:0 error:nil]) {
+                NSNumber *fileSize;
+                [fileURL getResourceValue:&fileSize forKey:NSURLFileSizeKey error:nil];
+                diskCacheByteCount += fileSize.longLongValue;
+            }
+        }
+        
+        if ([thumbnailData writeToFile:[self.cacheDirectoryPath stringByAppendingPathComponent:key] options:NSDataWritingAtomic error:nil]) {
+            diskCacheByteCount += thumbnailData.length;
+        }
+        
+        if (diskCacheByteCount > (long long)self.maximumDiskCacheByteCount) {
+            // Evict least recently used thumbnails (reads touch the modification date) down to 3/4 of the limit so this doesn't run on every write.
+            NSArray<NSURL *> *const fileURLs = [fileManager contentsOfDirectoryAtURL:[NSURL fileURLWithPath:self.cacheDirectoryPath isDirectory:YES] includingPropertiesForKeys:@[NSURLFileSizeKey, NSURLContentModificationDateKey] options:0 error:nil];
+            NSArray<NSURL *> *const sortedFileURLs = [fileURLs sortedArrayUsingComparator:^NSComparisonResult(NSURL * _Nonnull firstURL, NSURL * _Nonnull secondURL) {
+                NSDate *firstDate, *secondDate;
+                [firstURL getResourceValue:&firstDate forKey:NSURLContentModificationDateKey error:nil];
+                [secondURL getResourceValue:&secondDate forKey:NSURLContentModificationDateKey error:nil];
+                return [firstDate compare:secondDate];
+            }];
+            const long long targetByteCount = self.maximumDiskCacheByteCount / 4 * 3;
+            for (NSURL *const fileURL in sortedFileURLs) {
+                if (diskCacheByteCount <= targetByteCount) {
+                    break;
+                }
+                NSNumber *fileSize;
+                [fileURL getResourceValue:&fileSize forKey:NSURLFileSizeKey error:nil];
+                if ([fileManager removeItemAtURL:fileURL error:nil]) {
+                    diskCacheByteCount -= fileSize.longLongValue;
+                }
+            }
+        }
+        
+        [self performSynchronized:^{
+            self.diskCacheByteCount = diskCacheByteCount;
+        }];
+    });
 }
 
 @end